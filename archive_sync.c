@@ -0,0 +1,398 @@
+/* Copyright (c) 2023 Diane Bruce db@db.net
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * archive_sync
+ *
+ * Brings a host's copy of the remote csv archive up to date from
+ * web_status /archive.csv. The copy only ever grows, so its size is
+ * how far the last sync got and only the bytes after that are asked
+ * for, with "Range: bytes=size-". With nothing new that is answered
+ * 416 and no body, a remote archive shorter than the copy means it
+ * was replaced and is refused rather than mixed in.
+ *
+ * Only whole lines are ever added to the copy. With -o the lines new
+ * this time are also written to a file of their own, ready for
+ * csv2solardb when the host has been offline.
+ *
+ * e.g. archive_sync -h pi.local -o new.csv solar.csv && csv2solardb new.csv
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sysexits.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include "config_parser.h"
+#include "solar_config.h"
+
+extern char *optarg;
+extern int optind;
+
+#define MAXBUF		1024
+#define TAIL_MAX	4096	/* a partial last line is shorter */
+
+char *remotehost=NULL;
+
+PARSE_ITEMS parse_table = {{"remotehost", &remotehost},
+			    {NULL,NULL}};
+
+typedef struct {
+	int		status;
+	long long	length;		/* Content-Length, -1 if none */
+	long long	first;		/* Content-Range */
+	long long	total;
+} REPLY;
+
+static void usage(const char *progname);
+static off_t whole_lines(FILE *fp, const char *name);
+static int connect_to(const char *host);
+static void send_request(int fd, const char *host, off_t offset);
+static void read_reply(FILE *in, REPLY *reply);
+static int copy_lines(FILE *in, long long length, FILE *mirror, FILE *out,
+		      long long *bytes, long *lines, long long *partial);
+
+int
+main(int argc, char* argv[])
+{
+	REPLY reply;
+	FILE *mirror;
+	FILE *out;
+	FILE *in;
+	char *progname;
+	char *mirrorname;
+	char *outname;
+	off_t offset;
+	long long bytes;
+	long long partial;
+	long lines;
+	int complete;
+	int ch;
+	int fd;
+
+	(void)parse_config(SOLAR_GLOBAL_CONFIG, parse_table);
+	(void)parse_config(SOLAR_CONFIG, parse_table);
+
+	progname = argv[0];
+	outname = NULL;
+	while ((ch = getopt(argc, argv, "h:o:?")) != -1) {
+		switch (ch) {
+		case 'h':
+			remotehost = strdup(optarg);
+			break;
+		case 'o':
+			outname = strdup(optarg);
+			break;
+		case '?':
+		default:
+			usage(progname);
+			exit(EX_USAGE);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 1 || remotehost == NULL) {
+		usage(progname);
+		exit(EX_USAGE);
+	}
+	mirrorname = *argv;
+
+	if ((mirror = fopen(mirrorname, "a+")) == NULL)
+		err(EX_CANTCREAT, "Can't open %s", mirrorname);
+	offset = whole_lines(mirror, mirrorname);
+
+	fd = connect_to(remotehost);
+	send_request(fd, remotehost, offset);
+	if ((in = fdopen(fd, "r")) == NULL)
+		err(EX_OSERR, "fdopen");
+	read_reply(in, &reply);
+
+	switch (reply.status) {
+	case 416:
+		if (reply.total < offset)
+			errx(EX_DATAERR, "archive on %s is %lld bytes, less "
+			     "than %s, has it been replaced?", remotehost,
+			     reply.total, mirrorname);
+		printf("%s: up to date, %lld bytes\n", mirrorname,
+		       (long long)offset);
+		exit(EX_OK);
+	case 206:
+		if (reply.first != offset)
+			errx(EX_PROTOCOL, "%s sent bytes from %lld, not %lld",
+			     remotehost, reply.first, (long long)offset);
+		break;
+	case 200:
+		if (offset > 0)
+			errx(EX_PROTOCOL, "%s ignored the Range asked for",
+			     remotehost);
+		break;
+	default:
+		errx(EX_UNAVAILABLE, "%s: HTTP status %d", remotehost,
+		     reply.status);
+	}
+
+	out = NULL;
+	if (outname != NULL && (out = fopen(outname, "w")) == NULL)
+		err(EX_CANTCREAT, "Can't open %s", outname);
+	complete = copy_lines(in, reply.length, mirror, out, &bytes, &lines,
+			      &partial);
+	if (fflush(mirror) != 0)
+		err(EX_IOERR, "%s", mirrorname);
+	if (out != NULL && fclose(out) != 0)
+		err(EX_IOERR, "%s", outname);
+	printf("%s: %ld new lines, %lld bytes, now %lld bytes\n", mirrorname,
+	       lines, bytes, (long long)offset + bytes);
+	if (partial > 0)
+		printf("%s: last line still being written, %lld bytes of it "
+		       "left for next time\n", mirrorname, partial);
+	fclose(mirror);
+	fclose(in);
+	exit(complete ? EX_OK : EX_IOERR);
+}
+
+/*
+ * whole_lines
+ *
+ * inputs	- the host's copy of the archive, open for appending
+ *		- its name
+ * output	- its size, which is where to carry on from
+ * side effects	- a partial last line, left by a sync that was cut
+ *		  short, is dropped
+ */
+static off_t
+whole_lines(FILE *fp, const char *name)
+{
+	char tail[TAIL_MAX];
+	struct stat st;
+	off_t start;
+	size_t n;
+
+	if (fstat(fileno(fp), &st) < 0)
+		err(EX_IOERR, "%s", name);
+	if (st.st_size == 0)
+		return (0);
+	start = st.st_size > TAIL_MAX ? st.st_size - TAIL_MAX : 0;
+	if (pread(fileno(fp), tail, st.st_size - start, start) !=
+	    st.st_size - start)
+		err(EX_IOERR, "%s", name);
+	n = st.st_size - start;
+	if (tail[n - 1] == '\n')
+		return (st.st_size);
+	while (n > 0 && tail[n - 1] != '\n')
+		n--;
+	if (n == 0 && start > 0)
+		errx(EX_DATAERR, "%s does not end in a csv line", name);
+	if (ftruncate(fileno(fp), start + n) < 0)
+		err(EX_IOERR, "%s", name);
+	return (start + n);
+}
+
+/*
+ * connect_to
+ *
+ * inputs	- "host" or "host:port", port 80 if not given
+ * output	- connected socket
+ * side effects	- exits if no address of host can be reached
+ */
+static int
+connect_to(const char *host)
+{
+	struct addrinfo hints;
+	struct addrinfo *res;
+	struct addrinfo *ai;
+	char name[MAXBUF];
+	const char *port;
+	char *p;
+	int error;
+	int fd;
+
+	strlcpy(name, host, sizeof(name));
+	port = "80";
+	if ((p = strchr(name, ':')) != NULL) {
+		*p++ = '\0';
+		port = p;
+	}
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if ((error = getaddrinfo(name, port, &hints, &res)) != 0)
+		errx(EX_NOHOST, "%s: %s", host, gai_strerror(error));
+	fd = -1;
+	for (ai = res; ai != NULL; ai = ai->ai_next) {
+		if ((fd = socket(ai->ai_family, ai->ai_socktype,
+				 ai->ai_protocol)) < 0)
+			continue;
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	if (fd < 0)
+		err(EX_UNAVAILABLE, "Can't connect to %s", host);
+	return (fd);
+}
+
+/*
+ * send_request
+ *
+ * inputs	- socket
+ *		- host, for the Host header
+ *		- bytes of the archive already held
+ * output	- none
+ * side effects	- a GET for what comes after offset is sent
+ */
+static void
+send_request(int fd, const char *host, off_t offset)
+{
+	char buf[MAXBUF];
+	ssize_t n;
+	int len;
+
+	len = snprintf(buf, sizeof(buf), "GET /archive.csv HTTP/1.1\r\n"
+		       "Host: %s\r\n"
+		       "Range: bytes=%lld-\r\n"
+		       "Connection: close\r\n\r\n",
+		       host, (long long)offset);
+	if (len < 0 || (size_t)len >= sizeof(buf))
+		errx(EX_USAGE, "host name too long");
+	while (len > 0) {
+		if ((n = write(fd, buf, len)) < 0) {
+			if (errno == EINTR)
+				continue;
+			err(EX_IOERR, "Can't send request");
+		}
+		memmove(buf, buf + n, len - n);
+		len -= n;
+	}
+}
+
+/*
+ * read_reply
+ *
+ * inputs	- connection
+ *		- REPLY to fill in
+ * output	- none
+ * side effects	- status line and headers are read, the body is next
+ */
+static void
+read_reply(FILE *in, REPLY *reply)
+{
+	char line[MAXBUF];
+	char *p;
+
+	reply->length = -1;
+	reply->first = 0;
+	reply->total = -1;
+	if (fgets(line, sizeof(line), in) == NULL ||
+	    sscanf(line, "HTTP/1.%*d %d", &reply->status) != 1)
+		errx(EX_PROTOCOL, "No HTTP reply");
+	while (fgets(line, sizeof(line), in) != NULL) {
+		if ((p = strpbrk(line, "\r\n")) != NULL)
+			*p = '\0';
+		if (line[0] == '\0')
+			return;
+		if ((p = strchr(line, ':')) == NULL)
+			continue;
+		*p++ = '\0';
+		while (*p == ' ')
+			p++;
+		if (strcasecmp(line, "Content-Length") == 0)
+			reply->length = strtoll(p, NULL, 10);
+		else if (strcasecmp(line, "Content-Range") == 0) {
+			if (sscanf(p, "bytes */%lld", &reply->total) != 1)
+				(void)sscanf(p, "bytes %lld-%*d/%lld",
+					     &reply->first, &reply->total);
+		}
+	}
+	errx(EX_PROTOCOL, "Reply ended in its headers");
+}
+
+/*
+ * copy_lines
+ *
+ * inputs	- connection, at the start of the body
+ *		- Content-Length, -1 to read until it closes
+ *		- the host's copy and the -o file, or NULL
+ *		- where to return the bytes and lines added
+ *		- where to return the length of a partial last line
+ * output	- 1 if the whole body was read, else 0. A partial last
+ *		  line is one web_status is still writing, and is
+ *		  not counted against it.
+ * side effects	- every whole line of the body is appended to the
+ *		  copy and out, a partial last line is not
+ */
+static int
+copy_lines(FILE *in, long long length, FILE *mirror, FILE *out,
+	   long long *bytes, long *lines, long long *partial)
+{
+	char *line;
+	size_t size;
+	ssize_t n;
+
+	line = NULL;
+	size = 0;
+	*bytes = 0;
+	*lines = 0;
+	*partial = 0;
+	while ((length < 0 || *bytes < length) &&
+	       (n = getline(&line, &size, in)) > 0) {
+		if (line[n - 1] != '\n') {
+			*partial = n;	/* only ever at the end */
+			break;
+		}
+		if (fwrite(line, 1, n, mirror) != (size_t)n)
+			err(EX_IOERR, "Can't add to the archive copy");
+		if (out != NULL && fwrite(line, 1, n, out) != (size_t)n)
+			err(EX_IOERR, "Can't write new lines");
+		*bytes += n;
+		(*lines)++;
+	}
+	free(line);
+	return (length < 0 ? !ferror(in) : *bytes + *partial == length);
+}
+
+/*
+ * usage
+ *
+ * inputs	- program name
+ * output	- none
+ * side effects	- how to run it is printed
+ */
+static void
+usage(const char *progname)
+{
+	fprintf(stderr, "%s: Defaults can be set in ~/%s\n", progname, SOLAR_CONFIG);
+	fprintf(stderr, "%s: Or in global %s\n", progname, SOLAR_GLOBAL_CONFIG);
+	fprintf(stderr, "%s: -h remote web_status host[:port] (remotehost)\n", progname);
+	fprintf(stderr, "%s: -o file for just the new lines, for csv2solardb\n", progname);
+	fprintf(stderr, "%s: csvname of the host's copy of the archive\n", progname);
+}
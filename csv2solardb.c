@@ -310,9 +310,8 @@ insertsql(PGconn *pg_conn, int force_update,
 	int status = 1;
 
 	asprintf(&sql,
-		 "INSERT INTO %s(date_time,array_v,array_a,array_w,"
-		 "soc,bat_v,bat_a,load_v,load_a) "
-		 "values (timestamp'%s',%s);",dbtable, date_time, data_in);
+		 "INSERT INTO %s(%s) values (timestamp'%s',%s);",
+		 dbtable, snapshot_columns(data_in), date_time, data_in);
 
 	status = do_one_sql(pg_conn, sql);
 
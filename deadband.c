@@ -0,0 +1,180 @@
+/* Copyright (c) 2023 Diane Bruce db@db.net
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Report by exception for the resident collector.
+ *
+ * Most samples, all night for instance, say nothing new. A sample
+ * is only passed on to be stored and shipped when
+ *
+ *	- some field has moved more than its deadband from the value
+ *	  in the last record passed on, or
+ *	- the charge state or fault bits changed, or
+ *	- heartbeat seconds have passed since the last record.
+ *
+ * Comparing with the last record passed on, rather than the previous
+ * sample, means a slow drift is still reported once it adds up to
+ * the deadband. Holding each record's values until the next one
+ * (sample and hold) therefore reconstructs every field to within its
+ * deadband at all times, and a gap longer than heartbeat means the
+ * collector was not running. See README.postgres for the query.
+ *
+ * A field with no deadband configured is reported on any change.
+ * With no deadband or heartbeat configured at all every sample is
+ * passed on, as before.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libsolar.h"
+#include "deadband.h"
+#include "solar_format.h"
+
+void
+deadband_init(DEADBAND *db)
+{
+	memset(db, 0, sizeof(*db));
+	db->heartbeat = DEADBAND_HEARTBEAT_DEFAULT;
+}
+
+/*
+ * deadband_set
+ *
+ * inputs	- DEADBAND
+ *		- field name
+ *		- deadband as a string from the config file
+ * output	- 0 or -1 if the field or value is no good
+ * side effects	- report by exception is turned on
+ */
+int
+deadband_set(DEADBAND *db, const char *field, const char *value)
+{
+	char *end;
+	double band;
+	int i;
+
+	band = strtod(value, &end);
+	if (end == value || band < 0)
+		return (-1);
+	if ((i = solar_snapshot_field(field)) < 0)
+		return (-1);
+	db->band[i] = band;
+	db->enabled = 1;
+	return (0);
+}
+
+void
+deadband_heartbeat(DEADBAND *db, int heartbeat)
+{
+	if (heartbeat < 1)
+		heartbeat = 1;
+	db->heartbeat = heartbeat;
+	db->enabled = 1;
+}
+
+/*
+ * deadband_check
+ *
+ * inputs	- DEADBAND
+ *		- time of sample
+ *		- sample
+ * output	- 1 if the sample should be stored and shipped, else 0
+ * side effects	- a sample passed on becomes the new reference
+ */
+int
+deadband_check(DEADBAND *db, time_t when, const SOLAR_SNAPSHOT *snap)
+{
+	double diff;
+	int emit;
+	int i;
+
+	db->samples++;
+	emit = !db->enabled || !db->have_last ||
+	    when - db->last_when >= db->heartbeat ||
+	    when < db->last_when ||
+	    snap->charge_state != db->last.charge_state ||
+	    snap->fault_bits != db->last.fault_bits;
+
+	for (i = 0; !emit && i < DEADBAND_FIELDS; i++) {
+		diff = solar_snapshot_value(snap, i) -
+		    solar_snapshot_value(&db->last, i);
+		if (diff < 0)
+			diff = -diff;
+		if (db->band[i] == 0 ? diff != 0 : diff > db->band[i])
+			emit = 1;
+	}
+	if (!emit)
+		return (0);
+
+	db->have_last = 1;
+	db->last_when = when;
+	db->last = *snap;
+	db->emitted++;
+	return (1);
+}
+
+/*
+ * deadband_due
+ *
+ * inputs	- DEADBAND
+ *		- current time
+ * output	- seconds until a heartbeat record is due, -1 if the
+ *		  filter is off
+ */
+int
+deadband_due(DEADBAND *db, time_t now)
+{
+	long due;
+
+	if (!db->enabled || !db->have_last)
+		return (-1);
+	due = db->last_when + db->heartbeat - now;
+	return (due < 0 ? 0 : due);
+}
+
+/*
+ * deadband_report
+ *
+ * inputs	- DEADBAND
+ *		- buffer for a one line report
+ * output	- percent of samples suppressed since the last report
+ * side effects	- statistics are reset
+ */
+int
+deadband_report(DEADBAND *db, char *buf, size_t len)
+{
+	int suppressed;
+
+	suppressed = 0;
+	if (db->samples > 0)
+		suppressed = (db->samples - db->emitted) * 100 / db->samples;
+	snprintf(buf, len, "%ld samples, %ld records sent, %d%% suppressed",
+		 db->samples, db->emitted, suppressed);
+	db->samples = 0;
+	db->emitted = 0;
+	return (suppressed);
+}
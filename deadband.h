@@ -0,0 +1,57 @@
+/* Copyright (c) 2023 Diane Bruce db@db.net
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#ifndef __DEADBAND_H__
+#define __DEADBAND_H__
+
+#include <time.h>
+#include "libsolar.h"
+#include "solar_format.h"
+
+#define DEADBAND_HEARTBEAT_DEFAULT	900	/* seconds */
+#define DEADBAND_FIELDS		SOLAR_SNAPSHOT_FIELDS
+
+/*
+ * Report by exception state, see deadband.c
+ */
+typedef struct {
+	int	enabled;
+	int	heartbeat;	/* longest silence, seconds */
+	double	band[DEADBAND_FIELDS];
+	int	have_last;
+	time_t	last_when;	/* last record emitted */
+	SOLAR_SNAPSHOT last;
+
+	/* statistics since the last deadband_report() */
+	long	samples;
+	long	emitted;
+} DEADBAND;
+
+void	deadband_init(DEADBAND *db);
+int	deadband_set(DEADBAND *db, const char *field, const char *value);
+void	deadband_heartbeat(DEADBAND *db, int heartbeat);
+int	deadband_check(DEADBAND *db, time_t when, const SOLAR_SNAPSHOT *snap);
+int	deadband_due(DEADBAND *db, time_t now);
+int	deadband_report(DEADBAND *db, char *buf, size_t len);
+
+#endif
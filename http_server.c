@@ -0,0 +1,1938 @@
+/* Copyright (c) 2023 Diane Bruce db@db.net
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Small non blocking HTTP/1.1 server for web_status.
+ *
+ * One thread, one kqueue (epoll on Linux) and level triggered
+ * events, so a slow client only ever holds up itself. Requests are
+ * parsed incrementally as bytes arrive, any number may be pipelined
+ * on one connection and responses always carry a Content-Length so
+ * connections persist unless the client asks otherwise. Only GET and
+ * HEAD are served, a request body is read and thrown away.
+ *
+ * The handler is called synchronously and appends its body to one
+ * buffer owned by the server, which is then copied after the
+ * response headers into the connection's output buffer. Buffers and
+ * connections are kept and reused, so once warmed up serving does
+ * no allocation. A pre-rendered body (HTTP_BLOB) is not copied, the
+ * connection keeps a reference and sends headers and body with one
+ * writev().
+ *
+ * Connections idle, or part way through a request, for longer than
+ * HTTP_READ_TIMEOUT, or making no progress sending for longer than
+ * HTTP_WRITE_TIMEOUT are dropped.
+ *
+ * A response can instead turn its connection into a subscriber
+ * (e.g. Server-Sent Events). Subscribers get whatever is passed to
+ * http_server_broadcast(), each has at most HTTP_STREAM_MAX bytes
+ * queued and one that falls further behind is dropped rather than
+ * holding up the others or growing without bound.
+ *
+ * A response can also be sent before its body is complete, the rest
+ * follows with chunked transfer encoding each time the application
+ * calls http_server_more(). Later pipelined requests wait for it.
+ *
+ * A file, e.g. the csv archive, is sent with sendfile() straight from
+ * the page cache after the headers, so a download of megabytes costs
+ * no copies through user space. Range and If-Modified-Since are up to
+ * the handler, see http_range() and http_modified_since().
+ *
+ * Given HTTP_URING, and a Linux kernel new enough, the same is done
+ * on io_uring instead, see solar_uring.c. Reads and writes are then
+ * queued rather than made, and all of them from one pass through the
+ * connections go to the kernel with the wait for the next events in
+ * a single system call. Each connection has at most one read and one
+ * write in flight. Nothing is queued after a write until it is done,
+ * output produced meanwhile goes to a second buffer, and a closed
+ * connection, descriptor included, is only reused once everything
+ * it had in flight has come back. Connections are accepted on the
+ * ring as well, already non blocking. sendfile() stays as it is,
+ * waiting on a one shot poll, so files are still never copied.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#else
+#include <sys/event.h>
+#endif
+
+#include "http_server.h"
+#include "solar_format.h"
+
+#define WANT_READ	1
+#define WANT_WRITE	2
+#define POLL_BATCH	64
+
+/*
+ * io_uring udata, the HTTP_CONN with the operation in the low bits.
+ * The listening socket is NULL, with U_ACCEPTS accepts always in
+ * flight, the watched descriptor &watch_fd.
+ */
+#define U_ACCEPTS	4
+#define U_RECV		1
+#define U_SEND		2
+#define U_POLL		3
+#define U_MASK		3
+#define U_BIT(op)	(1 << (op))	/* in HTTP_CONN ring */
+#define U_DATA(p, op)	((uint64_t)(uintptr_t)(p) | (op))
+#define U_ENTRIES	(4 * HTTP_MAX_CONN)
+
+struct http_conn {
+	int		fd;		/* -1 once closed */
+	char		in[HTTP_IN_MAX];
+	size_t		inlen;
+	size_t		scan;		/* header end searched up to here */
+	size_t		skip;		/* request body still to discard */
+	SOLAR_BUF	out;
+	size_t		outoff;		/* sent so far */
+	HTTP_BLOB	*blob;		/* sent after out, if any */
+	size_t		bloboff;
+	int		file;		/* sent after out, -1 if none */
+	off_t		fileoff;
+	off_t		fileend;
+	int		closing;	/* close once out is sent */
+	int		eof;		/* client has shut down its side */
+	int		stream;		/* subscriber, see http_server_broadcast */
+	HTTP_MORE	more;		/* body still coming, see http_server_more */
+	void		*more_arg;
+	int		chunked;	/* else ends by closing */
+	int		more_close;	/* close once it is complete */
+	int		events;		/* WANT_ bits registered */
+	time_t		last;		/* last progress either way */
+	int		ring;		/* U_BIT()s of io_uring ops in flight */
+	int		ringfd;		/* closed once they are all back */
+	size_t		recv_at;	/* where the read in flight goes */
+	struct iovec	iov[2];		/* what the write in flight sends */
+	SOLAR_BUF	later;		/* queued while it is in flight */
+	HTTP_CONN	*next;
+	HTTP_CONN	*prev;
+};
+
+struct poll_event {
+	void	*udata;
+	int	readable;
+	int	writable;
+};
+
+static int	poller_open(void);
+static int	poller_set(int pfd, int fd, void *udata, int had, int want);
+static int	poller_wait(int pfd, struct poll_event *pe, int max,
+			    int timeout_ms);
+static int	poller_events(HTTP_SERVER *srv, int timeout_ms);
+static int	set_nonblock(int fd);
+static void	accept_conns(HTTP_SERVER *srv);
+static void	conn_new(HTTP_SERVER *srv, int fd);
+static int	uring_events(HTTP_SERVER *srv, int timeout_ms);
+static void	uring_recv(HTTP_SERVER *srv, HTTP_CONN *conn, int res);
+static void	uring_send(HTTP_SERVER *srv, HTTP_CONN *conn, int res);
+static void	uring_update(HTTP_SERVER *srv, HTTP_CONN *conn);
+static void	conn_run(HTTP_SERVER *srv, HTTP_CONN *conn);
+static int	conn_read(HTTP_SERVER *srv, HTTP_CONN *conn);
+static int	conn_process(HTTP_SERVER *srv, HTTP_CONN *conn);
+static int	conn_write(HTTP_SERVER *srv, HTTP_CONN *conn);
+static void	conn_update(HTTP_SERVER *srv, HTTP_CONN *conn);
+static void	conn_close(HTTP_SERVER *srv, HTTP_CONN *conn);
+static int	conn_more(HTTP_SERVER *srv, HTTP_CONN *conn);
+static int	conn_blocked(HTTP_SERVER *srv, HTTP_CONN *conn);
+static ssize_t	conn_sendfile(HTTP_CONN *conn);
+static size_t	conn_pending(HTTP_CONN *conn);
+static int	conn_flatten(HTTP_CONN *conn);
+static SOLAR_BUF *conn_out(HTTP_CONN *conn);
+static void	consume(HTTP_CONN *conn, size_t n);
+static size_t	find_end(HTTP_CONN *conn);
+static int	parse_request(char *buf, size_t len, HTTP_REQUEST *req,
+			      size_t *clen);
+static char	*line_end(char *line);
+static int	has_token(const char *value, const char *token);
+static void	dispatch(HTTP_SERVER *srv, HTTP_CONN *conn,
+			 HTTP_REQUEST *req);
+static void	respond_error(HTTP_SERVER *srv, HTTP_CONN *conn, int status);
+static int	queue_response(HTTP_CONN *conn, HTTP_RESPONSE *resp,
+			       int head, int minor);
+static const char *http_date(void);
+static time_t	parse_http_time(const char *s);
+static const char *query_value(HTTP_REQUEST *req, const char *name);
+
+/*
+ * http_server_init
+ *
+ * inputs	- HTTP_SERVER to set up
+ *		- bound listening socket
+ *		- HTTP_URING or 0
+ *		- handler called for each request and its argument
+ * output	- 0 or -1 with errno set
+ * side effects	- listening socket is made non blocking, without
+ *		  io_uring to be had kqueue or epoll are used quietly
+ */
+int
+http_server_init(HTTP_SERVER *srv, int listen_fd, int flags,
+		 HTTP_HANDLER handler, void *arg)
+{
+	int i;
+
+	memset(srv, 0, sizeof(*srv));
+	srv->listen_fd = listen_fd;
+	srv->poll_fd = -1;
+	srv->watch_fd = -1;
+	srv->handler = handler;
+	srv->arg = arg;
+	solar_buf_init(&srv->body);
+	if (set_nonblock(listen_fd) < 0)
+		return (-1);
+	if ((flags & HTTP_URING) &&
+	    (srv->uring = solar_uring_new(U_ENTRIES, 0)) != NULL) {
+		srv->stats.uring = 1;
+		for (i = 0; i < U_ACCEPTS; i++)
+			if (solar_uring_accept(srv->uring, listen_fd,
+					       U_DATA(NULL, U_RECV)) < 0)
+				return (-1);
+		return (0);
+	}
+	if ((srv->poll_fd = poller_open()) < 0)
+		return (-1);
+	return (poller_set(srv->poll_fd, listen_fd, NULL, 0, WANT_READ));
+}
+
+/*
+ * http_server_poll
+ *
+ * inputs	- HTTP_SERVER
+ *		- longest to wait for something to happen, ms
+ * output	- number of events handled or -1 on error
+ * side effects	- connections are accepted, read, answered and closed
+ */
+int
+http_server_poll(HTTP_SERVER *srv, int timeout_ms)
+{
+	HTTP_CONN *conn;
+	HTTP_CONN *next;
+	time_t now;
+	int n;
+
+	if (srv->uring != NULL)
+		n = uring_events(srv, timeout_ms);
+	else
+		n = poller_events(srv, timeout_ms);
+	if (n < 0)
+		return (-1);
+
+	now = time(NULL);
+	if (now != srv->last_sweep) {
+		srv->last_sweep = now;
+		for (conn = srv->conns; conn != NULL; conn = next) {
+			next = conn->next;
+			if (conn->fd < 0)
+				continue;
+			if ((conn->stream || conn->more != NULL) &&
+			    conn_pending(conn) == 0)
+				continue;	/* waiting for the application */
+			if (now - conn->last > (conn_pending(conn) > 0 ?
+			    HTTP_WRITE_TIMEOUT : HTTP_READ_TIMEOUT)) {
+				srv->stats.timeouts++;
+				conn_close(srv, conn);
+			}
+		}
+	}
+
+	/*
+	 * Only now can closed connections be reused, nothing in this
+	 * batch of events can still refer to them. On io_uring not
+	 * until the kernel has finished with them either.
+	 */
+	for (conn = srv->conns; conn != NULL; conn = next) {
+		next = conn->next;
+		if (conn->fd >= 0 || conn->ring != 0)
+			continue;
+		if (conn->ringfd >= 0) {
+			srv->stats.io_calls++;
+			close(conn->ringfd);
+			conn->ringfd = -1;
+		}
+		if (conn->prev != NULL)
+			conn->prev->next = conn->next;
+		else
+			srv->conns = conn->next;
+		if (conn->next != NULL)
+			conn->next->prev = conn->prev;
+		conn->next = srv->spare;
+		srv->spare = conn;
+	}
+	return (n);
+}
+
+/*
+ * http_server_watch
+ *
+ * inputs	- HTTP_SERVER
+ *		- descriptor to watch, e.g. the read side of a pipe
+ *		- function called from http_server_poll when it is
+ *		  readable, and its argument
+ * output	- 0 or -1 with errno set
+ * side effects	- one descriptor only, the function must drain it
+ */
+int
+http_server_watch(HTTP_SERVER *srv, int fd, HTTP_WATCH watch, void *arg)
+{
+	if (srv->watch_fd >= 0) {
+		errno = EBUSY;
+		return (-1);
+	}
+	if (srv->uring != NULL) {
+		if (solar_uring_poll(srv->uring, fd, SOLAR_URING_IN,
+				     U_DATA(&srv->watch_fd, U_POLL)) < 0)
+			return (-1);
+	} else if (poller_set(srv->poll_fd, fd, &srv->watch_fd, 0,
+			      WANT_READ) < 0)
+		return (-1);
+	srv->watch_fd = fd;
+	srv->watch = watch;
+	srv->watch_arg = arg;
+	return (0);
+}
+
+/*
+ * http_server_broadcast
+ *
+ * inputs	- HTTP_SERVER
+ *		- data to send every subscriber and its length
+ * output	- number of subscribers it was queued for
+ * side effects	- as much as each socket takes is sent at once,
+ *		  subscribers over HTTP_STREAM_MAX behind are dropped
+ */
+int
+http_server_broadcast(HTTP_SERVER *srv, const char *data, size_t len)
+{
+	HTTP_CONN *conn;
+	size_t pending;
+	int sent;
+
+	sent = 0;
+	for (conn = srv->conns; conn != NULL; conn = conn->next) {
+		if (conn->fd < 0 || !conn->stream)
+			continue;
+		pending = conn_pending(conn);
+		if (pending + len > HTTP_STREAM_MAX) {
+			srv->stats.dropped++;
+			conn_close(srv, conn);
+			continue;
+		}
+		if (conn_flatten(conn) < 0) {
+			conn_close(srv, conn);
+			continue;
+		}
+		if (conn->outoff > 0 && !(conn->ring & U_BIT(U_SEND))) {
+			/* a subscriber's queue never drains by itself */
+			conn->out.len -= conn->outoff;
+			memmove(conn->out.buf, conn->out.buf + conn->outoff,
+				conn->out.len);
+			conn->outoff = 0;
+		}
+		if (solar_buf_append(conn_out(conn), data, len) < 0) {
+			conn_close(srv, conn);
+			continue;
+		}
+		if (conn_write(srv, conn) < 0)
+			continue;
+		conn_update(srv, conn);
+		sent++;
+	}
+	return (sent);
+}
+
+/*
+ * http_server_more
+ *
+ * inputs	- HTTP_SERVER
+ * output	- none
+ * side effects	- every response still being sent in parts is asked
+ *		  for more, unless it is still sending what it has
+ */
+void
+http_server_more(HTTP_SERVER *srv)
+{
+	HTTP_CONN *conn;
+
+	for (conn = srv->conns; conn != NULL; conn = conn->next) {
+		if (conn->fd < 0 || conn->more == NULL ||
+		    conn_pending(conn) > HTTP_OUT_HIGH)
+			continue;
+		if (conn_more(srv, conn) < 0) {
+			conn_close(srv, conn);
+			continue;
+		}
+		conn_run(srv, conn);
+	}
+}
+
+const HTTP_STATS *
+http_server_stats(HTTP_SERVER *srv)
+{
+	srv->stats.buf_grows = solar_buf_grows();
+	return (&srv->stats);
+}
+
+/*
+ * http_header
+ *
+ * inputs	- request
+ *		- header name, any case
+ * output	- header value or NULL if not sent
+ */
+const char *
+http_header(HTTP_REQUEST *req, const char *name)
+{
+	int i;
+
+	for (i = 0; i < req->nheaders; i++)
+		if (strcasecmp(req->header_name[i], name) == 0)
+			return (req->header_value[i]);
+	return (NULL);
+}
+
+/*
+ * http_query_int
+ *
+ * inputs	- request
+ *		- name of a name=value query parameter
+ *		- where to return its value
+ * output	- 1 if given as a whole number, 0 if absent, -1 if bad
+ */
+int
+http_query_int(HTTP_REQUEST *req, const char *name, long *value)
+{
+	const char *p;
+	char *end;
+	long v;
+
+	if ((p = query_value(req, name)) == NULL)
+		return (0);
+	v = strtol(p, &end, 10);
+	if (end == p || (*end != '\0' && *end != '&'))
+		return (-1);
+	*value = v;
+	return (1);
+}
+
+/*
+ * http_query
+ *
+ * inputs	- request
+ *		- name of a name=value query parameter
+ *		- buffer for its value and its size
+ * output	- 1 if given, 0 if absent, -1 if it does not fit
+ * side effects	- the value is copied as is, it is not %-decoded
+ */
+int
+http_query(HTTP_REQUEST *req, const char *name, char *buf, size_t size)
+{
+	const char *p;
+	size_t len;
+
+	if ((p = query_value(req, name)) == NULL)
+		return (0);
+	len = strcspn(p, "&");
+	if (len >= size)
+		return (-1);
+	memcpy(buf, p, len);
+	buf[len] = '\0';
+	return (1);
+}
+
+/* start of the value of a query parameter, NULL if not given */
+static const char *
+query_value(HTTP_REQUEST *req, const char *name)
+{
+	const char *p;
+	size_t len;
+
+	len = strlen(name);
+	for (p = req->query; p != NULL && *p != '\0'; p = strchr(p, '&')) {
+		if (*p == '&')
+			p++;
+		if (strncmp(p, name, len) == 0 && p[len] == '=')
+			return (p + len + 1);
+	}
+	return (NULL);
+}
+
+/*
+ * http_add_header
+ * Headers that don't fit are dropped, handlers only add a few.
+ */
+void
+http_add_header(HTTP_RESPONSE *resp, const char *name, const char *value)
+{
+	size_t len;
+	int n;
+
+	len = strlen(resp->headers);
+	n = snprintf(resp->headers + len, sizeof(resp->headers) - len,
+		     "%s: %s\r\n", name, value);
+	if (n < 0 || (size_t)n >= sizeof(resp->headers) - len)
+		resp->headers[len] = '\0';
+}
+
+/*
+ * http_etag_match
+ *
+ * inputs	- request
+ *		- current ETag of the resource, quotes included
+ * output	- 1 if If-None-Match lists it (or is *), the client's
+ *		  copy is still good and 304 can be sent
+ */
+int
+http_etag_match(HTTP_REQUEST *req, const char *etag)
+{
+	const char *p;
+	size_t len;
+
+	if ((p = http_header(req, "If-None-Match")) == NULL)
+		return (0);
+	len = strlen(etag);
+	while (*p != '\0') {
+		while (*p == ' ' || *p == '\t' || *p == ',')
+			p++;
+		if (*p == '*')
+			return (1);
+		if (strncmp(p, "W/", 2) == 0)	/* weak compare is allowed */
+			p += 2;
+		if (strncmp(p, etag, len) == 0 &&
+		    (p[len] == '\0' || p[len] == ',' || p[len] == ' ' ||
+		     p[len] == '\t'))
+			return (1);
+		while (*p != '\0' && *p != ',')
+			p++;
+	}
+	return (0);
+}
+
+/*
+ * http_accepts
+ *
+ * inputs	- request
+ *		- content coding, e.g. "gzip"
+ * output	- 1 if Accept-Encoding lists it, or *, without q=0
+ */
+int
+http_accepts(HTTP_REQUEST *req, const char *coding)
+{
+	const char *p;
+	const char *q;
+	size_t len;
+	size_t n;
+
+	if ((p = http_header(req, "Accept-Encoding")) == NULL)
+		return (0);
+	len = strlen(coding);
+	while (*p != '\0') {
+		while (*p == ' ' || *p == '\t' || *p == ',')
+			p++;
+		n = strcspn(p, " \t;,");
+		if ((n == len && strncasecmp(p, coding, len) == 0) ||
+		    (n == 1 && *p == '*')) {
+			q = p + n;
+			while (*q == ' ' || *q == '\t')
+				q++;
+			if (*q != ';')
+				return (1);
+			q = strchr(q, '=');
+			if (q == NULL || strtod(q + 1, NULL) > 0)
+				return (1);
+			return (0);
+		}
+		while (*p != '\0' && *p != ',')
+			p++;
+	}
+	return (0);
+}
+
+HTTP_BLOB *
+http_blob_new(void)
+{
+	HTTP_BLOB *blob;
+
+	if ((blob = malloc(sizeof(*blob))) == NULL)
+		return (NULL);
+	blob->refs = 1;
+	solar_buf_init(&blob->buf);
+	return (blob);
+}
+
+/*
+ * http_blob_gzip
+ *
+ * inputs	- blob to compress
+ * output	- gzip of it as a new blob, or NULL if that would not be
+ *		  any smaller or on error
+ * side effects	- none, meant to be done once per rendering and not
+ *		  per request
+ */
+HTTP_BLOB *
+http_blob_gzip(const HTTP_BLOB *blob)
+{
+	HTTP_BLOB *gz;
+	z_stream zs;
+	size_t bound;
+	int status;
+
+	if (blob->buf.len == 0)
+		return (NULL);
+	memset(&zs, 0, sizeof(zs));
+	/* 15 + 16 is a 32K window with a gzip header and trailer */
+	if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9,
+			 Z_DEFAULT_STRATEGY) != Z_OK)
+		return (NULL);
+	bound = deflateBound(&zs, blob->buf.len);
+	if ((gz = http_blob_new()) == NULL ||
+	    solar_buf_reserve(&gz->buf, bound) < 0) {
+		if (gz != NULL)
+			http_blob_release(gz);
+		deflateEnd(&zs);
+		return (NULL);
+	}
+	zs.next_in = (Bytef *)blob->buf.buf;
+	zs.avail_in = blob->buf.len;
+	zs.next_out = (Bytef *)gz->buf.buf;
+	zs.avail_out = bound;
+	status = deflate(&zs, Z_FINISH);
+	gz->buf.len = zs.total_out;
+	deflateEnd(&zs);
+	if (status != Z_STREAM_END || gz->buf.len >= blob->buf.len) {
+		http_blob_release(gz);
+		return (NULL);
+	}
+	return (gz);
+}
+
+HTTP_BLOB *
+http_blob_hold(HTTP_BLOB *blob)
+{
+	blob->refs++;
+	return (blob);
+}
+
+void
+http_blob_release(HTTP_BLOB *blob)
+{
+	if (--blob->refs > 0)
+		return;
+	solar_buf_free(&blob->buf);
+	free(blob);
+}
+
+const char *
+http_reason(int status)
+{
+	switch (status) {
+	case 200:
+		return ("OK");
+	case 204:
+		return ("No Content");
+	case 206:
+		return ("Partial Content");
+	case 304:
+		return ("Not Modified");
+	case 400:
+		return ("Bad Request");
+	case 404:
+		return ("Not Found");
+	case 405:
+		return ("Method Not Allowed");
+	case 416:
+		return ("Range Not Satisfiable");
+	case 431:
+		return ("Request Header Fields Too Large");
+	case 500:
+		return ("Internal Server Error");
+	case 501:
+		return ("Not Implemented");
+	case 503:
+		return ("Service Unavailable");
+	case 505:
+		return ("HTTP Version Not Supported");
+	default:
+		return ("Unknown");
+	}
+}
+
+/*
+ * http_time
+ *
+ * inputs	- time
+ *		- buffer for it and its size, 30 bytes is enough
+ * output	- none
+ * side effects	- the time is formatted for Date, Last-Modified etc.
+ */
+void
+http_time(time_t when, char *buf, size_t size)
+{
+	struct tm tm;
+
+	gmtime_r(&when, &tm);
+	strftime(buf, size, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+/*
+ * http_modified_since
+ *
+ * inputs	- request
+ *		- when what it asks for last changed
+ * output	- 0 if If-Modified-Since says the client has it,
+ *		  1 if it has to be sent
+ */
+int
+http_modified_since(HTTP_REQUEST *req, time_t mtime)
+{
+	const char *since;
+	time_t t;
+
+	/* If-None-Match takes precedence, see http_etag_match() */
+	if (http_header(req, "If-None-Match") != NULL ||
+	    (since = http_header(req, "If-Modified-Since")) == NULL ||
+	    (t = parse_http_time(since)) < 0)
+		return (1);
+	return (mtime > t);
+}
+
+/*
+ * http_range
+ *
+ * inputs	- request
+ *		- size of what it asks for
+ *		- its current Last-Modified or ETag, for If-Range
+ *		- where to return the first and last byte to send
+ * output	- 0 to send all of it, 1 to send first..last with 206
+ *		  or -1 if the range can't be satisfied, send 416
+ *
+ * One range, "bytes=first-", "bytes=first-last" or "bytes=-suffix".
+ * Several ranges, or a Range that is not understood, are ignored and
+ * all of it is sent, as RFC 9110 allows.
+ */
+int
+http_range(HTTP_REQUEST *req, off_t size, const char *validator,
+	   off_t *first, off_t *last)
+{
+	const char *range;
+	const char *cond;
+	char *p;
+	long long a;
+	long long b;
+
+	*first = 0;
+	*last = size - 1;
+	if ((range = http_header(req, "Range")) == NULL ||
+	    strncmp(range, "bytes=", 6) != 0 || strchr(range, ',') != NULL)
+		return (0);
+	if ((cond = http_header(req, "If-Range")) != NULL &&
+	    (validator == NULL || strcmp(cond, validator) != 0))
+		return (0);
+	range += 6;
+	if (*range == '-') {
+		if (!isdigit((unsigned char)range[1]))
+			return (0);
+		b = strtoll(range + 1, &p, 10);
+		if (*p != '\0')
+			return (0);
+		if (b == 0 || size == 0)
+			return (-1);
+		*first = b < size ? size - b : 0;
+		return (1);
+	}
+	if (!isdigit((unsigned char)*range))
+		return (0);
+	a = strtoll(range, &p, 10);
+	if (*p++ != '-')
+		return (0);
+	b = size - 1;
+	if (*p != '\0') {
+		if (!isdigit((unsigned char)*p))
+			return (0);
+		b = strtoll(p, &p, 10);
+		if (*p != '\0' || b < a)
+			return (0);
+	}
+	if (a >= size)
+		return (-1);
+	*first = a;
+	*last = b < size ? b : size - 1;
+	return (1);
+}
+
+/*
+ * Event backends, kqueue or epoll. Both are used level triggered.
+ * The listening socket is registered with a NULL udata, connections
+ * with their HTTP_CONN.
+ */
+static int
+poller_open(void)
+{
+#ifdef __linux__
+	return (epoll_create1(EPOLL_CLOEXEC));
+#else
+	return (kqueue());
+#endif
+}
+
+/*
+ * poller_set
+ *
+ * inputs	- poller descriptor
+ *		- descriptor and udata to register
+ *		- WANT_ bits registered now and those wanted
+ * output	- 0 or -1 on error
+ */
+static int
+poller_set(int pfd, int fd, void *udata, int had, int want)
+{
+#ifdef __linux__
+	struct epoll_event ev;
+
+	if (want == had)
+		return (0);
+	if (want == 0)
+		return (epoll_ctl(pfd, EPOLL_CTL_DEL, fd, NULL));
+	memset(&ev, 0, sizeof(ev));
+	if (want & WANT_READ)
+		ev.events |= EPOLLIN;
+	if (want & WANT_WRITE)
+		ev.events |= EPOLLOUT;
+	ev.data.ptr = udata;
+	return (epoll_ctl(pfd, had ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &ev));
+#else
+	struct kevent kev[2];
+	int n;
+
+	n = 0;
+	if ((want ^ had) & WANT_READ)
+		EV_SET(&kev[n++], fd, EVFILT_READ,
+		       (want & WANT_READ) ? EV_ADD : EV_DELETE, 0, 0, udata);
+	if ((want ^ had) & WANT_WRITE)
+		EV_SET(&kev[n++], fd, EVFILT_WRITE,
+		       (want & WANT_WRITE) ? EV_ADD : EV_DELETE, 0, 0, udata);
+	if (n == 0)
+		return (0);
+	return (kevent(pfd, kev, n, NULL, 0, NULL));
+#endif
+}
+
+static int
+poller_wait(int pfd, struct poll_event *pe, int max, int timeout_ms)
+{
+#ifdef __linux__
+	struct epoll_event ev[POLL_BATCH];
+	int n;
+	int i;
+
+	if (max > POLL_BATCH)
+		max = POLL_BATCH;
+	n = epoll_wait(pfd, ev, max, timeout_ms);
+	for (i = 0; i < n; i++) {
+		pe[i].udata = ev[i].data.ptr;
+		pe[i].readable = (ev[i].events &
+				  (EPOLLIN | EPOLLHUP | EPOLLERR)) != 0;
+		pe[i].writable = (ev[i].events & EPOLLOUT) != 0;
+	}
+	return (n);
+#else
+	struct kevent kev[POLL_BATCH];
+	struct timespec ts;
+	int n;
+	int i;
+
+	if (max > POLL_BATCH)
+		max = POLL_BATCH;
+	ts.tv_sec = timeout_ms / 1000;
+	ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+	n = kevent(pfd, NULL, 0, kev, max, timeout_ms < 0 ? NULL : &ts);
+	for (i = 0; i < n; i++) {
+		pe[i].udata = kev[i].udata;
+		pe[i].readable = kev[i].filter == EVFILT_READ;
+		pe[i].writable = kev[i].filter == EVFILT_WRITE;
+	}
+	return (n);
+#endif
+}
+
+/*
+ * poller_events
+ * Wait for and handle one batch of kqueue or epoll events.
+ * output	- number of events handled or -1 on error
+ */
+static int
+poller_events(HTTP_SERVER *srv, int timeout_ms)
+{
+	struct poll_event pe[POLL_BATCH];
+	HTTP_CONN *conn;
+	int n;
+	int i;
+
+	n = poller_wait(srv->poll_fd, pe, POLL_BATCH, timeout_ms);
+	srv->stats.io_calls++;
+	if (n < 0)
+		return (errno == EINTR ? 0 : -1);
+	for (i = 0; i < n; i++) {
+		if (pe[i].udata == NULL) {
+			accept_conns(srv);
+			continue;
+		}
+		if (pe[i].udata == &srv->watch_fd) {
+			srv->watch(srv, srv->watch_arg);
+			continue;
+		}
+		/* closed earlier in this batch, memory still valid */
+		conn = pe[i].udata;
+		if (conn->fd < 0)
+			continue;
+		if (pe[i].readable && conn_read(srv, conn) < 0)
+			continue;
+		if (pe[i].writable || pe[i].readable)
+			conn_run(srv, conn);
+	}
+	return (n);
+}
+
+/*
+ * uring_events
+ * Submit everything queued since the last call, wait for and handle
+ * the completions.
+ * output	- number of completions handled or -1 on error
+ */
+static int
+uring_events(HTTP_SERVER *srv, int timeout_ms)
+{
+	HTTP_CONN *conn;
+	uint64_t udata;
+	unsigned long enters;
+	int res;
+	int op;
+	int n;
+
+	if (solar_uring_enter(srv->uring, 1, timeout_ms) < 0)
+		return (-1);
+	for (n = 0; solar_uring_next(srv->uring, &udata, &res); n++) {
+		if (udata == 0)
+			continue;	/* a cancel */
+		op = udata & U_MASK;
+		conn = (HTTP_CONN *)(uintptr_t)(udata & ~(uint64_t)U_MASK);
+		if (conn == NULL) {
+			if (res >= 0)
+				conn_new(srv, res);
+			if (solar_uring_accept(srv->uring, srv->listen_fd,
+					       U_DATA(NULL, U_RECV)) < 0)
+				return (-1);
+			continue;
+		}
+		if ((void *)conn == &srv->watch_fd) {
+			srv->watch(srv, srv->watch_arg);
+			if (solar_uring_poll(srv->uring, srv->watch_fd,
+			    SOLAR_URING_IN, U_DATA(&srv->watch_fd, U_POLL)) < 0)
+				return (-1);
+			continue;
+		}
+		conn->ring &= ~U_BIT(op);
+		if (op == U_RECV)
+			uring_recv(srv, conn, res);
+		else if (op == U_SEND)
+			uring_send(srv, conn, res);
+		else if (conn->fd >= 0)
+			conn_run(srv, conn);	/* writable, for sendfile */
+	}
+	enters = solar_uring_enters(srv->uring);
+	srv->stats.io_calls += enters - srv->enters;
+	srv->enters = enters;
+	return (n);
+}
+
+/*
+ * uring_recv
+ * A read has completed, the input buffer may have been consumed
+ * from the front meanwhile, so the data is moved down to follow on.
+ */
+static void
+uring_recv(HTTP_SERVER *srv, HTTP_CONN *conn, int res)
+{
+	if (conn->fd < 0)
+		return;
+	if (res > 0) {
+		if (conn->recv_at != conn->inlen)
+			memmove(conn->in + conn->inlen,
+				conn->in + conn->recv_at, res);
+		conn->inlen += res;
+		conn->last = time(NULL);
+		if (conn->stream)
+			conn->inlen = 0;	/* nothing more to serve */
+	} else if (res == 0)
+		conn->eof = 1;
+	else if (res != -EINTR && res != -EAGAIN) {
+		conn_close(srv, conn);
+		return;
+	}
+	conn_run(srv, conn);
+}
+
+/*
+ * uring_send
+ * A write has completed, account for what went and carry on.
+ */
+static void
+uring_send(HTTP_SERVER *srv, HTTP_CONN *conn, int res)
+{
+	size_t done;
+
+	if (conn->fd < 0) {
+		/* closed meanwhile, the blob was kept for the kernel */
+		if (conn->blob != NULL) {
+			http_blob_release(conn->blob);
+			conn->blob = NULL;
+		}
+		return;
+	}
+	if (res > 0) {
+		conn->last = time(NULL);
+		srv->stats.bytes_out += res;
+		done = (size_t)res < conn->iov[0].iov_len ? (size_t)res :
+		    conn->iov[0].iov_len;
+		conn->outoff += done;
+		conn->bloboff += res - done;
+	} else if (res != -EINTR && res != -EAGAIN) {
+		conn_close(srv, conn);
+		return;
+	}
+	conn_run(srv, conn);
+}
+
+/*
+ * uring_update
+ * conn_update() for io_uring, a read is queued whenever one is wanted
+ * and none is in flight. There is no taking one back, more input than
+ * wanted just waits in the buffer.
+ */
+static void
+uring_update(HTTP_SERVER *srv, HTTP_CONN *conn)
+{
+	if (!conn->closing && !conn->eof && conn->inlen < sizeof(conn->in) &&
+	    conn_pending(conn) <= HTTP_OUT_HIGH &&
+	    !(conn->ring & U_BIT(U_RECV))) {
+		conn->recv_at = conn->inlen;
+		if (solar_uring_recv(srv->uring, conn->fd,
+		    conn->in + conn->inlen, sizeof(conn->in) - conn->inlen,
+		    U_DATA(conn, U_RECV)) < 0) {
+			conn_close(srv, conn);
+			return;
+		}
+		conn->ring |= U_BIT(U_RECV);
+	}
+}
+
+static int
+set_nonblock(int fd)
+{
+	int flags;
+
+	if ((flags = fcntl(fd, F_GETFL)) < 0)
+		return (-1);
+	return (fcntl(fd, F_SETFL, flags | O_NONBLOCK));
+}
+
+static void
+accept_conns(HTTP_SERVER *srv)
+{
+	int fd;
+
+	for (;;) {
+		srv->stats.io_calls++;
+		if ((fd = accept(srv->listen_fd, NULL, NULL)) < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			return;
+		}
+		if (srv->nconn < HTTP_MAX_CONN) {
+			srv->stats.io_calls += 2;	/* fcntl, get and set */
+			if (set_nonblock(fd) < 0) {
+				srv->stats.refused++;
+				close(fd);
+				continue;
+			}
+		}
+		conn_new(srv, fd);
+	}
+}
+
+/*
+ * conn_new
+ *
+ * inputs	- HTTP_SERVER
+ *		- newly accepted non blocking connection
+ * output	- none
+ * side effects	- it is refused if there are too many already
+ */
+static void
+conn_new(HTTP_SERVER *srv, int fd)
+{
+	HTTP_CONN *conn;
+
+	if (srv->nconn >= HTTP_MAX_CONN) {
+		srv->stats.refused++;
+		close(fd);
+		return;
+	}
+	if ((conn = srv->spare) != NULL)
+		srv->spare = conn->next;
+	else if ((conn = calloc(1, sizeof(*conn))) == NULL) {
+		close(fd);
+		return;
+	} else {
+		solar_buf_init(&conn->out);
+		solar_buf_init(&conn->later);
+		conn->ringfd = -1;
+	}
+	conn->fd = fd;
+	conn->inlen = 0;
+	conn->scan = 0;
+	conn->skip = 0;
+	solar_buf_reset(&conn->out);
+	solar_buf_reset(&conn->later);
+	conn->outoff = 0;
+	conn->blob = NULL;
+	conn->bloboff = 0;
+	conn->file = -1;
+	conn->closing = 0;
+	conn->eof = 0;
+	conn->stream = 0;
+	conn->more = NULL;
+	conn->events = 0;
+	conn->last = time(NULL);
+	conn->prev = NULL;
+	conn->next = srv->conns;
+	if (srv->conns != NULL)
+		srv->conns->prev = conn;
+	srv->conns = conn;
+	srv->nconn++;
+	srv->stats.accepted++;
+	conn_update(srv, conn);
+}
+
+/*
+ * conn_read
+ * Read whatever has arrived, up to a full input buffer.
+ * output	- 0 or -1 if the connection was closed
+ */
+static int
+conn_read(HTTP_SERVER *srv, HTTP_CONN *conn)
+{
+	ssize_t n;
+
+	while (!conn->eof && conn->inlen < sizeof(conn->in)) {
+		srv->stats.io_calls++;
+		n = read(conn->fd, conn->in + conn->inlen,
+			 sizeof(conn->in) - conn->inlen);
+		if (n > 0) {
+			conn->inlen += n;
+			conn->last = time(NULL);
+			if (conn->stream)
+				conn->inlen = 0;	/* nothing more to serve */
+		} else if (n == 0)
+			conn->eof = 1;
+		else if (errno == EINTR)
+			continue;
+		else if (errno == EAGAIN || errno == EWOULDBLOCK)
+			break;
+		else {
+			conn_close(srv, conn);
+			return (-1);
+		}
+	}
+	return (0);
+}
+
+/*
+ * conn_run
+ *
+ * Answer every complete request that has arrived and send as much
+ * as the socket will take. Parsing stops while a lot of output is
+ * waiting, or a file is being sent, and carries on once it is done.
+ */
+static void
+conn_run(HTTP_SERVER *srv, HTTP_CONN *conn)
+{
+	int handled;
+	int sending;
+
+	do {
+		sending = conn->file >= 0;
+		handled = conn_process(srv, conn);
+		if (conn_write(srv, conn) < 0)
+			return;
+	} while ((handled > 0 || sending) && conn_pending(conn) == 0 &&
+		 conn->inlen > 0);
+
+	if (conn_pending(conn) == 0 && (conn->closing || conn->eof)) {
+		conn_close(srv, conn);
+		return;
+	}
+	conn_update(srv, conn);
+}
+
+/*
+ * conn_process
+ * output	- number of requests answered
+ */
+static int
+conn_process(HTTP_SERVER *srv, HTTP_CONN *conn)
+{
+	HTTP_REQUEST req;
+	size_t clen;
+	size_t used;
+	size_t n;
+	int handled;
+	int status;
+
+	handled = 0;
+	/* a reply must not overtake what is still queued in later */
+	while (!conn->closing && !conn->stream && conn->more == NULL &&
+	       conn->file < 0 && !(conn->ring & U_BIT(U_SEND)) &&
+	       conn->later.len == 0) {
+		if (conn->skip > 0) {
+			n = conn->skip < conn->inlen ? conn->skip : conn->inlen;
+			consume(conn, n);
+			conn->skip -= n;
+			if (conn->skip > 0)
+				break;
+			continue;
+		}
+		if (conn_pending(conn) > HTTP_OUT_HIGH)
+			break;
+		/* stray CRLF between requests is allowed */
+		while (conn->inlen > 0 &&
+		       (conn->in[0] == '\r' || conn->in[0] == '\n'))
+			consume(conn, 1);
+		if ((used = find_end(conn)) == 0) {
+			if (conn->inlen == sizeof(conn->in))
+				respond_error(srv, conn, 431);
+			break;
+		}
+		status = parse_request(conn->in, used, &req, &clen);
+		if (status != 0) {
+			respond_error(srv, conn, status);
+			break;
+		}
+		dispatch(srv, conn, &req);
+		consume(conn, used);
+		conn->skip = clen;
+		handled++;
+	}
+	return (handled);
+}
+
+/*
+ * conn_write
+ * On io_uring the write is queued, it carries on from uring_send().
+ * output	- 0 or -1 if the connection was closed
+ */
+static int
+conn_write(HTTP_SERVER *srv, HTTP_CONN *conn)
+{
+	struct iovec *iov;
+	SOLAR_BUF swap;
+	ssize_t n;
+	size_t done;
+	int cnt;
+
+	if (conn->ring & (U_BIT(U_SEND) | U_BIT(U_POLL)))
+		return (0);
+	iov = conn->iov;
+	while (conn_pending(conn) > 0) {
+		if (conn->outoff == conn->out.len && conn->blob == NULL &&
+		    conn->file < 0) {
+			/* what came while a write was in flight */
+			swap = conn->out;
+			conn->out = conn->later;
+			conn->later = swap;
+			solar_buf_reset(&conn->later);
+			conn->outoff = 0;
+			continue;
+		}
+		if (conn->outoff == conn->out.len && conn->blob == NULL) {
+			srv->stats.io_calls++;
+			if ((n = conn_sendfile(conn)) > 0) {
+				conn->last = time(NULL);
+				srv->stats.bytes_out += n;
+				continue;
+			}
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				return (conn_blocked(srv, conn));
+			conn_close(srv, conn);	/* the file shrank */
+			return (-1);
+		}
+		iov[0].iov_base = conn->out.buf + conn->outoff;
+		iov[0].iov_len = conn->out.len - conn->outoff;
+		cnt = 1;
+		if (conn->blob != NULL) {
+			iov[1].iov_base = conn->blob->buf.buf + conn->bloboff;
+			iov[1].iov_len = conn->blob->buf.len - conn->bloboff;
+			cnt = 2;
+		}
+		if (srv->uring != NULL) {
+			if (solar_uring_writev(srv->uring, conn->fd, iov, cnt,
+					       U_DATA(conn, U_SEND)) < 0) {
+				conn_close(srv, conn);
+				return (-1);
+			}
+			conn->ring |= U_BIT(U_SEND);
+			return (0);
+		}
+		srv->stats.io_calls++;
+		n = writev(conn->fd, iov, cnt);
+		if (n > 0) {
+			conn->last = time(NULL);
+			srv->stats.bytes_out += n;
+			done = (size_t)n < iov[0].iov_len ? (size_t)n :
+			    iov[0].iov_len;
+			conn->outoff += done;
+			conn->bloboff += n - done;
+		} else if (n < 0 && errno == EINTR)
+			continue;
+		else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return (0);
+		else {
+			conn_close(srv, conn);
+			return (-1);
+		}
+	}
+	if (conn->blob != NULL) {
+		http_blob_release(conn->blob);
+		conn->blob = NULL;
+	}
+	if (conn->file >= 0) {
+		srv->stats.io_calls++;
+		close(conn->file);
+		conn->file = -1;
+	}
+	solar_buf_reset(&conn->out);
+	conn->outoff = 0;
+	return (0);
+}
+
+/*
+ * conn_blocked
+ * The socket takes no more for now, kqueue and epoll say when it
+ * will by themselves, io_uring is asked to.
+ * output	- 0 or -1 if the connection was closed
+ */
+static int
+conn_blocked(HTTP_SERVER *srv, HTTP_CONN *conn)
+{
+	if (srv->uring == NULL)
+		return (0);
+	if (solar_uring_poll(srv->uring, conn->fd, SOLAR_URING_OUT,
+			     U_DATA(conn, U_POLL)) < 0) {
+		conn_close(srv, conn);
+		return (-1);
+	}
+	conn->ring |= U_BIT(U_POLL);
+	return (0);
+}
+
+/*
+ * conn_sendfile
+ * Send what the socket will take of the file.
+ * output	- bytes sent, 0 at end of file or -1 with errno set
+ */
+static ssize_t
+conn_sendfile(HTTP_CONN *conn)
+{
+	size_t len;
+#ifdef __linux__
+	ssize_t n;
+
+	len = conn->fileend - conn->fileoff;
+	if ((n = sendfile(conn->fd, conn->file, &conn->fileoff, len)) == 0)
+		errno = EIO;
+	return (n);
+#else
+	off_t sent;
+
+	len = conn->fileend - conn->fileoff;
+	sent = 0;
+	if (sendfile(conn->file, conn->fd, conn->fileoff, len, NULL, &sent,
+		     0) < 0 && sent == 0)
+		return (-1);
+	if (sent == 0)
+		errno = EIO;
+	conn->fileoff += sent;
+	return (sent);
+#endif
+}
+
+/* bytes queued but not yet sent */
+static size_t
+conn_pending(HTTP_CONN *conn)
+{
+	size_t n;
+
+	n = conn->out.len - conn->outoff + conn->later.len;
+	if (conn->blob != NULL)
+		n += conn->blob->buf.len - conn->bloboff;
+	if (conn->file >= 0)
+		n += conn->fileend - conn->fileoff;
+	return (n);
+}
+
+/*
+ * conn_flatten
+ * Anything queued must go after the blob, so what is left of the
+ * blob is copied to out first. Only pipelining gets here. While a
+ * write is in flight the blob is left alone, see conn_out().
+ */
+static int
+conn_flatten(HTTP_CONN *conn)
+{
+	HTTP_BLOB *blob;
+
+	if ((blob = conn->blob) == NULL || (conn->ring & U_BIT(U_SEND)))
+		return (0);
+	conn->blob = NULL;
+	if (solar_buf_append(&conn->out, blob->buf.buf + conn->bloboff,
+			     blob->buf.len - conn->bloboff) < 0) {
+		http_blob_release(blob);
+		return (-1);
+	}
+	http_blob_release(blob);
+	return (0);
+}
+
+/*
+ * conn_out
+ * Where more output goes. out is not touched while io_uring has a
+ * write from it in flight, conn_write() sends later after it.
+ */
+static SOLAR_BUF *
+conn_out(HTTP_CONN *conn)
+{
+	return ((conn->ring & U_BIT(U_SEND)) ? &conn->later : &conn->out);
+}
+
+static void
+conn_update(HTTP_SERVER *srv, HTTP_CONN *conn)
+{
+	int want;
+
+	if (srv->uring != NULL) {
+		uring_update(srv, conn);
+		return;
+	}
+	want = 0;
+	if (!conn->closing && !conn->eof && conn->inlen < sizeof(conn->in) &&
+	    conn_pending(conn) <= HTTP_OUT_HIGH)
+		want |= WANT_READ;
+	if (conn_pending(conn) > 0)
+		want |= WANT_WRITE;
+	if (want != conn->events)
+		srv->stats.io_calls++;
+	if (poller_set(srv->poll_fd, conn->fd, conn, conn->events, want) < 0) {
+		conn_close(srv, conn);
+		return;
+	}
+	conn->events = want;
+}
+
+/*
+ * conn_close
+ * The connection stays on the list with fd -1 until the end of
+ * http_server_poll, see there. On io_uring whatever it has in flight
+ * is cancelled, and the descriptor kept open until that is back, so
+ * its number can't be reused by a new connection under it.
+ */
+static void
+conn_close(HTTP_SERVER *srv, HTTP_CONN *conn)
+{
+	int op;
+
+	if (srv->uring != NULL) {
+		for (op = U_RECV; op <= U_POLL; op++)
+			if (conn->ring & U_BIT(op))
+				(void)solar_uring_cancel(srv->uring,
+							 U_DATA(conn, op));
+		conn->ringfd = conn->fd;
+	} else {
+		srv->stats.io_calls++;
+		close(conn->fd);
+	}
+	conn->fd = -1;
+	srv->nconn--;
+	if (conn->blob != NULL && !(conn->ring & U_BIT(U_SEND))) {
+		http_blob_release(conn->blob);
+		conn->blob = NULL;
+	}
+	if (conn->file >= 0) {
+		srv->stats.io_calls++;
+		close(conn->file);
+		conn->file = -1;
+	}
+	if (conn->stream) {
+		conn->stream = 0;
+		srv->stats.streams--;
+	}
+	if (conn->more != NULL) {
+		(void)conn->more(NULL, conn->more_arg);
+		conn->more = NULL;
+	}
+}
+
+/*
+ * conn_more
+ *
+ * inputs	- HTTP_SERVER
+ *		- connection sending a response in parts
+ * output	- 0 or -1 if out of memory
+ * side effects	- whatever more() adds is queued as a chunk, the last
+ *		  chunk once it says the body is complete
+ */
+static int
+conn_more(HTTP_SERVER *srv, HTTP_CONN *conn)
+{
+	char size[24];
+	int done;
+	int n;
+
+	solar_buf_reset(&srv->body);
+	done = conn->more(&srv->body, conn->more_arg) == 0;
+	if (done)
+		conn->more = NULL;
+	if (conn_flatten(conn) < 0)
+		return (-1);
+	if (srv->body.len > 0) {
+		if (conn->chunked) {
+			n = snprintf(size, sizeof(size), "%zx\r\n",
+				     srv->body.len);
+			if (solar_buf_append(conn_out(conn), size, n) < 0 ||
+			    solar_buf_append(&srv->body, "\r\n", 2) < 0)
+				return (-1);
+		}
+		if (solar_buf_append(conn_out(conn), srv->body.buf,
+				     srv->body.len) < 0)
+			return (-1);
+	}
+	if (!done)
+		return (0);
+	if (conn->chunked &&
+	    solar_buf_append(conn_out(conn), "0\r\n\r\n", 5) < 0)
+		return (-1);
+	conn->closing = conn->more_close;
+	return (0);
+}
+
+static void
+consume(HTTP_CONN *conn, size_t n)
+{
+	memmove(conn->in, conn->in + n, conn->inlen - n);
+	conn->inlen -= n;
+	conn->scan = 0;
+}
+
+/*
+ * find_end
+ *
+ * Look for the blank line ending the headers, CRLF or bare LF,
+ * carrying on from where the last call got to.
+ *
+ * output	- length of request line plus headers, 0 if incomplete
+ */
+static size_t
+find_end(HTTP_CONN *conn)
+{
+	const char *in;
+	size_t i;
+
+	in = conn->in;
+	for (i = conn->scan; i < conn->inlen; i++) {
+		if (in[i] != '\n')
+			continue;
+		if (i >= 1 && in[i - 1] == '\n')
+			return (i + 1);
+		if (i >= 2 && in[i - 1] == '\r' && in[i - 2] == '\n')
+			return (i + 1);
+	}
+	conn->scan = conn->inlen;
+	return (0);
+}
+
+/*
+ * parse_request
+ *
+ * inputs	- request line and headers, ending in a blank line
+ *		- HTTP_REQUEST to fill in
+ *		- where to return the Content-Length
+ * output	- 0 or the HTTP status to refuse it with
+ * side effects	- buf is split into nul terminated strings
+ */
+static int
+parse_request(char *buf, size_t len, HTTP_REQUEST *req, size_t *clen)
+{
+	char *line;
+	char *next;
+	char *target;
+	char *version;
+	char *value;
+	char *p;
+	char *end;
+	unsigned long long v;
+
+	memset(req, 0, sizeof(*req));
+	*clen = 0;
+	end = buf + len;
+
+	/* a nul would hide the end of a line from line_end() */
+	if (memchr(buf, '\0', len) != NULL)
+		return (400);
+	next = line_end(buf);
+	req->method = buf;
+	if ((target = strchr(buf, ' ')) == NULL)
+		return (400);
+	*target++ = '\0';
+	if ((version = strchr(target, ' ')) == NULL)
+		return (400);
+	*version++ = '\0';
+	if (strncmp(version, "HTTP/", 5) != 0)
+		return (400);
+	if (strncmp(version, "HTTP/1.", 7) != 0 ||
+	    !isdigit((unsigned char)version[7]) || version[8] != '\0')
+		return (505);
+	req->minor = version[7] - '0';
+	req->keepalive = req->minor >= 1;
+
+	/* absolute form, http://host/path */
+	if (strncasecmp(target, "http://", 7) == 0) {
+		p = strchr(target + 7, '/');
+		if (p == NULL) {
+			target[0] = '/';
+			target[1] = '\0';
+		} else
+			target = p;
+	}
+	if (*target != '/')
+		return (400);
+	if ((p = strchr(target, '?')) != NULL) {
+		*p++ = '\0';
+		req->query = p;
+	} else
+		req->query = "";
+	req->path = target;
+
+	for (line = next; line < end; line = next) {
+		next = line_end(line);
+		if (*line == '\0')
+			break;
+		if (*line == ' ' || *line == '\t')
+			return (400);		/* obsolete line folding */
+		if ((value = strchr(line, ':')) == NULL || value == line)
+			return (400);
+		*value++ = '\0';
+		while (*value == ' ' || *value == '\t')
+			value++;
+		p = value + strlen(value);
+		while (p > value && (p[-1] == ' ' || p[-1] == '\t'))
+			*--p = '\0';
+		if (req->nheaders == HTTP_MAX_HEADERS)
+			return (431);
+		req->header_name[req->nheaders] = line;
+		req->header_value[req->nheaders] = value;
+		req->nheaders++;
+
+		if (strcasecmp(line, "Content-Length") == 0) {
+			if (!isdigit((unsigned char)*value))
+				return (400);
+			v = strtoull(value, &p, 10);
+			if (*p != '\0' || v > HTTP_IN_MAX * 1024ULL)
+				return (400);
+			*clen = v;
+		} else if (strcasecmp(line, "Transfer-Encoding") == 0)
+			return (501);
+		else if (strcasecmp(line, "Connection") == 0) {
+			if (has_token(value, "close"))
+				req->keepalive = 0;
+			else if (has_token(value, "keep-alive"))
+				req->keepalive = 1;
+		}
+	}
+
+	if (req->minor >= 1 && http_header(req, "Host") == NULL)
+		return (400);
+	if (strcmp(req->method, "HEAD") == 0)
+		req->head = 1;
+	else if (strcmp(req->method, "GET") != 0)
+		return (405);
+	return (0);
+}
+
+/*
+ * line_end
+ * nul terminate the line at line, dropping any CR, and return
+ * the start of the next one. The header block always ends in LF
+ * and parse_request() has refused any with a nul in it.
+ */
+static char *
+line_end(char *line)
+{
+	char *p;
+
+	p = strchr(line, '\n');
+	*p = '\0';
+	if (p > line && p[-1] == '\r')
+		p[-1] = '\0';
+	return (p + 1);
+}
+
+/* is token one of the comma separated tokens in value, any case */
+static int
+has_token(const char *value, const char *token)
+{
+	size_t len;
+
+	len = strlen(token);
+	while (*value != '\0') {
+		while (*value == ' ' || *value == '\t' || *value == ',')
+			value++;
+		if (strncasecmp(value, token, len) == 0 &&
+		    (value[len] == '\0' || value[len] == ',' ||
+		     value[len] == ' ' || value[len] == '\t'))
+			return (1);
+		while (*value != '\0' && *value != ',')
+			value++;
+	}
+	return (0);
+}
+
+static void
+dispatch(HTTP_SERVER *srv, HTTP_CONN *conn, HTTP_REQUEST *req)
+{
+	HTTP_RESPONSE resp;
+	struct timespec start;
+	struct timespec end;
+	double t;
+
+	solar_buf_reset(&srv->body);
+	resp.status = 200;
+	resp.content_type = "text/html; charset=utf-8";
+	resp.body = &srv->body;
+	resp.headers[0] = '\0';
+	resp.stream = 0;
+	resp.blob = NULL;
+	resp.more = NULL;
+	resp.file = -1;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	srv->handler(req, &resp, srv->arg);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	t = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	srv->stats.requests++;
+	srv->stats.render_sum += t;
+	if (t > srv->stats.render_max)
+		srv->stats.render_max = t;
+	if (resp.status >= 100 && resp.status < 600)
+		srv->stats.status[resp.status / 100]++;
+	if (resp.more != NULL && req->head) {
+		(void)resp.more(NULL, resp.more_arg);
+		resp.more = NULL;
+	}
+	if (resp.stream && !req->head) {
+		conn->stream = 1;
+		srv->stats.streams++;
+	} else if (!req->keepalive || resp.stream ||
+		   (resp.more != NULL && req->minor == 0))
+		conn->closing = 1;
+	if (queue_response(conn, &resp, req->head, req->minor) < 0)
+		conn->closing = 1;
+	if (resp.blob != NULL)
+		http_blob_release(resp.blob);
+	if (resp.file >= 0) {
+		srv->stats.io_calls++;
+		close(resp.file);	/* HEAD, 304 or not queued */
+	}
+	if (resp.more != NULL) {
+		/* the rest comes from http_server_more() */
+		conn->more = resp.more;
+		conn->more_arg = resp.more_arg;
+		conn->chunked = req->minor > 0;
+		conn->more_close = conn->closing;
+		conn->closing = 0;
+	}
+}
+
+/*
+ * respond_error
+ * The rest of the input can't be trusted so the connection is
+ * closed once the error is sent.
+ */
+static void
+respond_error(HTTP_SERVER *srv, HTTP_CONN *conn, int status)
+{
+	HTTP_RESPONSE resp;
+
+	solar_buf_reset(&srv->body);
+	resp.status = status;
+	resp.content_type = "text/html; charset=utf-8";
+	resp.body = &srv->body;
+	resp.headers[0] = '\0';
+	resp.stream = 0;
+	resp.blob = NULL;
+	resp.more = NULL;
+	resp.file = -1;
+	solar_buf_printf(&srv->body,
+			 "<html><body><h1>%d %s</h1></body></html>\n",
+			 status, http_reason(status));
+	conn->closing = 1;
+	conn->inlen = 0;
+	srv->stats.status[status / 100]++;
+	(void)queue_response(conn, &resp, 0, 1);
+}
+
+/*
+ * queue_response
+ *
+ * inputs	- connection
+ *		- response
+ *		- HEAD request, send headers only
+ *		- HTTP/1.minor of the request
+ * output	- 0 or -1 if out of memory
+ * side effects	- status line, headers and body are added to conn->out
+ */
+static int
+queue_response(HTTP_CONN *conn, HTTP_RESPONSE *resp, int head, int minor)
+{
+	char hdr[512];
+	char length[48];
+	const char *connection;
+	SOLAR_BUF *body;
+	int has_body;
+	int chunked;
+	int n;
+
+	if (conn_flatten(conn) < 0)
+		return (-1);
+	body = resp->blob != NULL ? &resp->blob->buf : resp->body;
+	has_body = resp->status != 204 && resp->status != 304;
+	chunked = has_body && resp->more != NULL && minor > 0;
+	length[0] = '\0';
+	if (chunked)
+		strlcpy(length, "Transfer-Encoding: chunked\r\n",
+			sizeof(length));
+	else if (has_body && resp->file >= 0)
+		snprintf(length, sizeof(length), "Content-Length: %lld\r\n",
+			 (long long)resp->file_len);
+	else if (has_body && !resp->stream && resp->more == NULL)
+		snprintf(length, sizeof(length), "Content-Length: %zu\r\n",
+			 body->len);
+	if (conn->closing || resp->stream)
+		connection = "Connection: close\r\n";
+	else if (minor == 0)
+		connection = "Connection: keep-alive\r\n";
+	else
+		connection = "";
+
+	n = snprintf(hdr, sizeof(hdr), "HTTP/1.1 %d %s\r\n"
+		     "Date: %s\r\n"
+		     "Content-Type: %s\r\n"
+		     "%s%s%s\r\n",
+		     resp->status, http_reason(resp->status), http_date(),
+		     resp->content_type, length, connection, resp->headers);
+	if (n < 0 || (size_t)n >= sizeof(hdr))
+		return (-1);
+	if (solar_buf_append(&conn->out, hdr, n) < 0)
+		return (-1);
+	if (resp->file >= 0) {
+		if (!has_body || head || resp->file_len <= 0)
+			return (0);
+		conn->file = resp->file;
+		conn->fileoff = resp->file_off;
+		conn->fileend = resp->file_off + resp->file_len;
+		resp->file = -1;
+		return (0);
+	}
+	if (!has_body || head || body->len == 0)
+		return (0);
+	if (chunked) {
+		n = snprintf(hdr, sizeof(hdr), "%zx\r\n", body->len);
+		if (solar_buf_append(&conn->out, hdr, n) < 0 ||
+		    solar_buf_append(&conn->out, body->buf, body->len) < 0)
+			return (-1);
+		return (solar_buf_append(&conn->out, "\r\n", 2));
+	}
+	if (resp->blob != NULL) {
+		conn->blob = http_blob_hold(resp->blob);
+		conn->bloboff = 0;
+		return (0);
+	}
+	return (solar_buf_append(&conn->out, body->buf, body->len));
+}
+
+/* Date header, only formatted once a second */
+static const char *
+http_date(void)
+{
+	static char date[64];
+	static time_t cached;
+	time_t now;
+
+	now = time(NULL);
+	if (now != cached) {
+		http_time(now, date, sizeof(date));
+		cached = now;
+	}
+	return (date);
+}
+
+/*
+ * parse_http_time
+ * Only the IMF-fixdate form every current client sends is taken.
+ * output	- the time or -1 if it is not one
+ */
+static time_t
+parse_http_time(const char *s)
+{
+	struct tm tm;
+	const char *end;
+
+	memset(&tm, 0, sizeof(tm));
+	end = strptime(s, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+	if (end == NULL || *end != '\0')
+		return (-1);
+	return (timegm(&tm));
+}
@@ -0,0 +1,176 @@
+/* Copyright (c) 2023 Diane Bruce db@db.net
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#ifndef __HTTP_SERVER_H__
+#define __HTTP_SERVER_H__
+
+#include <sys/types.h>
+#include <stddef.h>
+#include <time.h>
+#include "solar_format.h"
+#include "solar_uring.h"
+
+#define HTTP_IN_MAX		8192	/* request line plus headers */
+#define HTTP_MAX_HEADERS	32
+#define HTTP_MAX_CONN		256
+#define HTTP_OUT_HIGH		(256 * 1024) /* stop reading above this */
+#define HTTP_READ_TIMEOUT	15	/* idle or partial request, seconds */
+#define HTTP_WRITE_TIMEOUT	30	/* no progress sending, seconds */
+#define HTTP_STREAM_MAX		(64 * 1024) /* unsent to a subscriber */
+
+/*
+ * A parsed request. Everything points into the connection's input
+ * buffer and is only valid during the handler call.
+ */
+typedef struct {
+	const char	*method;
+	const char	*path;		/* without the query */
+	const char	*query;		/* after '?', "" if none */
+	int		minor;		/* HTTP/1.minor */
+	int		head;		/* HEAD, headers only */
+	int		keepalive;
+	int		nheaders;
+	const char	*header_name[HTTP_MAX_HEADERS];
+	const char	*header_value[HTTP_MAX_HEADERS];
+} HTTP_REQUEST;
+
+/*
+ * Reference counted body that is not changed once rendered, e.g. a
+ * pre-rendered page. Connections sending it hold a reference of
+ * their own so its owner can drop or replace it at any time.
+ */
+typedef struct {
+	int		refs;
+	SOLAR_BUF	buf;
+} HTTP_BLOB;
+
+/*
+ * Continues a response whose body is not all there yet. Called with
+ * the buffer to append to when http_server_more() says there may be
+ * more, it returns 1 if there is still more to come or 0 once the
+ * body is complete. Called with a NULL buffer if the connection goes
+ * first. Either way after returning 0 it is not called again.
+ */
+typedef int (*HTTP_MORE)(SOLAR_BUF *body, void *arg);
+
+/*
+ * Filled in by the handler. The body is appended to a buffer owned
+ * by the server and reused for every request.
+ * A handler setting stream makes the connection a subscriber, the
+ * body has no length and carries on with http_server_broadcast().
+ * A handler setting blob sends that instead of the body, the
+ * response owns one reference which the server releases.
+ * A handler setting more sends the body so far at once, and the rest
+ * chunked (HTTP/1.0, until close) as more() adds to it.
+ * A handler setting file, an open descriptor the server then owns
+ * and closes, sends file_len bytes of it from file_off with
+ * sendfile() instead of the body, never copying them.
+ */
+typedef struct {
+	int		status;
+	const char	*content_type;
+	SOLAR_BUF	*body;
+	char		headers[256];	/* extra "Name: value\r\n" lines */
+	int		stream;
+	HTTP_BLOB	*blob;
+	HTTP_MORE	more;
+	void		*more_arg;
+	int		file;		/* -1 if none */
+	off_t		file_off;
+	off_t		file_len;
+} HTTP_RESPONSE;
+
+typedef void (*HTTP_HANDLER)(HTTP_REQUEST *req, HTTP_RESPONSE *resp,
+			     void *arg);
+
+typedef struct http_conn HTTP_CONN;
+typedef struct http_server HTTP_SERVER;
+typedef void (*HTTP_WATCH)(HTTP_SERVER *srv, void *arg);
+
+/* Counters since http_server_init(), see http_server_stats() */
+typedef struct {
+	unsigned long	accepted;
+	unsigned long	refused;	/* over HTTP_MAX_CONN */
+	unsigned long	timeouts;	/* dropped idle or stalled */
+	unsigned long	requests;
+	unsigned long	status[6];	/* responses by status / 100 */
+	double		render_sum;	/* seconds spent in the handler */
+	double		render_max;
+	unsigned long	bytes_out;
+	unsigned long	streams;	/* subscribers now */
+	unsigned long	dropped;	/* subscribers too slow to keep */
+	unsigned long	io_calls;	/* socket, poller and ring calls made
+					   here, not by handlers or zlib */
+	unsigned long	buf_grows;	/* see solar_buf_grows() */
+	unsigned long	uring;		/* 1 if running on io_uring */
+} HTTP_STATS;
+
+/* http_server_init() flags */
+#define HTTP_URING	0x01	/* use io_uring if the kernel has it */
+
+struct http_server {
+	int		listen_fd;
+	int		poll_fd;	/* kqueue or epoll descriptor */
+	SOLAR_URING	*uring;		/* or this instead, if not NULL */
+	unsigned long	enters;		/* of uring counted in stats */
+	HTTP_HANDLER	handler;
+	void		*arg;
+	HTTP_CONN	*conns;		/* open connections */
+	HTTP_CONN	*spare;		/* closed ones kept for reuse */
+	int		nconn;
+	SOLAR_BUF	body;
+	time_t		last_sweep;
+	HTTP_STATS	stats;
+	int		watch_fd;	/* see http_server_watch() */
+	HTTP_WATCH	watch;
+	void		*watch_arg;
+};
+
+int	http_server_init(HTTP_SERVER *srv, int listen_fd, int flags,
+			 HTTP_HANDLER handler, void *arg);
+int	http_server_poll(HTTP_SERVER *srv, int timeout_ms);
+int	http_server_watch(HTTP_SERVER *srv, int fd, HTTP_WATCH watch,
+			  void *arg);
+int	http_server_broadcast(HTTP_SERVER *srv, const char *data,
+			      size_t len);
+void	http_server_more(HTTP_SERVER *srv);
+const HTTP_STATS *http_server_stats(HTTP_SERVER *srv);
+const char *http_header(HTTP_REQUEST *req, const char *name);
+int	http_query_int(HTTP_REQUEST *req, const char *name, long *value);
+int	http_query(HTTP_REQUEST *req, const char *name, char *buf,
+		   size_t size);
+void	http_add_header(HTTP_RESPONSE *resp, const char *name,
+			const char *value);
+const char *http_reason(int status);
+void	http_time(time_t when, char *buf, size_t size);
+int	http_modified_since(HTTP_REQUEST *req, time_t mtime);
+int	http_range(HTTP_REQUEST *req, off_t size, const char *validator,
+		   off_t *first, off_t *last);
+int	http_etag_match(HTTP_REQUEST *req, const char *etag);
+int	http_accepts(HTTP_REQUEST *req, const char *coding);
+HTTP_BLOB *http_blob_new(void);
+HTTP_BLOB *http_blob_gzip(const HTTP_BLOB *blob);
+HTTP_BLOB *http_blob_hold(HTTP_BLOB *blob);
+void	http_blob_release(HTTP_BLOB *blob);
+
+#endif
@@ -51,7 +51,6 @@
 #include "modbus_crc.h"
 #include "libmodbus.h"
 
-#define MAX_PACKET	1024
 #define MAXBUF		1024
 
 struct modbus_dev {
@@ -62,17 +61,36 @@ struct modbus_dev {
 	unsigned short *data;
 };
 
-static struct modbus_dev *do_one_modbus_rx(unsigned short *data_buf);
-static struct modbus_dev *receive_modbus_packet(int check, unsigned char, unsigned short *);
-static struct modbus_dev *decode_modbus_packet(unsigned char *, int buflen, unsigned short *data);
-static void send_to_modbus_dev(struct modbus_dev *modbus_dev, unsigned short data[]);
-
-static int master_fd;
-static int baud;
+static struct modbus_dev *do_one_modbus_rx(MODBUS_CTX *ctx,
+					   struct modbus_dev *decode,
+					   int maxcnt,
+					   unsigned short *data_buf);
+static void receive_modbus_packet(MODBUS_CTX *ctx, unsigned char);
+static struct modbus_dev *decode_modbus_packet(MODBUS_CTX *ctx,
+					       unsigned char *, int buflen,
+					       struct modbus_dev *decode,
+					       int maxcnt,
+					       unsigned short *data);
+static void send_to_modbus_dev(MODBUS_CTX *ctx, struct modbus_dev *modbus_dev,
+			       unsigned short data[]);
+static int read_regs(MODBUS_CTX *ctx, int device_id, int count,
+		     unsigned short addr, unsigned short data[], int maxcnt);
+static double elapsed(const struct timespec *start);
+static void count_reply(MODBUS_CTX *ctx, const struct timespec *start);
+
+/* upper bound of each latency bucket in seconds, the last is +Inf */
+const double modbus_latency_bound[MODBUS_LATENCY_BUCKETS] =
+	{0.05, 0.1, 0.2, 0.35, 0.5, 1.0, 2.0, 0};
+
+/* Context used by the original single port API */
+static MODBUS_CTX default_ctx = { -1 };
 
 /*
  * do_one_modbus_rx
- * inputs	pointer to data_buf
+ * inputs	modbus context
+ *		where to put the decoded header
+ *		max number of words data_buf can hold
+ *		pointer to data_buf
  * output	pointer to decoded packet
  * side effects none
  *
@@ -83,7 +101,8 @@ static int baud;
  */
 
 static struct modbus_dev *
-do_one_modbus_rx(unsigned short *data_buf)
+do_one_modbus_rx(MODBUS_CTX *ctx, struct modbus_dev *decode, int maxcnt,
+		 unsigned short *data_buf)
 {
 	fd_set	readfs;
 	int	status;
@@ -91,11 +110,13 @@ do_one_modbus_rx(unsigned short *data_buf)
 	struct timeval timeout;
 	unsigned char readbuf[MAXBUF];
 	int delay;
+	struct modbus_dev *modbus_dev;
 	
 	FD_ZERO(&readfs);
+	ctx->rxlen = 0;
 
 	for(;;) {	
-		FD_SET(master_fd, &readfs);
+		FD_SET(ctx->fd, &readfs);
 		/*
 		 * XXX
 		 * This timeout depends on baud rate and should
@@ -105,23 +126,42 @@ do_one_modbus_rx(unsigned short *data_buf)
 		 * At 9.6 Kb that's roughly 1ms per bit so 10ms per byte
 		 * (1 start 1 stop bit + 8 data bits) that's 336000 usec
 		 */
-		delay = (baud * 3.5) * 10;
+		delay = (ctx->baud * 3.5) * 10;
 		//		timeout.tv_usec = 350000;
 		timeout.tv_usec = delay;
 		timeout.tv_sec = 0;
-		if ((status = select(FD_SETSIZE, &readfs, NULL, NULL, &timeout)) > 0){
-			if (FD_ISSET(master_fd, &readfs)) {
-				if (ioctl(master_fd, FIONREAD, &nread) != 0)
+		if ((status = select(ctx->fd + 1, &readfs, NULL, NULL, &timeout)) > 0){
+			if (FD_ISSET(ctx->fd, &readfs)) {
+				if (ioctl(ctx->fd, FIONREAD, &nread) != 0) {
+					ctx->stats.bad_replies++;
 					return(NULL);
+				}
 				if (nread > 0) {
-					FD_CLR(master_fd, &readfs);
-					if(read(master_fd, readbuf, 1) > 0)
-						receive_modbus_packet(0, readbuf[0], data_buf);
-					FD_CLR(master_fd, &readfs);
+					FD_CLR(ctx->fd, &readfs);
+					if(read(ctx->fd, readbuf, 1) > 0)
+						receive_modbus_packet(ctx,
+								      readbuf[0]);
+					FD_CLR(ctx->fd, &readfs);
 				}
 			}
-		} else if (status == 0)
-			return(receive_modbus_packet(1, readbuf[0], data_buf));
+		} else if (status == 0) {
+			/*
+			 * The device stopped sending, if anything was
+			 * accumulated it should be a complete packet.
+			 */
+			modbus_dev = NULL;
+			if (ctx->rxlen != 0)
+				modbus_dev = decode_modbus_packet(ctx,
+					ctx->rxbuf, ctx->rxlen, decode,
+					maxcnt, data_buf);
+			else
+				ctx->stats.timeouts++;
+			ctx->rxlen = 0;
+			return(modbus_dev);
+		} else if (errno != EINTR) {
+			ctx->stats.bad_replies++;
+			return(NULL);
+		}
 	}
 	return (NULL);
 }
@@ -131,73 +171,73 @@ do_one_modbus_rx(unsigned short *data_buf)
  *
  * modbus binary protocol uses a 3.5 char delay to signal the start and
  * end of a packet. So simply accumulate a buffer until I either overflow
- * or check is set because the device stopped sending. If check is set
- * a complete packet should be available.
+ * or the device stops sending, see do_one_modbus_rx
  */
 
-static unsigned char buf[MAX_PACKET];
-
-static struct modbus_dev *
-receive_modbus_packet(int check, unsigned char c, unsigned short *data_buf)
+static void
+receive_modbus_packet(MODBUS_CTX *ctx, unsigned char c)
 {
-	static unsigned char *bp=buf;
-	static int buflen = 0;
-	static struct modbus_dev *modbus_dev=NULL;
-	
-	/* Initialize or check for full buffer hence packet available
-	 * If buffer decodes correctly, return a pointer to the modbus_dev 
-	 */
-
-	if (check) {
-		if (buflen != 0)
-			modbus_dev =
-				decode_modbus_packet(buf, buflen, data_buf);
-		else
-			modbus_dev = NULL;
-		buflen = 0;
-		bp = buf;
-		return(modbus_dev);
-	} else {
-		if (buflen < MAX_PACKET) {
-			*bp++ = c;
-			buflen++;
-		}
-	}
-	return (NULL);
+	if (ctx->rxlen < MODBUS_MAX_PACKET)
+		ctx->rxbuf[ctx->rxlen++] = c;
 }
 
 /*
  * Try to parse out the function, station, count, address, and byte count
  * from incoming packet and then verify the checksum.
  * If it's valid checksum return a pointer to a modbus_dev struct.
+ * Never copy more than maxcnt words into data_buf.
+ * Why a packet was rejected is counted in ctx->stats.
  */
 
 static struct modbus_dev *
-decode_modbus_packet(unsigned char * buf, int buflen, unsigned short *data_buf)
+decode_modbus_packet(MODBUS_CTX *ctx, unsigned char * buf, int buflen,
+		     struct modbus_dev *modbus_decode, int maxcnt,
+		     unsigned short *data_buf)
 {
 	unsigned short crc=0;
 	unsigned short check_crc=0;
-	unsigned short addr=0;
-	int station=0;
-	int function=0;
 	int byte_count;
-	int cnt=0;
-	static struct modbus_dev modbus_decode;
 	
+	if (buflen < 5) {
+		ctx->stats.bad_replies++;
+		return (NULL);
+	}
 	crc = buf[buflen - 1];
 	crc += buf[buflen - 2] << 8;
 	check_crc = crc16(buf, buflen - 2);
 
-	if (crc == check_crc) {
-		modbus_decode.station = buf[0] & 0xFF;
-		modbus_decode.function = buf[1] & 0xFF;
-		byte_count = buf[2];
-		modbus_decode.cnt  = byte_count / 2;
-		modbus_decode.data = data_buf;
-		swab(buf+3, data_buf, byte_count);
-		return (&modbus_decode); /* OK a valid modbus packet */
-	} else
+	if (crc != check_crc) {
+		ctx->stats.crc_errors++;
 		return (NULL);		/* bad modbus packet */
+	}
+
+	modbus_decode->station = buf[0] & 0xFF;
+	modbus_decode->function = buf[1] & 0xFF;
+	modbus_decode->data = data_buf;
+	if (modbus_decode->function & 0x80) {
+		ctx->stats.exceptions++;
+		return (NULL);		/* modbus exception response */
+	}
+	if (modbus_decode->function == WRITE_MULTIPLE_REGISTERS) {
+		/* Reply echoes address and count, no data */
+		if (buflen < 8) {
+			ctx->stats.bad_replies++;
+			return (NULL);
+		}
+		modbus_decode->addr = (buf[2] << 8) | buf[3];
+		modbus_decode->cnt = (buf[4] << 8) | buf[5];
+		return (modbus_decode);
+	}
+	byte_count = buf[2];
+	if (byte_count > buflen - 5) {
+		ctx->stats.bad_replies++;
+		return (NULL);		/* truncated */
+	}
+	if (byte_count / 2 > maxcnt)
+		byte_count = maxcnt * 2;
+	modbus_decode->cnt  = byte_count / 2;
+	swab(buf+3, data_buf, byte_count);
+	return (modbus_decode); /* OK a valid modbus packet */
 }
 
 /*
@@ -206,16 +246,17 @@ decode_modbus_packet(unsigned char * buf, int buflen, unsigned short *data_buf)
  * then does the write
  */
 
-static unsigned char sndbuf[MAXBUF];
-
 static void
-send_to_modbus_dev(struct modbus_dev *modbus_dev, unsigned short data[])
+send_to_modbus_dev(MODBUS_CTX *ctx, struct modbus_dev *modbus_dev,
+		   unsigned short data[])
 {
+	unsigned char *sndbuf;
 	int byte_count;
 	int total=0;
 	int crc_cnt=0;
 	unsigned short send_crc;
 
+	sndbuf = ctx->txbuf;
 	sndbuf[0] = modbus_dev->station & 0xFF;
 	sndbuf[1] = modbus_dev->function & 0xFF;
 	sndbuf[2] = (modbus_dev->addr >> 8) & 0xFF;
@@ -232,6 +273,8 @@ send_to_modbus_dev(struct modbus_dev *modbus_dev, unsigned short data[])
 		break;
 	case WRITE_MULTIPLE_REGISTERS:
 		byte_count = 2 * modbus_dev->cnt;
+		if (byte_count > MODBUS_MAX_PACKET - 9)
+			byte_count = MODBUS_MAX_PACKET - 9;
 		sndbuf[6] = byte_count;
 		swab(data, sndbuf + 7, byte_count);
 		/* 7 for header */
@@ -245,114 +288,206 @@ send_to_modbus_dev(struct modbus_dev *modbus_dev, unsigned short data[])
 		break;
 	}
 	
-	write(master_fd, sndbuf, total);
+	write(ctx->fd, sndbuf, total);
+	ctx->stats.requests++;
+}
+
+static double
+elapsed(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return ((now.tv_sec - start->tv_sec) +
+		(now.tv_nsec - start->tv_nsec) / 1e9);
+}
+
+/* a good reply came back, account its latency */
+static void
+count_reply(MODBUS_CTX *ctx, const struct timespec *start)
+{
+	double t;
+	int i;
+
+	t = elapsed(start);
+	ctx->stats.replies++;
+	ctx->stats.latency_sum += t;
+	if (t > ctx->stats.latency_max)
+		ctx->stats.latency_max = t;
+	for (i = 0; i < MODBUS_LATENCY_BUCKETS - 1; i++)
+		if (t <= modbus_latency_bound[i])
+			break;
+	ctx->stats.latency_bucket[i]++;
 }
 
 /* Public facing functions */
 
+void
+modbus_ctx_init(MODBUS_CTX *ctx)
+{
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->fd = -1;
+}
+
 /*
- * open_modbus is just given a tty name to open, returns -ve
+ * modbus_ctx_open is just given a tty name to open, returns -ve
  * if error.
  * Since the official spec uses the bit rate to adjust timing I will
  * need the baud rate to properly set that even if I don't adjut
  * the tty speed here.
  *
- * inputs	- tty_name the name of the tty to open
+ * inputs	- modbus context
+ *		- tty_name the name of the tty to open
  * output	- tty fd or -1
- * side effects	- master_fd is set
+ * side effects	- ctx->fd is set
  *
  * XXX should speed actually be set in this function?
  * or read from ioctl?
  */
 
-static struct termios origtermsettings;
-
 #define	RETRY_COUNT	5
 int
-open_modbus(const char *tty_name, speed_t speed)
+modbus_ctx_open(MODBUS_CTX *ctx, const char *tty_name, speed_t speed)
 {
-	int status;
-	int i;
-	unsigned short *data;
 	struct termios termsettings;
 	int retry_count;
 
-	receive_modbus_packet(1, 0, NULL);	/* Init only */
-	baud = speed;
-	master_fd = -1;
+	ctx->rxlen = 0;
+	ctx->baud = speed;
+	ctx->fd = -1;
 	/*
 	 * It is possible that another process is reading the modbus
 	 * hence try RETRY_COUNT times with short delay between each
 	 * attempt. 1 second is plenty.
 	 */
 	retry_count = RETRY_COUNT;
-	while (master_fd < 0 && retry_count > 0) {
-		master_fd = open(tty_name, O_RDWR|O_EXLOCK|LOCK_NB);
-		if (master_fd < 0) {
+	while (ctx->fd < 0 && retry_count > 0) {
+		ctx->fd = open(tty_name, O_RDWR|O_EXLOCK|LOCK_NB);
+		if (ctx->fd < 0) {
 			if (errno != EAGAIN)
 				return(-1);
 			retry_count--;
 			sleep(1);
 		} else {
-			tcgetattr(master_fd, &origtermsettings);
-			tcgetattr(master_fd, &termsettings);
+			tcgetattr(ctx->fd, &ctx->origtermsettings);
+			tcgetattr(ctx->fd, &termsettings);
 			cfmakeraw(&termsettings);
 	
 			termsettings.c_cflag = CS8|CREAD|CLOCAL;
 			cfsetspeed(&termsettings, B9600);
-			tcsetattr(master_fd, TCSANOW, &termsettings);
+			tcsetattr(ctx->fd, TCSANOW, &termsettings);
 		}
 	}
 
-	return(master_fd);
+	return(ctx->fd);
 }
 
 int
-close_modbus(int fd)
+modbus_ctx_close(MODBUS_CTX *ctx)
 {
 /* Ignore errors */
 	
-	tcsetattr(fd, TCSANOW, &origtermsettings);
-	close(fd);
+	if (ctx->fd >= 0) {
+		tcsetattr(ctx->fd, TCSANOW, &ctx->origtermsettings);
+		close(ctx->fd);
+	}
+	ctx->fd = -1;
 	return(-1);
 }
 
-static	unsigned short	temp_data[MAXBUF];
-
 int
-write_registers(int device_id, int count,
-		unsigned short addr, unsigned short data[])
+modbus_ctx_write_registers(MODBUS_CTX *ctx, int device_id, int count,
+			   unsigned short addr, unsigned short data[])
 {
-	static struct modbus_dev modbus_dev;
-	static struct modbus_dev *modbus_response;
+	struct modbus_dev modbus_dev;
+	struct modbus_dev decode;
+	struct modbus_dev *modbus_response;
+	struct timespec start;
 
 	modbus_dev.station = device_id;
 	modbus_dev.function = WRITE_MULTIPLE_REGISTERS;
 	modbus_dev.addr = addr;
 	modbus_dev.cnt = count;
-	send_to_modbus_dev(&modbus_dev, data);
-	modbus_response = do_one_modbus_rx(temp_data);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	send_to_modbus_dev(ctx, &modbus_dev, data);
+	modbus_response = do_one_modbus_rx(ctx, &decode, 0, NULL);
 	if (modbus_response == NULL)
 		return (-1);
-	else
-		return (modbus_response->cnt);
+	count_reply(ctx, &start);
+	return (modbus_response->cnt);
 }
 
-int
-read_registers(int device_id, int count,
-		       unsigned short addr, unsigned short data[])
+static int
+read_regs(MODBUS_CTX *ctx, int device_id, int count,
+	  unsigned short addr, unsigned short data[], int maxcnt)
 {
-	static struct modbus_dev modbus_dev;
-	static struct modbus_dev *modbus_response;
+	struct modbus_dev modbus_dev;
+	struct modbus_dev decode;
+	struct modbus_dev *modbus_response;
+	struct timespec start;
 
 	modbus_dev.station = device_id;
 	modbus_dev.function = READ_HOLDING_REGISTERS;
 	modbus_dev.addr = addr;
 	modbus_dev.cnt = count;
-	send_to_modbus_dev(&modbus_dev, data);
-	modbus_response = do_one_modbus_rx(data);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	send_to_modbus_dev(ctx, &modbus_dev, data);
+	modbus_response = do_one_modbus_rx(ctx, &decode, maxcnt, data);
 	if (modbus_response == NULL)
 		return (-1);
-	else
-		return (modbus_response->cnt);
+	count_reply(ctx, &start);
+	return (modbus_response->cnt);
+}
+
+/*
+ * modbus_ctx_read_registers
+ *
+ * inputs	- modbus context
+ *		- station id, word count, start address
+ *		- data array with room for count words
+ * output	- number of words read or -1 on error
+ * side effects	- never writes more than count words to data
+ */
+int
+modbus_ctx_read_registers(MODBUS_CTX *ctx, int device_id, int count,
+			  unsigned short addr, unsigned short data[])
+{
+	return (read_regs(ctx, device_id, count, addr, data, count));
+}
+
+/*
+ * Original single port API, kept for the command line programs.
+ * These all share one static context and so are not thread safe.
+ */
+
+int
+open_modbus(const char *tty_name, speed_t speed)
+{
+	return (modbus_ctx_open(&default_ctx, tty_name, speed));
+}
+
+int
+close_modbus(int fd)
+{
+	return (modbus_ctx_close(&default_ctx));
+}
+
+int
+write_registers(int device_id, int count,
+		unsigned short addr, unsigned short data[])
+{
+	return (modbus_ctx_write_registers(&default_ctx, device_id, count,
+					   addr, data));
+}
+
+int
+read_registers(int device_id, int count,
+		       unsigned short addr, unsigned short data[])
+{
+	/*
+	 * History addresses return a whole day no matter what count
+	 * is asked for, callers of the old API rely on that.
+	 */
+	return (read_regs(&default_ctx, device_id, count, addr, data,
+			  MODBUS_MAX_PACKET / 2));
 }
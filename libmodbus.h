@@ -36,6 +36,54 @@
 #define WRITE_MULTIPLE_REGISTERS 16
 
 #include <termios.h>
+
+#define MODBUS_MAX_PACKET	1024
+
+/*
+ * Transaction statistics, kept per context from modbus_ctx_init().
+ * Latency is from sending a request to the end of its reply, which
+ * includes the 3.5 character end of frame silence.
+ */
+#define MODBUS_LATENCY_BUCKETS	8	/* see modbus_latency_bound[] */
+
+typedef struct {
+	unsigned long	requests;
+	unsigned long	replies;	/* good replies */
+	unsigned long	timeouts;	/* nothing came back */
+	unsigned long	crc_errors;
+	unsigned long	exceptions;	/* modbus exception replies */
+	unsigned long	bad_replies;	/* short, truncated or i/o error */
+	double		latency_sum;	/* seconds, good replies only */
+	double		latency_max;
+	unsigned long	latency_bucket[MODBUS_LATENCY_BUCKETS];
+} MODBUS_STATS;
+
+extern const double modbus_latency_bound[MODBUS_LATENCY_BUCKETS];
+
+/*
+ * Per port state. Everything needed to talk to one serial port lives
+ * here so separate threads can each use their own MODBUS_CTX.
+ * The old open_modbus() etc. API uses one static MODBUS_CTX.
+ */
+typedef struct modbus_ctx {
+	int	fd;
+	int	baud;
+	int	rxlen;
+	unsigned char	rxbuf[MODBUS_MAX_PACKET];
+	unsigned char	txbuf[MODBUS_MAX_PACKET];
+	struct termios	origtermsettings;
+	MODBUS_STATS	stats;
+} MODBUS_CTX;
+
+void	modbus_ctx_init(MODBUS_CTX *ctx);
+int	modbus_ctx_open(MODBUS_CTX *ctx, const char *tty_name, speed_t speed);
+int	modbus_ctx_close(MODBUS_CTX *ctx);
+int	modbus_ctx_read_registers(MODBUS_CTX *ctx, int device_id, int count,
+				  unsigned short addr, unsigned short data[]);
+int	modbus_ctx_write_registers(MODBUS_CTX *ctx, int device_id, int count,
+				   unsigned short addr,
+				   unsigned short data[]);
+
 int open_modbus(const char *tty_name, speed_t speed);
 int close_modbus(int fd);
 int write_registers(int device_id, int count,
@@ -30,180 +30,612 @@
 #include <time.h>
 #include <sys/time.h>
 #include <unistd.h>
-#include <err.h>
-#include <sysexits.h>
 
 #include "libsolar.h"
 #include "libmodbus.h"
+#include "solar_format.h"
 
 /*
  * This library will read data from a Renogy controller
  * and return values that can be used by the web server
  * showing status or by remote_snap for database collection.
+ *
+ * All state lives in a SOLAR_CTX. The original API further down
+ * uses one internal context.
+ *
+ * Reads are single flight. Threads sharing a context that ask for
+ * registers another thread is already waiting to read, e.g. a burst
+ * of page views each wanting the live values, wait for that one
+ * transaction and take its result. That read had not finished when
+ * they asked, so what they get is at most one transaction older than
+ * a read of their own, and a burst costs one bus transaction instead
+ * of one each queued behind the port.
+ */
+
+static DATA	access_data(SOLAR_CTX *ctx, ADDR i);
+static DATA	access_data_hi(SOLAR_CTX *ctx, ADDR i);
+static DATA	access_data_lo(SOLAR_CTX *ctx, ADDR i);
+static float	float_access_data(SOLAR_CTX *ctx, ADDR i, float dp);
+static int	access_long_data(SOLAR_CTX *ctx, ADDR i);
+static unsigned int access_counter(SOLAR_CTX *ctx, ADDR i);
+static int	open_port(SOLAR_CTX *ctx);
+static int	read_block(SOLAR_CTX *ctx, int count, ADDR addr, DATA *data);
+static int	read_group(SOLAR_CTX *ctx, int group);
+static void	decode_snapshot(SOLAR_CTX *ctx, SOLAR_SNAPSHOT *status);
+static void	decode_info(SOLAR_CTX *ctx, SOLAR_INFO *info);
+static void	decode_ident(SOLAR_CTX *ctx, SOLAR_INFO *info);
+static int	probe_history(SOLAR_CTX *ctx, int *batchp);
+static SOLAR_CTX *legacy_ctx(const char *modport);
+static int	flight_join(SOLAR_CTX *ctx, int mask, int day1, int day2,
+			    SOLAR_FLIGHT **flight);
+static void	flight_land(SOLAR_CTX *ctx, SOLAR_FLIGHT *flight,
+			    int error);
+
+#define GROUP_MASK(g)	(1 << (g))
+#define INFO_MASK	(GROUP_MASK(SOLAR_GROUP_IDENT) | \
+			 GROUP_MASK(SOLAR_GROUP_LIVE) | \
+			 GROUP_MASK(SOLAR_GROUP_SETTINGS))
+#define FLIGHT_LEAD	1	/* not a SOLAR_E error, caller reads */
+
+/*
+ * solar_ctx_new
+ *
+ * inputs	- name of serial port
+ * output	- new SOLAR_CTX or NULL if out of memory
+ * side effects	- none, the port is not opened until it is used
  */
+SOLAR_CTX *
+solar_ctx_new(const char *modport)
+{
+	SOLAR_CTX *ctx;
 
-DATA data_at_a[MAX_DATA];
-DATA data_at_e001[MAX_DATA];
-DATA data_at_100[MAX_DATA];
+	ctx = calloc(1, sizeof(*ctx));
+	if (ctx == NULL)
+		return (NULL);
+	ctx->modport = strdup(modport);
+	if (ctx->modport == NULL) {
+		free(ctx);
+		return (NULL);
+	}
+	modbus_ctx_init(&ctx->modbus);
+	pthread_mutex_init(&ctx->lock, NULL);
+	pthread_mutex_init(&ctx->flight_lock, NULL);
+	pthread_cond_init(&ctx->flight_done, NULL);
+	return (ctx);
+}
+
+void
+solar_ctx_free(SOLAR_CTX *ctx)
+{
+	if (ctx == NULL)
+		return;
+	modbus_ctx_close(&ctx->modbus);
+	pthread_mutex_destroy(&ctx->lock);
+	pthread_mutex_destroy(&ctx->flight_lock);
+	pthread_cond_destroy(&ctx->flight_done);
+	free(ctx->modport);
+	free(ctx);
+}
+
+const char *
+solar_strerror(int error)
+{
+	switch (error) {
+	case SOLAR_OK:
+		return ("no error");
+	case SOLAR_EOPEN:
+		return ("can't open serial port");
+	case SOLAR_EIO:
+		return ("no reply from controller");
+	case SOLAR_ENOMEM:
+		return ("out of memory");
+	case SOLAR_EINVAL:
+		return ("invalid argument");
+	default:
+		return ("unknown error");
+	}
+}
+
+/*
+ * open_port
+ *
+ * The port is opened exclusively (O_EXLOCK) and only for the length
+ * of one call, so cron jobs and the web server can share it.
+ * open_modbus already retries for a while if the port is busy.
+ */
+static int
+open_port(SOLAR_CTX *ctx)
+{
+	if (modbus_ctx_open(&ctx->modbus, ctx->modport, B9600) < 0)
+		return (SOLAR_EOPEN);
+	return (SOLAR_OK);
+}
+
+static int
+read_block(SOLAR_CTX *ctx, int count, ADDR addr, DATA *data)
+{
+	if (modbus_ctx_read_registers(&ctx->modbus, 1, count, addr, data)
+	    != count)
+		return (SOLAR_EIO);
+	return (SOLAR_OK);
+}
+
+/*
+ * The fixed size register groups.
+ * These magic numbers, 17, 35 and 35 come from a reverse engineered
+ * Windows program I examined. ;) 35 rather than 33 at 0x100 so the
+ * fault bits at 0x121-0x122 are included.
+ * N.B. These are not byte counts but short 16 bit word counts.
+ */
+static const struct {
+	ADDR	addr;
+	int	count;
+} register_groups[] = {
+	{0xa, 17},		/* SOLAR_GROUP_IDENT */
+	{0x100, 35},		/* SOLAR_GROUP_LIVE */
+	{0xe001, 35},		/* SOLAR_GROUP_SETTINGS */
+};
+
+/*
+ * read_group
+ *
+ * inputs	- SOLAR_CTX, locked with the port open
+ *		- one of the fixed size groups
+ * output	- SOLAR_OK or SOLAR_E error
+ */
+static int
+read_group(SOLAR_CTX *ctx, int group)
+{
+	DATA *data;
 
-static DATA	access_data(ADDR);
-static DATA	access_data_hi(ADDR i);
-static DATA	access_data_lo(ADDR i);
-static float	float_access_data(ADDR, float);
-static int	access_long_data(ADDR);
-static DATA	access_data_lo(ADDR);
-static DATA	access_data_hi(ADDR);
+	switch (group) {
+	case SOLAR_GROUP_IDENT:
+		data = ctx->data_at_a;
+		break;
+	case SOLAR_GROUP_LIVE:
+		data = ctx->data_at_100;
+		break;
+	case SOLAR_GROUP_SETTINGS:
+		data = ctx->data_at_e001;
+		break;
+	default:
+		return (SOLAR_EINVAL);
+	}
+	return (read_block(ctx, register_groups[group].count,
+			   register_groups[group].addr, data));
+}
 
 /*
  * All data should be read via an accessor defined in this file
  */
 
-SOLAR_SNAPSHOT *
-get_solar_snapshot(const char *modport)
+/*
+ * solar_read_snapshot
+ *
+ * inputs	- SOLAR_CTX
+ *		- SOLAR_SNAPSHOT to fill in
+ * output	- SOLAR_OK or SOLAR_E error
+ * side effects	- none
+ */
+int
+solar_read_snapshot(SOLAR_CTX *ctx, SOLAR_SNAPSHOT *status)
 {
-	int	fd;
-	SOLAR_SNAPSHOT *status;
+	SOLAR_FLIGHT *flight;
+	int error;
 
-	status = malloc(sizeof(*status));
-	if (NULL == status)
-		return(NULL);
+	error = flight_join(ctx, GROUP_MASK(SOLAR_GROUP_LIVE), 0, 0,
+			    &flight);
+	pthread_mutex_lock(&ctx->lock);
+	if (error == FLIGHT_LEAD) {
+		error = open_port(ctx);
+		if (error == SOLAR_OK) {
+			error = read_group(ctx, SOLAR_GROUP_LIVE);
+			modbus_ctx_close(&ctx->modbus);
+		}
+	}
+	if (error == SOLAR_OK)
+		decode_snapshot(ctx, status);
+	pthread_mutex_unlock(&ctx->lock);
+	flight_land(ctx, flight, error);
+	return (error);
+}
 
-	fd = open_modbus(modport, B9600);
-	if (fd < 0)
-		err(EX_IOERR, "Can't open modbus %s", modport);
-	read_registers(1, 35, 0x100, data_at_100);
-	close(fd);
-	status->array_v = float_access_data(PANEL_V, 10);
-	status->array_a = float_access_data(PANEL_A, 100);
-	status->array_w = access_data(CHARGING_POWER);
-	status->soc = access_data(BAT_SOC);
-	status->bat_v = float_access_data(BAT_V, 10);
-	status->bat_a = float_access_data(BAT_CHARGING_AMP, 100);
-	status->load_v = float_access_data(LOAD_V, 10);
-	status->load_a = float_access_data(LOAD_A, 100);
-	return (status);
+static void
+decode_snapshot(SOLAR_CTX *ctx, SOLAR_SNAPSHOT *status)
+{
+	status->array_v = float_access_data(ctx, PANEL_V, 10);
+	status->array_a = float_access_data(ctx, PANEL_A, 100);
+	status->array_w = access_data(ctx, CHARGING_POWER);
+	status->soc = access_data(ctx, BAT_SOC);
+	status->bat_v = float_access_data(ctx, BAT_V, 10);
+	status->bat_a = float_access_data(ctx, BAT_CHARGING_AMP, 100);
+	status->load_v = float_access_data(ctx, LOAD_V, 10);
+	status->load_a = float_access_data(ctx, LOAD_A, 100);
+	status->gen_wh = access_counter(ctx, CUMULATIVE_POWER_GENERATION);
+	status->con_wh = access_counter(ctx, CUMULATIVE_POWER_CONSUMPTION);
+	status->charge_state = access_data(ctx, CHARGE_STATE) & 0x7;
+	status->fault_bits = access_long_data(ctx, CONTROLLER_FAULT_INFO);
+}
+
+/*
+ * solar_counter_delta
+ *
+ * The cumulative counters are 32 bit and wrap, so the difference is
+ * taken modulo 2^32. A counter that went backwards by less than half
+ * its range was reset (e.g. a factory reset of the controller)
+ * rather than wrapped, then everything since the reset is counted.
+ *
+ * inputs	- previous and current counter value
+ * output	- amount counted between the two
+ */
+unsigned int
+solar_counter_delta(unsigned int prev, unsigned int cur)
+{
+	unsigned int delta;
+
+	delta = cur - prev;
+	if (delta > 0x80000000U)
+		return (cur);
+	return (delta);
+}
+
+/*
+ * solar_energy_delta
+ *
+ * Energy generated and consumed between two snapshots. The counters
+ * are exact, so two snapshots a day give the exact daily totals
+ * however far apart they are.
+ *
+ * inputs	- earlier and later snapshot
+ *		- SOLAR_ENERGY to fill in
+ * output	- none
+ */
+void
+solar_energy_delta(const SOLAR_SNAPSHOT *prev, const SOLAR_SNAPSHOT *cur,
+		   SOLAR_ENERGY *delta)
+{
+	delta->gen_wh = solar_counter_delta(prev->gen_wh, cur->gen_wh);
+	delta->con_wh = solar_counter_delta(prev->con_wh, cur->con_wh);
 }
 
 static char *charging_names[] = {"Idle","Start","MPPT","EQU","BST","Float","Limit","Overcharge"};
 static char *bat_type_names  [] = {"User","Flooded","Sealed","Gel","Lithium","Err","Err","Err"};
 
-#define SMALL_BUF 20
+const char *
+solar_charge_state(int charge_state)
+{
+	return (charging_names[charge_state & 0x7]);
+}
 
-SOLAR_INFO *
-get_solar_info(const char *modport)
+/*
+ * Bits of fault_bits. The controller's fault word is 0x121 high,
+ * 0x122 low with faults from bit 16 up; fault_bits has the words
+ * the other way round so these start at bit 0.
+ */
+static const char *fault_names[SOLAR_FAULT_BITS] = {
+	"bat_over_discharge", "bat_over_voltage", "bat_under_voltage",
+	"load_short_circuit", "load_over_current", "controller_over_temp",
+	"ambient_over_temp", "array_over_power", "array_short_circuit",
+	"array_over_voltage", "array_counter_current",
+	"array_working_point_over_voltage", "array_reversed",
+	"anti_reverse_mos_short", "charge_mos_short"
+};
+
+const char *
+solar_fault_name(int bit)
 {
-	char	model[20];
-	char	hardware_version[SMALL_BUF];
-	char	software_version[SMALL_BUF];
-	char	serial_number[SMALL_BUF];	
-	int	i,j;
-	int	fd;
-	int	fault_bits;
-	SOLAR_INFO *info;
+	if (bit < 0 || bit >= SOLAR_FAULT_BITS)
+		return (NULL);
+	return (fault_names[bit]);
+}
 
-	fd = open_modbus(modport, B9600);
-	if (fd < 0)
-		err(EX_IOERR,"Can't open modbus %s", modport);
-
-	/*
-	 * These magic numbers, 17, 33 and 35
-	 * come from a reverse engineered Windows program I examined. ;)
-	 * N.B. These are not byte counts but short 16 bit word counts.
-	 */
-	read_registers(1, 17, 0xa, data_at_a);
-	read_registers(1, 33, 0x100, data_at_100);
-	read_registers(1, 35, 0xe001, data_at_e001);
-	close(fd);
-	
-	info = malloc(sizeof(*info));
-	if (NULL == info)
-		return(NULL);
+/*
+ * solar_read_info
+ *
+ * inputs	- SOLAR_CTX
+ *		- SOLAR_INFO to fill in
+ * output	- SOLAR_OK or SOLAR_E error
+ * side effects	- none
+ */
+int
+solar_read_info(SOLAR_CTX *ctx, SOLAR_INFO *info)
+{
+	SOLAR_FLIGHT *flight;
+	int group;
+	int error;
 
-	/* Solar Panel Status */
+	error = flight_join(ctx, INFO_MASK, 0, 0, &flight);
+	pthread_mutex_lock(&ctx->lock);
+	if (error == FLIGHT_LEAD) {
+		error = open_port(ctx);
+		if (error == SOLAR_OK) {
+			for (group = SOLAR_GROUP_IDENT;
+			     group <= SOLAR_GROUP_SETTINGS &&
+			     error == SOLAR_OK; group++)
+				error = read_group(ctx, group);
+			modbus_ctx_close(&ctx->modbus);
+		}
+	}
+	if (error == SOLAR_OK)
+		decode_info(ctx, info);
+	pthread_mutex_unlock(&ctx->lock);
+	flight_land(ctx, flight, error);
+	return (error);
+}
+
+/*
+ * solar_read_group
+ *
+ * Read one register group into the ctx without decoding it.
+ * SOLAR_GROUP_HISTORY reads every day, use solar_read_history for
+ * part of it.
+ *
+ * inputs	- SOLAR_CTX
+ *		- SOLAR_GROUP_ number
+ * output	- SOLAR_OK or SOLAR_E error
+ * side effects	- register buffers for the group are updated
+ */
+int
+solar_read_group(SOLAR_CTX *ctx, int group)
+{
+	SOLAR_FLIGHT *flight;
+	int error;
+
+	if (group == SOLAR_GROUP_HISTORY)
+		return (solar_read_history(ctx, 0, MAX_DAYS_HISTORY - 1));
+	if (group < 0 || group >= SOLAR_GROUPS)
+		return (SOLAR_EINVAL);
+
+	if ((error = flight_join(ctx, GROUP_MASK(group), 0, 0, &flight))
+	    != FLIGHT_LEAD)
+		return (error);
+	pthread_mutex_lock(&ctx->lock);
+	error = open_port(ctx);
+	if (error == SOLAR_OK) {
+		error = read_group(ctx, group);
+		modbus_ctx_close(&ctx->modbus);
+	}
+	pthread_mutex_unlock(&ctx->lock);
+	flight_land(ctx, flight, error);
+	return (error);
+}
+
+/*
+ * solar_cached_snapshot
+ * solar_cached_info
+ *
+ * Decode whatever was last read into the ctx, no modbus traffic.
+ * The caller is expected to have read the groups needed, for info
+ * that is IDENT, LIVE and SETTINGS, for a snapshot just LIVE.
+ */
+void
+solar_cached_snapshot(SOLAR_CTX *ctx, SOLAR_SNAPSHOT *status)
+{
+	pthread_mutex_lock(&ctx->lock);
+	decode_snapshot(ctx, status);
+	pthread_mutex_unlock(&ctx->lock);
+}
+
+void
+solar_cached_info(SOLAR_CTX *ctx, SOLAR_INFO *info)
+{
+	pthread_mutex_lock(&ctx->lock);
+	decode_info(ctx, info);
+	pthread_mutex_unlock(&ctx->lock);
+}
+
+/* reads shared with another caller since the context was created */
+unsigned long
+solar_coalesced(SOLAR_CTX *ctx)
+{
+	unsigned long n;
+
+	pthread_mutex_lock(&ctx->flight_lock);
+	n = ctx->coalesced;
+	pthread_mutex_unlock(&ctx->flight_lock);
+	return (n);
+}
+
+/*
+ * flight_join
+ *
+ * inputs	- SOLAR_CTX
+ *		- GROUP_MASK()s of the groups about to be read
+ *		- days wanted if that includes SOLAR_GROUP_HISTORY
+ *		- where to return the flight to land, NULL if none
+ * output	- FLIGHT_LEAD if the caller is to read them itself,
+ *		  else the result of another caller's read covering
+ *		  them that was not yet done when this was called
+ * side effects	- a waiting caller blocks until that read is done
+ */
+static int
+flight_join(SOLAR_CTX *ctx, int mask, int day1, int day2,
+	    SOLAR_FLIGHT **flight)
+{
+	SOLAR_FLIGHT *f;
+	int error;
+	int i;
+
+	*flight = NULL;
+	pthread_mutex_lock(&ctx->flight_lock);
+	for (i = 0; i < SOLAR_FLIGHTS; i++) {
+		f = &ctx->flight[i];
+		if (f->mask == 0 || f->done || (f->mask & mask) != mask)
+			continue;
+		if ((mask & GROUP_MASK(SOLAR_GROUP_HISTORY)) &&
+		    (day1 < f->day1 || day2 > f->day2))
+			continue;
+		f->waiters++;
+		ctx->coalesced++;
+		while (!f->done)
+			pthread_cond_wait(&ctx->flight_done,
+					  &ctx->flight_lock);
+		error = f->error;
+		if (--f->waiters == 0)
+			f->mask = 0;
+		pthread_mutex_unlock(&ctx->flight_lock);
+		return (error);
+	}
+	/* with every slot in use the caller reads unannounced */
+	for (i = 0; i < SOLAR_FLIGHTS; i++) {
+		f = &ctx->flight[i];
+		if (f->mask != 0)
+			continue;
+		f->mask = mask;
+		f->day1 = day1;
+		f->day2 = day2;
+		f->done = 0;
+		f->waiters = 0;
+		*flight = f;
+		break;
+	}
+	pthread_mutex_unlock(&ctx->flight_lock);
+	return (FLIGHT_LEAD);
+}
+
+/*
+ * flight_land
+ *
+ * inputs	- SOLAR_CTX
+ *		- flight from flight_join(), may be NULL
+ *		- result of the read
+ * output	- none
+ * side effects	- callers waiting on the flight are given the result
+ */
+static void
+flight_land(SOLAR_CTX *ctx, SOLAR_FLIGHT *flight, int error)
+{
+	if (flight == NULL)
+		return;
+	pthread_mutex_lock(&ctx->flight_lock);
+	flight->done = 1;
+	flight->error = error;
+	if (flight->waiters == 0)
+		flight->mask = 0;
+	pthread_cond_broadcast(&ctx->flight_done);
+	pthread_mutex_unlock(&ctx->flight_lock);
+}
+
+/* modbus transaction statistics since the context was created */
+void
+solar_modbus_stats(SOLAR_CTX *ctx, MODBUS_STATS *stats)
+{
+	pthread_mutex_lock(&ctx->lock);
+	*stats = ctx->modbus.stats;
+	pthread_mutex_unlock(&ctx->lock);
+}
+
+/*
+ * decode_ident
+ * Model, versions and serial number, all from the block at 0xA
+ */
+static void
+decode_ident(SOLAR_CTX *ctx, SOLAR_INFO *info)
+{
+	int	i,j;
 
 	j = 0;
 	for (i = MODEL_LO; i < MODEL_HI; i++) {
-		model[j++] = access_data_hi(i) & 0xFF;
-		model[j++] = access_data_lo(i) & 0xFF;
+		info->model[j++] = access_data_hi(ctx, i) & 0xFF;
+		info->model[j++] = access_data_lo(ctx, i) & 0xFF;
 	}
-	model[j] = '\0';
-	info->model = strdup(model);
+	info->model[j] = '\0';
 	
-	sprintf(hardware_version, "%d.%d.%d",
-		access_data_lo(HW_VERSION_LO),
-		access_data_hi(HW_VERSION_HI),
-		access_data_lo(HW_VERSION_HI));
-	info->hardware_version = strdup(hardware_version);
-
-	sprintf(software_version, "%d.%d.%d",
-		access_data_lo(SW_VERSION_LO),		
-		access_data_hi(SW_VERSION_HI),
-		access_data_lo(SW_VERSION_HI));
-	info->software_version = strdup(software_version);
+	snprintf(info->hardware_version, sizeof(info->hardware_version),
+		 "%d.%d.%d",
+		 access_data_lo(ctx, HW_VERSION_LO),
+		 access_data_hi(ctx, HW_VERSION_HI),
+		 access_data_lo(ctx, HW_VERSION_HI));
+
+	snprintf(info->software_version, sizeof(info->software_version),
+		 "%d.%d.%d",
+		 access_data_lo(ctx, SW_VERSION_LO),		
+		 access_data_hi(ctx, SW_VERSION_HI),
+		 access_data_lo(ctx, SW_VERSION_HI));
 	
-	sprintf(serial_number, "%d%d%d%d",
-		access_data_hi(SERIAL_NO_LO),
-		access_data_lo(SERIAL_NO_LO),
-		access_data_hi(SERIAL_NO_HI),
-		access_data_lo(SERIAL_NO_HI));
-	info->serial_number = strdup(serial_number);
+	snprintf(info->serial_number, sizeof(info->serial_number),
+		 "%d%d%d%d",
+		 access_data_hi(ctx, SERIAL_NO_LO),
+		 access_data_lo(ctx, SERIAL_NO_LO),
+		 access_data_hi(ctx, SERIAL_NO_HI),
+		 access_data_lo(ctx, SERIAL_NO_HI));
+}
+
+static void
+decode_info(SOLAR_CTX *ctx, SOLAR_INFO *info)
+{
+	int	fault_bits;
+
+	/* Solar Panel Status */
+	decode_ident(ctx, info);
 
 	/* Array Information */
-	info->array_v = float_access_data(PANEL_V,10);
-	info->array_a = float_access_data(PANEL_A,100);
-	info->array_w = access_data(CHARGING_POWER);
-	fault_bits = access_long_data(CONTROLLER_FAULT_INFO);
+	info->array_v = float_access_data(ctx, PANEL_V,10);
+	info->array_a = float_access_data(ctx, PANEL_A,100);
+	info->array_w = access_data(ctx, CHARGING_POWER);
+	fault_bits = access_long_data(ctx, CONTROLLER_FAULT_INFO);
 	info->fault_bits = fault_bits;
 	if (fault_bits & 0x100)
-		info->array_working_state = strdup("Short Circuit");
+		strlcpy(info->array_working_state, "Short Circuit",
+			sizeof(info->array_working_state));
 	else if (fault_bits & 0x80)
-		info->array_working_state = strdup("Over Power");
+		strlcpy(info->array_working_state, "Over Power",
+			sizeof(info->array_working_state));
 	else
-		info->array_working_state = strdup("Normal");
-	info->power_gen_today = access_data(POWER_GEN_TODAY);
+		strlcpy(info->array_working_state, "Normal",
+			sizeof(info->array_working_state));
+	info->power_gen_today = access_data(ctx, POWER_GEN_TODAY);
+	info->power_con_today = access_data(ctx, POWER_CONSUMPTION_TODAY);
 	
 	/* Battery Information */
-	info->bat_v = float_access_data(BAT_V,10);
-	info->bat_a = float_access_data(BAT_CHARGING_AMP,100);
-	info->charging_state =
-		strdup(charging_names[access_data(CHARGE_STATE) & 0x7]);
-	info->bat_type = strdup(bat_type_names[access_data(BAT_INDEX) & 0x7]);
-	info->bat_temp = access_data_lo(TEMPERATURE);
-	info->soc = access_data(BAT_SOC);
-	info->bat_capacity = access_data(BAT_CAPACITY);
+	info->bat_v = float_access_data(ctx, BAT_V,10);
+	info->bat_a = float_access_data(ctx, BAT_CHARGING_AMP,100);
+	strlcpy(info->charging_state,
+		charging_names[access_data(ctx, CHARGE_STATE) & 0x7],
+		sizeof(info->charging_state));
+	strlcpy(info->bat_type,
+		bat_type_names[access_data(ctx, BAT_INDEX) & 0x7],
+		sizeof(info->bat_type));
+	info->bat_temp = access_data_lo(ctx, TEMPERATURE);
+	info->soc = access_data(ctx, BAT_SOC);
+	info->bat_capacity = access_data(ctx, BAT_CAPACITY);
 	
 	/* Load Information */
-	info->load_v = float_access_data(LOAD_V,10);
-	info->load_a = float_access_data(LOAD_A,100);
+	info->load_v = float_access_data(ctx, LOAD_V,10);
+	info->load_a = float_access_data(ctx, LOAD_A,100);
 
 	/* Controller Information */
-	info->device_temp = access_data_hi(TEMPERATURE);
-	info->system_voltage_setting = access_data_hi(SYSTEM_VOLTAGE);
-	info->system_voltage_recognized = access_data_lo(SYSTEM_VOLTAGE);
-	info->max_v_system = access_data_hi(MAX_V_A);
-	info->rated_charge_a = access_data_lo(MAX_V_A);
+	info->device_temp = access_data_hi(ctx, TEMPERATURE);
+	info->system_voltage_setting = access_data_hi(ctx, SYSTEM_VOLTAGE);
+	info->system_voltage_recognized = access_data_lo(ctx, SYSTEM_VOLTAGE);
+	info->max_v_system = access_data_hi(ctx, MAX_V_A);
+	info->rated_charge_a = access_data_lo(ctx, MAX_V_A);
 	
 	/* Battery history today */
-	info->bat_min_volts_today = float_access_data(BAT_MIN_V_TODAY,10);
-	info->bat_max_volts_today = float_access_data(BAT_MAX_V_TODAY,10);
+	info->bat_min_volts_today = float_access_data(ctx, BAT_MIN_V_TODAY,10);
+	info->bat_max_volts_today = float_access_data(ctx, BAT_MAX_V_TODAY,10);
 	info->bat_max_charge_a_today = 
-		float_access_data(BAT_MAX_CHARGE_A_TODAY,100);
+		float_access_data(ctx, BAT_MAX_CHARGE_A_TODAY,100);
 	info->bat_max_discharge_a_today = 
-		float_access_data(BAT_MAX_DISCHARGE_A_TODAY,100);
+		float_access_data(ctx, BAT_MAX_DISCHARGE_A_TODAY,100);
 
 
-	info->bat_charging_ah_today = access_data(BAT_CHARGING_AH_TODAY);
-	info->bat_discharging_ah_today = access_data(BAT_DISCHARGING_AH_TODAY);
+	info->bat_charging_ah_today = access_data(ctx, BAT_CHARGING_AH_TODAY);
+	info->bat_discharging_ah_today =
+		access_data(ctx, BAT_DISCHARGING_AH_TODAY);
 	info->bat_max_charging_power_today = 
-		access_data(BAT_MAX_CHARGING_POWER_TODAY);
+		access_data(ctx, BAT_MAX_CHARGING_POWER_TODAY);
+	info->bat_max_discharge_power_today =
+		access_data(ctx, BAT_MAX_DISCHARGING_POWER_TODAY);
 
 	/* Historical data */
-	info->total_operating_days = access_data(TOTAL_OPERATING_DAYS);
+	info->total_operating_days = access_data(ctx, TOTAL_OPERATING_DAYS);
 	info->bat_total_over_discharges =
-		access_data(BAT_TOTAL_OVER_DISCHARGES);
-	info->bat_total_full_charges = access_data(BAT_TOTAL_FULL_CHARGES);
-
-	return (info);
+		access_data(ctx, BAT_TOTAL_OVER_DISCHARGES);
+	info->bat_total_full_charges =
+		access_data(ctx, BAT_TOTAL_FULL_CHARGES);
+	info->gen_wh = access_counter(ctx, CUMULATIVE_POWER_GENERATION);
+	info->con_wh = access_counter(ctx, CUMULATIVE_POWER_CONSUMPTION);
 }
 
 
@@ -218,84 +650,424 @@ get_solar_info(const char *modport)
  * of 10 word values which makes it easier to retrieve SOLAR_HISTORY structures
  */
 
-/* inputs	- name of serial port
+/*
+ * Some controller firmware will return several consecutive days for
+ * one read at 0xF000+day if asked for a multiple of MAX_DAY_DATA words,
+ * others always return exactly one day. probe_history finds out which
+ * and the answer is remembered per model and firmware version so it
+ * is only ever asked once per process for each kind of controller.
+ *
+ * HISTORY_BATCH_MAX days is 120 words, modbus allows at most 125
+ * registers in one reply.
+ */
+#define HISTORY_BATCH_MAX	12
+#define PROBE_CACHE_SIZE	8
+
+struct history_probe {
+	char	model[SOLAR_STR_MAX];
+	char	hardware_version[SOLAR_STR_MAX];
+	char	software_version[SOLAR_STR_MAX];
+	int	batch;
+};
+
+static struct history_probe probe_cache[PROBE_CACHE_SIZE];
+static int probe_cache_count;
+static pthread_mutex_t probe_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * probe_history
+ *
+ * inputs	- SOLAR_CTX, locked with the port open
+ *		- where to return the days to read at a time
+ * output	- SOLAR_OK or SOLAR_E error
+ * side effects	- ctx->history_batch is set once the answer is known
+ *
+ * Days 1 and 2 are used rather than day 0 since today's record is
+ * still changing. If days 1 and 2 happen to be identical (a new
+ * controller) the probe can't tell a real block read from a
+ * firmware repeating one day, so single day reads are used this
+ * time only and nothing is remembered, the next read probes again.
+ */
+static int
+probe_history(SOLAR_CTX *ctx, int *batchp)
+{
+	SOLAR_INFO ident;
+	DATA day1[MAX_DAY_DATA];
+	DATA day2[MAX_DAY_DATA];
+	DATA block[HISTORY_BATCH_MAX * MAX_DAY_DATA];
+	struct history_probe *hp;
+	int batch;
+	int error;
+	int i;
+
+	if ((error = read_group(ctx, SOLAR_GROUP_IDENT)) != SOLAR_OK)
+		return (error);
+	decode_ident(ctx, &ident);
+
+	pthread_mutex_lock(&probe_lock);
+	for (i = 0; i < probe_cache_count; i++) {
+		hp = &probe_cache[i];
+		if (strcmp(hp->model, ident.model) == 0 &&
+		    strcmp(hp->hardware_version, ident.hardware_version) == 0 &&
+		    strcmp(hp->software_version, ident.software_version) == 0) {
+			ctx->history_batch = *batchp = hp->batch;
+			pthread_mutex_unlock(&probe_lock);
+			return (SOLAR_OK);
+		}
+	}
+	pthread_mutex_unlock(&probe_lock);
+
+	if ((error = read_block(ctx, MAX_DAY_DATA, 0xF001, day1)) != SOLAR_OK)
+		return (error);
+	if ((error = read_block(ctx, MAX_DAY_DATA, 0xF002, day2)) != SOLAR_OK)
+		return (error);
+	if (memcmp(day1, day2, sizeof(day1)) == 0) {
+		*batchp = 1;
+		return (SOLAR_OK);
+	}
+
+	batch = 1;
+	if (modbus_ctx_read_registers(&ctx->modbus, 1, sizeof(block) /
+				      sizeof(DATA), 0xF001, block) ==
+	    sizeof(block) / sizeof(DATA) &&
+	    memcmp(block, day1, sizeof(day1)) == 0 &&
+	    memcmp(block + MAX_DAY_DATA, day2, sizeof(day2)) == 0)
+		batch = HISTORY_BATCH_MAX;
+	ctx->history_batch = *batchp = batch;
+
+	pthread_mutex_lock(&probe_lock);
+	if (probe_cache_count < PROBE_CACHE_SIZE) {
+		hp = &probe_cache[probe_cache_count++];
+		strlcpy(hp->model, ident.model, sizeof(hp->model));
+		strlcpy(hp->hardware_version, ident.hardware_version,
+			sizeof(hp->hardware_version));
+		strlcpy(hp->software_version, ident.software_version,
+			sizeof(hp->software_version));
+		hp->batch = batch;
+	}
+	pthread_mutex_unlock(&probe_lock);
+	return (SOLAR_OK);
+}
+
+/*
+ * solar_probe_history
+ *
+ * inputs	- SOLAR_CTX
+ * output	- number of days fetched per history read or SOLAR_E error
+ * side effects	- probes the controller unless already known
+ */
+int
+solar_probe_history(SOLAR_CTX *ctx)
+{
+	int batch;
+	int error;
+
+	pthread_mutex_lock(&ctx->lock);
+	error = SOLAR_OK;
+	if ((batch = ctx->history_batch) == 0) {
+		error = open_port(ctx);
+		if (error == SOLAR_OK) {
+			error = probe_history(ctx, &batch);
+			modbus_ctx_close(&ctx->modbus);
+		}
+	}
+	if (error == SOLAR_OK)
+		error = batch;
+	pthread_mutex_unlock(&ctx->lock);
+	return (error);
+}
+
+/* inputs	- SOLAR_CTX
  * 		- day1 index
  *		- day2
- * output	- none
- * side effects	- History array is filled in
+ * output	- SOLAR_OK or SOLAR_E error
+ * side effects	- History array in ctx is filled in
+ *
+ * The port is held open for the whole range. Days are fetched
+ * ctx->history_batch, or what the probe says, at a time, straight into day_history since
+ * that is laid out day after day. If a block read fails that
+ * block is retried one day at a time.
  *
  * BUGS N.B. there is no way at present to ensure the history data
  * has been primed before accessed.
  */
 
-DATA day_history[MAX_DAYS_HISTORY][MAX_DAY_DATA];
-
-void
-prime_solar_history(const char *modport, int day1, int day2)
+int
+solar_read_history(SOLAR_CTX *ctx, int day1, int day2)
 {
+	SOLAR_FLIGHT *flight;
+	int batch;
 	int day;
-	int fd;
+	int count;
+	int i;
+	int error;
 
-	fd = open_modbus(modport, B9600);
-	if (fd < 0)
-		err(EX_IOERR,"can't open modbus %s", modport);
+	if (day1 < 0 || day2 >= MAX_DAYS_HISTORY || day1 > day2)
+		return (SOLAR_EINVAL);
 
-	for (day = day1; day <= day2; day++) {
-		read_registers(1, MAX_DAY_DATA, 0xF000 + day,
-			       &day_history[day][0]);
+	if ((error = flight_join(ctx, GROUP_MASK(SOLAR_GROUP_HISTORY),
+				 day1, day2, &flight)) != FLIGHT_LEAD)
+		return (error);
+	pthread_mutex_lock(&ctx->lock);
+	error = open_port(ctx);
+	if (error == SOLAR_OK && (batch = ctx->history_batch) == 0)
+		error = probe_history(ctx, &batch);
+	for (day = day1; day <= day2 && error == SOLAR_OK; day += count) {
+		count = batch;
+		if (count > day2 - day + 1)
+			count = day2 - day + 1;
+		if (count > 1 &&
+		    read_block(ctx, count * MAX_DAY_DATA, 0xF000 + day,
+			       &ctx->day_history[day][0]) == SOLAR_OK)
+			continue;
+		for (i = 0; i < count && error == SOLAR_OK; i++)
+			error = read_block(ctx, MAX_DAY_DATA, 0xF000 + day + i,
+					   &ctx->day_history[day + i][0]);
 	}
-	close(fd);
+	modbus_ctx_close(&ctx->modbus);
+	pthread_mutex_unlock(&ctx->lock);
+	flight_land(ctx, flight, error);
+	return (error);
 }
 
 /*
  * Given a request for a particular day history, index into
  * our array of solar_history items and fill in one SOLAR_HISTORY
- * to return.
- * N.B. at present prime_solar_history must be called first
+ * N.B. at present solar_read_history must be called first
  * However this is not enforced. (BUG)
  *
- * inputs	- day index into history array
- * output	- SOLAR_HISTORY
+ * inputs	- SOLAR_CTX
+ *		- day index into history array
+ *		- SOLAR_HISTORY to fill in
+ * output	- SOLAR_OK or SOLAR_EINVAL
  * side effects	- none
  */
 
+int
+solar_history(SOLAR_CTX *ctx, int day, SOLAR_HISTORY *solar_history)
+{
+	DATA *h;
+
+	if (day < 0 || day >= MAX_DAYS_HISTORY)
+		return (SOLAR_EINVAL);
+
+	pthread_mutex_lock(&ctx->lock);
+	h = ctx->day_history[day];
+	solar_history->day = day;
+	solar_history->bat_min_v = (float)h[0] / 10.0;
+	solar_history->bat_max_v = (float)h[1] / 10.0;
+	solar_history->bat_max_charge_a = (float)h[2] / 100.0;
+	solar_history->bat_max_discharge_a = (float)h[3] / 100.0;
+	solar_history->bat_max_charge_w = (float)h[4] / 10.0;
+	solar_history->bat_max_discharge_w = (float)h[5] / 10.0;
+	solar_history->bat_charge_ah = h[6];
+	solar_history->bat_discharge_ah = h[7];
+	solar_history->bat_charge_kwh =	(float)h[8] / 1000.0;
+	solar_history->bat_discharge_kwh = (float)h[9] / 1000.0;
+	pthread_mutex_unlock(&ctx->lock);
+	return (SOLAR_OK);
+}
+
+/*
+ * Columnar history
+ *
+ * The raw day_history block is day major, ten words per day. It is
+ * first transposed into one contiguous run of words per column, then
+ * each column is converted and scaled by scale_column(). That works
+ * on fixed blocks of 8 over contiguous restrict pointers, which the
+ * compiler turns into SIMD widen/convert/divide even at -O2.
+ * Dividing (rather than multiplying by a reciprocal) gives exactly
+ * the same floats as solar_history().
+ */
+
+/* scale of each of the ten words in a day record, see solar_history */
+static const float history_scale[MAX_DAY_DATA] =
+	{10, 10, 100, 100, 10, 10, 1, 1, 1000, 1000};
+
+#define SCALE_BLOCK	8
+
+static void
+scale_column(const DATA *restrict src, float *restrict dst, int count,
+	     float scale)
+{
+	int i;
+	int j;
+
+	for (i = 0; i < count; i += SCALE_BLOCK)
+		for (j = 0; j < SCALE_BLOCK; j++)
+			dst[i + j] = (float)src[i + j] / scale;
+}
+
+/*
+ * solar_history_columns
+ *
+ * inputs	- SOLAR_CTX, history already read with solar_read_history
+ *		- first and last day wanted
+ *		- SOLAR_HISTORY_COLUMNS to fill in
+ * output	- SOLAR_OK or SOLAR_EINVAL
+ * side effects	- none
+ */
+int
+solar_history_columns(SOLAR_CTX *ctx, int first, int last,
+		      SOLAR_HISTORY_COLUMNS *cols)
+{
+	DATA raw[MAX_DAY_DATA][HISTORY_COLUMN_MAX];
+	float *dst[MAX_DAY_DATA];
+	int count;
+	int day;
+	int c;
+
+	if (first < 0 || last >= MAX_DAYS_HISTORY || first > last)
+		return (SOLAR_EINVAL);
+	count = last - first + 1;
+
+	memset(raw, 0, sizeof(raw));
+	pthread_mutex_lock(&ctx->lock);
+	for (day = 0; day < count; day++)
+		for (c = 0; c < MAX_DAY_DATA; c++)
+			raw[c][day] = ctx->day_history[first + day][c];
+	pthread_mutex_unlock(&ctx->lock);
+
+	dst[0] = cols->bat_min_v;
+	dst[1] = cols->bat_max_v;
+	dst[2] = cols->bat_max_charge_a;
+	dst[3] = cols->bat_max_discharge_a;
+	dst[4] = cols->bat_max_charge_w;
+	dst[5] = cols->bat_max_discharge_w;
+	dst[6] = cols->bat_charge_ah;
+	dst[7] = cols->bat_discharge_ah;
+	dst[8] = cols->bat_charge_kwh;
+	dst[9] = cols->bat_discharge_kwh;
+	for (c = 0; c < MAX_DAY_DATA; c++)
+		scale_column(raw[c], dst[c], count, history_scale[c]);
+	cols->first = first;
+	cols->count = count;
+	return (SOLAR_OK);
+}
+
+/*
+ * Original API
+ *
+ * All of these share one SOLAR_CTX, created on first use.
+ */
+
+static SOLAR_CTX *legacy;
+
+static SOLAR_CTX *
+legacy_ctx(const char *modport)
+{
+	char *p;
+
+	if (legacy == NULL) {
+		legacy = solar_ctx_new(modport);
+		return (legacy);
+	}
+	if (strcmp(legacy->modport, modport) != 0) {
+		p = strdup(modport);
+		if (p == NULL)
+			return (NULL);
+		free(legacy->modport);
+		legacy->modport = p;
+	}
+	return (legacy);
+}
+
+SOLAR_SNAPSHOT *
+get_solar_snapshot(const char *modport)
+{
+	SOLAR_CTX *ctx;
+	SOLAR_SNAPSHOT *status;
+
+	if ((ctx = legacy_ctx(modport)) == NULL)
+		return (NULL);
+	status = malloc(sizeof(*status));
+	if (NULL == status)
+		return(NULL);
+	if (solar_read_snapshot(ctx, status) != SOLAR_OK) {
+		free(status);
+		return (NULL);
+	}
+	return (status);
+}
+
+SOLAR_INFO *
+get_solar_info(const char *modport)
+{
+	SOLAR_CTX *ctx;
+	SOLAR_INFO *info;
+
+	if ((ctx = legacy_ctx(modport)) == NULL)
+		return (NULL);
+	info = malloc(sizeof(*info));
+	if (NULL == info)
+		return(NULL);
+	if (solar_read_info(ctx, info) != SOLAR_OK) {
+		free(info);
+		return (NULL);
+	}
+	return (info);
+}
+
+int
+prime_solar_history(const char *modport, int day1, int day2)
+{
+	SOLAR_CTX *ctx;
+
+	if ((ctx = legacy_ctx(modport)) == NULL)
+		return (-1);
+	if (solar_read_history(ctx, day1, day2) != SOLAR_OK)
+		return (-1);
+	return (0);
+}
+
 SOLAR_HISTORY *
 get_solar_history(int day)
 {
-	SOLAR_HISTORY *solar_history;
+	SOLAR_HISTORY *history;
 
-	solar_history = malloc(sizeof(*solar_history));
-	
-	solar_history->day = day;
-	solar_history->bat_min_v = (float)day_history[day][0] / 10.0;
-	solar_history->bat_max_v = (float)day_history[day][1] / 10.0;
-        solar_history->bat_max_charge_a = (float)day_history[day][2] / 100.0;
-        solar_history->bat_max_discharge_a = (float)day_history[day][3] / 100.0;
-        solar_history->bat_max_charge_w = (float)day_history[day][4] / 10.0;
-        solar_history->bat_max_discharge_w = (float)day_history[day][5] / 10.0;
-	solar_history->bat_charge_ah = day_history[day][6];
-	solar_history->bat_discharge_ah = day_history[day][7];
-	solar_history->bat_charge_kwh =	(float)day_history[day][8] / 1000.0;
-        solar_history->bat_discharge_kwh = (float)day_history[day][9] / 1000.0;
-	return (solar_history);
+	if (legacy == NULL)
+		return (NULL);
+	history = malloc(sizeof(*history));
+	if (history == NULL)
+		return (NULL);
+	if (solar_history(legacy, day, history) != SOLAR_OK) {
+		free(history);
+		return (NULL);
+	}
+	return (history);
+}
+
+/*
+ * get_solar_history_columns
+ *
+ * inputs	- first and last day, prime_solar_history must be called
+ *		  for those days first
+ * output	- SOLAR_HISTORY_COLUMNS or NULL, caller must free
+ */
+SOLAR_HISTORY_COLUMNS *
+get_solar_history_columns(int first, int last)
+{
+	SOLAR_HISTORY_COLUMNS *cols;
+
+	if (legacy == NULL)
+		return (NULL);
+	cols = malloc(sizeof(*cols));
+	if (cols == NULL)
+		return (NULL);
+	if (solar_history_columns(legacy, first, last, cols) != SOLAR_OK) {
+		free(cols);
+		return (NULL);
+	}
+	return (cols);
 }
 
 /*
- * SOLAR_INFO has dangling memory bits allocated
- * keep track of them to free
+ * For consistency
  */
  
 void
 free_solar_info(SOLAR_INFO *info)
 {
-       
-	free(info->model);
-	free(info->hardware_version);
-	free(info->software_version);
-	free(info->serial_number);
-	free(info->array_working_state);
-	free(info->charging_state);
-	free(info->bat_type);
 	free(info);
 }
 
@@ -319,63 +1091,82 @@ free_solar_history(SOLAR_HISTORY *history)
 	free(history);
 }
 
-DATA
-access_data(ADDR i)
+void
+free_solar_history_columns(SOLAR_HISTORY_COLUMNS *cols)
+{
+	free(cols);
+}
+
+static DATA
+access_data(SOLAR_CTX *ctx, ADDR i)
 {
 	DATA *data;
 	ADDR offset;
 	
 	if (i < 0x100) {
 		offset = i - 0xa;
-		data = data_at_a;
+		data = ctx->data_at_a;
 	} else if (i < 0xE000) {
 		offset = i - 0x100;
-		data = data_at_100;
+		data = ctx->data_at_100;
 	} else if (i < 0xF000) {
 		offset = i - 0xE001;
-		data = data_at_e001;
-	}
+		data = ctx->data_at_e001;
+	} else
+		return (0);
 
-      return (data[offset]);
+	if (offset >= MAX_DATA)
+		return (0);
+	return (data[offset]);
 }
 
 
 static int
-access_long_data(ADDR i)
+access_long_data(SOLAR_CTX *ctx, ADDR i)
 {
 	int	datahi;
 	int	datalo;
 	int	data;
 
-	datahi = (access_data(i+1) << 16);
-	datalo = (access_data(i) & 0xFFFF);
+	datahi = (access_data(ctx, i+1) << 16);
+	datalo = (access_data(ctx, i) & 0xFFFF);
 	data = datalo + datahi;
 	return (data);
 }
 
+/*
+ * The cumulative counters are two words, high word first.
+ */
+static unsigned int
+access_counter(SOLAR_CTX *ctx, ADDR i)
+{
+	return (((unsigned int)access_data(ctx, i) << 16) |
+		access_data(ctx, i + 1));
+}
+
 static DATA
-access_data_lo(ADDR i)
+access_data_lo(SOLAR_CTX *ctx, ADDR i)
 {
 	DATA data;
 
-	data = access_data(i);
+	data = access_data(ctx, i);
 	return (data & 0xFF);
 }
 
 static DATA
-access_data_hi(ADDR i)
+access_data_hi(SOLAR_CTX *ctx, ADDR i)
 {
 	DATA data;
 
-	data = access_data(i);
+	data = access_data(ctx, i);
 	return ((data >> 8) & 0xFF);
 }
 
 static float
-float_access_data(ADDR i, float dp)
+float_access_data(SOLAR_CTX *ctx, ADDR i, float dp)
 {
 
-	return((float)access_data(i) / dp);
+	return((float)access_data(ctx, i) / dp);
 }
 
 /*
@@ -383,30 +1174,26 @@ float_access_data(ADDR i, float dp)
  *
  * input	- char * to modport name
  * output	- char * of csv string generated from SOLAR_SNAPSHOT
+ *		  caller must free
  *
- * 
+ * N.B. Collectors taking many samples should keep their own SOLAR_BUF
+ * and use solar_format_snapshot() directly, see solar_format.c
  */
 char *
 get_csv_snapshot(const char *modport)
 {
-	char *csv_line;
+	SOLAR_BUF sb;
 	SOLAR_SNAPSHOT *sol;
-	struct tm *local_time;
-	time_t cur_time;
 
 	sol = get_solar_snapshot(modport);
 	if (NULL == sol)
 		return (NULL);
 
-	time(&cur_time);
-	local_time = localtime(&cur_time);
-	asprintf(&csv_line,
-		 "%4d-%02d-%02d %02d:%02d:%02d+00,%.1f,%.2f,%d,%d,%.2f,%.2f,%.2f,%.2f\n",
-		 local_time->tm_year+1900, local_time->tm_mon + 1,
-		 local_time->tm_mday, local_time->tm_hour,
-		 local_time->tm_min, local_time->tm_sec,
-		 sol->array_v, sol->array_a, sol->array_w,
-		 sol->soc, sol->bat_v, sol->bat_a, 
-		 sol->load_v, sol->load_a);
-	return (csv_line);
+	solar_buf_init(&sb);
+	if (solar_format_snapshot(&sb, SOLAR_FMT_CSV, time(NULL), sol) < 0) {
+		solar_buf_free(&sb);
+		sb.buf = NULL;
+	}
+	free_solar_snapshot(sol);
+	return (sb.buf);
 }
@@ -31,8 +31,12 @@ typedef unsigned short DATA;
 
 #define MODBUS_PORT_DEFAULT "/dev/cuaU0"
 
+#include <pthread.h>
+#include "libmodbus.h"
 #include "renogy.h"
 
+#define SOLAR_STR_MAX	24	/* longest string decoded from controller */
+
 /*
  * struct of data items useful both for a webserver
  * and data collection for history database.
@@ -47,27 +51,50 @@ typedef struct {
 	float bat_a;	/* battery amps */
 	float load_v;	/* load voltage */
 	float load_a;	/* load amps */
+	unsigned int gen_wh;	/* cumulative energy generated, wraps */
+	unsigned int con_wh;	/* cumulative energy consumed, wraps */
+	int charge_state;	/* CHARGE_STATE, see solar_charge_state() */
+	int fault_bits;		/* CONTROLLER_FAULT_INFO */
 } SOLAR_SNAPSHOT;
 
+/* CHARGE_STATE values */
+#define CHARGE_IDLE		0
+#define CHARGE_START		1
+#define CHARGE_MPPT		2
+#define CHARGE_EQUALIZE		3
+#define CHARGE_BOOST		4
+#define CHARGE_FLOAT		5
+#define CHARGE_LIMIT		6
+#define CHARGE_OVERCHARGE	7
+
+#define SOLAR_FAULT_BITS	15	/* named bits, see solar_fault_name() */
+
+/* Energy between two snapshots, see solar_energy_delta() */
+typedef struct {
+	unsigned int gen_wh;
+	unsigned int con_wh;
+} SOLAR_ENERGY;
+
 typedef struct {
 /* Solar Panel Status */
-	char	*model;
-	char	*hardware_version;
-	char	*software_version;
-	char	*serial_number;
+	char	model[SOLAR_STR_MAX];
+	char	hardware_version[SOLAR_STR_MAX];
+	char	software_version[SOLAR_STR_MAX];
+	char	serial_number[SOLAR_STR_MAX];
 
 /* Array Information */
 	float	array_v;
 	float	array_a;
 	int	array_w;
-	char	*array_working_state;
+	char	array_working_state[SOLAR_STR_MAX];
 	int	power_gen_today;
+	int	power_con_today;
 
 /* Battery Information */
 	float	bat_v;
 	float	bat_a;
-	char	*charging_state;
-	char	*bat_type;
+	char	charging_state[SOLAR_STR_MAX];
+	char	bat_type[SOLAR_STR_MAX];
 	int	bat_temp;
 	int	soc;
 	int	bat_capacity;
@@ -97,6 +124,8 @@ typedef struct {
 	int	total_operating_days;
 	int	bat_total_over_discharges;
 	int	bat_total_full_charges;
+	unsigned int	gen_wh;		/* cumulative energy generated */
+	unsigned int	con_wh;		/* cumulative energy consumed */
 
 /* Easy to present so why not ? */
 	int	fault_bits;
@@ -117,13 +146,122 @@ typedef struct {
 	float bat_discharge_kwh;
 } SOLAR_HISTORY;
 
+/*
+ * The same history as columns, index 0 is day first.
+ * The Ah columns are whole numbers but are kept as float so every
+ * column can go straight to a chart or export.
+ * Columns are padded to a multiple of 8 for the conversion kernel.
+ */
+#define HISTORY_COLUMN_MAX	((MAX_DAYS_HISTORY + 7) & ~7)
+
+typedef struct {
+	int   first;
+	int   count;
+	float bat_min_v[HISTORY_COLUMN_MAX];
+	float bat_max_v[HISTORY_COLUMN_MAX];
+	float bat_max_charge_a[HISTORY_COLUMN_MAX];
+	float bat_max_discharge_a[HISTORY_COLUMN_MAX];
+	float bat_max_charge_w[HISTORY_COLUMN_MAX];
+	float bat_max_discharge_w[HISTORY_COLUMN_MAX];
+	float bat_charge_ah[HISTORY_COLUMN_MAX];
+	float bat_discharge_ah[HISTORY_COLUMN_MAX];
+	float bat_charge_kwh[HISTORY_COLUMN_MAX];
+	float bat_discharge_kwh[HISTORY_COLUMN_MAX];
+} SOLAR_HISTORY_COLUMNS;
+
+/*
+ * Error returns from the SOLAR_CTX functions.
+ * None of the library functions ever exit the program.
+ */
+#define SOLAR_OK	0
+#define SOLAR_EOPEN	-1	/* can't open or lock the serial port */
+#define SOLAR_EIO	-2	/* no reply or bad reply from controller */
+#define SOLAR_ENOMEM	-3
+#define SOLAR_EINVAL	-4	/* bad argument e.g. day out of range */
+
+/*
+ * Register groups. Each is read as one modbus transaction and
+ * changes at a very different rate, see solar_sched.c
+ */
+#define SOLAR_GROUP_IDENT	0	/* 0xA model, versions, ratings */
+#define SOLAR_GROUP_LIVE	1	/* 0x100 live values and today */
+#define SOLAR_GROUP_SETTINGS	2	/* 0xE001 battery settings */
+#define SOLAR_GROUP_HISTORY	3	/* 0xF000+ per day history */
+#define SOLAR_GROUPS		4
+
+/*
+ * A read of some register groups that other callers can wait on
+ * rather than reading the same registers again, see flight_join()
+ */
+#define SOLAR_FLIGHTS		8
+
+typedef struct {
+	int		mask;		/* 1 << SOLAR_GROUP_, 0 if free */
+	int		day1;		/* days of SOLAR_GROUP_HISTORY */
+	int		day2;
+	int		done;
+	int		error;
+	int		waiters;
+} SOLAR_FLIGHT;
+
+/*
+ * One SOLAR_CTX per controller. It owns the raw register buffers
+ * and the modbus port state, so separate contexts can be used from
+ * separate threads. A context may also be shared, calls on one
+ * context are serialized by its lock, and a call finding the same
+ * registers already about to be read waits for that read and shares
+ * its result instead of making its own.
+ * The serial port is only held open for the duration of one call.
+ */
+typedef struct solar_ctx {
+	char		*modport;
+	MODBUS_CTX	modbus;
+	pthread_mutex_t	lock;
+	DATA		data_at_a[MAX_DATA];
+	DATA		data_at_100[MAX_DATA];
+	DATA		data_at_e001[MAX_DATA];
+	DATA		day_history[MAX_DAYS_HISTORY][MAX_DAY_DATA];
+	int		history_batch;	/* days per history read, 0 unknown */
+	pthread_mutex_t	flight_lock;
+	pthread_cond_t	flight_done;
+	SOLAR_FLIGHT	flight[SOLAR_FLIGHTS];
+	unsigned long	coalesced;	/* reads shared rather than made */
+} SOLAR_CTX;
+
+SOLAR_CTX *solar_ctx_new(const char *modport);
+void	solar_ctx_free(SOLAR_CTX *ctx);
+int	solar_read_snapshot(SOLAR_CTX *ctx, SOLAR_SNAPSHOT *snapshot);
+int	solar_read_info(SOLAR_CTX *ctx, SOLAR_INFO *info);
+int	solar_read_group(SOLAR_CTX *ctx, int group);
+void	solar_cached_snapshot(SOLAR_CTX *ctx, SOLAR_SNAPSHOT *snapshot);
+void	solar_cached_info(SOLAR_CTX *ctx, SOLAR_INFO *info);
+void	solar_modbus_stats(SOLAR_CTX *ctx, MODBUS_STATS *stats);
+unsigned long solar_coalesced(SOLAR_CTX *ctx);
+int	solar_read_history(SOLAR_CTX *ctx, int day1, int day2);
+int	solar_history(SOLAR_CTX *ctx, int day, SOLAR_HISTORY *history);
+int	solar_probe_history(SOLAR_CTX *ctx);
+int	solar_history_columns(SOLAR_CTX *ctx, int first, int last,
+			      SOLAR_HISTORY_COLUMNS *cols);
+unsigned int solar_counter_delta(unsigned int prev, unsigned int cur);
+void	solar_energy_delta(const SOLAR_SNAPSHOT *prev,
+			   const SOLAR_SNAPSHOT *cur, SOLAR_ENERGY *delta);
+const char *solar_strerror(int error);
+const char *solar_charge_state(int charge_state);
+const char *solar_fault_name(int bit);
+
+/*
+ * Original API. These share one internal SOLAR_CTX so are not
+ * thread safe, and return NULL or -1 on error.
+ */
 SOLAR_SNAPSHOT *get_solar_snapshot(const char *modport);
 void	free_solar_snapshot(SOLAR_SNAPSHOT *snapshot);
 SOLAR_INFO *get_solar_info(const char *modport);
-void	prime_solar_history(const char *modport, int day1, int day2);
+int	prime_solar_history(const char *modport, int day1, int day2);
 SOLAR_HISTORY *get_solar_history(int day);
+SOLAR_HISTORY_COLUMNS *get_solar_history_columns(int first, int last);
 void	free_solar_info(SOLAR_INFO *info);
 void	free_solar_history(SOLAR_HISTORY *history);
+void	free_solar_history_columns(SOLAR_HISTORY_COLUMNS *cols);
 char*	get_csv_snapshot(const char *modport);
 
 
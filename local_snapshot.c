@@ -85,6 +85,8 @@ main(void)
 		err(EX_USAGE, "No csv filename in config file given\n");
 
 	csv_line = get_csv_snapshot(modport);	/* From libsolar */
+	if (csv_line == NULL)
+		errx(EX_IOERR, "Can't read controller on %s", modport);
 
 	/* Add csv line to the given csv file */
 	fp = fopen(csvfilename, "a");
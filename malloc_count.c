@@ -0,0 +1,211 @@
+/* Copyright (c) 2023 Diane Bruce db@db.net
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * malloc_count
+ *
+ * Counts every allocation a program makes, stdio, getline() and zlib
+ * included, for web_bench -a. Preloaded, it passes malloc() and the
+ * rest on to the real ones and adds one to the MALLOC_COUNT mapped
+ * from the file named by MALLOC_COUNT. The mapping is shared, and
+ * inherited by whatever the program forks, so the file holds the sum
+ * over all of its processes and can be read while they run.
+ *
+ * e.g. MALLOC_COUNT=/tmp/allocs LD_PRELOAD=./malloc_count.so web_status
+ *	web_bench -a /tmp/allocs -c 16 -k -t 30
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "malloc_count.h"
+
+#define EARLY_MAX	8192	/* for dlsym()'s own calloc() */
+
+static void	*(*real_malloc)(size_t);
+static void	*(*real_calloc)(size_t, size_t);
+static void	*(*real_realloc)(void *, size_t);
+static int	(*real_posix_memalign)(void **, size_t, size_t);
+static void	*(*real_aligned_alloc)(size_t, size_t);
+static void	(*real_free)(void *);
+
+static MALLOC_COUNT *counts;
+static char	early[EARLY_MAX] __attribute__((__aligned__(16)));
+static size_t	early_used;
+static int	resolving;
+
+static void	malloc_count_init(void) __attribute__((__constructor__));
+static int	resolve(void);
+static void	*early_alloc(size_t size);
+static void	count(int freed);
+
+/*
+ * malloc_count_init
+ *
+ * inputs	- none
+ * output	- none
+ * side effects	- the counts are mapped, nothing is counted if
+ *		  MALLOC_COUNT is not set or the file can't be had
+ */
+static void
+malloc_count_init(void)
+{
+	const char *path;
+	void *p;
+	int fd;
+
+	if ((path = getenv("MALLOC_COUNT")) == NULL)
+		return;
+	if ((fd = open(path, O_RDWR | O_CREAT, 0644)) < 0)
+		return;
+	if (ftruncate(fd, sizeof(MALLOC_COUNT)) < 0) {
+		close(fd);
+		return;
+	}
+	p = mmap(NULL, sizeof(MALLOC_COUNT), PROT_READ | PROT_WRITE,
+		 MAP_SHARED, fd, 0);
+	close(fd);
+	if (p != MAP_FAILED)
+		counts = p;
+}
+
+/*
+ * resolve
+ * Finds the real functions. dlsym() may itself allocate, that is
+ * given memory from early[] that is never freed.
+ *
+ * output	- 0 or -1 if they were not found
+ */
+static int
+resolve(void)
+{
+	resolving = 1;
+	real_malloc = dlsym(RTLD_NEXT, "malloc");
+	real_calloc = dlsym(RTLD_NEXT, "calloc");
+	real_realloc = dlsym(RTLD_NEXT, "realloc");
+	real_posix_memalign = dlsym(RTLD_NEXT, "posix_memalign");
+	real_aligned_alloc = dlsym(RTLD_NEXT, "aligned_alloc");
+	real_free = dlsym(RTLD_NEXT, "free");
+	resolving = 0;
+	return (real_malloc != NULL && real_calloc != NULL &&
+		real_realloc != NULL && real_posix_memalign != NULL &&
+		real_aligned_alloc != NULL && real_free != NULL ? 0 : -1);
+}
+
+static void *
+early_alloc(size_t size)
+{
+	void *p;
+
+	size = (size + 15) & ~(size_t)15;
+	if (size > EARLY_MAX - early_used)
+		return (NULL);
+	p = early + early_used;
+	early_used += size;
+	return (p);
+}
+
+/* another allocation, or with freed set another free() */
+static void
+count(int freed)
+{
+	if (counts != NULL)
+		__atomic_add_fetch(freed ? &counts->frees : &counts->allocs,
+				   1, __ATOMIC_RELAXED);
+}
+
+void *
+malloc(size_t size)
+{
+	if (real_malloc == NULL && (resolving || resolve() < 0))
+		return (early_alloc(size));
+	count(0);
+	return (real_malloc(size));
+}
+
+void *
+calloc(size_t n, size_t size)
+{
+	if (real_calloc == NULL && (resolving || resolve() < 0)) {
+		if (size != 0 && n > EARLY_MAX / size)
+			return (NULL);
+		return (early_alloc(n * size));	/* early[] is zero */
+	}
+	count(0);
+	return (real_calloc(n, size));
+}
+
+void *
+realloc(void *p, size_t size)
+{
+	size_t room;
+	char *q;
+
+	if (real_realloc == NULL && (resolving || resolve() < 0))
+		return (NULL);
+	if ((char *)p >= early && (char *)p < early + EARLY_MAX) {
+		/* its size is not known, copy what it could hold */
+		room = early + EARLY_MAX - (char *)p;
+		if ((q = malloc(size)) != NULL)
+			memcpy(q, p, size < room ? size : room);
+		return (q);
+	}
+	count(0);
+	return (real_realloc(p, size));
+}
+
+int
+posix_memalign(void **p, size_t align, size_t size)
+{
+	if (real_posix_memalign == NULL && resolve() < 0)
+		return (ENOMEM);
+	count(0);
+	return (real_posix_memalign(p, align, size));
+}
+
+void *
+aligned_alloc(size_t align, size_t size)
+{
+	if (real_aligned_alloc == NULL && resolve() < 0)
+		return (NULL);
+	count(0);
+	return (real_aligned_alloc(align, size));
+}
+
+void
+free(void *p)
+{
+	if (p == NULL ||
+	    ((char *)p >= early && (char *)p < early + EARLY_MAX))
+		return;
+	if (real_free == NULL && resolve() < 0)
+		return;
+	count(1);
+	real_free(p);
+}
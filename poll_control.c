@@ -0,0 +1,197 @@
+/* Copyright (c) 2023 Diane Bruce db@db.net
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Adaptive poll interval for the resident collector.
+ *
+ * Polling at a fixed rate either wastes bus time all night, when
+ * the array is dark and nothing changes, or misses what clouds do to
+ * the array at midday. Instead after each sample the next interval is
+ * chosen between min and max from
+ *
+ *	- how fast array watts and battery amps are changing
+ *	- the charge state, bulk (MPPT/boost) charging is watched more
+ *	  closely than float, and any change of state is followed up
+ *	  right away
+ *	- time of day, the array being dark means night
+ *
+ * poll_report() says how many samples fixed polling at min would
+ * have taken and so how many were saved.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libsolar.h"
+#include "poll_control.h"
+
+/*
+ * Changes of this size per minute count as one unit of activity.
+ * One unit of activity halves the interval, two thirds it etc.
+ */
+#define ACTIVITY_WATTS	20.0
+#define ACTIVITY_AMPS	1.0
+#define ACTIVITY_WEIGHT	0.5	/* smoothing of successive rates */
+
+#define NIGHT_ARRAY_V	1.0	/* array volts below this is dark */
+#define NIGHT_BAT_A	0.1
+
+#define MIDDAY_START	10	/* local hours most prone to cloud */
+#define MIDDAY_END	15
+
+static int	state_cap(POLL_CONTROL *pc, int charge_state);
+
+void
+poll_init(POLL_CONTROL *pc, int min, int max, time_t now)
+{
+	memset(pc, 0, sizeof(*pc));
+	if (min < 1)
+		min = 1;
+	if (max < min)
+		max = min;
+	pc->min = min;
+	pc->max = max;
+	pc->interval = min;
+	pc->stats_start = now;
+}
+
+/*
+ * poll_next
+ *
+ * inputs	- POLL_CONTROL
+ *		- time and contents of the sample just taken
+ * output	- seconds until the next sample
+ * side effects	- activity and statistics are updated
+ */
+int
+poll_next(POLL_CONTROL *pc, time_t when, const SOLAR_SNAPSHOT *snap)
+{
+	double minutes;
+	double rate;
+	double interval;
+	struct tm tm;
+	int cap;
+
+	pc->samples++;
+	if (!pc->have_prev) {
+		pc->have_prev = 1;
+		pc->prev = *snap;
+		pc->prev_when = when;
+		pc->interval = pc->min;
+		return (pc->interval);
+	}
+
+	minutes = (when - pc->prev_when) / 60.0;
+	if (minutes < 1.0 / 60.0)
+		minutes = 1.0 / 60.0;
+	rate = (abs(snap->array_w - pc->prev.array_w) / ACTIVITY_WATTS +
+		fabs(snap->bat_a - pc->prev.bat_a) / ACTIVITY_AMPS) / minutes;
+	pc->activity = ACTIVITY_WEIGHT * pc->activity +
+		(1.0 - ACTIVITY_WEIGHT) * rate;
+
+	interval = pc->max / (1.0 + pc->activity);
+
+	cap = state_cap(pc, snap->charge_state);
+	if (interval > cap)
+		interval = cap;
+
+	localtime_r(&when, &tm);
+	if (snap->array_v < NIGHT_ARRAY_V && fabs(snap->bat_a) < NIGHT_BAT_A)
+		interval = pc->max;		/* dark and idle */
+	else if (tm.tm_hour >= MIDDAY_START && tm.tm_hour < MIDDAY_END &&
+		 interval > pc->max / 4)
+		interval = pc->max / 4;
+
+	if (snap->charge_state != pc->prev.charge_state ||
+	    snap->fault_bits != pc->prev.fault_bits)
+		interval = pc->min;		/* follow up a transition */
+
+	/* back off gently, but speed up at once */
+	if (interval > 2.0 * pc->interval)
+		interval = 2.0 * pc->interval;
+	if (interval < pc->min)
+		interval = pc->min;
+	if (interval > pc->max)
+		interval = pc->max;
+
+	pc->interval = interval;
+	pc->prev = *snap;
+	pc->prev_when = when;
+	return (pc->interval);
+}
+
+/*
+ * Longest interval allowed in each charge state.
+ */
+static int
+state_cap(POLL_CONTROL *pc, int charge_state)
+{
+	switch (charge_state) {
+	case CHARGE_START:
+	case CHARGE_OVERCHARGE:
+		return (pc->min);
+	case CHARGE_MPPT:
+	case CHARGE_EQUALIZE:
+	case CHARGE_BOOST:
+	case CHARGE_LIMIT:
+		return (pc->max / 4);
+	case CHARGE_FLOAT:
+		return (pc->max / 2);
+	case CHARGE_IDLE:
+	default:
+		return (pc->max);
+	}
+}
+
+/*
+ * poll_report
+ *
+ * inputs	- POLL_CONTROL
+ *		- now
+ *		- buffer for a one line report
+ * output	- samples per hour saved against fixed polling at min
+ * side effects	- statistics are restarted
+ */
+int
+poll_report(POLL_CONTROL *pc, time_t now, char *buf, size_t len)
+{
+	double hours;
+	long fixed;
+	int saved;
+
+	hours = (now - pc->stats_start) / 3600.0;
+	if (hours <= 0)
+		hours = 1.0 / 3600.0;
+	fixed = (now - pc->stats_start) / pc->min;
+	saved = (fixed - pc->samples) / hours;
+	snprintf(buf, len, "%ld samples in %.1f hours, interval now %ds, "
+		 "fixed %ds polling would take %ld, saved %d/hour",
+		 pc->samples, hours, pc->interval, pc->min, fixed, saved);
+	pc->samples = 0;
+	pc->stats_start = now;
+	return (saved);
+}
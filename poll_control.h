@@ -0,0 +1,54 @@
+/* Copyright (c) 2023 Diane Bruce db@db.net
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#ifndef __POLL_CONTROL_H__
+#define __POLL_CONTROL_H__
+
+#include <time.h>
+#include "libsolar.h"
+
+#define POLL_MIN_DEFAULT	10	/* seconds */
+#define POLL_MAX_DEFAULT	1800	/* the old 30 minute cron cadence */
+
+/*
+ * State for the adaptive poll interval, see poll_control.c
+ */
+typedef struct {
+	int	min;		/* bounds on the interval, seconds */
+	int	max;
+	int	interval;	/* last interval chosen */
+	int	have_prev;
+	time_t	prev_when;
+	SOLAR_SNAPSHOT prev;
+	double	activity;	/* smoothed rate of change */
+
+	/* statistics since the last poll_report() */
+	time_t	stats_start;
+	long	samples;
+} POLL_CONTROL;
+
+void	poll_init(POLL_CONTROL *pc, int min, int max, time_t now);
+int	poll_next(POLL_CONTROL *pc, time_t when, const SOLAR_SNAPSHOT *snap);
+int	poll_report(POLL_CONTROL *pc, time_t now, char *buf, size_t len);
+
+#endif
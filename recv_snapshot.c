@@ -69,6 +69,8 @@ static char input_buf[MAXBUF];
  * then enters this data into a postgres database using dbhost, dbport,
  * dbname, dbuser, dbpassword from the ~/.solar config file.
  * The table it updates is given by 'dbtable' 
+ * One line at a time is handled until end of input, so a resident
+ * snapshot_collector can keep one ssh session open.
  *
  * BUGS: No sanity checcking on csv input line.
  */
@@ -93,19 +95,22 @@ main(int argc, char* argv[])
 	if (dbtable == NULL)
 		err(-1, "No table name (dbtable) in config file given\n");
 
-	fgets(input_buf, MAXBUF-1, stdin);
-	p = strchr(input_buf, '\n');		/* strip newline */
-	if (p != NULL)
-		*p = '\0';
+	while (fgets(input_buf, MAXBUF-1, stdin) != NULL) {
+		p = strchr(input_buf, '\n');		/* strip newline */
+		if (p != NULL)
+			*p = '\0';
+		if (*input_buf == '\0')
+			continue;
 	
-	if (csvfilename != NULL) {
-		fp = fopen(csvfilename, "a");
-		if (fp != NULL) {
-			fprintf(fp, "%s\n",input_buf);
-			fclose(fp);
+		if (csvfilename != NULL) {
+			fp = fopen(csvfilename, "a");
+			if (fp != NULL) {
+				fprintf(fp, "%s\n",input_buf);
+				fclose(fp);
+			}
 		}
+		update_database(dbhost, dbport, dbname, dbuser, dbpassword,
+				dbtable, input_buf);
 	}
-	update_database(dbhost, dbport, dbname, dbuser, dbpassword,
-			dbtable, input_buf);
 }
 
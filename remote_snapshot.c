@@ -73,6 +73,8 @@ main(void)
 		err(EX_USAGE, "No ssh user or host from config file given\n");
 
 	csv_line = get_csv_snapshot(modport);	/* From libsolar */
+	if (csv_line == NULL)
+		errx(EX_IOERR, "Can't read controller on %s", modport);
 
 	/* popen ssh isn't exactly secure and clever but it's
 	 * on a small remote server. Who cares.
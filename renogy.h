@@ -60,8 +60,8 @@
 #define BAT_TOTAL_OVER_DISCHARGES  0x116
 #define BAT_TOTAL_FULL_CHARGES	0x117
 #define BAT_MAX_CHARGING_POWER  0x118
-#define CUMULATIVE_POWER_GENERATION  0x11C
-#define CUMULATIVE_POWER_CONSUMPTION  0x11E
+#define CUMULATIVE_POWER_GENERATION  0x11C	/* 32 bit Wh, hi word first */
+#define CUMULATIVE_POWER_CONSUMPTION  0x11E	/* 32 bit Wh, hi word first */
 #define CHARGE_STATE  0x120			/* floating, MPPT etc. */
 #define CONTROLLER_FAULT_INFO  0x121		/* Bit map of faults */
 
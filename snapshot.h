@@ -27,4 +27,31 @@
 
 #define DEFAULT_DBHOST	"127.0.0.1"
 #define DEFAULT_DBPORT	"5432"
+
+/*
+ * Database columns for a csv snapshot line. Lines written before the
+ * cumulative energy counters were added have SNAPSHOT_FIELDS_V1 data
+ * fields after the time, current lines have SNAPSHOT_FIELDS.
+ */
+#define SNAPSHOT_COLUMNS_V1	"date_time,array_v,array_a,array_w," \
+				"soc,bat_v,bat_a,load_v,load_a"
+#define SNAPSHOT_COLUMNS	SNAPSHOT_COLUMNS_V1 ",gen_wh,con_wh"
+#define SNAPSHOT_FIELDS_V1	8
+#define SNAPSHOT_FIELDS		10
+
+#define snapshot_columns(data)	\
+	(snapshot_field_count(data) == SNAPSHOT_FIELDS_V1 ? \
+	 SNAPSHOT_COLUMNS_V1 : SNAPSHOT_COLUMNS)
+
+/* number of comma separated fields in data */
+static inline int
+snapshot_field_count(const char *data)
+{
+	int count;
+
+	for (count = 1; *data != '\0'; data++)
+		if (*data == ',')
+			count++;
+	return (count);
+}
 #endif
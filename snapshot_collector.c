@@ -0,0 +1,475 @@
+/* Copyright (c) 2023 Diane Bruce db@db.net
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * snapshot_collector
+ *
+ * Resident replacement for running remote_snapshot from cron.
+ * It keeps the controller context, the csv buffer and the ssh
+ * session to the host open, and chooses when to take the next
+ * sample with the adaptive poll controller in poll_control.c,
+ * sampling quickly while things are changing and rarely at night.
+ *
+ * Each sample is appended to csvfilename and, if ssh_host and
+ * ssh_user are given, written down one long lived ssh session
+ * to recv_snapshot on the host. If any deadband_<field> or heartbeat
+ * is configured only samples that say something new are, see
+ * deadband.c
+ *
+ * If eventfilename is given the controller is also sampled every
+ * trigger_rate seconds into the trigger ring of trigger.c, and faults,
+ * charge state changes and trigger thresholds are captured as events
+ * in that file at burst rate.
+ *
+ * With "io_uring = yes", built with HAVE_IO_URING on a kernel that has
+ * it, the csv and event appends, open, write and close each, and the
+ * write down the ssh session are queued on io_uring instead and go to
+ * the kernel together in one system call per sample, see
+ * solar_uring.c. Without, or should the ring fail, stdio is used.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sysexits.h>
+#include "config_parser.h"
+#include "deadband.h"
+#include "libsolar.h"
+#include "poll_control.h"
+#include "solar_config.h"
+#include "solar_format.h"
+#include "solar_uring.h"
+#include "trigger.h"
+
+char *modport=MODBUS_PORT_DEFAULT;
+char *csvfilename=NULL;
+char *ssh_host=NULL;
+char *ssh_user=NULL;
+char *poll_min=NULL;
+char *poll_max=NULL;
+char *heartbeat=NULL;
+char *deadband_cfg[DEADBAND_FIELDS];
+char *eventfilename=NULL;
+char *trigger_cfg=NULL;
+char *trigger_rate=NULL;
+char *trigger_burst=NULL;
+char *trigger_pre=NULL;
+char *trigger_post=NULL;
+char *iouring=NULL;
+
+PARSE_ITEMS parse_table = {{"modport", &modport},
+			   {"csvfilename", &csvfilename},
+			   {"ssh_host", &ssh_host},
+			   {"ssh_user", &ssh_user},
+			   {"poll_min", &poll_min},
+			   {"poll_max", &poll_max},
+			   {"heartbeat", &heartbeat},
+			   {"deadband_array_v", &deadband_cfg[0]},
+			   {"deadband_array_a", &deadband_cfg[1]},
+			   {"deadband_array_w", &deadband_cfg[2]},
+			   {"deadband_soc", &deadband_cfg[3]},
+			   {"deadband_bat_v", &deadband_cfg[4]},
+			   {"deadband_bat_a", &deadband_cfg[5]},
+			   {"deadband_load_v", &deadband_cfg[6]},
+			   {"deadband_load_a", &deadband_cfg[7]},
+			   {"deadband_gen_wh", &deadband_cfg[8]},
+			   {"deadband_con_wh", &deadband_cfg[9]},
+			   {"eventfilename", &eventfilename},
+			   {"trigger", &trigger_cfg},
+			   {"trigger_rate", &trigger_rate},
+			   {"trigger_burst", &trigger_burst},
+			   {"trigger_pre", &trigger_pre},
+			   {"trigger_post", &trigger_post},
+			   {"io_uring", &iouring},
+			   {NULL,NULL}};
+
+#define REPORT_INTERVAL	3600	/* seconds between syslog reports */
+
+static SOLAR_CTX *solar_ctx;
+static SOLAR_BUF csv_buf;
+static FILE *ssh_fp;
+static DEADBAND deadband;
+static TRIGGER trigger;
+static SOLAR_BUF event_buf;
+
+/* io_uring udata of each file written, see ring_flush() */
+#define RING_CSV	1
+#define RING_EVENT	2
+#define RING_SSH	3
+#define RING_ENTRIES	16
+
+static SOLAR_URING *ring;
+static int ring_pending;		/* completions still to come */
+static size_t ssh_len;			/* queued down the ssh session */
+
+static void	collect_loop(void);
+static void	setup_trigger(void);
+static void	store_sample(const char *record, size_t len);
+static void	store_event(void);
+static void	ship_sample(const char *record, size_t len);
+static void	ssh_failed(void);
+static void	ring_flush(void);
+static void	usage(const char *progname);
+
+int
+main(int argc, char *argv[])
+{
+	int ch;
+	int foreground = 0;
+	int i;
+
+	(void)parse_config(SOLAR_GLOBAL_CONFIG, parse_table);
+	(void)parse_config(SOLAR_CONFIG, parse_table);
+
+	while ((ch = getopt(argc, argv, "f")) != -1) {
+		switch (ch) {
+		case 'f':
+			foreground = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (csvfilename == NULL)
+		errx(EX_USAGE, "No csv filename in config file given");
+	if ((ssh_host == NULL) != (ssh_user == NULL))
+		errx(EX_USAGE, "Need both ssh_user and ssh_host or neither");
+
+	deadband_init(&deadband);
+	if (heartbeat != NULL)
+		deadband_heartbeat(&deadband, atoi(heartbeat));
+	for (i = 0; i < DEADBAND_FIELDS; i++)
+		if (deadband_cfg[i] != NULL &&
+		    deadband_set(&deadband, solar_snapshot_name(i),
+				 deadband_cfg[i]) < 0)
+			errx(EX_DATAERR, "Bad deadband_%s: %s",
+			     solar_snapshot_name(i), deadband_cfg[i]);
+	if (eventfilename != NULL)
+		setup_trigger();
+
+	if ((solar_ctx = solar_ctx_new(modport)) == NULL)
+		err(EX_OSERR, "Can't allocate solar context");
+	solar_buf_init(&csv_buf);
+	signal(SIGPIPE, SIG_IGN);
+	openlog("snapshot_collector", foreground ? LOG_PERROR : 0, LOG_DAEMON);
+	if (iouring != NULL && strcasecmp(iouring, "yes") == 0 &&
+	    (ring = solar_uring_new(RING_ENTRIES, 2)) == NULL)
+		syslog(LOG_NOTICE, "no io_uring (%m), using stdio");
+
+	if (!foreground) {
+		switch (fork()) {
+		case -1:
+			err(EX_OSERR, "fork");
+			break;
+		default:
+			return (0);
+			break;
+		case 0:
+			setsid();
+			break;
+		}
+	}
+
+	collect_loop();
+	exit(EX_OK);
+}
+
+/*
+ * collect_loop
+ *
+ * Take a sample, store and ship it unless the deadband filter
+ * drops it, then sleep for however long the poll controller says.
+ * With triggers on, samples in between only go to the trigger ring.
+ * Controller errors are logged and the sample retried after the
+ * minimum interval.
+ */
+static void
+collect_loop(void)
+{
+	POLL_CONTROL pc;
+	SOLAR_SNAPSHOT snap;
+	time_t now;
+	time_t next_store;
+	time_t next_report;
+	char report[200];
+	int interval;
+	int due;
+	int wait;
+	int error;
+
+	now = time(NULL);
+	poll_init(&pc, poll_min ? atoi(poll_min) : POLL_MIN_DEFAULT,
+		  poll_max ? atoi(poll_max) : POLL_MAX_DEFAULT, now);
+	next_report = now + REPORT_INTERVAL;
+	next_store = now;
+
+	for (;;) {
+		now = time(NULL);
+		error = solar_read_snapshot(solar_ctx, &snap);
+		if (error != SOLAR_OK) {
+			syslog(LOG_WARNING, "%s: %s", modport,
+			       solar_strerror(error));
+			sleep(pc.min);
+			continue;
+		}
+
+		if (eventfilename != NULL &&
+		    trigger_sample(&trigger, now, &snap) == TRIGGER_DONE)
+			store_event();
+
+		if (now >= next_store) {
+			solar_buf_reset(&csv_buf);
+			if (deadband_check(&deadband, now, &snap) &&
+			    solar_format_snapshot(&csv_buf, SOLAR_FMT_CSV,
+						  now, &snap) == 0) {
+				store_sample(csv_buf.buf, csv_buf.len);
+				ship_sample(csv_buf.buf, csv_buf.len);
+			}
+
+			interval = poll_next(&pc, now, &snap);
+			due = deadband_due(&deadband, now);
+			if (due >= 0 && due < interval)
+				interval = due > pc.min ? due : pc.min;
+			next_store = now + interval;
+		}
+
+		if (ring != NULL)
+			ring_flush();
+
+		if (now >= next_report) {
+			poll_report(&pc, now, report, sizeof(report));
+			syslog(LOG_INFO, "%s", report);
+			deadband_report(&deadband, report, sizeof(report));
+			syslog(LOG_INFO, "%s", report);
+			next_report = now + REPORT_INTERVAL;
+		}
+
+		wait = next_store - now;
+		if (eventfilename != NULL && trigger_interval(&trigger) < wait)
+			wait = trigger_interval(&trigger);
+		if (wait > 0)
+			sleep(wait);
+	}
+}
+
+/*
+ * setup_trigger
+ * trigger is a comma separated list of thresholds e.g.
+ * bat_v<11.8,load_a>15
+ */
+static void
+setup_trigger(void)
+{
+	char *list;
+	char *p;
+	char *spec;
+
+	trigger_init(&trigger);
+	solar_buf_init(&event_buf);
+	if (trigger_window(&trigger,
+		trigger_rate ? atoi(trigger_rate) : TRIGGER_RATE_DEFAULT,
+		trigger_burst ? atoi(trigger_burst) : TRIGGER_BURST_DEFAULT,
+		trigger_pre ? atoi(trigger_pre) : TRIGGER_PRE_DEFAULT,
+		trigger_post ? atoi(trigger_post) : TRIGGER_POST_DEFAULT) < 0)
+		errx(EX_DATAERR, "trigger_rate, trigger_burst, trigger_pre "
+		     "or trigger_post out of range");
+	if (trigger_cfg == NULL)
+		return;
+	if ((list = strdup(trigger_cfg)) == NULL)
+		err(EX_OSERR, "strdup");
+	p = list;
+	while ((spec = strsep(&p, ", ")) != NULL) {
+		if (*spec == '\0')
+			continue;
+		if (trigger_add(&trigger, spec) < 0)
+			errx(EX_DATAERR, "Bad trigger: %s", spec);
+	}
+	free(list);
+}
+
+/*
+ * store_sample
+ * The archive is opened for each record so it can be rotated
+ * underneath us. On io_uring the record must stay put until
+ * ring_flush().
+ */
+static void
+store_sample(const char *record, size_t len)
+{
+	FILE *fp;
+	int n;
+
+	if (ring != NULL &&
+	    (n = solar_uring_append(ring, csvfilename, record, len,
+				    RING_CSV)) > 0) {
+		ring_pending += n;
+		return;
+	}
+	fp = fopen(csvfilename, "a");
+	if (fp == NULL) {
+		syslog(LOG_WARNING, "can't open %s: %m", csvfilename);
+		return;
+	}
+	fwrite(record, 1, len, fp);
+	fclose(fp);
+}
+
+/*
+ * store_event
+ * Write out the window around the trigger that just completed.
+ */
+static void
+store_event(void)
+{
+	FILE *fp;
+	int n;
+
+	syslog(LOG_NOTICE, "event: %s", trigger.cause);
+	solar_buf_reset(&event_buf);
+	if (trigger_event(&trigger, &event_buf) < 0) {
+		syslog(LOG_WARNING, "out of memory for event");
+		return;
+	}
+	if (ring != NULL &&
+	    (n = solar_uring_append(ring, eventfilename, event_buf.buf,
+				    event_buf.len, RING_EVENT)) > 0) {
+		ring_pending += n;
+		return;
+	}
+	fp = fopen(eventfilename, "a");
+	if (fp == NULL) {
+		syslog(LOG_WARNING, "can't open %s: %m", eventfilename);
+		return;
+	}
+	fwrite(event_buf.buf, 1, event_buf.len, fp);
+	fclose(fp);
+}
+
+/*
+ * ship_sample
+ * The ssh session is started on first use and restarted on the
+ * next sample if it dies. recv_snapshot on the host reads lines
+ * until end of input.
+ */
+static void
+ship_sample(const char *record, size_t len)
+{
+	char *cmd;
+
+	if (ssh_host == NULL)
+		return;
+	if (ssh_fp == NULL) {
+		if (asprintf(&cmd, "/usr/bin/ssh %s@%s", ssh_user, ssh_host) < 0)
+			return;
+		ssh_fp = popen(cmd, "w");
+		free(cmd);
+		if (ssh_fp == NULL) {
+			syslog(LOG_WARNING, "can't start ssh to %s: %m",
+			       ssh_host);
+			return;
+		}
+	}
+	if (ring != NULL &&
+	    solar_uring_write(ring, fileno(ssh_fp), record, len,
+			      RING_SSH) == 0) {
+		ring_pending++;
+		ssh_len = len;
+		return;
+	}
+	if (fwrite(record, 1, len, ssh_fp) != len || fflush(ssh_fp) != 0)
+		ssh_failed();
+}
+
+static void
+ssh_failed(void)
+{
+	syslog(LOG_WARNING, "ssh to %s failed, will reconnect", ssh_host);
+	pclose(ssh_fp);
+	ssh_fp = NULL;
+}
+
+/*
+ * ring_flush
+ *
+ * inputs	- none
+ * output	- none
+ * side effects	- everything queued on io_uring this time round is
+ *		  submitted with one system call and waited for, and
+ *		  failures reported as the stdio path does. If the
+ *		  ring itself fails it is dropped for stdio.
+ */
+static void
+ring_flush(void)
+{
+	int error[RING_SSH + 1];
+	uint64_t udata;
+	int res;
+
+	memset(error, 0, sizeof(error));
+	while (ring_pending > 0) {
+		if (solar_uring_enter(ring, ring_pending, -1) < 0) {
+			syslog(LOG_WARNING, "io_uring failed (%m), "
+			       "using stdio");
+			solar_uring_free(ring);
+			ring = NULL;
+			ring_pending = 0;
+			return;
+		}
+		while (solar_uring_next(ring, &udata, &res)) {
+			ring_pending--;
+			if (udata > RING_SSH || error[udata] != 0)
+				continue;	/* only the first counts */
+			if (res < 0)
+				error[udata] = -res;
+			else if (udata == RING_SSH && (size_t)res != ssh_len)
+				error[udata] = EIO;
+		}
+	}
+	if (error[RING_CSV] != 0)
+		syslog(LOG_WARNING, "can't append to %s: %s", csvfilename,
+		       strerror(error[RING_CSV]));
+	if (error[RING_EVENT] != 0)
+		syslog(LOG_WARNING, "can't append to %s: %s", eventfilename,
+		       strerror(error[RING_EVENT]));
+	if (error[RING_SSH] != 0)
+		ssh_failed();
+}
+
+static void
+usage(const char *progname)
+{
+	fprintf(stderr, "%s: [-f]\n", progname);
+	fprintf(stderr, "%s: -f stay in the foreground\n", progname);
+	exit(EX_USAGE);
+}
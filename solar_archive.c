@@ -0,0 +1,432 @@
+/* Copyright (c) 2023 Diane Bruce db@db.net
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Time series from the csv archive.
+ *
+ * The archive only ever grows, one line per sample, oldest first.
+ * It is indexed once by time, a SOLAR_MARK about every
+ * ARCHIVE_MARK_BYTES, and the index is extended by whatever has
+ * been appended since the last call. A range is then read by
+ * seeking to the mark before it and parsing only the lines in it.
+ *
+ * However many samples are in the range, at most a given number of
+ * points are returned, chosen by Largest-Triangle-Three-Buckets.
+ * The range is cut into buckets of equal time, first and last
+ * samples are always kept and from each bucket in between the
+ * sample making the largest triangle with the point kept from the
+ * bucket before and the mean of the bucket after. That keeps peaks
+ * and dips a plain average would flatten. Buckets are equal in time
+ * rather than in samples so the range can be read in one pass
+ * holding only two buckets; gaps in the archive are empty buckets.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libsolar.h"
+#include "solar_archive.h"
+#include "solar_format.h"
+
+#define ARCHIVE_MARK_BYTES	(64 * 1024)
+
+typedef struct {
+	long		id;		/* bucket number */
+	SOLAR_POINT	*p;
+	int		n;
+	int		max;
+	double		sum_when;
+	double		sum_value;
+} BUCKET;
+
+typedef struct {
+	SOLAR_POINT	*out;
+	int		points;
+	int		n;		/* points chosen so far */
+	time_t		from;
+	double		width;		/* seconds per bucket */
+	SOLAR_POINT	held;		/* newest sample, maybe the last */
+	int		have_held;
+	BUCKET		cur;
+	BUCKET		next;
+	int		error;
+} LTTB;
+
+static int	add_mark(SOLAR_ARCHIVE *ar, time_t when, off_t offset);
+static off_t	find_mark(SOLAR_ARCHIVE *ar, time_t when);
+static int	field_value(const char *line, int field, float *value);
+static void	lttb_init(LTTB *lt, SOLAR_POINT *out, int points,
+			  time_t from, time_t to);
+static void	lttb_add(LTTB *lt, time_t when, float value);
+static void	lttb_bucket(LTTB *lt, const SOLAR_POINT *p);
+static void	lttb_choose(LTTB *lt, BUCKET *b, double when,
+			    double value);
+static int	lttb_finish(LTTB *lt);
+static int	bucket_push(BUCKET *b, const SOLAR_POINT *p);
+
+void
+solar_archive_init(SOLAR_ARCHIVE *ar, const char *path)
+{
+	memset(ar, 0, sizeof(*ar));
+	ar->path = path;
+}
+
+/*
+ * solar_archive_update
+ *
+ * inputs	- SOLAR_ARCHIVE
+ * output	- 0 or -1 with errno set
+ * side effects	- lines appended since the last call are indexed,
+ *		  a file that was replaced or shrank is indexed anew
+ */
+int
+solar_archive_update(SOLAR_ARCHIVE *ar)
+{
+	struct stat st;
+	FILE *fp;
+	char *line;
+	size_t size;
+	ssize_t len;
+	off_t offset;
+	off_t marked;
+	time_t when;
+
+	if ((fp = fopen(ar->path, "r")) == NULL)
+		return (-1);
+	if (fstat(fileno(fp), &st) < 0) {
+		fclose(fp);
+		return (-1);
+	}
+	if (st.st_dev != ar->dev || st.st_ino != ar->ino ||
+	    st.st_size < ar->indexed) {
+		ar->dev = st.st_dev;
+		ar->ino = st.st_ino;
+		ar->indexed = 0;
+		ar->first = ar->last = 0;
+		ar->nmark = 0;
+	}
+	if (st.st_size == ar->indexed ||
+	    fseeko(fp, ar->indexed, SEEK_SET) < 0) {
+		fclose(fp);
+		return (0);
+	}
+
+	line = NULL;
+	size = 0;
+	offset = ar->indexed;
+	marked = ar->nmark > 0 ? ar->mark[ar->nmark - 1].offset :
+	    -ARCHIVE_MARK_BYTES;
+	while ((len = getline(&line, &size, fp)) > 0) {
+		if (line[len - 1] != '\n')
+			break;		/* still being written */
+		if ((when = solar_parse_time(line)) >= 0) {
+			if (ar->first == 0)
+				ar->first = when;
+			if (when > ar->last)
+				ar->last = when;
+			if (offset - marked >= ARCHIVE_MARK_BYTES) {
+				if (add_mark(ar, when, offset) < 0)
+					break;
+				marked = offset;
+			}
+		}
+		offset += len;
+	}
+	ar->indexed = offset;
+	free(line);
+	fclose(fp);
+	return (0);
+}
+
+/*
+ * solar_archive_series
+ *
+ * inputs	- SOLAR_ARCHIVE
+ *		- snapshot field, see solar_snapshot_field()
+ *		- time range, inclusive
+ *		- where to put the points and how many at most, >= 3
+ *		- where to return how many samples were in the range
+ * output	- number of points or -1 with errno set
+ */
+int
+solar_archive_series(SOLAR_ARCHIVE *ar, int field, time_t from, time_t to,
+		     SOLAR_POINT *out, int points, long *rows)
+{
+	LTTB lt;
+	FILE *fp;
+	char *line;
+	size_t size;
+	time_t when;
+	float value;
+
+	*rows = 0;
+	if (field < 0 || field >= SOLAR_SNAPSHOT_FIELDS || points < 3) {
+		errno = EINVAL;
+		return (-1);
+	}
+	if (solar_archive_update(ar) < 0)
+		return (-1);
+	if (ar->first == 0)
+		return (0);
+	if (from < ar->first)
+		from = ar->first;
+	if (to > ar->last)
+		to = ar->last;
+	if (from > to)
+		return (0);
+
+	if ((fp = fopen(ar->path, "r")) == NULL)
+		return (-1);
+	if (fseeko(fp, find_mark(ar, from), SEEK_SET) < 0) {
+		fclose(fp);
+		return (-1);
+	}
+	lttb_init(&lt, out, points, from, to);
+	line = NULL;
+	size = 0;
+	while (getline(&line, &size, fp) > 0) {
+		if ((when = solar_parse_time(line)) < 0 || when < from)
+			continue;
+		if (when > to)
+			break;
+		if (field_value(line, field, &value) < 0)
+			continue;
+		(*rows)++;
+		lttb_add(&lt, when, value);
+	}
+	free(line);
+	fclose(fp);
+	return (lttb_finish(&lt));
+}
+
+static int
+add_mark(SOLAR_ARCHIVE *ar, time_t when, off_t offset)
+{
+	SOLAR_MARK *p;
+	int max;
+
+	if (ar->nmark == ar->maxmark) {
+		max = ar->maxmark ? ar->maxmark * 2 : 256;
+		p = realloc(ar->mark, max * sizeof(*p));
+		if (p == NULL)
+			return (-1);
+		ar->mark = p;
+		ar->maxmark = max;
+	}
+	ar->mark[ar->nmark].when = when;
+	ar->mark[ar->nmark].offset = offset;
+	ar->nmark++;
+	return (0);
+}
+
+/* offset of the last mark before when, where a scan for it starts */
+static off_t
+find_mark(SOLAR_ARCHIVE *ar, time_t when)
+{
+	int lo;
+	int hi;
+	int mid;
+
+	lo = 0;
+	hi = ar->nmark;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (ar->mark[mid].when < when)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return (lo > 0 ? ar->mark[lo - 1].offset : 0);
+}
+
+/*
+ * fields follow the time stamp, the first is field 0, and a "nan"
+ * or "inf" is skipped like a missing one as JSON has no way to say it
+ */
+static int
+field_value(const char *line, int field, float *value)
+{
+	const char *p;
+	char *end;
+	int i;
+
+	p = line;
+	for (i = 0; i <= field; i++)
+		if ((p = strchr(p, ',')) == NULL)
+			return (-1);
+		else
+			p++;
+	*value = strtof(p, &end);
+	if (end == p || !isfinite(*value))
+		return (-1);
+	return (0);
+}
+
+/*
+ * LTTB, one pass
+ */
+static void
+lttb_init(LTTB *lt, SOLAR_POINT *out, int points, time_t from, time_t to)
+{
+	memset(lt, 0, sizeof(*lt));
+	lt->out = out;
+	lt->points = points;
+	lt->from = from;
+	lt->width = (double)(to - from + 1) / (points - 2);
+}
+
+/* the newest sample is held back until it is known not to be last */
+static void
+lttb_add(LTTB *lt, time_t when, float value)
+{
+	SOLAR_POINT p;
+
+	p.when = when;
+	p.value = value;
+	if (lt->n == 0) {
+		lt->out[lt->n++] = p;
+		return;
+	}
+	if (lt->have_held)
+		lttb_bucket(lt, &lt->held);
+	lt->held = p;
+	lt->have_held = 1;
+}
+
+/*
+ * A sample for a bucket past the next one means the current bucket
+ * can be decided, the next one being complete.
+ */
+static void
+lttb_bucket(LTTB *lt, const SOLAR_POINT *p)
+{
+	BUCKET swap;
+	long id;
+
+	id = (long)((p->when - lt->from) / lt->width);
+	if (lt->cur.n > 0 && lt->next.n == 0 && id != lt->cur.id)
+		lt->next.id = id;
+	else if (lt->next.n > 0 && id != lt->next.id) {
+		lttb_choose(lt, &lt->cur, lt->next.sum_when / lt->next.n,
+			    lt->next.sum_value / lt->next.n);
+		swap = lt->cur;
+		lt->cur = lt->next;
+		lt->next = swap;
+		lt->next.id = id;
+	} else if (lt->cur.n == 0)
+		lt->cur.id = id;
+	if (bucket_push(id == lt->cur.id ? &lt->cur : &lt->next, p) < 0)
+		lt->error = 1;
+}
+
+/*
+ * lttb_choose
+ *
+ * inputs	- LTTB
+ *		- bucket to keep one sample of
+ *		- third corner of the triangle
+ * output	- none
+ * side effects	- the sample is kept and the bucket emptied
+ */
+static void
+lttb_choose(LTTB *lt, BUCKET *b, double when, double value)
+{
+	const SOLAR_POINT *a;
+	const SOLAR_POINT *best;
+	double area;
+	double max;
+	int i;
+
+	a = &lt->out[lt->n - 1];
+	best = NULL;
+	max = -1;
+	for (i = 0; i < b->n; i++) {
+		area = fabs(((double)a->when - when) *
+			    ((double)b->p[i].value - a->value) -
+			    ((double)a->when - b->p[i].when) *
+			    (value - a->value));
+		if (area > max) {
+			max = area;
+			best = &b->p[i];
+		}
+	}
+	if (best != NULL && lt->n < lt->points - 1)
+		lt->out[lt->n++] = *best;
+	b->n = 0;
+	b->sum_when = 0;
+	b->sum_value = 0;
+}
+
+/* output	- number of points or -1 if out of memory */
+static int
+lttb_finish(LTTB *lt)
+{
+	if (lt->have_held) {
+		if (lt->cur.n > 0) {
+			if (lt->next.n > 0)
+				lttb_choose(lt, &lt->cur,
+					    lt->next.sum_when / lt->next.n,
+					    lt->next.sum_value / lt->next.n);
+			else
+				lttb_choose(lt, &lt->cur, lt->held.when,
+					    lt->held.value);
+		}
+		if (lt->next.n > 0)
+			lttb_choose(lt, &lt->next, lt->held.when,
+				    lt->held.value);
+		lt->out[lt->n++] = lt->held;
+	}
+	free(lt->cur.p);
+	free(lt->next.p);
+	if (lt->error) {
+		errno = ENOMEM;
+		return (-1);
+	}
+	return (lt->n);
+}
+
+static int
+bucket_push(BUCKET *b, const SOLAR_POINT *p)
+{
+	SOLAR_POINT *np;
+	int max;
+
+	if (b->n == b->max) {
+		max = b->max ? b->max * 2 : 64;
+		if ((np = realloc(b->p, max * sizeof(*np))) == NULL)
+			return (-1);
+		b->p = np;
+		b->max = max;
+	}
+	b->p[b->n++] = *p;
+	b->sum_when += p->when;
+	b->sum_value += p->value;
+	return (0);
+}
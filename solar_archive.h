@@ -0,0 +1,63 @@
+/* Copyright (c) 2023 Diane Bruce db@db.net
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#ifndef __SOLAR_ARCHIVE_H__
+#define __SOLAR_ARCHIVE_H__
+
+#include <sys/types.h>
+#include <time.h>
+
+/* Time index entry, the first record at or after some byte offset */
+typedef struct {
+	time_t		when;
+	off_t		offset;
+} SOLAR_MARK;
+
+/*
+ * A csv archive as written by snapshot_collector or remote_snapshot,
+ * indexed as it grows, see solar_archive.c
+ */
+typedef struct {
+	const char	*path;
+	dev_t		dev;		/* to notice it being rotated */
+	ino_t		ino;
+	off_t		indexed;	/* whole lines scanned up to here */
+	time_t		first;		/* first and last record, 0 if none */
+	time_t		last;
+	SOLAR_MARK	*mark;
+	int		nmark;
+	int		maxmark;
+} SOLAR_ARCHIVE;
+
+typedef struct {
+	time_t		when;
+	float		value;
+} SOLAR_POINT;
+
+void	solar_archive_init(SOLAR_ARCHIVE *ar, const char *path);
+int	solar_archive_update(SOLAR_ARCHIVE *ar);
+int	solar_archive_series(SOLAR_ARCHIVE *ar, int field, time_t from,
+			     time_t to, SOLAR_POINT *out, int points,
+			     long *rows);
+
+#endif
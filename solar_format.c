@@ -0,0 +1,1340 @@
+/* Copyright (c) 2023 Diane Bruce db@db.net
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Record serializers for SOLAR_SNAPSHOT and SOLAR_INFO.
+ *
+ * Every format is driven from the same field tables below, and every
+ * record is written straight into a caller supplied SOLAR_BUF.
+ * Enough space for a whole record is reserved up front so the
+ * field writers never have to check for overflow, and numbers are
+ * converted by hand rather than going through printf.
+ * The timestamp uses a cached local time zone offset instead of
+ * calling localtime() for every sample.
+ */
+
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "libsolar.h"
+#include "solar_format.h"
+
+#define SF_INT		0
+#define SF_FLOAT	1
+#define SF_STR		2	/* nul terminated char array member */
+#define SF_UINT		3
+
+struct solar_field {
+	const char	*name;
+	int		type;
+	size_t		offset;
+	int		decimals;	/* SF_FLOAT digits after the point */
+};
+
+/*
+ * N.B. The order and precision of snapshot_fields is the csv
+ * layout expected by recv_snapshot, csv2solardb and the database.
+ */
+#define SNAP(f)	offsetof(SOLAR_SNAPSHOT, f)
+
+static const struct solar_field snapshot_fields[] = {
+	{"array_v",	SF_FLOAT,	SNAP(array_v),	1},
+	{"array_a",	SF_FLOAT,	SNAP(array_a),	2},
+	{"array_w",	SF_INT,		SNAP(array_w),	0},
+	{"soc",		SF_INT,		SNAP(soc),	0},
+	{"bat_v",	SF_FLOAT,	SNAP(bat_v),	2},
+	{"bat_a",	SF_FLOAT,	SNAP(bat_a),	2},
+	{"load_v",	SF_FLOAT,	SNAP(load_v),	2},
+	{"load_a",	SF_FLOAT,	SNAP(load_a),	2},
+	{"gen_wh",	SF_UINT,	SNAP(gen_wh),	0},
+	{"con_wh",	SF_UINT,	SNAP(con_wh),	0},
+	{NULL,		0,		0,		0}
+};
+
+#define INFO(f)	offsetof(SOLAR_INFO, f)
+
+static const struct solar_field info_fields[] = {
+	{"model",		SF_STR,		INFO(model),		0},
+	{"hardware_version",	SF_STR,		INFO(hardware_version),	0},
+	{"software_version",	SF_STR,		INFO(software_version),	0},
+	{"serial_number",	SF_STR,		INFO(serial_number),	0},
+	{"array_v",		SF_FLOAT,	INFO(array_v),		1},
+	{"array_a",		SF_FLOAT,	INFO(array_a),		2},
+	{"array_w",		SF_INT,		INFO(array_w),		0},
+	{"array_working_state",	SF_STR,	INFO(array_working_state),	0},
+	{"power_gen_today",	SF_INT,		INFO(power_gen_today),	0},
+	{"power_con_today",	SF_INT,		INFO(power_con_today),	0},
+	{"bat_v",		SF_FLOAT,	INFO(bat_v),		1},
+	{"bat_a",		SF_FLOAT,	INFO(bat_a),		2},
+	{"charging_state",	SF_STR,		INFO(charging_state),	0},
+	{"bat_type",		SF_STR,		INFO(bat_type),		0},
+	{"bat_temp",		SF_INT,		INFO(bat_temp),		0},
+	{"soc",			SF_INT,		INFO(soc),		0},
+	{"bat_capacity",	SF_INT,		INFO(bat_capacity),	0},
+	{"load_v",		SF_FLOAT,	INFO(load_v),		1},
+	{"load_a",		SF_FLOAT,	INFO(load_a),		2},
+	{"device_temp",		SF_INT,		INFO(device_temp),	0},
+	{"system_voltage_setting", SF_INT, INFO(system_voltage_setting), 0},
+	{"system_voltage_recognized", SF_INT,
+	 INFO(system_voltage_recognized), 0},
+	{"max_v_system",	SF_INT,		INFO(max_v_system),	0},
+	{"rated_charge_a",	SF_INT,		INFO(rated_charge_a),	0},
+	{"bat_min_volts_today",	SF_FLOAT, INFO(bat_min_volts_today),	1},
+	{"bat_max_volts_today",	SF_FLOAT, INFO(bat_max_volts_today),	1},
+	{"bat_max_charge_a_today", SF_INT, INFO(bat_max_charge_a_today), 0},
+	{"bat_max_discharge_a_today", SF_INT,
+	 INFO(bat_max_discharge_a_today), 0},
+	{"bat_max_charging_power_today", SF_INT,
+	 INFO(bat_max_charging_power_today), 0},
+	{"bat_max_discharge_power_today", SF_INT,
+	 INFO(bat_max_discharge_power_today), 0},
+	{"bat_charging_ah_today", SF_INT, INFO(bat_charging_ah_today),	0},
+	{"bat_discharging_ah_today", SF_INT,
+	 INFO(bat_discharging_ah_today), 0},
+	{"total_operating_days", SF_INT, INFO(total_operating_days),	0},
+	{"bat_total_over_discharges", SF_INT,
+	 INFO(bat_total_over_discharges), 0},
+	{"bat_total_full_charges", SF_INT, INFO(bat_total_full_charges), 0},
+	{"gen_wh",		SF_UINT,	INFO(gen_wh),		0},
+	{"con_wh",		SF_UINT,	INFO(con_wh),		0},
+	{"fault_bits",		SF_INT,		INFO(fault_bits),	0},
+	{NULL,			0,		0,			0}
+};
+
+/*
+ * Prometheus metrics. Cumulative fields are counters and get names
+ * following the _total convention, state strings become a state
+ * label and the rest of the strings are labels of solar_info.
+ */
+static const struct {
+	const char	*field;
+	const char	*metric;
+} metric_counters[] = {
+	{"total_operating_days",	"solar_operating_days_total"},
+	{"bat_total_over_discharges",	"solar_bat_over_discharges_total"},
+	{"bat_total_full_charges",	"solar_bat_full_charges_total"},
+	{"gen_wh",			"solar_gen_wh_total"},
+	{"con_wh",			"solar_con_wh_total"},
+	{NULL,				NULL}
+};
+
+static const char *metric_states[] = {
+	"array_working_state", "charging_state", NULL
+};
+
+/*
+ * Worst case bytes one numeric field can produce in any format,
+ * key, punctuation and number included. Field names are all
+ * well under 32 characters.
+ */
+#define FIELD_MAX	64
+#define RECORD_OVERHEAD	96	/* timestamp, braces, measurement name */
+#define MAX_DECIMALS	6
+
+/* largest value solar_fmt_float() scales in a long, 32 bit ones too */
+#if LONG_MAX > 1000000000000000L
+#define SCALED_MAX	1e15
+#else
+#define SCALED_MAX	((double)LONG_MAX)
+#endif
+
+static const char *format_names[] = {"csv", "json", "binary", "line", NULL};
+
+static unsigned long buf_grows;	/* see solar_buf_grows() */
+
+static const long pow10_tab[MAX_DECIMALS + 1] =
+	{1, 10, 100, 1000, 10000, 100000, 1000000};
+
+static size_t	record_reserve(const struct solar_field *fields,
+			       const void *rec);
+static char	*format_record(char *p, int fmt, int magic, time_t when,
+			       const struct solar_field *fields,
+			       const void *rec);
+static char	*fmt_csv(char *p, time_t when,
+			 const struct solar_field *fields, const void *rec);
+static char	*fmt_json(char *p, time_t when,
+			  const struct solar_field *fields, const void *rec);
+static char	*fmt_line(char *p, time_t when,
+			  const struct solar_field *fields, const void *rec);
+static char	*fmt_binary(char *p, int magic, time_t when,
+			    const struct solar_field *fields,
+			    const void *rec);
+static char	*fmt_field_value(char *p, const struct solar_field *f,
+				 const void *rec);
+static char	*fmt_json_string(char *p, const char *s);
+static char	*fmt_tag_string(char *p, const char *s);
+static char	*fmt_label_string(char *p, const char *s);
+static const char *metric_counter(const char *field);
+static int	metric_state(const char *field);
+static char	*put_le(char *p, uint64_t v, int bytes);
+static long	scaled_value(const struct solar_field *f, const void *rec);
+static char	*json_member(SOLAR_JSON *js, const char *key, size_t need);
+static void	json_open(SOLAR_JSON *js, const char *key, char open,
+			  char close);
+static long	tz_offset(time_t when);
+static void	civil_from_days(long z, int *year, int *month, int *day);
+static long	days_from_civil(int year, int month, int day);
+static int	parse_digits(const char *s, int n);
+
+/*
+ * SOLAR_BUF handling
+ */
+
+void
+solar_buf_init(SOLAR_BUF *sb)
+{
+	sb->buf = NULL;
+	sb->len = 0;
+	sb->size = 0;
+}
+
+/*
+ * solar_buf_reserve
+ *
+ * inputs	- SOLAR_BUF
+ *		- number of bytes that are about to be appended
+ * output	- 0 if ok, -1 if out of memory
+ * side effects	- buffer may be grown, always kept nul terminated
+ */
+int
+solar_buf_reserve(SOLAR_BUF *sb, size_t need)
+{
+	size_t size;
+	char *p;
+
+	if (sb->size - sb->len > need)
+		return (0);
+	size = sb->size ? sb->size : 4096;
+	while (size - sb->len <= need)
+		size *= 2;
+	p = realloc(sb->buf, size);
+	if (p == NULL)
+		return (-1);
+	buf_grows++;
+	sb->buf = p;
+	sb->size = size;
+	sb->buf[sb->len] = '\0';
+	return (0);
+}
+
+int
+solar_buf_append(SOLAR_BUF *sb, const char *s, size_t len)
+{
+	if (solar_buf_reserve(sb, len) < 0)
+		return (-1);
+	memcpy(sb->buf + sb->len, s, len);
+	sb->len += len;
+	sb->buf[sb->len] = '\0';
+	return (0);
+}
+
+/*
+ * solar_buf_printf
+ *
+ * inputs	- SOLAR_BUF
+ *		- printf format and arguments
+ * output	- bytes appended or -1 on error
+ */
+int
+solar_buf_printf(SOLAR_BUF *sb, const char *fmt, ...)
+{
+	va_list ap;
+	size_t room;
+	int n;
+
+	room = sb->size - sb->len;
+	va_start(ap, fmt);
+	n = vsnprintf(sb->buf == NULL ? NULL : sb->buf + sb->len, room,
+		      fmt, ap);
+	va_end(ap);
+	if (n < 0)
+		return (-1);
+	if ((size_t)n >= room) {
+		if (solar_buf_reserve(sb, n) < 0)
+			return (-1);
+		va_start(ap, fmt);
+		vsnprintf(sb->buf + sb->len, sb->size - sb->len, fmt, ap);
+		va_end(ap);
+	}
+	sb->len += n;
+	return (n);
+}
+
+/*
+ * Typed appends. Numbers are converted by hand, there is no format
+ * string to parse and nothing is allocated once the buffer is big
+ * enough. All return 0 or -1 if out of memory.
+ */
+int
+solar_buf_str(SOLAR_BUF *sb, const char *s)
+{
+	return (solar_buf_append(sb, s, strlen(s)));
+}
+
+int
+solar_buf_int(SOLAR_BUF *sb, long v)
+{
+	if (solar_buf_reserve(sb, FIELD_MAX) < 0)
+		return (-1);
+	sb->len = solar_fmt_int(sb->buf + sb->len, v) - sb->buf;
+	sb->buf[sb->len] = '\0';
+	return (0);
+}
+
+/*
+ * solar_buf_fixed
+ * As solar_fmt_float() but with trailing zeros, and a trailing
+ * point, dropped, so 13.500 is 13.5 and 12.000 is 12.
+ */
+int
+solar_buf_fixed(SOLAR_BUF *sb, double v, int decimals)
+{
+	char *start;
+	char *p;
+
+	if (solar_buf_reserve(sb, FIELD_MAX) < 0)
+		return (-1);
+	start = sb->buf + sb->len;
+	p = solar_fmt_float(start, v, decimals);
+	if (decimals > 0 && memchr(start, '.', p - start) != NULL) {
+		while (p[-1] == '0')
+			p--;
+		if (p[-1] == '.')
+			p--;
+	}
+	sb->len = p - sb->buf;
+	sb->buf[sb->len] = '\0';
+	return (0);
+}
+
+/*
+ * solar_buf_grows
+ * output	- times any SOLAR_BUF has been grown, a statistic only
+ *		  so not locked. Other allocations are not counted.
+ */
+unsigned long
+solar_buf_grows(void)
+{
+	return (buf_grows);
+}
+
+void
+solar_buf_reset(SOLAR_BUF *sb)
+{
+	sb->len = 0;
+	if (sb->buf != NULL)
+		*sb->buf = '\0';
+}
+
+void
+solar_buf_free(SOLAR_BUF *sb)
+{
+	free(sb->buf);
+	solar_buf_init(sb);
+}
+
+/*
+ * solar_format_lookup
+ *
+ * inputs	- format name as found in a config file e.g. "json"
+ * output	- SOLAR_FMT_ value or -1 if not known
+ */
+int
+solar_format_lookup(const char *name)
+{
+	int i;
+
+	for (i = 0; format_names[i] != NULL; i++)
+		if (strcmp(name, format_names[i]) == 0)
+			return (i);
+	return (-1);
+}
+
+/*
+ * solar_snapshot_field
+ *
+ * Numeric access to SOLAR_SNAPSHOT fields by name, for config
+ * driven filters and triggers. Indexes are in csv field order.
+ *
+ * inputs	- field name e.g. "bat_v"
+ * output	- field index or -1 if not known
+ */
+int
+solar_snapshot_field(const char *name)
+{
+	int i;
+
+	for (i = 0; snapshot_fields[i].name != NULL; i++)
+		if (strcmp(name, snapshot_fields[i].name) == 0)
+			return (i);
+	return (-1);
+}
+
+const char *
+solar_snapshot_name(int field)
+{
+	if (field < 0 || field >= SOLAR_SNAPSHOT_FIELDS)
+		return (NULL);
+	return (snapshot_fields[field].name);
+}
+
+/* digits after the point the field is recorded with */
+int
+solar_snapshot_decimals(int field)
+{
+	if (field < 0 || field >= SOLAR_SNAPSHOT_FIELDS)
+		return (0);
+	return (snapshot_fields[field].decimals);
+}
+
+double
+solar_snapshot_value(const SOLAR_SNAPSHOT *snap, int field)
+{
+	const struct solar_field *f;
+	const char *base;
+
+	f = &snapshot_fields[field];
+	base = (const char *)snap + f->offset;
+	if (f->type == SF_INT)
+		return (*(const int *)base);
+	if (f->type == SF_UINT)
+		return (*(const unsigned int *)base);
+	return (*(const float *)base);
+}
+
+/*
+ * solar_format_snapshot
+ *
+ * inputs	- SOLAR_BUF to append to
+ *		- SOLAR_FMT_ format
+ *		- time the snapshot was taken
+ *		- SOLAR_SNAPSHOT
+ * output	- 0 if ok, -1 on error
+ * side effects	- one record is appended to sb
+ */
+int
+solar_format_snapshot(SOLAR_BUF *sb, int fmt, time_t when,
+		      const SOLAR_SNAPSHOT *snap)
+{
+	char *p;
+
+	if (solar_buf_reserve(sb, record_reserve(snapshot_fields, snap)) < 0)
+		return (-1);
+	p = format_record(sb->buf + sb->len, fmt, SOLAR_BIN_MAGIC, when,
+			  snapshot_fields, snap);
+	if (p == NULL)
+		return (-1);
+	sb->len = p - sb->buf;
+	sb->buf[sb->len] = '\0';
+	return (0);
+}
+
+/*
+ * solar_format_samples
+ *
+ * Batch version of solar_format_snapshot. The space for the whole
+ * batch is reserved once, then records are written back to back.
+ *
+ * inputs	- SOLAR_BUF to append to
+ *		- SOLAR_FMT_ format
+ *		- array of samples and count
+ * output	- 0 if ok, -1 on error
+ * side effects	- count records are appended to sb
+ */
+int
+solar_format_samples(SOLAR_BUF *sb, int fmt,
+		     const SOLAR_SAMPLE *samples, int count)
+{
+	int i;
+	char *p;
+
+	if (count <= 0)
+		return (0);
+	if (solar_buf_reserve(sb, count *
+			      record_reserve(snapshot_fields,
+					     &samples[0].snap)) < 0)
+		return (-1);
+	p = sb->buf + sb->len;
+	for (i = 0; i < count; i++) {
+		p = format_record(p, fmt, SOLAR_BIN_MAGIC, samples[i].when,
+				  snapshot_fields, &samples[i].snap);
+		if (p == NULL)
+			return (-1);
+	}
+	sb->len = p - sb->buf;
+	sb->buf[sb->len] = '\0';
+	return (0);
+}
+
+/*
+ * solar_format_info
+ *
+ * As solar_format_snapshot but for a full SOLAR_INFO. The string
+ * members become tags in line protocol.
+ */
+int
+solar_format_info(SOLAR_BUF *sb, int fmt, time_t when, const SOLAR_INFO *info)
+{
+	char *p;
+
+	if (solar_buf_reserve(sb, record_reserve(info_fields, info)) < 0)
+		return (-1);
+	p = format_record(sb->buf + sb->len, fmt, SOLAR_BIN_INFO_MAGIC, when,
+			  info_fields, info);
+	if (p == NULL)
+		return (-1);
+	sb->len = p - sb->buf;
+	sb->buf[sb->len] = '\0';
+	return (0);
+}
+
+/*
+ * solar_format_metrics
+ *
+ * Every SOLAR_INFO field in Prometheus text exposition format,
+ * fault_bits both as is and one solar_fault series per named bit.
+ *
+ * inputs	- SOLAR_BUF to append to
+ *		- SOLAR_INFO
+ * output	- 0 if ok, -1 on error
+ */
+int
+solar_format_metrics(SOLAR_BUF *sb, const SOLAR_INFO *info)
+{
+	const struct solar_field *f;
+	const char *metric;
+	const char *s;
+	char *p;
+	int first;
+	int bit;
+
+	if (solar_buf_reserve(sb, 2 * record_reserve(info_fields, info) +
+			      SOLAR_FAULT_BITS * FIELD_MAX * 2) < 0)
+		return (-1);
+	p = sb->buf + sb->len;
+
+	p = stpcpy(p, "# TYPE solar_info gauge\nsolar_info{");
+	first = 1;
+	for (f = info_fields; f->name != NULL; f++) {
+		if (f->type != SF_STR || metric_state(f->name))
+			continue;
+		if (!first)
+			*p++ = ',';
+		first = 0;
+		p = stpcpy(p, f->name);
+		p = fmt_label_string(p, (const char *)info + f->offset);
+	}
+	p = stpcpy(p, "} 1\n");
+
+	for (f = info_fields; f->name != NULL; f++) {
+		s = (const char *)info + f->offset;
+		if (f->type == SF_STR) {
+			if (!metric_state(f->name))
+				continue;
+			p = stpcpy(p, "# TYPE solar_");
+			p = stpcpy(p, f->name);
+			p = stpcpy(p, " gauge\nsolar_");
+			p = stpcpy(p, f->name);
+			p = stpcpy(p, "{state");
+			p = fmt_label_string(p, s);
+			p = stpcpy(p, "} 1\n");
+			continue;
+		}
+		p = stpcpy(p, "# TYPE ");
+		if ((metric = metric_counter(f->name)) != NULL) {
+			p = stpcpy(p, metric);
+			p = stpcpy(p, " counter\n");
+			p = stpcpy(p, metric);
+		} else {
+			p = stpcpy(p, "solar_");
+			p = stpcpy(p, f->name);
+			p = stpcpy(p, " gauge\nsolar_");
+			p = stpcpy(p, f->name);
+		}
+		*p++ = ' ';
+		p = fmt_field_value(p, f, info);
+		*p++ = '\n';
+	}
+
+	p = stpcpy(p, "# TYPE solar_fault gauge\n");
+	for (bit = 0; bit < SOLAR_FAULT_BITS; bit++) {
+		p = stpcpy(p, "solar_fault{fault=\"");
+		p = stpcpy(p, solar_fault_name(bit));
+		p = stpcpy(p, "\"} ");
+		*p++ = (info->fault_bits & (1 << bit)) ? '1' : '0';
+		*p++ = '\n';
+	}
+	sb->len = p - sb->buf;
+	sb->buf[sb->len] = '\0';
+	return (0);
+}
+
+static const char *
+metric_counter(const char *field)
+{
+	int i;
+
+	for (i = 0; metric_counters[i].field != NULL; i++)
+		if (strcmp(metric_counters[i].field, field) == 0)
+			return (metric_counters[i].metric);
+	return (NULL);
+}
+
+static int
+metric_state(const char *field)
+{
+	int i;
+
+	for (i = 0; metric_states[i] != NULL; i++)
+		if (strcmp(metric_states[i], field) == 0)
+			return (1);
+	return (0);
+}
+
+/*
+ * SOLAR_JSON streaming writer
+ */
+
+void
+solar_json_init(SOLAR_JSON *js, SOLAR_BUF *sb)
+{
+	js->sb = sb;
+	js->depth = 0;
+	js->error = 0;
+	js->more[0] = 0;
+}
+
+/*
+ * json_member
+ *
+ * inputs	- SOLAR_JSON
+ *		- key or NULL for an array element or the top level value
+ *		- worst case bytes of the value about to be written
+ * output	- where to write the value or NULL on error
+ * side effects	- comma and key are written, the caller sets sb->len
+ */
+static char *
+json_member(SOLAR_JSON *js, const char *key, size_t need)
+{
+	char *p;
+
+	if (js->error)
+		return (NULL);
+	if (key != NULL)
+		need += strlen(key) + 3;
+	if (solar_buf_reserve(js->sb, need + 1) < 0) {
+		js->error = 1;
+		return (NULL);
+	}
+	p = js->sb->buf + js->sb->len;
+	if (js->more[js->depth])
+		*p++ = ',';
+	js->more[js->depth] = 1;
+	if (key != NULL) {
+		*p++ = '"';
+		p = stpcpy(p, key);
+		*p++ = '"';
+		*p++ = ':';
+	}
+	return (p);
+}
+
+static void
+json_open(SOLAR_JSON *js, const char *key, char open, char close)
+{
+	char *p;
+
+	if (js->depth + 1 >= SOLAR_JSON_DEPTH) {
+		js->error = 1;
+		return;
+	}
+	if ((p = json_member(js, key, 1)) == NULL)
+		return;
+	*p++ = open;
+	js->sb->len = p - js->sb->buf;
+	js->depth++;
+	js->close[js->depth] = close;
+	js->more[js->depth] = 0;
+}
+
+void
+solar_json_object(SOLAR_JSON *js, const char *key)
+{
+	json_open(js, key, '{', '}');
+}
+
+void
+solar_json_array(SOLAR_JSON *js, const char *key)
+{
+	json_open(js, key, '[', ']');
+}
+
+/* close the innermost object or array */
+void
+solar_json_end(SOLAR_JSON *js)
+{
+	if (js->error)
+		return;
+	if (js->depth == 0 || solar_buf_reserve(js->sb, 2) < 0) {
+		js->error = 1;
+		return;
+	}
+	js->sb->buf[js->sb->len++] = js->close[js->depth--];
+}
+
+void
+solar_json_int(SOLAR_JSON *js, const char *key, long v)
+{
+	char *p;
+
+	if ((p = json_member(js, key, FIELD_MAX)) == NULL)
+		return;
+	js->sb->len = solar_fmt_int(p, v) - js->sb->buf;
+}
+
+void
+solar_json_float(SOLAR_JSON *js, const char *key, double v, int decimals)
+{
+	char *p;
+
+	if ((p = json_member(js, key, FIELD_MAX)) == NULL)
+		return;
+	js->sb->len = solar_fmt_float(p, v, decimals) - js->sb->buf;
+}
+
+void
+solar_json_string(SOLAR_JSON *js, const char *key, const char *s)
+{
+	char *p;
+
+	if ((p = json_member(js, key, s == NULL ? 4 : 6 * strlen(s) + 2))
+	    == NULL)
+		return;
+	js->sb->len = fmt_json_string(p, s) - js->sb->buf;
+}
+
+/*
+ * solar_json_floats
+ * A whole column as one array, the space for it is reserved once.
+ */
+void
+solar_json_floats(SOLAR_JSON *js, const char *key, const float *v,
+		  int count, int decimals)
+{
+	char *p;
+	int i;
+
+	if (count < 0)
+		count = 0;
+	if ((p = json_member(js, key, (size_t)count * FIELD_MAX + 2)) == NULL)
+		return;
+	*p++ = '[';
+	for (i = 0; i < count; i++) {
+		if (i > 0)
+			*p++ = ',';
+		p = solar_fmt_float(p, v[i], decimals);
+	}
+	*p++ = ']';
+	js->sb->len = p - js->sb->buf;
+}
+
+/*
+ * solar_json_info
+ * Every SOLAR_INFO field as members of the current object, named
+ * and rounded as in the json records from solar_format_info().
+ */
+void
+solar_json_info(SOLAR_JSON *js, const SOLAR_INFO *info)
+{
+	const struct solar_field *f;
+	char *p;
+
+	for (f = info_fields; f->name != NULL; f++) {
+		if (f->type == SF_STR) {
+			solar_json_string(js, f->name,
+					  (const char *)info + f->offset);
+			continue;
+		}
+		if ((p = json_member(js, f->name, FIELD_MAX)) == NULL)
+			return;
+		js->sb->len = fmt_field_value(p, f, info) - js->sb->buf;
+	}
+}
+
+/*
+ * solar_json_finish
+ *
+ * inputs	- SOLAR_JSON
+ * output	- 0 if a complete value was written, -1 if not
+ * side effects	- buffer is nul terminated
+ */
+int
+solar_json_finish(SOLAR_JSON *js)
+{
+	if (js->error || js->depth != 0)
+		return (-1);
+	if (js->sb->buf != NULL)
+		js->sb->buf[js->sb->len] = '\0';
+	return (0);
+}
+
+/*
+ * record_reserve
+ *
+ * Upper bound on the bytes one record can take in any format.
+ * Strings are accounted for at JSON escaped worst case.
+ */
+static size_t
+record_reserve(const struct solar_field *fields, const void *rec)
+{
+	const struct solar_field *f;
+	const char *s;
+	size_t need;
+
+	need = RECORD_OVERHEAD;
+	for (f = fields; f->name != NULL; f++) {
+		need += FIELD_MAX;
+		if (f->type == SF_STR) {
+			s = (const char *)rec + f->offset;
+			if (s != NULL)
+				need += 6 * strlen(s);
+		}
+	}
+	return (need);
+}
+
+static char *
+format_record(char *p, int fmt, int magic, time_t when,
+	      const struct solar_field *fields, const void *rec)
+{
+	switch (fmt) {
+	case SOLAR_FMT_CSV:
+		return (fmt_csv(p, when, fields, rec));
+	case SOLAR_FMT_JSON:
+		return (fmt_json(p, when, fields, rec));
+	case SOLAR_FMT_BINARY:
+		return (fmt_binary(p, magic, when, fields, rec));
+	case SOLAR_FMT_LINE:
+		return (fmt_line(p, when, fields, rec));
+	default:
+		return (NULL);
+	}
+}
+
+/*
+ * csv is "YYYY-MM-DD HH:MM:SS+00,field,field...\n"
+ * N.B. the +00 is historical, the time is local time.
+ */
+static char *
+fmt_csv(char *p, time_t when, const struct solar_field *fields,
+	const void *rec)
+{
+	const struct solar_field *f;
+
+	p = solar_fmt_time(p, when);
+	memcpy(p, "+00", 3);
+	p += 3;
+	for (f = fields; f->name != NULL; f++) {
+		*p++ = ',';
+		p = fmt_field_value(p, f, rec);
+	}
+	*p++ = '\n';
+	return (p);
+}
+
+static char *
+fmt_json(char *p, time_t when, const struct solar_field *fields,
+	 const void *rec)
+{
+	const struct solar_field *f;
+	const char *s;
+
+	memcpy(p, "{\"time\":\"", 9);
+	p = solar_fmt_time(p + 9, when);
+	memcpy(p, "\",\"ts\":", 7);
+	p = solar_fmt_int(p + 7, (long)when);
+	for (f = fields; f->name != NULL; f++) {
+		*p++ = ',';
+		*p++ = '"';
+		p = stpcpy(p, f->name);
+		*p++ = '"';
+		*p++ = ':';
+		if (f->type == SF_STR) {
+			s = (const char *)rec + f->offset;
+			p = fmt_json_string(p, s);
+		} else
+			p = fmt_field_value(p, f, rec);
+	}
+	*p++ = '}';
+	*p++ = '\n';
+	return (p);
+}
+
+/*
+ * InfluxDB line protocol
+ * solar[,tag=value...] field=value[,field=value...] timestamp_ns
+ * Integers carry the 'i' suffix so they are stored as integers.
+ */
+static char *
+fmt_line(char *p, time_t when, const struct solar_field *fields,
+	 const void *rec)
+{
+	const struct solar_field *f;
+	const char *s;
+	int first;
+
+	p = stpcpy(p, "solar");
+	for (f = fields; f->name != NULL; f++) {
+		if (f->type != SF_STR)
+			continue;
+		s = (const char *)rec + f->offset;
+		if (s == NULL || *s == '\0')
+			continue;
+		*p++ = ',';
+		p = stpcpy(p, f->name);
+		*p++ = '=';
+		p = fmt_tag_string(p, s);
+	}
+	first = 1;
+	for (f = fields; f->name != NULL; f++) {
+		if (f->type == SF_STR)
+			continue;
+		*p++ = first ? ' ' : ',';
+		first = 0;
+		p = stpcpy(p, f->name);
+		*p++ = '=';
+		p = fmt_field_value(p, f, rec);
+		if (f->type == SF_INT || f->type == SF_UINT)
+			*p++ = 'i';
+	}
+	*p++ = ' ';
+	p = solar_fmt_int(p, (long)when);
+	memcpy(p, "000000000\n", 10);
+	return (p + 10);
+}
+
+/*
+ * Binary record, all integers little endian
+ *
+ * byte 0	magic, SOLAR_BIN_MAGIC or SOLAR_BIN_INFO_MAGIC
+ * byte 1	SOLAR_BIN_VERSION
+ * bytes 2-3	total record length in bytes
+ * bytes 4-11	time_t seconds
+ * then for each field in table order
+ *		SF_INT	 int32
+ *		SF_UINT	 uint32
+ *		SF_FLOAT int32 scaled by 10^decimals, i.e. the raw register
+ *		SF_STR	 one length byte followed by up to 255 bytes
+ *
+ * A snapshot record therefore has a fixed size of 52 bytes.
+ * Version 1 records (44 bytes) lacked gen_wh and con_wh.
+ */
+static char *
+fmt_binary(char *p, int magic, time_t when, const struct solar_field *fields,
+	   const void *rec)
+{
+	const struct solar_field *f;
+	const char *s;
+	char *start;
+	size_t len;
+
+	start = p;
+	*p++ = magic;
+	*p++ = SOLAR_BIN_VERSION;
+	p += 2;			/* length, filled in below */
+	p = put_le(p, (uint64_t)(int64_t)when, 8);
+	for (f = fields; f->name != NULL; f++) {
+		if (f->type == SF_STR) {
+			s = (const char *)rec + f->offset;
+			len = (s == NULL) ? 0 : strlen(s);
+			if (len > 255)
+				len = 255;
+			*p++ = len;
+			if (len > 0)
+				memcpy(p, s, len);
+			p += len;
+		} else
+			p = put_le(p, (uint32_t)scaled_value(f, rec), 4);
+	}
+	put_le(start + 2, p - start, 2);
+	return (p);
+}
+
+static char *
+put_le(char *p, uint64_t v, int bytes)
+{
+	int i;
+
+	for (i = 0; i < bytes; i++) {
+		*p++ = v & 0xFF;
+		v >>= 8;
+	}
+	return (p);
+}
+
+static long
+scaled_value(const struct solar_field *f, const void *rec)
+{
+	const char *base;
+	double v;
+
+	base = (const char *)rec + f->offset;
+	if (f->type == SF_INT)
+		return (*(const int *)base);
+	if (f->type == SF_UINT)
+		return (*(const unsigned int *)base);
+	v = *(const float *)base * pow10_tab[f->decimals];
+	return ((long)(v < 0 ? v - 0.5 : v + 0.5));
+}
+
+static char *
+fmt_field_value(char *p, const struct solar_field *f, const void *rec)
+{
+	const char *base;
+	const char *s;
+
+	base = (const char *)rec + f->offset;
+	switch (f->type) {
+	case SF_INT:
+		return (solar_fmt_int(p, *(const int *)base));
+	case SF_UINT:
+		return (solar_fmt_int(p, *(const unsigned int *)base));
+	case SF_FLOAT:
+		return (solar_fmt_float(p, *(const float *)base,
+					f->decimals));
+	case SF_STR:
+	default:
+		s = base;
+		if (s == NULL)
+			return (p);
+		/* controller strings never contain a comma or quote */
+		return (stpcpy(p, s));
+	}
+}
+
+static char *
+fmt_json_string(char *p, const char *s)
+{
+	static const char hex[] = "0123456789abcdef";
+	unsigned char c;
+
+	if (s == NULL)
+		return (stpcpy(p, "null"));
+	*p++ = '"';
+	while ((c = *s++) != '\0') {
+		if (c == '"' || c == '\\') {
+			*p++ = '\\';
+			*p++ = c;
+		} else if (c < 0x20) {
+			memcpy(p, "\\u00", 4);
+			p[4] = hex[c >> 4];
+			p[5] = hex[c & 0xF];
+			p += 6;
+		} else
+			*p++ = c;
+	}
+	*p++ = '"';
+	return (p);
+}
+
+/* line protocol tag values escape space, comma and equals */
+static char *
+fmt_tag_string(char *p, const char *s)
+{
+	char c;
+
+	while ((c = *s++) != '\0') {
+		if (c == ' ' || c == ',' || c == '=')
+			*p++ = '\\';
+		*p++ = c;
+	}
+	return (p);
+}
+
+/* ="value" of a Prometheus label, escaping backslash, quote, newline */
+static char *
+fmt_label_string(char *p, const char *s)
+{
+	char c;
+
+	*p++ = '=';
+	*p++ = '"';
+	while ((c = *s++) != '\0') {
+		if (c == '\\' || c == '"') {
+			*p++ = '\\';
+			*p++ = c;
+		} else if (c == '\n') {
+			*p++ = '\\';
+			*p++ = 'n';
+		} else
+			*p++ = c;
+	}
+	*p++ = '"';
+	return (p);
+}
+
+/*
+ * solar_fmt_int
+ *
+ * inputs	- where to write, value
+ * output	- pointer past the last digit written
+ * side effects	- none, no nul is written
+ */
+char *
+solar_fmt_int(char *p, long v)
+{
+	char tmp[24];
+	char *t;
+	unsigned long u;
+
+	if (v < 0) {
+		*p++ = '-';
+		u = -(unsigned long)v;
+	} else
+		u = v;
+	t = tmp + sizeof(tmp);
+	do {
+		*--t = '0' + u % 10;
+		u /= 10;
+	} while (u != 0);
+	memcpy(p, t, tmp + sizeof(tmp) - t);
+	return (p + (tmp + sizeof(tmp) - t));
+}
+
+/*
+ * solar_fmt_float
+ *
+ * Fixed point replacement for printf("%.*f"). All values from the
+ * controller are integers scaled by 10, 100 or 1000 so rounding the
+ * scaled value to the nearest integer gives the same digits printf
+ * would. Silly values (NaN, huge) fall back to snprintf.
+ *
+ * inputs	- where to write, value, digits after the decimal point
+ * output	- pointer past the last digit written
+ */
+char *
+solar_fmt_float(char *p, double v, int decimals)
+{
+	double scaled;
+	long whole;
+	long frac;
+	int i;
+
+	if (decimals < 0)
+		decimals = 0;
+	if (decimals > MAX_DECIMALS)
+		decimals = MAX_DECIMALS;
+	scaled = v * pow10_tab[decimals];
+	if (!(scaled < SCALED_MAX && scaled > -SCALED_MAX))
+		return (p + snprintf(p, FIELD_MAX, "%.*f", decimals, v));
+	whole = (long)(scaled < 0 ? scaled - 0.5 : scaled + 0.5);
+	if (whole < 0) {
+		*p++ = '-';
+		whole = -whole;
+	}
+	frac = whole % pow10_tab[decimals];
+	p = solar_fmt_int(p, whole / pow10_tab[decimals]);
+	if (decimals > 0) {
+		*p = '.';
+		for (i = decimals; i > 0; i--) {
+			p[i] = '0' + frac % 10;
+			frac /= 10;
+		}
+		p += decimals + 1;
+	}
+	return (p);
+}
+
+/*
+ * solar_fmt_time
+ *
+ * Writes "YYYY-MM-DD HH:MM:SS" in local time without localtime().
+ *
+ * inputs	- where to write, time
+ * output	- pointer past the last character written (19 written)
+ */
+char *
+solar_fmt_time(char *p, time_t when)
+{
+	long t;
+	long days;
+	long secs;
+	int year, month, day;
+	int hour, min, sec;
+
+	t = (long)when + tz_offset(when);
+	days = t / 86400;
+	secs = t % 86400;
+	if (secs < 0) {
+		secs += 86400;
+		days--;
+	}
+	civil_from_days(days, &year, &month, &day);
+	hour = secs / 3600;
+	min = (secs / 60) % 60;
+	sec = secs % 60;
+
+	p[0] = '0' + (year / 1000) % 10;
+	p[1] = '0' + (year / 100) % 10;
+	p[2] = '0' + (year / 10) % 10;
+	p[3] = '0' + year % 10;
+	p[4] = '-';
+	p[5] = '0' + month / 10;
+	p[6] = '0' + month % 10;
+	p[7] = '-';
+	p[8] = '0' + day / 10;
+	p[9] = '0' + day % 10;
+	p[10] = ' ';
+	p[11] = '0' + hour / 10;
+	p[12] = '0' + hour % 10;
+	p[13] = ':';
+	p[14] = '0' + min / 10;
+	p[15] = '0' + min % 10;
+	p[16] = ':';
+	p[17] = '0' + sec / 10;
+	p[18] = '0' + sec % 10;
+	return (p + 19);
+}
+
+/*
+ * solar_parse_time
+ *
+ * The inverse of solar_fmt_time(), "YYYY-mm-dd HH:MM:SS" local time.
+ *
+ * inputs	- string
+ * output	- the time or -1 if it does not start with one
+ */
+time_t
+solar_parse_time(const char *s)
+{
+	int year, month, day;
+	int hour, min, sec;
+	long t;
+
+	if (strnlen(s, 19) < 19)
+		return (-1);
+	if (s[4] != '-' || s[7] != '-' || s[10] != ' ' || s[13] != ':' ||
+	    s[16] != ':')
+		return (-1);
+	year = parse_digits(s, 4);
+	month = parse_digits(s + 5, 2);
+	day = parse_digits(s + 8, 2);
+	hour = parse_digits(s + 11, 2);
+	min = parse_digits(s + 14, 2);
+	sec = parse_digits(s + 17, 2);
+	if (year < 0 || month < 1 || month > 12 || day < 1 || day > 31 ||
+	    hour < 0 || hour > 23 || min < 0 || min > 59 || sec < 0 ||
+	    sec > 60)
+		return (-1);
+	t = days_from_civil(year, month, day) * 86400L + hour * 3600L +
+	    min * 60L + sec;
+	/* the offset in force at t as if it were UTC, right but for the
+	 * hour when clocks change */
+	return ((time_t)(t - tz_offset(t - tz_offset(t))));
+}
+
+/* n decimal digits, -1 if any is not one */
+static int
+parse_digits(const char *s, int n)
+{
+	int v;
+
+	for (v = 0; n > 0; n--, s++) {
+		if (*s < '0' || *s > '9')
+			return (-1);
+		v = v * 10 + *s - '0';
+	}
+	return (v);
+}
+
+/*
+ * tz_offset
+ *
+ * Offset of local time from UTC in seconds. Zone rules only ever
+ * change on an hour boundary so the result is cached for the rest
+ * of the current hour. The cache is per thread.
+ */
+static long
+tz_offset(time_t when)
+{
+	static __thread time_t start = 1;
+	static __thread time_t end = 0;
+	static __thread long offset = 0;
+	struct tm tm;
+
+	if (when < start || when >= end) {
+		localtime_r(&when, &tm);
+		offset = tm.tm_gmtoff;
+		start = when - (tm.tm_min * 60 + tm.tm_sec);
+		end = start + 3600;
+	}
+	return (offset);
+}
+
+/*
+ * Days since 1970-01-01 to a proleptic Gregorian date.
+ * From Howard Hinnant's "chrono-Compatible Low-Level Date Algorithms"
+ */
+static void
+civil_from_days(long z, int *year, int *month, int *day)
+{
+	long era;
+	long doe;
+	long yoe;
+	long doy;
+	long mp;
+
+	z += 719468;
+	era = (z >= 0 ? z : z - 146096) / 146097;
+	doe = z - era * 146097;
+	yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	mp = (5 * doy + 2) / 153;
+	*day = doy - (153 * mp + 2) / 5 + 1;
+	*month = mp < 10 ? mp + 3 : mp - 9;
+	*year = yoe + era * 400 + (*month <= 2);
+}
+
+/* and back again, same source */
+static long
+days_from_civil(int year, int month, int day)
+{
+	long era;
+	long yoe;
+	long doy;
+	long doe;
+
+	year -= month <= 2;
+	era = (year >= 0 ? year : year - 399) / 400;
+	yoe = year - era * 400;
+	doy = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+	doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	return (era * 146097 + doe - 719468);
+}
@@ -0,0 +1,120 @@
+/* Copyright (c) 2023 Diane Bruce db@db.net
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#ifndef __SOLAR_FORMAT_H__
+#define __SOLAR_FORMAT_H__
+
+#include <stddef.h>
+#include <time.h>
+#include "libsolar.h"
+
+/*
+ * Growable output buffer owned by the caller.
+ * Records are appended in place, the buffer is only ever
+ * grown (doubled) never shrunk, so steady state serialization
+ * does no allocation at all. Call solar_buf_reset() to reuse it.
+ */
+typedef struct {
+	char	*buf;
+	size_t	len;		/* bytes used */
+	size_t	size;		/* bytes allocated */
+} SOLAR_BUF;
+
+/* One timestamped sample, e.g. from a collector ring buffer */
+typedef struct {
+	time_t		when;
+	SOLAR_SNAPSHOT	snap;
+} SOLAR_SAMPLE;
+
+/*
+ * Streaming JSON writer. Members are written straight into the
+ * SOLAR_BUF as they are given, the writer only keeps track of
+ * nesting and where commas go. Keys are trusted names and are not
+ * escaped. Errors are sticky and reported by solar_json_finish().
+ */
+#define SOLAR_JSON_DEPTH	8
+
+typedef struct {
+	SOLAR_BUF	*sb;
+	int		depth;
+	int		error;
+	char		close[SOLAR_JSON_DEPTH];	/* '}' or ']' */
+	char		more[SOLAR_JSON_DEPTH];		/* need a comma */
+} SOLAR_JSON;
+
+#define SOLAR_FMT_CSV		0	/* the historical csv line */
+#define SOLAR_FMT_JSON		1	/* one JSON object per line */
+#define SOLAR_FMT_BINARY	2	/* fixed little endian record */
+#define SOLAR_FMT_LINE		3	/* InfluxDB line protocol */
+
+/* Binary record header, see solar_format.c */
+#define SOLAR_BIN_MAGIC		'S'
+#define SOLAR_BIN_INFO_MAGIC	'I'
+#define SOLAR_BIN_VERSION	2
+
+#define SOLAR_SNAPSHOT_FIELDS	10	/* see solar_snapshot_field() */
+
+void	solar_buf_init(SOLAR_BUF *sb);
+int	solar_buf_reserve(SOLAR_BUF *sb, size_t need);
+int	solar_buf_append(SOLAR_BUF *sb, const char *s, size_t len);
+int	solar_buf_printf(SOLAR_BUF *sb, const char *fmt, ...)
+	    __attribute__((__format__ (__printf__, 2, 3)));
+int	solar_buf_str(SOLAR_BUF *sb, const char *s);
+int	solar_buf_int(SOLAR_BUF *sb, long v);
+int	solar_buf_fixed(SOLAR_BUF *sb, double v, int decimals);
+unsigned long solar_buf_grows(void);
+void	solar_buf_reset(SOLAR_BUF *sb);
+void	solar_buf_free(SOLAR_BUF *sb);
+
+int	solar_format_lookup(const char *name);
+int	solar_snapshot_field(const char *name);
+const char *solar_snapshot_name(int field);
+double	solar_snapshot_value(const SOLAR_SNAPSHOT *snap, int field);
+int	solar_snapshot_decimals(int field);
+int	solar_format_snapshot(SOLAR_BUF *sb, int fmt, time_t when,
+			      const SOLAR_SNAPSHOT *snap);
+int	solar_format_samples(SOLAR_BUF *sb, int fmt,
+			     const SOLAR_SAMPLE *samples, int count);
+int	solar_format_info(SOLAR_BUF *sb, int fmt, time_t when,
+			  const SOLAR_INFO *info);
+int	solar_format_metrics(SOLAR_BUF *sb, const SOLAR_INFO *info);
+
+void	solar_json_init(SOLAR_JSON *js, SOLAR_BUF *sb);
+void	solar_json_object(SOLAR_JSON *js, const char *key);
+void	solar_json_array(SOLAR_JSON *js, const char *key);
+void	solar_json_end(SOLAR_JSON *js);
+void	solar_json_int(SOLAR_JSON *js, const char *key, long v);
+void	solar_json_float(SOLAR_JSON *js, const char *key, double v,
+			 int decimals);
+void	solar_json_string(SOLAR_JSON *js, const char *key, const char *s);
+void	solar_json_floats(SOLAR_JSON *js, const char *key, const float *v,
+			  int count, int decimals);
+void	solar_json_info(SOLAR_JSON *js, const SOLAR_INFO *info);
+int	solar_json_finish(SOLAR_JSON *js);
+
+char	*solar_fmt_int(char *p, long v);
+char	*solar_fmt_float(char *p, double v, int decimals);
+char	*solar_fmt_time(char *p, time_t when);
+time_t	solar_parse_time(const char *s);
+
+#endif
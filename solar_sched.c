@@ -0,0 +1,425 @@
+/* Copyright (c) 2023 Diane Bruce db@db.net
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Register group scheduler.
+ *
+ * The controller registers fall into groups that change at very
+ * different rates. Identity (0xA block) never changes, settings
+ * (0xE001 block) rarely, live values (0x100 block) every second and
+ * the per day history (0xF000+) once a day, when every day moves
+ * along one at local midnight. Reading all of them for every page
+ * view is most of the time spent on the bus.
+ *
+ * Each group has a refresh period and a priority. solar_sched_run()
+ * is one step of a bus loop and does at most one modbus transaction.
+ * The live group is read whenever it is due so it keeps its rate.
+ * Otherwise the highest priority group that is due is read, but only
+ * if its measured transaction time fits in the gap before the next
+ * live read. History is refreshed one batch of days per step so a
+ * full sweep never holds up the live values.
+ *
+ * solar_sched_info() and solar_sched_history() are for callers that
+ * work on demand. They read only what is stale and decode the rest
+ * from what is already in the SOLAR_CTX.
+ */
+
+#include <string.h>
+#include <time.h>
+
+#include "libsolar.h"
+#include "solar_sched.h"
+
+static int	pick_group(SOLAR_SCHED *sched, time_t now);
+static int	group_due(SOLAR_SCHED *sched, int group, time_t now);
+static int	group_fresh(SOLAR_SCHED *sched, int group, time_t now);
+static int	day_fresh(SOLAR_SCHED *sched, int day, time_t now);
+static int	run_group(SOLAR_SCHED *sched, int group, time_t now);
+static int	run_history(SOLAR_SCHED *sched, time_t now);
+static void	account(SOLAR_GROUP *g, int error, time_t now,
+			struct timespec *start);
+static void	measure(SOLAR_GROUP *g, struct timespec *start);
+static int	same_day(time_t t1, time_t t2);
+static int	to_midnight(time_t now);
+
+/*
+ * solar_sched_init
+ *
+ * inputs	- SOLAR_SCHED to set up
+ *		- SOLAR_CTX it reads through
+ * output	- none
+ * side effects	- every group is due straight away
+ */
+void
+solar_sched_init(SOLAR_SCHED *sched, SOLAR_CTX *ctx)
+{
+	memset(sched, 0, sizeof(*sched));
+	sched->ctx = ctx;
+	solar_sched_period(sched, SOLAR_GROUP_IDENT, SCHED_IDENT_PERIOD, 1);
+	solar_sched_period(sched, SOLAR_GROUP_LIVE, SCHED_LIVE_PERIOD, 3);
+	solar_sched_period(sched, SOLAR_GROUP_SETTINGS,
+			   SCHED_SETTINGS_PERIOD, 2);
+	solar_sched_period(sched, SOLAR_GROUP_HISTORY,
+			   SCHED_HISTORY_PERIOD, 0);
+}
+
+void
+solar_sched_period(SOLAR_SCHED *sched, int group, int period, int priority)
+{
+	SOLAR_GROUP *g;
+
+	if (group < 0 || group >= SOLAR_GROUPS)
+		return;
+	if (period < 1)
+		period = 1;
+	g = &sched->group[group];
+	g->period = period;
+	g->priority = priority;
+	if (g->last != 0)
+		g->next = g->last + period;
+}
+
+/*
+ * solar_sched_run
+ *
+ * inputs	- SOLAR_SCHED
+ *		- current time
+ *		- where to return the group read, -1 if none was
+ * output	- SOLAR_OK or SOLAR_E error from the read
+ * side effects	- at most one modbus transaction
+ */
+int
+solar_sched_run(SOLAR_SCHED *sched, time_t now, int *group)
+{
+	int best;
+
+	*group = -1;
+	if ((best = pick_group(sched, now)) < 0)
+		return (SOLAR_OK);
+	*group = best;
+	if (best == SOLAR_GROUP_HISTORY)
+		return (run_history(sched, now));
+	return (run_group(sched, best, now));
+}
+
+/*
+ * solar_sched_wait
+ *
+ * inputs	- SOLAR_SCHED
+ *		- current time
+ * output	- seconds until solar_sched_run() has something to do
+ *
+ * A group that is due but does not fit before the next live read
+ * waits for that, there is a whole live period after it.
+ */
+int
+solar_sched_wait(SOLAR_SCHED *sched, time_t now)
+{
+	long wait;
+	long w;
+	int i;
+
+	if (pick_group(sched, now) >= 0)
+		return (0);
+	wait = sched->group[SOLAR_GROUP_LIVE].next - now;
+	for (i = 0; i < SOLAR_GROUPS; i++) {
+		if (group_due(sched, i, now))
+			continue;
+		w = sched->group[i].next - now;
+		if (i == SOLAR_GROUP_HISTORY && to_midnight(now) < w)
+			w = to_midnight(now);
+		if (w < wait)
+			wait = w;
+	}
+	return (wait);
+}
+
+/*
+ * pick_group
+ *
+ * inputs	- SOLAR_SCHED
+ *		- current time
+ * output	- group to read next or -1 for none yet
+ */
+static int
+pick_group(SOLAR_SCHED *sched, time_t now)
+{
+	SOLAR_GROUP *live;
+	SOLAR_GROUP *g;
+	long gap;
+	int best;
+	int i;
+
+	if (group_due(sched, SOLAR_GROUP_LIVE, now))
+		return (SOLAR_GROUP_LIVE);
+
+	/*
+	 * Right after a live read the gap is a whole live period,
+	 * a group slower than that still gets its turn then.
+	 */
+	live = &sched->group[SOLAR_GROUP_LIVE];
+	gap = (long)(live->next - now) * 1000;
+	best = -1;
+	for (i = 0; i < SOLAR_GROUPS; i++) {
+		g = &sched->group[i];
+		if (i == SOLAR_GROUP_LIVE || !group_due(sched, i, now))
+			continue;
+		if (g->cost > gap && gap < live->period * 1000L)
+			continue;
+		if (best < 0 || g->priority > sched->group[best].priority)
+			best = i;
+	}
+	return (best);
+}
+
+/*
+ * solar_sched_info
+ *
+ * inputs	- SOLAR_SCHED
+ *		- current time
+ *		- SOLAR_INFO to fill in
+ * output	- SOLAR_OK or SOLAR_E error
+ * side effects	- reads only those of IDENT, LIVE and SETTINGS that
+ *		  are older than their period
+ */
+int
+solar_sched_info(SOLAR_SCHED *sched, time_t now, SOLAR_INFO *info)
+{
+	int group;
+	int error;
+
+	for (group = SOLAR_GROUP_IDENT; group <= SOLAR_GROUP_SETTINGS;
+	     group++) {
+		if (group_fresh(sched, group, now))
+			continue;
+		if ((error = run_group(sched, group, now)) != SOLAR_OK)
+			return (error);
+	}
+	solar_cached_info(sched->ctx, info);
+	return (SOLAR_OK);
+}
+
+/*
+ * solar_sched_history
+ *
+ * inputs	- SOLAR_SCHED
+ *		- current time
+ *		- first and last day wanted
+ * output	- SOLAR_OK or SOLAR_E error
+ * side effects	- the stale days in the range are read into the ctx,
+ *		  then solar_history() etc. can be used on all of it
+ */
+int
+solar_sched_history(SOLAR_SCHED *sched, time_t now, int day1, int day2)
+{
+	int first;
+	int last;
+	int day;
+	int error;
+
+	if (day1 < 0 || day2 >= MAX_DAYS_HISTORY || day1 > day2)
+		return (SOLAR_EINVAL);
+
+	first = -1;
+	last = -1;
+	for (day = day1; day <= day2; day++) {
+		if (day_fresh(sched, day, now))
+			continue;
+		if (first < 0)
+			first = day;
+		last = day;
+	}
+	if (first < 0)
+		return (SOLAR_OK);
+	error = solar_read_history(sched->ctx, first, last);
+	if (error == SOLAR_OK)
+		for (day = first; day <= last; day++)
+			sched->day_time[day] = now;
+	return (error);
+}
+
+/*
+ * group_due is for the bus loop and backs off after a failed read,
+ * group_fresh is for callers on demand who want a failure reported.
+ * The history days are all renumbered at local midnight.
+ */
+static int
+group_due(SOLAR_SCHED *sched, int group, time_t now)
+{
+	SOLAR_GROUP *g;
+
+	g = &sched->group[group];
+	if (now >= g->next)
+		return (1);
+	if (group == SOLAR_GROUP_HISTORY && g->last != 0 &&
+	    !same_day(g->last, now))
+		return (1);
+	return (0);
+}
+
+static int
+group_fresh(SOLAR_SCHED *sched, int group, time_t now)
+{
+	SOLAR_GROUP *g;
+
+	g = &sched->group[group];
+	return (g->last != 0 && now < g->last + g->period);
+}
+
+/*
+ * Today's record, day 0, is still changing so goes stale as fast as
+ * the live values.
+ */
+static int
+day_fresh(SOLAR_SCHED *sched, int day, time_t now)
+{
+	time_t when;
+	int period;
+
+	when = sched->day_time[day];
+	if (when == 0 || !same_day(when, now))
+		return (0);
+	if (day == 0)
+		period = sched->group[SOLAR_GROUP_LIVE].period;
+	else
+		period = sched->group[SOLAR_GROUP_HISTORY].period;
+	return (now < when + period);
+}
+
+static int
+run_group(SOLAR_SCHED *sched, int group, time_t now)
+{
+	struct timespec start;
+	int error;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	error = solar_read_group(sched->ctx, group);
+	account(&sched->group[group], error, now, &start);
+	return (error);
+}
+
+/*
+ * run_history
+ *
+ * One batch of the history sweep. A sweep that runs over midnight
+ * starts again since the days it already read have moved.
+ */
+static int
+run_history(SOLAR_SCHED *sched, time_t now)
+{
+	SOLAR_GROUP *g;
+	struct timespec start;
+	int first;
+	int last;
+	int batch;
+	int day;
+	int error;
+
+	g = &sched->group[SOLAR_GROUP_HISTORY];
+	if (sched->sweep_day > 0 && !same_day(sched->day_time[0], now))
+		sched->sweep_day = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	batch = solar_probe_history(sched->ctx);
+	if (batch < 0) {
+		account(g, batch, now, &start);
+		return (batch);
+	}
+	first = sched->sweep_day;
+	last = first + batch - 1;
+	if (last >= MAX_DAYS_HISTORY)
+		last = MAX_DAYS_HISTORY - 1;
+	error = solar_read_history(sched->ctx, first, last);
+	if (error == SOLAR_OK) {
+		for (day = first; day <= last; day++)
+			sched->day_time[day] = now;
+		sched->sweep_day = last + 1;
+	}
+	if (error != SOLAR_OK || sched->sweep_day == MAX_DAYS_HISTORY) {
+		account(g, error, now, &start);
+		sched->sweep_day = 0;
+		return (error);
+	}
+
+	/* part way through, the group stays due */
+	measure(g, &start);
+	return (SOLAR_OK);
+}
+
+/*
+ * account
+ *
+ * inputs	- group just read
+ *		- result of the read
+ *		- current time and when the read started
+ * output	- none
+ * side effects	- the group's next due time and cost are updated
+ */
+static void
+account(SOLAR_GROUP *g, int error, time_t now, struct timespec *start)
+{
+	measure(g, start);
+	if (error == SOLAR_OK) {
+		g->last = now;
+		g->next = now + g->period;
+	} else {
+		g->errors++;
+		g->next = now + (g->period < SCHED_RETRY ?
+				 g->period : SCHED_RETRY);
+	}
+}
+
+/* cost is kept per transaction, a history batch counts as one */
+static void
+measure(SOLAR_GROUP *g, struct timespec *start)
+{
+	struct timespec end;
+	long ms;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	ms = (end.tv_sec - start->tv_sec) * 1000 +
+	    (end.tv_nsec - start->tv_nsec) / 1000000;
+	g->cost = g->cost == 0 ? ms : (g->cost * 3 + ms) / 4;
+	g->reads++;
+}
+
+static int
+same_day(time_t t1, time_t t2)
+{
+	struct tm tm1;
+	struct tm tm2;
+
+	localtime_r(&t1, &tm1);
+	localtime_r(&t2, &tm2);
+	return (tm1.tm_yday == tm2.tm_yday && tm1.tm_year == tm2.tm_year);
+}
+
+static int
+to_midnight(time_t now)
+{
+	struct tm tm;
+
+	localtime_r(&now, &tm);
+	return (86400 - (tm.tm_hour * 3600 + tm.tm_min * 60 + tm.tm_sec));
+}
@@ -0,0 +1,67 @@
+/* Copyright (c) 2023 Diane Bruce db@db.net
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#ifndef __SOLAR_SCHED_H__
+#define __SOLAR_SCHED_H__
+
+#include <time.h>
+#include "libsolar.h"
+
+/* Default refresh periods, seconds */
+#define SCHED_IDENT_PERIOD	86400	/* never changes, once a day */
+#define SCHED_LIVE_PERIOD	5
+#define SCHED_SETTINGS_PERIOD	3600
+#define SCHED_HISTORY_PERIOD	21600	/* and after local midnight */
+#define SCHED_RETRY		10	/* after a failed read */
+
+typedef struct {
+	int	period;		/* seconds between refreshes */
+	int	priority;	/* higher first when several are due */
+	time_t	last;		/* last good read, 0 never */
+	time_t	next;		/* when due again */
+	int	cost;		/* smoothed transaction time, ms */
+	long	reads;
+	long	errors;
+} SOLAR_GROUP;
+
+/*
+ * Register group scheduler state, see solar_sched.c
+ * One per SOLAR_CTX, used from one thread.
+ */
+typedef struct {
+	SOLAR_CTX	*ctx;
+	SOLAR_GROUP	group[SOLAR_GROUPS];
+	int		sweep_day;	/* next day of history refresh */
+	time_t		day_time[MAX_DAYS_HISTORY]; /* when each day read */
+} SOLAR_SCHED;
+
+void	solar_sched_init(SOLAR_SCHED *sched, SOLAR_CTX *ctx);
+void	solar_sched_period(SOLAR_SCHED *sched, int group, int period,
+			   int priority);
+int	solar_sched_run(SOLAR_SCHED *sched, time_t now, int *group);
+int	solar_sched_wait(SOLAR_SCHED *sched, time_t now);
+int	solar_sched_info(SOLAR_SCHED *sched, time_t now, SOLAR_INFO *info);
+int	solar_sched_history(SOLAR_SCHED *sched, time_t now, int day1,
+			    int day2);
+
+#endif
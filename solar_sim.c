@@ -0,0 +1,551 @@
+/* Copyright (c) 2023 Diane Bruce db@db.net
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * solar_sim
+ *
+ * A charge controller on a pseudo terminal, so web_status,
+ * snapshot_collector and web_bench can be run without hardware.
+ * The name of the terminal is printed, give it as modport.
+ *
+ * Modbus RTU read holding/input registers, write single and write
+ * multiple registers are answered from a register map laid out as in
+ * renogy.h. Replies are held back for the time they would take on
+ * the wire at the given baud rate, so what a benchmark measures
+ * includes a realistic bus.
+ *
+ * The live values either follow a synthetic day, the array following
+ * the sun from 06:00 to 18:00 local time, or with -r replay a csv
+ * archive captured by snapshot_collector or remote_snapshot. The
+ * archive is played from its first line at -s times real time and
+ * starts over at the end. Day history at 0xF000 is always synthetic.
+ *
+ * Like most Renogy firmware several days of history are returned for
+ * one read if asked for, -1 answers one day per read like the rest.
+ *
+ * e.g. solar_sim -l /tmp/solar.tty -r solar.csv -s 60
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "libsolar.h"
+#include "modbus_crc.h"
+#include "solar_format.h"
+
+extern char *optarg;
+extern int optind;
+
+#define MAXLINE		1024
+#define HISTORY_ADDR	0xF000
+#define FRAME_GAP	50		/* ms of quiet ending a partial frame */
+#define SIM_ARRAY_W	400.0		/* array watts at noon */
+#define SIM_LOAD_W	30.0
+#define SIM_BAT_AH	100.0
+
+static DATA regs[0x10000];
+static int single_day;
+static int baud = 9600;
+
+static FILE *replay;
+static double speed = 1.0;
+static time_t replay_start;		/* first line of the archive */
+static time_t replay_epoch;		/* when it was played */
+static SOLAR_SNAPSHOT replay_next;
+static time_t replay_next_when;
+
+static void	usage(const char *progname);
+static int	open_pty(const char *link);
+static int	frame_length(const unsigned char *buf, int len);
+static int	answer(const unsigned char *req, int len, unsigned char *reply);
+static int	read_words(int addr, int cnt, unsigned char *p);
+static void	load_ident(void);
+static void	load_snapshot(const SOLAR_SNAPSHOT *snap);
+static void	synthetic(time_t now, SOLAR_SNAPSHOT *snap);
+static int	replayed(time_t now, SOLAR_SNAPSHOT *snap);
+static int	replay_line(SOLAR_SNAPSHOT *snap, time_t *when);
+static void	put_word(unsigned char *p, DATA w);
+static DATA	scaled(double v, double scale);
+
+int
+main(int argc, char* argv[])
+{
+	unsigned char buf[MODBUS_MAX_PACKET];
+	unsigned char reply[MODBUS_MAX_PACKET];
+	struct pollfd pfd;
+	SOLAR_SNAPSHOT snap;
+	char *link;
+	int len;
+	int flen;
+	int rlen;
+	int ch;
+	int n;
+
+	link = NULL;
+	while ((ch = getopt(argc, argv, "1b:l:r:s:?")) != -1) {
+		switch (ch) {
+		case '1':
+			single_day = 1;
+			break;
+		case 'b':
+			baud = atoi(optarg);
+			break;
+		case 'l':
+			link = optarg;
+			break;
+		case 'r':
+			if ((replay = fopen(optarg, "r")) == NULL)
+				err(EX_NOINPUT, "%s", optarg);
+			break;
+		case 's':
+			speed = atof(optarg);
+			break;
+		case '?':
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (speed <= 0)
+		usage(argv[0]);
+	if (replay != NULL && !replay_line(&replay_next, &replay_next_when))
+		errx(EX_DATAERR, "no csv lines to replay");
+	replay_start = replay_next_when;
+	replay_epoch = time(NULL);
+
+	pfd.fd = open_pty(link);
+	pfd.events = POLLIN;
+	load_ident();
+	memset(&snap, 0, sizeof(snap));
+	len = 0;
+	for (;;) {
+		if ((n = poll(&pfd, 1, len > 0 ? FRAME_GAP : -1)) < 0) {
+			if (errno == EINTR)
+				continue;
+			err(EX_OSERR, "poll");
+		}
+		if (n == 0) {
+			len = 0;		/* partial frame, line noise */
+			continue;
+		}
+		if ((n = read(pfd.fd, buf + len, sizeof(buf) - len)) <= 0) {
+			if (n < 0 && errno != EAGAIN && errno != EINTR)
+				err(EX_IOERR, "read");
+			continue;
+		}
+		len += n;
+		while ((flen = frame_length(buf, len)) > 0 && flen <= len) {
+			if (replay == NULL || !replayed(time(NULL), &snap))
+				synthetic(time(NULL), &snap);
+			load_snapshot(&snap);
+			if ((rlen = answer(buf, flen, reply)) > 0) {
+				if (baud > 0)
+					usleep((long long)(flen + rlen) * 10 *
+					       1000000 / baud);
+				if (write(pfd.fd, reply, rlen) != rlen)
+					warn("write");
+			}
+			memmove(buf, buf + flen, len - flen);
+			len -= flen;
+		}
+		if (flen < 0 || len == sizeof(buf))
+			len = 0;
+	}
+}
+
+/*
+ * open_pty
+ *
+ * inputs	- path for a symlink to the terminal, or NULL
+ * output	- master side of a new pseudo terminal
+ * side effects	- the slave side is kept open and raw, its name printed
+ */
+static int
+open_pty(const char *link)
+{
+	struct termios tio;
+	char *name;
+	int master;
+	int slave;
+
+	if ((master = posix_openpt(O_RDWR | O_NOCTTY)) < 0 ||
+	    grantpt(master) < 0 || unlockpt(master) < 0 ||
+	    (name = ptsname(master)) == NULL)
+		err(EX_OSERR, "Can't allocate a pseudo terminal");
+	/* held open so the master does not see EOF between clients */
+	if ((slave = open(name, O_RDWR | O_NOCTTY)) < 0)
+		err(EX_OSERR, "%s", name);
+	if (tcgetattr(slave, &tio) < 0)
+		err(EX_OSERR, "%s", name);
+	cfmakeraw(&tio);
+	if (tcsetattr(slave, TCSANOW, &tio) < 0)
+		err(EX_OSERR, "%s", name);
+	/* web_status opens modport after giving up root */
+	if (fchmod(slave, 0666) < 0)
+		err(EX_OSERR, "%s", name);
+	if (link != NULL) {
+		(void)unlink(link);
+		if (symlink(name, link) < 0)
+			err(EX_CANTCREAT, "%s", link);
+	}
+	printf("%s\n", name);
+	fflush(stdout);
+	return (master);
+}
+
+/*
+ * frame_length
+ *
+ * inputs	- bytes received so far
+ * output	- length of the request frame they start, 0 if more bytes
+ *		  are needed to tell, -1 if it is not a request
+ * side effects	- none
+ */
+static int
+frame_length(const unsigned char *buf, int len)
+{
+	if (len < 2)
+		return (0);
+	switch (buf[1]) {
+	case READ_HOLDING_REGISTERS:
+	case READ_INPUT_REGISTERS:
+	case WRITE_SINGLE_REGISTER:
+		return (8);
+	case WRITE_MULTIPLE_REGISTERS:
+		if (len < 7)
+			return (0);
+		return (9 + buf[6]);
+	default:
+		return (-1);
+	}
+}
+
+/*
+ * answer
+ *
+ * inputs	- one request frame
+ *		- buffer for the reply
+ * output	- length of the reply, 0 for none
+ * side effects	- writes change the register map
+ */
+static int
+answer(const unsigned char *req, int len, unsigned char *reply)
+{
+	unsigned short crc;
+	int addr;
+	int cnt;
+	int rlen;
+	int i;
+
+	crc = crc16((unsigned char *)req, len - 2);
+	if (req[len - 2] != (crc >> 8) || req[len - 1] != (crc & 0xFF))
+		return (0);		/* devices ignore a bad crc */
+	addr = (req[2] << 8) | req[3];
+	cnt = (req[4] << 8) | req[5];
+	reply[0] = req[0];
+	reply[1] = req[1];
+	switch (req[1]) {
+	case READ_HOLDING_REGISTERS:
+	case READ_INPUT_REGISTERS:
+		if (cnt < 1 || cnt > 125)
+			goto bad;
+		cnt = read_words(addr, cnt, reply + 3);
+		reply[2] = cnt * 2;
+		rlen = 3 + cnt * 2;
+		break;
+	case WRITE_SINGLE_REGISTER:
+		regs[addr] = cnt;
+		memcpy(reply, req, 6);
+		rlen = 6;
+		break;
+	case WRITE_MULTIPLE_REGISTERS:
+		if (cnt < 1 || req[6] != cnt * 2 || addr + cnt > 0x10000)
+			goto bad;
+		for (i = 0; i < cnt; i++)
+			regs[addr + i] = (req[7 + 2 * i] << 8) |
+				req[8 + 2 * i];
+		memcpy(reply, req, 6);
+		rlen = 6;
+		break;
+	default:
+	bad:
+		reply[1] |= 0x80;
+		reply[2] = 3;		/* illegal data value */
+		rlen = 3;
+		break;
+	}
+	crc = crc16(reply, rlen);
+	reply[rlen++] = crc >> 8;
+	reply[rlen++] = crc & 0xFF;
+	return (rlen);
+}
+
+/*
+ * read_words
+ *
+ * inputs	- first register and count asked for
+ *		- where to put them, big endian
+ * output	- number of words put
+ * side effects	- none
+ *
+ * Day history is ten words a day from HISTORY_ADDR, day 0 is today.
+ * Unmapped registers read as 0.
+ */
+static int
+read_words(int addr, int cnt, unsigned char *p)
+{
+	int day;
+	int days;
+	int i;
+
+	if (addr < HISTORY_ADDR) {
+		for (i = 0; i < cnt && addr + i < HISTORY_ADDR; i++)
+			put_word(p + 2 * i, regs[addr + i]);
+		return (i);
+	}
+	days = single_day || cnt < MAX_DAY_DATA ? 1 : cnt / MAX_DAY_DATA;
+	for (i = 0; i < days; i++, p += 2 * MAX_DAY_DATA) {
+		day = addr - HISTORY_ADDR + i;
+		put_word(p, 120 + day % 7);		/* min V x10 */
+		put_word(p + 2, 140 + day % 3);		/* max V x10 */
+		put_word(p + 4, 1000 + day % 900);	/* max charge A x100 */
+		put_word(p + 6, 200 + day % 50);
+		put_word(p + 8, 3000 + day % 1000);	/* max charge W x10 */
+		put_word(p + 10, 400);
+		put_word(p + 12, 20 + day % 5);		/* charge Ah */
+		put_word(p + 14, 10);
+		put_word(p + 16, (day * 10) % 3000);	/* charge Wh */
+		put_word(p + 18, 50);
+	}
+	return (days * MAX_DAY_DATA);
+}
+
+/* model, versions and ratings, which never change */
+static void
+load_ident(void)
+{
+	const char *model = "  RNG-CTRL-RVR40";
+	int i;
+
+	for (i = 0; i <= MODEL_HI - MODEL_LO; i++)
+		regs[MODEL_LO + i] = (model[2 * i] << 8) | model[2 * i + 1];
+	regs[MAX_V_A] = (24 << 8) | 40;
+	regs[SW_VERSION_LO] = 0x0001;
+	regs[SW_VERSION_HI] = 0x0408;
+	regs[HW_VERSION_LO] = 0x0000;
+	regs[HW_VERSION_HI] = 0x0500;
+	regs[SERIAL_NO_LO] = 0x110C;
+	regs[SERIAL_NO_HI] = 0x0064;
+	regs[BAT_CAPACITY] = SIM_BAT_AH;
+	regs[SYSTEM_VOLTAGE] = (12 << 8) | 12;
+	regs[BAT_INDEX] = 2;
+}
+
+/* the live registers, scaled as libsolar.c reads them */
+static void
+load_snapshot(const SOLAR_SNAPSHOT *snap)
+{
+	regs[BAT_SOC] = snap->soc;
+	regs[BAT_V] = scaled(snap->bat_v, 10);
+	regs[BAT_CHARGING_AMP] = scaled(snap->bat_a, 100);
+	regs[TEMPERATURE] = (25 << 8) | 21;
+	regs[LOAD_V] = scaled(snap->load_v, 10);
+	regs[LOAD_A] = scaled(snap->load_a, 100);
+	regs[LOAD_A + 1] = scaled(snap->load_v * snap->load_a, 1);
+	regs[PANEL_V] = scaled(snap->array_v, 10);
+	regs[PANEL_A] = scaled(snap->array_a, 100);
+	regs[CHARGING_POWER] = snap->array_w;
+	regs[CUMULATIVE_POWER_GENERATION] = snap->gen_wh >> 16;
+	regs[CUMULATIVE_POWER_GENERATION + 1] = snap->gen_wh & 0xFFFF;
+	regs[CUMULATIVE_POWER_CONSUMPTION] = snap->con_wh >> 16;
+	regs[CUMULATIVE_POWER_CONSUMPTION + 1] = snap->con_wh & 0xFFFF;
+	regs[CHARGE_STATE] = snap->charge_state;
+	regs[CONTROLLER_FAULT_INFO] = snap->fault_bits >> 16;
+	regs[CONTROLLER_FAULT_INFO + 1] = snap->fault_bits & 0xFFFF;
+}
+
+/*
+ * synthetic
+ *
+ * inputs	- now
+ *		- SOLAR_SNAPSHOT to fill in
+ * output	- none
+ * side effects	- energy counters advance by the time since last called
+ */
+static void
+synthetic(time_t now, SOLAR_SNAPSHOT *snap)
+{
+	static double gen_wh = 12345;
+	static double con_wh = 2345;
+	static double soc = 60;
+	static time_t last;
+	struct tm tm;
+	double hours;
+	double sun;
+	double h;
+
+	localtime_r(&now, &tm);
+	h = tm.tm_hour + tm.tm_min / 60.0 + tm.tm_sec / 3600.0;
+	sun = (h > 6 && h < 18) ? sin(M_PI * (h - 6) / 12) : 0;
+	/* a passing cloud every quarter hour or so */
+	if (sun > 0 && (now / 60) % 15 < 2)
+		sun *= 0.3;
+
+	hours = last != 0 ? (now - last) / 3600.0 : 0;
+	last = now;
+
+	snap->array_w = SIM_ARRAY_W * sun;
+	snap->array_v = sun > 0 ? 17.0 + 2.0 * sun : 0.4;
+	snap->array_a = snap->array_w / snap->array_v;
+	snap->load_v = 12.0 + soc / 50.0;
+	snap->load_a = SIM_LOAD_W / snap->load_v;
+	snap->bat_v = snap->load_v + 0.6 * sun;
+	snap->bat_a = snap->array_w / snap->bat_v;
+
+	soc += (snap->array_w - SIM_LOAD_W) * hours / 12.0 / SIM_BAT_AH;
+	if (soc > 100)
+		soc = 100;
+	if (soc < 10)
+		soc = 10;
+	snap->soc = soc;
+	gen_wh += snap->array_w * hours;
+	con_wh += SIM_LOAD_W * hours;
+	snap->gen_wh = gen_wh;
+	snap->con_wh = con_wh;
+	if (sun <= 0)
+		snap->charge_state = CHARGE_IDLE;
+	else
+		snap->charge_state = soc < 95 ? CHARGE_MPPT : CHARGE_FLOAT;
+	snap->fault_bits = 0;
+}
+
+/*
+ * replayed
+ *
+ * inputs	- now
+ *		- SOLAR_SNAPSHOT to fill in
+ * output	- 1 with the archive line due now, 0 on a read error
+ * side effects	- the archive is read up to now, at the end it
+ *		  starts over
+ */
+static int
+replayed(time_t now, SOLAR_SNAPSHOT *snap)
+{
+	time_t due;
+
+	due = replay_start + (now - replay_epoch) * speed;
+	while (replay_next_when <= due) {
+		*snap = replay_next;
+		if (!replay_line(&replay_next, &replay_next_when)) {
+			if (ferror(replay))
+				return (0);
+			rewind(replay);
+			replay_epoch = now;
+			if (!replay_line(&replay_next, &replay_next_when))
+				return (0);
+			break;
+		}
+	}
+	return (1);
+}
+
+/*
+ * replay_line
+ *
+ * inputs	- SOLAR_SNAPSHOT and time to fill in
+ * output	- 1 if a csv line was read, 0 at end of file
+ * side effects	- lines that do not parse are skipped
+ */
+static int
+replay_line(SOLAR_SNAPSHOT *snap, time_t *when)
+{
+	char line[MAXLINE];
+	char *p;
+
+	while (fgets(line, sizeof(line), replay) != NULL) {
+		if ((*when = solar_parse_time(line)) < 0 ||
+		    (p = strchr(line, ',')) == NULL)
+			continue;
+		memset(snap, 0, sizeof(*snap));
+		if (sscanf(p, ",%f,%f,%d,%d,%f,%f,%f,%f,%u,%u",
+			   &snap->array_v, &snap->array_a, &snap->array_w,
+			   &snap->soc, &snap->bat_v, &snap->bat_a,
+			   &snap->load_v, &snap->load_a, &snap->gen_wh,
+			   &snap->con_wh) != SOLAR_SNAPSHOT_FIELDS)
+			continue;
+		/* the archive has no charge state, near enough */
+		if (snap->array_w > 0)
+			snap->charge_state = snap->soc < 95 ? CHARGE_MPPT :
+				CHARGE_FLOAT;
+		return (1);
+	}
+	return (0);
+}
+
+static void
+put_word(unsigned char *p, DATA w)
+{
+	p[0] = w >> 8;
+	p[1] = w & 0xFF;
+}
+
+/* registers are unsigned, charging amps are never negative */
+static DATA
+scaled(double v, double scale)
+{
+	v = v * scale + 0.5;
+	if (v < 0)
+		return (0);
+	if (v > 0xFFFF)
+		return (0xFFFF);
+	return (v);
+}
+
+/*
+ * usage
+ *
+ * inputs	- program name
+ * output	- none
+ * side effects	- how to run it is printed and it exits
+ */
+static void
+usage(const char *progname)
+{
+	fprintf(stderr, "%s: [-1] [-b baud] [-l link] [-r archive.csv [-s speed]]\n", progname);
+	fprintf(stderr, "%s: -1 answer one day of history per read\n", progname);
+	fprintf(stderr, "%s: -b baud rate to pace replies at, 0 for none (9600)\n", progname);
+	fprintf(stderr, "%s: -l make link a symlink to the terminal\n", progname);
+	fprintf(stderr, "%s: -r replay a csv archive instead of a synthetic day\n", progname);
+	fprintf(stderr, "%s: -s replay speed, times real time (1)\n", progname);
+	exit(EX_USAGE);
+}
@@ -0,0 +1,569 @@
+/* Copyright (c) 2023 Diane Bruce db@db.net
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Minimal io_uring for web_status and snapshot_collector.
+ *
+ * With epoll every read and write on a connection is a system call
+ * of its own, and at high poll rates the collector's csv append is
+ * an open, a write and a close for every sample. On io_uring they
+ * are queued in a ring shared with the kernel instead, and all of
+ * them, across every connection and file, go in with one
+ * io_uring_enter() that also waits for whatever completes next.
+ *
+ * This talks to the kernel directly rather than through liburing,
+ * only a handful of operations are needed and a Pi image then needs
+ * nothing more installed. It wants Linux 5.19 or later, on anything
+ * older, or with io_uring disabled (kernel.io_uring_disabled, seccomp
+ * in a container) solar_uring_new() fails and callers fall back.
+ *
+ * An append opens the file into a direct descriptor, one of "slots"
+ * registered with the ring, writes and closes it as one linked chain,
+ * so a file replaced underneath (log rotation) is picked up by the
+ * next append just as with fopen(path, "a") every time.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "solar_uring.h"
+
+#ifdef HAVE_IO_URING
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+struct solar_uring {
+	int		fd;
+	unsigned	*sq_head;
+	unsigned	*sq_tail;
+	unsigned	*sq_mask;
+	unsigned	*sq_array;
+	unsigned	sq_entries;
+	unsigned	tail;		/* our copy of *sq_tail */
+	unsigned	to_submit;
+	unsigned	*cq_head;
+	unsigned	*cq_tail;
+	unsigned	*cq_mask;
+	struct io_uring_cqe *cqes;
+	struct io_uring_sqe *sqes;
+	void		*ring;
+	size_t		ring_size;
+	size_t		sqes_size;
+	int		slots;		/* direct descriptors for appends */
+	int		next_slot;
+	unsigned long	enters;
+};
+
+/* operations that have to be there */
+static const int needed_ops[] = {
+	IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_WRITEV, IORING_OP_WRITE,
+	IORING_OP_POLL_ADD, IORING_OP_ASYNC_CANCEL, IORING_OP_OPENAT,
+	IORING_OP_CLOSE
+};
+
+#define NEEDED_FEATURES	(IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | \
+			 IORING_FEAT_RW_CUR_POS | IORING_FEAT_EXT_ARG)
+
+static int	probe(int fd);
+static struct io_uring_sqe *get_sqe(SOLAR_URING *ur);
+static int	submit(SOLAR_URING *ur, unsigned wait, int timeout_ms);
+
+/*
+ * solar_uring_new
+ *
+ * inputs	- ring size, more than are ever outstanding at once
+ *		- direct descriptors for solar_uring_append(), 0 if none
+ * output	- SOLAR_URING or NULL with errno set if io_uring can't
+ *		  be used
+ * side effects	- the ring is set up and mapped
+ */
+SOLAR_URING *
+solar_uring_new(unsigned entries, int slots)
+{
+	struct io_uring_params p;
+	SOLAR_URING *ur;
+	size_t cq_size;
+	int *fds;
+	int i;
+
+	if ((ur = calloc(1, sizeof(*ur))) == NULL)
+		return (NULL);
+	memset(&p, 0, sizeof(p));
+	if ((ur->fd = syscall(__NR_io_uring_setup, entries, &p)) < 0) {
+		free(ur);
+		return (NULL);
+	}
+	if ((p.features & NEEDED_FEATURES) != NEEDED_FEATURES ||
+	    probe(ur->fd) < 0) {
+		close(ur->fd);
+		free(ur);
+		errno = ENOSYS;
+		return (NULL);
+	}
+
+	/* one mapping for both rings, IORING_FEAT_SINGLE_MMAP */
+	ur->ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (cq_size > ur->ring_size)
+		ur->ring_size = cq_size;
+	ur->ring = mmap(NULL, ur->ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_SQ_RING);
+	ur->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ur->sqes = mmap(NULL, ur->sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_SQES);
+	if (ur->ring == MAP_FAILED || ur->sqes == MAP_FAILED)
+		goto fail;
+	ur->sq_head = (unsigned *)((char *)ur->ring + p.sq_off.head);
+	ur->sq_tail = (unsigned *)((char *)ur->ring + p.sq_off.tail);
+	ur->sq_mask = (unsigned *)((char *)ur->ring + p.sq_off.ring_mask);
+	ur->sq_array = (unsigned *)((char *)ur->ring + p.sq_off.array);
+	ur->sq_entries = p.sq_entries;
+	ur->tail = *ur->sq_tail;
+	ur->cq_head = (unsigned *)((char *)ur->ring + p.cq_off.head);
+	ur->cq_tail = (unsigned *)((char *)ur->ring + p.cq_off.tail);
+	ur->cq_mask = (unsigned *)((char *)ur->ring + p.cq_off.ring_mask);
+	ur->cqes = (struct io_uring_cqe *)((char *)ur->ring + p.cq_off.cqes);
+
+	if (slots > 0) {
+		/* all empty, openat fills them in */
+		if ((fds = malloc(slots * sizeof(*fds))) == NULL)
+			goto fail;
+		for (i = 0; i < slots; i++)
+			fds[i] = -1;
+		i = syscall(__NR_io_uring_register, ur->fd,
+			    IORING_REGISTER_FILES, fds, slots);
+		free(fds);
+		if (i < 0)
+			goto fail;
+		ur->slots = slots;
+	}
+	return (ur);
+
+fail:
+	i = errno;
+	solar_uring_free(ur);
+	errno = i;
+	return (NULL);
+}
+
+void
+solar_uring_free(SOLAR_URING *ur)
+{
+	if (ur == NULL)
+		return;
+	if (ur->sqes != NULL && ur->sqes != MAP_FAILED)
+		munmap(ur->sqes, ur->sqes_size);
+	if (ur->ring != NULL && ur->ring != MAP_FAILED)
+		munmap(ur->ring, ur->ring_size);
+	close(ur->fd);
+	free(ur);
+}
+
+/* completes with a new non blocking connection or -errno */
+int
+solar_uring_accept(SOLAR_URING *ur, int fd, uint64_t udata)
+{
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = get_sqe(ur)) == NULL)
+		return (-1);
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = fd;
+	sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+	sqe->user_data = udata;
+	return (0);
+}
+
+/* receive up to len bytes from a socket */
+int
+solar_uring_recv(SOLAR_URING *ur, int fd, void *buf, size_t len,
+		 uint64_t udata)
+{
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = get_sqe(ur)) == NULL)
+		return (-1);
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = len;
+	sqe->user_data = udata;
+	return (0);
+}
+
+/* write from iov, which must stay put too, at the current position */
+int
+solar_uring_writev(SOLAR_URING *ur, int fd, const struct iovec *iov,
+		   int cnt, uint64_t udata)
+{
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = get_sqe(ur)) == NULL)
+		return (-1);
+	sqe->opcode = IORING_OP_WRITEV;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)iov;
+	sqe->len = cnt;
+	sqe->off = (uint64_t)-1;
+	sqe->user_data = udata;
+	return (0);
+}
+
+int
+solar_uring_write(SOLAR_URING *ur, int fd, const void *buf, size_t len,
+		  uint64_t udata)
+{
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = get_sqe(ur)) == NULL)
+		return (-1);
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = len;
+	sqe->off = (uint64_t)-1;
+	sqe->user_data = udata;
+	return (0);
+}
+
+/* one shot, completes with the poll(2) revents */
+int
+solar_uring_poll(SOLAR_URING *ur, int fd, int events, uint64_t udata)
+{
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = get_sqe(ur)) == NULL)
+		return (-1);
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	events = ((unsigned)events << 16) | ((unsigned)events >> 16);
+#endif
+	sqe->poll32_events = events;
+	sqe->user_data = udata;
+	return (0);
+}
+
+/*
+ * Cancel the operation with udata target, it then completes with
+ * -ECANCELED, unless it already has. The cancel itself completes
+ * with udata 0.
+ */
+int
+solar_uring_cancel(SOLAR_URING *ur, uint64_t target)
+{
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = get_sqe(ur)) == NULL)
+		return (-1);
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = target;
+	sqe->user_data = 0;
+	return (0);
+}
+
+/*
+ * solar_uring_append
+ *
+ * inputs	- file to append to, created if need be
+ *		- what to append
+ *		- udata of the write
+ * output	- number of completions it will have, 3, or -1
+ * side effects	- open, write and close are queued, linked so each
+ *		  only runs if the one before worked. All three
+ *		  complete with udata, the first failure is the one
+ *		  that counts, later ones are -ECANCELED.
+ */
+int
+solar_uring_append(SOLAR_URING *ur, const char *path, const void *buf,
+		   size_t len, uint64_t udata)
+{
+	struct io_uring_sqe *sqe;
+	int slot;
+
+	if (ur->slots == 0 || ur->sq_entries - (ur->tail - *ur->sq_head) < 3) {
+		errno = ENOSPC;
+		return (-1);
+	}
+	slot = ur->next_slot;
+	ur->next_slot = (ur->next_slot + 1) % ur->slots;
+
+	sqe = get_sqe(ur);
+	sqe->opcode = IORING_OP_OPENAT;
+	sqe->fd = AT_FDCWD;
+	sqe->addr = (uintptr_t)path;
+	/* direct descriptors are never inherited, O_CLOEXEC is refused */
+	sqe->open_flags = O_WRONLY | O_APPEND | O_CREAT;
+	sqe->len = 0666;
+	sqe->file_index = slot + 1;
+	sqe->flags = IOSQE_IO_LINK;
+	sqe->user_data = udata;
+
+	sqe = get_sqe(ur);
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = slot;
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = len;
+	sqe->off = (uint64_t)-1;
+	sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+	sqe->user_data = udata;
+
+	sqe = get_sqe(ur);
+	sqe->opcode = IORING_OP_CLOSE;
+	sqe->file_index = slot + 1;
+	sqe->user_data = udata;
+	return (3);
+}
+
+/*
+ * solar_uring_enter
+ *
+ * inputs	- SOLAR_URING
+ *		- completions to wait for, 0 to only submit
+ *		- longest to wait, ms, -1 for as long as it takes
+ * output	- 0 or -1 with errno set
+ * side effects	- everything queued is submitted, running out of time
+ *		  or a signal is not an error
+ */
+int
+solar_uring_enter(SOLAR_URING *ur, unsigned wait, int timeout_ms)
+{
+	return (submit(ur, wait, timeout_ms));
+}
+
+/*
+ * solar_uring_next
+ *
+ * inputs	- SOLAR_URING
+ *		- where to return the udata and result of a completion
+ * output	- 1 if there was one, else 0
+ * side effects	- it is taken off the completion ring
+ */
+int
+solar_uring_next(SOLAR_URING *ur, uint64_t *udata, int *res)
+{
+	struct io_uring_cqe *cqe;
+	unsigned head;
+
+	head = *ur->cq_head;
+	if (head == __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE))
+		return (0);
+	cqe = &ur->cqes[head & *ur->cq_mask];
+	*udata = cqe->user_data;
+	*res = cqe->res;
+	__atomic_store_n(ur->cq_head, head + 1, __ATOMIC_RELEASE);
+	return (1);
+}
+
+/* io_uring_enter() calls so far, for statistics */
+unsigned long
+solar_uring_enters(SOLAR_URING *ur)
+{
+	return (ur->enters);
+}
+
+/* check the kernel has every operation used */
+static int
+probe(int fd)
+{
+	struct io_uring_probe *pr;
+	size_t size;
+	unsigned i;
+	int ok;
+
+	size = sizeof(*pr) + 256 * sizeof(struct io_uring_probe_op);
+	if ((pr = calloc(1, size)) == NULL)
+		return (-1);
+	ok = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE,
+		     pr, 256) == 0;
+	for (i = 0; ok && i < sizeof(needed_ops) / sizeof(needed_ops[0]);
+	     i++)
+		ok = needed_ops[i] <= pr->last_op &&
+		    (pr->ops[needed_ops[i]].flags & IO_URING_OP_SUPPORTED);
+	free(pr);
+	return (ok ? 0 : -1);
+}
+
+/*
+ * The next free submission entry, cleared and already made visible
+ * to the kernel, which only looks at it once it is entered. If the
+ * ring is full what is queued is submitted first.
+ */
+static struct io_uring_sqe *
+get_sqe(SOLAR_URING *ur)
+{
+	struct io_uring_sqe *sqe;
+	unsigned idx;
+
+	if (ur->tail - __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE) >=
+	    ur->sq_entries && (submit(ur, 0, 0) < 0 ||
+	    ur->tail - *ur->sq_head >= ur->sq_entries)) {
+		errno = EBUSY;
+		return (NULL);
+	}
+	idx = ur->tail & *ur->sq_mask;
+	sqe = &ur->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	ur->sq_array[idx] = idx;
+	ur->tail++;
+	__atomic_store_n(ur->sq_tail, ur->tail, __ATOMIC_RELEASE);
+	ur->to_submit++;
+	return (sqe);
+}
+
+static int
+submit(SOLAR_URING *ur, unsigned wait, int timeout_ms)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned flags;
+	int n;
+
+	flags = 0;
+	memset(&arg, 0, sizeof(arg));
+	if (wait > 0) {
+		flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+		if (timeout_ms >= 0) {
+			ts.tv_sec = timeout_ms / 1000;
+			ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+			arg.ts = (uintptr_t)&ts;
+		}
+	}
+	ur->enters++;
+	n = syscall(__NR_io_uring_enter, ur->fd, ur->to_submit, wait, flags,
+		    wait > 0 ? &arg : NULL, wait > 0 ? sizeof(arg) : 0);
+	if (n < 0) {
+		if (errno == ETIME || errno == EINTR)
+			return (0);
+		return (-1);
+	}
+	ur->to_submit -= n;
+	return (0);
+}
+
+#else /* !HAVE_IO_URING */
+
+/* ARGSUSED */
+SOLAR_URING *
+solar_uring_new(unsigned entries, int slots)
+{
+	errno = ENOSYS;
+	return (NULL);
+}
+
+/* ARGSUSED */
+void
+solar_uring_free(SOLAR_URING *ur)
+{
+}
+
+/* ARGSUSED */
+int
+solar_uring_accept(SOLAR_URING *ur, int fd, uint64_t udata)
+{
+	errno = ENOSYS;
+	return (-1);
+}
+
+/* ARGSUSED */
+int
+solar_uring_recv(SOLAR_URING *ur, int fd, void *buf, size_t len,
+		 uint64_t udata)
+{
+	errno = ENOSYS;
+	return (-1);
+}
+
+/* ARGSUSED */
+int
+solar_uring_writev(SOLAR_URING *ur, int fd, const struct iovec *iov,
+		   int cnt, uint64_t udata)
+{
+	errno = ENOSYS;
+	return (-1);
+}
+
+/* ARGSUSED */
+int
+solar_uring_write(SOLAR_URING *ur, int fd, const void *buf, size_t len,
+		  uint64_t udata)
+{
+	errno = ENOSYS;
+	return (-1);
+}
+
+/* ARGSUSED */
+int
+solar_uring_poll(SOLAR_URING *ur, int fd, int events, uint64_t udata)
+{
+	errno = ENOSYS;
+	return (-1);
+}
+
+/* ARGSUSED */
+int
+solar_uring_cancel(SOLAR_URING *ur, uint64_t target)
+{
+	errno = ENOSYS;
+	return (-1);
+}
+
+/* ARGSUSED */
+int
+solar_uring_append(SOLAR_URING *ur, const char *path, const void *buf,
+		   size_t len, uint64_t udata)
+{
+	errno = ENOSYS;
+	return (-1);
+}
+
+/* ARGSUSED */
+int
+solar_uring_enter(SOLAR_URING *ur, unsigned wait, int timeout_ms)
+{
+	errno = ENOSYS;
+	return (-1);
+}
+
+/* ARGSUSED */
+int
+solar_uring_next(SOLAR_URING *ur, uint64_t *udata, int *res)
+{
+	return (0);
+}
+
+/* ARGSUSED */
+unsigned long
+solar_uring_enters(SOLAR_URING *ur)
+{
+	return (0);
+}
+
+#endif /* HAVE_IO_URING */
@@ -0,0 +1,67 @@
+/* Copyright (c) 2023 Diane Bruce db@db.net
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#ifndef __SOLAR_URING_H__
+#define __SOLAR_URING_H__
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <stdint.h>
+
+/*
+ * Batched asynchronous I/O on Linux io_uring, see solar_uring.c
+ * Operations are only queued by the calls below, every one queued
+ * is submitted by the next solar_uring_enter(), which can wait for
+ * completions at the same time. Each completion carries the udata
+ * of its operation, 0 is kept for operations whose result is of no
+ * interest. Buffers must stay put until their operation completes.
+ *
+ * Without HAVE_IO_URING, or on a kernel without the operations used,
+ * solar_uring_new() returns NULL and callers use their plain system
+ * call path instead.
+ */
+typedef struct solar_uring SOLAR_URING;
+
+/* poll events for solar_uring_poll(), as poll(2) */
+#define SOLAR_URING_IN		0x001
+#define SOLAR_URING_OUT		0x004
+
+SOLAR_URING *solar_uring_new(unsigned entries, int slots);
+void	solar_uring_free(SOLAR_URING *ur);
+int	solar_uring_accept(SOLAR_URING *ur, int fd, uint64_t udata);
+int	solar_uring_recv(SOLAR_URING *ur, int fd, void *buf, size_t len,
+			 uint64_t udata);
+int	solar_uring_writev(SOLAR_URING *ur, int fd, const struct iovec *iov,
+			   int cnt, uint64_t udata);
+int	solar_uring_write(SOLAR_URING *ur, int fd, const void *buf,
+			  size_t len, uint64_t udata);
+int	solar_uring_poll(SOLAR_URING *ur, int fd, int events,
+			 uint64_t udata);
+int	solar_uring_cancel(SOLAR_URING *ur, uint64_t target);
+int	solar_uring_append(SOLAR_URING *ur, const char *path,
+			   const void *buf, size_t len, uint64_t udata);
+int	solar_uring_enter(SOLAR_URING *ur, unsigned wait, int timeout_ms);
+int	solar_uring_next(SOLAR_URING *ur, uint64_t *udata, int *res);
+unsigned long solar_uring_enters(SOLAR_URING *ur);
+
+#endif
@@ -0,0 +1,317 @@
+/* Copyright (c) 2023 Diane Bruce db@db.net
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Event trigger for the resident collector, much like the trigger
+ * on an oscilloscope.
+ *
+ * Faults and charge state changes are usually over long before the
+ * next stored sample. So every sample, taken every rate seconds, goes
+ * into a ring whether or not it is stored. A trigger fires on
+ *
+ *	- any change of the fault bits
+ *	- any change of charge state
+ *	- a field crossing a configured threshold e.g. bat_v<11.8,
+ *	  only on the crossing so a battery sitting low fires once
+ *
+ * The collector then samples every burst seconds for post seconds,
+ * and the whole window, from pre seconds before the trigger to post
+ * seconds after, is written out as one event: a JSON header line
+ *
+ * {"event":"bat_v<11.8","time":"...","ts":...,"pre":60,"post":120,
+ *  "retriggers":0,"samples":85}
+ *
+ * followed by that many JSON sample lines, which unlike the stored
+ * snapshots also carry charge_state and fault_bits. Triggers during
+ * the window are only counted in retriggers, except one on the very
+ * sample that ends it, which starts the next event once this one has
+ * been written out.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libsolar.h"
+#include "solar_format.h"
+#include "trigger.h"
+
+static int	check(TRIGGER *tr, const SOLAR_SNAPSHOT *snap, char *cause,
+		      size_t len);
+static int	append_sample(SOLAR_BUF *sb, const SOLAR_SAMPLE *sample);
+static void	start_capture(TRIGGER *tr, time_t when, const char *cause);
+
+void
+trigger_init(TRIGGER *tr)
+{
+	memset(tr, 0, sizeof(*tr));
+	(void)trigger_window(tr, TRIGGER_RATE_DEFAULT, TRIGGER_BURST_DEFAULT,
+			     TRIGGER_PRE_DEFAULT, TRIGGER_POST_DEFAULT);
+}
+
+/*
+ * trigger_window
+ *
+ * inputs	- TRIGGER
+ *		- seconds between samples normally and after a trigger
+ *		- seconds kept before and captured after a trigger
+ * output	- 0 or -1 if the window won't fit in the ring
+ * side effects	- none on error
+ */
+int
+trigger_window(TRIGGER *tr, int rate, int burst, int pre, int post)
+{
+	if (rate < 1 || burst < 1 || pre < 0 || post < 1)
+		return (-1);
+	if (pre / rate + post / burst + 2 > TRIGGER_RING)
+		return (-1);
+	tr->rate = rate;
+	tr->burst = burst;
+	tr->pre = pre;
+	tr->post = post;
+	return (0);
+}
+
+/*
+ * trigger_add
+ *
+ * inputs	- TRIGGER
+ *		- threshold as field<level or field>level
+ * output	- 0 or -1 if it can't be parsed or there are too many
+ */
+int
+trigger_add(TRIGGER *tr, const char *spec)
+{
+	TRIGGER_THRESHOLD *t;
+	char name[32];
+	const char *op;
+	char *end;
+	size_t len;
+
+	if (tr->nthreshold >= TRIGGER_MAX)
+		return (-1);
+	if ((op = strpbrk(spec, "<>")) == NULL)
+		return (-1);
+	len = op - spec;
+	if (len == 0 || len >= sizeof(name))
+		return (-1);
+	memcpy(name, spec, len);
+	name[len] = '\0';
+
+	t = &tr->threshold[tr->nthreshold];
+	if ((t->field = solar_snapshot_field(name)) < 0)
+		return (-1);
+	t->below = (*op == '<');
+	t->level = strtod(op + 1, &end);
+	if (end == op + 1 || *end != '\0')
+		return (-1);
+	tr->nthreshold++;
+	return (0);
+}
+
+/*
+ * trigger_sample
+ *
+ * inputs	- TRIGGER
+ *		- time and value of a sample
+ * output	- TRIGGER_IDLE, TRIGGER_CAPTURE or TRIGGER_DONE, after
+ *		  TRIGGER_DONE call trigger_event() before the next sample
+ * side effects	- sample is kept in the ring
+ */
+int
+trigger_sample(TRIGGER *tr, time_t when, const SOLAR_SNAPSHOT *snap)
+{
+	char cause[TRIGGER_CAUSE_MAX];
+	int fired;
+
+	if (tr->pending) {
+		/* fired as the last window ended, now it has been written */
+		start_capture(tr, tr->pending_fired, tr->pending_cause);
+		tr->pending = 0;
+	}
+	tr->ring[tr->head].when = when;
+	tr->ring[tr->head].snap = *snap;
+	tr->head = (tr->head + 1) % TRIGGER_RING;
+	if (tr->count < TRIGGER_RING)
+		tr->count++;
+
+	fired = tr->have_prev && check(tr, snap, cause, sizeof(cause));
+	tr->prev = *snap;
+	tr->have_prev = 1;
+
+	if (tr->active) {
+		if (when - tr->fired < tr->post) {
+			if (fired)
+				tr->retriggers++;
+			return (TRIGGER_CAPTURE);
+		}
+		tr->active = 0;
+		tr->events++;
+		if (fired) {
+			/* a crossing only happens once, keep it for later */
+			tr->pending = 1;
+			tr->pending_fired = when;
+			strlcpy(tr->pending_cause, cause,
+				sizeof(tr->pending_cause));
+		}
+		return (TRIGGER_DONE);
+	}
+	if (!fired)
+		return (TRIGGER_IDLE);
+	start_capture(tr, when, cause);
+	return (TRIGGER_CAPTURE);
+}
+
+static void
+start_capture(TRIGGER *tr, time_t when, const char *cause)
+{
+	tr->active = 1;
+	tr->fired = when;
+	tr->retriggers = 0;
+	strlcpy(tr->cause, cause, sizeof(tr->cause));
+}
+
+/*
+ * trigger_interval
+ *
+ * output	- seconds until the next sample is wanted
+ */
+int
+trigger_interval(TRIGGER *tr)
+{
+	return (tr->active || tr->pending ? tr->burst : tr->rate);
+}
+
+/*
+ * trigger_event
+ *
+ * inputs	- TRIGGER, just returned TRIGGER_DONE
+ *		- SOLAR_BUF to append the event to
+ * output	- 0 or -1 if out of memory
+ */
+int
+trigger_event(TRIGGER *tr, SOLAR_BUF *sb)
+{
+	char hdr[TRIGGER_CAUSE_MAX + 200];
+	char *p;
+	int first;
+	int n;
+	int i;
+
+	first = (tr->head - tr->count + TRIGGER_RING) % TRIGGER_RING;
+	n = tr->count;
+	while (n > 0 && tr->ring[first].when < tr->fired - tr->pre) {
+		first = (first + 1) % TRIGGER_RING;
+		n--;
+	}
+
+	p = stpcpy(hdr, "{\"event\":\"");
+	p = stpcpy(p, tr->cause);
+	p = stpcpy(p, "\",\"time\":\"");
+	p = solar_fmt_time(p, tr->fired);
+	p = stpcpy(p, "\",\"ts\":");
+	p = solar_fmt_int(p, (long)tr->fired);
+	p = stpcpy(p, ",\"pre\":");
+	p = solar_fmt_int(p, tr->pre);
+	p = stpcpy(p, ",\"post\":");
+	p = solar_fmt_int(p, tr->post);
+	p = stpcpy(p, ",\"retriggers\":");
+	p = solar_fmt_int(p, tr->retriggers);
+	p = stpcpy(p, ",\"samples\":");
+	p = solar_fmt_int(p, n);
+	p = stpcpy(p, "}\n");
+	if (solar_buf_append(sb, hdr, p - hdr) < 0)
+		return (-1);
+
+	for (i = 0; i < n; i++)
+		if (append_sample(sb, &tr->ring[(first + i) % TRIGGER_RING])
+		    < 0)
+			return (-1);
+	return (0);
+}
+
+/*
+ * check
+ *
+ * inputs	- TRIGGER with the previous sample
+ *		- new sample
+ *		- buffer for what fired
+ * output	- 1 if a trigger fired
+ */
+static int
+check(TRIGGER *tr, const SOLAR_SNAPSHOT *snap, char *cause, size_t len)
+{
+	TRIGGER_THRESHOLD *t;
+	double prev;
+	double cur;
+	int i;
+
+	if (snap->fault_bits != tr->prev.fault_bits) {
+		snprintf(cause, len, "fault_bits 0x%x->0x%x",
+			 tr->prev.fault_bits, snap->fault_bits);
+		return (1);
+	}
+	if (snap->charge_state != tr->prev.charge_state) {
+		snprintf(cause, len, "charge_state %s->%s",
+			 solar_charge_state(tr->prev.charge_state),
+			 solar_charge_state(snap->charge_state));
+		return (1);
+	}
+	for (i = 0; i < tr->nthreshold; i++) {
+		t = &tr->threshold[i];
+		prev = solar_snapshot_value(&tr->prev, t->field);
+		cur = solar_snapshot_value(snap, t->field);
+		if (t->below ? (prev >= t->level && cur < t->level) :
+		    (prev <= t->level && cur > t->level)) {
+			snprintf(cause, len, "%s%c%g",
+				 solar_snapshot_name(t->field),
+				 t->below ? '<' : '>', t->level);
+			return (1);
+		}
+	}
+	return (0);
+}
+
+/*
+ * A JSON snapshot record with charge_state and fault_bits added
+ * before its closing brace.
+ */
+static int
+append_sample(SOLAR_BUF *sb, const SOLAR_SAMPLE *sample)
+{
+	char extra[64];
+	char *p;
+
+	if (solar_format_snapshot(sb, SOLAR_FMT_JSON, sample->when,
+				  &sample->snap) < 0)
+		return (-1);
+	sb->len -= 2;			/* "}\n" */
+	p = stpcpy(extra, ",\"charge_state\":");
+	p = solar_fmt_int(p, sample->snap.charge_state);
+	p = stpcpy(p, ",\"fault_bits\":");
+	p = solar_fmt_int(p, sample->snap.fault_bits);
+	p = stpcpy(p, "}\n");
+	return (solar_buf_append(sb, extra, p - extra));
+}
@@ -0,0 +1,87 @@
+/* Copyright (c) 2023 Diane Bruce db@db.net
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#ifndef __TRIGGER_H__
+#define __TRIGGER_H__
+
+#include <time.h>
+#include "libsolar.h"
+#include "solar_format.h"
+
+#define TRIGGER_RING		512	/* samples, pre plus post window */
+#define TRIGGER_MAX		8	/* threshold triggers */
+#define TRIGGER_CAUSE_MAX	64
+
+/* Defaults, seconds */
+#define TRIGGER_RATE_DEFAULT	2	/* sampling into the ring */
+#define TRIGGER_BURST_DEFAULT	1	/* sampling after a trigger */
+#define TRIGGER_PRE_DEFAULT	60
+#define TRIGGER_POST_DEFAULT	120
+
+/* trigger_sample() returns */
+#define TRIGGER_IDLE		0
+#define TRIGGER_CAPTURE		1	/* burst polling */
+#define TRIGGER_DONE		2	/* event ready for trigger_event() */
+
+typedef struct {
+	int	field;		/* solar_snapshot_field() index */
+	int	below;		/* fire on falling below, else rising above */
+	double	level;
+} TRIGGER_THRESHOLD;
+
+/*
+ * Trigger engine state, see trigger.c
+ */
+typedef struct {
+	int	rate;
+	int	burst;
+	int	pre;
+	int	post;
+	int	nthreshold;
+	TRIGGER_THRESHOLD threshold[TRIGGER_MAX];
+
+	SOLAR_SAMPLE ring[TRIGGER_RING];
+	int	head;		/* next slot written */
+	int	count;
+
+	int	have_prev;
+	SOLAR_SNAPSHOT prev;
+
+	int	active;		/* capturing the post trigger window */
+	time_t	fired;
+	char	cause[TRIGGER_CAUSE_MAX];
+	int	retriggers;	/* further triggers during the window */
+	int	pending;	/* fired as the window ended, see trigger.c */
+	time_t	pending_fired;
+	char	pending_cause[TRIGGER_CAUSE_MAX];
+	long	events;
+} TRIGGER;
+
+void	trigger_init(TRIGGER *tr);
+int	trigger_window(TRIGGER *tr, int rate, int burst, int pre, int post);
+int	trigger_add(TRIGGER *tr, const char *spec);
+int	trigger_sample(TRIGGER *tr, time_t when, const SOLAR_SNAPSHOT *snap);
+int	trigger_interval(TRIGGER *tr);
+int	trigger_event(TRIGGER *tr, SOLAR_BUF *sb);
+
+#endif
@@ -28,6 +28,7 @@
 #include <string.h>
 #include <libpq-fe.h>
 #include "config_parser.h"
+#include "snapshot.h"
 #include "update_database.h"
 
 /*
@@ -86,9 +87,8 @@ update_database(const char *dbhost, const char *dbport,
 	data_in = p + 1;
 	
 	asprintf(&sql,
-		 "INSERT INTO %s(date_time,array_v,array_a,array_w,"
-		"soc,bat_v,bat_a,load_v,load_a) "
-		 "values (timestamp'%s',%s);",dbtable, date_time, data_in);
+		 "INSERT INTO %s(%s) values (timestamp'%s',%s);",
+		 dbtable, snapshot_columns(data_in), date_time, data_in);
 
 	pg_result = PQexec(pg_conn, sql);
 	*p = ',';
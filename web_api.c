@@ -0,0 +1,584 @@
+/* Copyright (c) 2023 Diane Bruce db@db.net
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * JSON API for web_status.
+ *
+ *	/api/status		live values
+ *	/api/info		everything in SOLAR_INFO
+ *	/api/history?from=&to=	per day history as one array per column
+ *
+ * Replies are compact JSON written member by member into the
+ * response buffer with the SOLAR_JSON writer, that buffer is reused
+ * for every request so a steady stream of polls allocates nothing.
+ * Every reply has "ts", when the data was read, and "age" in
+ * seconds, also sent as an X-Data-Age header.
+ *
+ * /stream is Server-Sent Events, one "status" event with the
+ * /api/status object each time the live values are read. The event
+ * is rendered once and the same bytes queued for every subscriber.
+ *
+ * /metrics is the same cached state for Prometheus, along with the
+ * modbus, register group and HTTP statistics. A scrape never causes
+ * a modbus transaction.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "http_server.h"
+#include "libsolar.h"
+#include "solar_archive.h"
+#include "solar_format.h"
+#include "web_api.h"
+#include "web_cache.h"
+
+#define API_HISTORY_DAYS	10	/* default span of /api/history */
+#define STREAM_RETRY		5000	/* ms before an SSE client reconnects */
+#define SERIES_POINTS		800	/* default points from /api/series */
+#define SERIES_POINTS_MAX	5000
+#define SERIES_SPAN		86400	/* default seconds before "to" */
+
+static void	api_status(HTTP_RESPONSE *resp, WEB_CACHE *cache);
+static void	status_json(SOLAR_JSON *js, const SOLAR_INFO *info,
+			    time_t when, long age);
+static int	stream_event(SOLAR_BUF *sb, WEB_CACHE *cache, time_t *when);
+static void	api_info(HTTP_RESPONSE *resp, WEB_CACHE *cache);
+static void	api_history(HTTP_REQUEST *req, HTTP_RESPONSE *resp,
+			    WEB_CACHE *cache);
+static void	api_series(HTTP_REQUEST *req, HTTP_RESPONSE *resp);
+static void	api_error(HTTP_RESPONSE *resp, int status, const char *msg);
+static void	api_finish(HTTP_RESPONSE *resp, SOLAR_JSON *js);
+static void	metrics_modbus(SOLAR_BUF *sb, const MODBUS_STATS *m);
+static void	metrics_groups(SOLAR_BUF *sb,
+			       const SOLAR_GROUP group[SOLAR_GROUPS]);
+static void	metrics_http(SOLAR_BUF *sb, const HTTP_STATS *h);
+
+static const char *group_names[SOLAR_GROUPS] = {
+	"ident", "live", "settings", "history"
+};
+
+static SOLAR_ARCHIVE *archive;
+
+/*
+ * web_api_archive
+ *
+ * inputs	- the csv archive, shared with the status page charts
+ * output	- none
+ * side effects	- /api/series reads it, it is indexed on first use
+ */
+void
+web_api_archive(SOLAR_ARCHIVE *ar)
+{
+	archive = ar;
+}
+
+/*
+ * web_api
+ *
+ * inputs	- parsed request
+ *		- response to fill in
+ *		- WEB_CACHE to answer from
+ * output	- 1 if this was an /api/ request, 0 if not
+ * side effects	- JSON reply is rendered into resp->body
+ */
+int
+web_api(HTTP_REQUEST *req, HTTP_RESPONSE *resp, WEB_CACHE *cache)
+{
+	const char *name;
+
+	if (strncmp(req->path, "/api/", 5) != 0)
+		return (0);
+	name = req->path + 5;
+	resp->content_type = "application/json";
+	if (strcmp(name, "status") == 0)
+		api_status(resp, cache);
+	else if (strcmp(name, "info") == 0)
+		api_info(resp, cache);
+	else if (strcmp(name, "history") == 0)
+		api_history(req, resp, cache);
+	else if (strcmp(name, "series") == 0)
+		api_series(req, resp);
+	else
+		api_error(resp, 404, "not found");
+	return (1);
+}
+
+/*
+ * web_stream
+ *
+ * inputs	- response to fill in
+ *		- WEB_CACHE
+ * output	- none
+ * side effects	- the connection becomes a /stream subscriber and is
+ *		  sent the latest status straight away
+ */
+void
+web_stream(HTTP_RESPONSE *resp, WEB_CACHE *cache)
+{
+	time_t when;
+
+	resp->content_type = "text/event-stream";
+	resp->stream = 1;
+	http_add_header(resp, "Cache-Control", "no-cache");
+	solar_buf_printf(resp->body, "retry: %d\n\n", STREAM_RETRY);
+	(void)stream_event(resp->body, cache, &when);
+}
+
+/*
+ * web_stream_notify
+ *
+ * inputs	- HTTP_SERVER
+ *		- WEB_CACHE
+ * output	- none
+ * side effects	- new live values are broadcast to /stream subscribers,
+ *		  a worker exits if the refresher's process has gone
+ *
+ * Called when the refresher has updated the cache, only a change
+ * of the live values makes an event.
+ */
+void
+web_stream_notify(HTTP_SERVER *srv, void *arg)
+{
+	static SOLAR_BUF event;
+	static time_t last_sent;
+	WEB_CACHE *cache;
+	time_t when;
+
+	cache = arg;
+	if (web_cache_drain(cache) < 0)
+		exit(0);		/* refresher is gone */
+	if (http_server_stats(srv)->streams == 0)
+		return;
+	solar_buf_reset(&event);
+	if (stream_event(&event, cache, &when) < 0 || when == last_sent)
+		return;
+	last_sent = when;
+	http_server_broadcast(srv, event.buf, event.len);
+}
+
+/* one SSE status event, -1 if there is nothing to send yet */
+static int
+stream_event(SOLAR_BUF *sb, WEB_CACHE *cache, time_t *when)
+{
+	SOLAR_JSON js;
+	SOLAR_INFO info;
+	long age;
+
+	if (web_cache_info(cache, &info, when) != SOLAR_OK)
+		return (-1);
+	age = time(NULL) - *when;
+	if (solar_buf_printf(sb, "id: %ld\nevent: status\ndata: ",
+			     (long)*when) < 0)
+		return (-1);
+	solar_json_init(&js, sb);
+	status_json(&js, &info, *when, age < 0 ? 0 : age);
+	if (solar_json_finish(&js) < 0 ||
+	    solar_buf_append(sb, "\n\n", 2) < 0)
+		return (-1);
+	return (0);
+}
+
+/*
+ * web_data_age
+ *
+ * inputs	- response
+ *		- when the data it carries was read
+ * output	- age in seconds
+ * side effects	- X-Data-Age header is added
+ */
+long
+web_data_age(HTTP_RESPONSE *resp, time_t when)
+{
+	char age[24];
+	long secs;
+
+	secs = time(NULL) - when;
+	if (secs < 0)
+		secs = 0;
+	snprintf(age, sizeof(age), "%ld", secs);
+	http_add_header(resp, "X-Data-Age", age);
+	return (secs);
+}
+
+/*
+ * web_metrics
+ *
+ * inputs	- response to fill in
+ *		- WEB_CACHE to answer from
+ *		- statistics of the HTTP server answering
+ * output	- none
+ * side effects	- Prometheus text format is rendered into resp->body
+ */
+void
+web_metrics(HTTP_RESPONSE *resp, WEB_CACHE *cache, const HTTP_STATS *http)
+{
+	SOLAR_BUF *sb;
+	SOLAR_INFO info;
+	MODBUS_STATS modbus;
+	SOLAR_GROUP group[SOLAR_GROUPS];
+	time_t when;
+	int error;
+
+	sb = resp->body;
+	resp->content_type = "text/plain; version=0.0.4; charset=utf-8";
+	error = web_cache_info(cache, &info, &when);
+	solar_buf_printf(sb, "# TYPE solar_up gauge\nsolar_up %d\n",
+			 error == SOLAR_OK);
+	if (error == SOLAR_OK) {
+		solar_buf_printf(sb, "# TYPE solar_data_age_seconds gauge\n"
+				 "solar_data_age_seconds %ld\n",
+				 web_data_age(resp, when));
+		if (solar_format_metrics(sb, &info) < 0) {
+			resp->status = 500;
+			return;
+		}
+	}
+	web_cache_bus(cache, &modbus, group);
+	metrics_modbus(sb, &modbus);
+	metrics_groups(sb, group);
+	metrics_http(sb, http);
+}
+
+static void
+metrics_modbus(SOLAR_BUF *sb, const MODBUS_STATS *m)
+{
+	unsigned long count;
+	int i;
+
+	solar_buf_printf(sb,
+	    "# TYPE solar_modbus_requests_total counter\n"
+	    "solar_modbus_requests_total %lu\n"
+	    "# TYPE solar_modbus_errors_total counter\n"
+	    "solar_modbus_errors_total{error=\"timeout\"} %lu\n"
+	    "solar_modbus_errors_total{error=\"crc\"} %lu\n"
+	    "solar_modbus_errors_total{error=\"exception\"} %lu\n"
+	    "solar_modbus_errors_total{error=\"bad_reply\"} %lu\n",
+	    m->requests, m->timeouts, m->crc_errors, m->exceptions,
+	    m->bad_replies);
+
+	solar_buf_printf(sb, "# TYPE solar_modbus_latency_seconds histogram\n");
+	count = 0;
+	for (i = 0; i < MODBUS_LATENCY_BUCKETS - 1; i++) {
+		count += m->latency_bucket[i];
+		solar_buf_printf(sb, "solar_modbus_latency_seconds_bucket"
+				 "{le=\"%g\"} %lu\n",
+				 modbus_latency_bound[i], count);
+	}
+	solar_buf_printf(sb,
+	    "solar_modbus_latency_seconds_bucket{le=\"+Inf\"} %lu\n"
+	    "solar_modbus_latency_seconds_sum %.6f\n"
+	    "solar_modbus_latency_seconds_count %lu\n"
+	    "# TYPE solar_modbus_latency_max_seconds gauge\n"
+	    "solar_modbus_latency_max_seconds %.6f\n",
+	    m->replies, m->latency_sum, m->replies, m->latency_max);
+}
+
+static void
+metrics_groups(SOLAR_BUF *sb, const SOLAR_GROUP group[SOLAR_GROUPS])
+{
+	int i;
+
+	solar_buf_printf(sb, "# TYPE solar_group_reads_total counter\n");
+	for (i = 0; i < SOLAR_GROUPS; i++)
+		solar_buf_printf(sb, "solar_group_reads_total{group=\"%s\"} "
+				 "%ld\n", group_names[i], group[i].reads);
+	solar_buf_printf(sb, "# TYPE solar_group_errors_total counter\n");
+	for (i = 0; i < SOLAR_GROUPS; i++)
+		solar_buf_printf(sb, "solar_group_errors_total{group=\"%s\"} "
+				 "%ld\n", group_names[i], group[i].errors);
+	solar_buf_printf(sb, "# TYPE solar_group_cost_seconds gauge\n");
+	for (i = 0; i < SOLAR_GROUPS; i++)
+		solar_buf_printf(sb, "solar_group_cost_seconds{group=\"%s\"} "
+				 "%.3f\n", group_names[i],
+				 group[i].cost / 1000.0);
+	solar_buf_printf(sb,
+			 "# TYPE solar_group_last_read_seconds gauge\n");
+	for (i = 0; i < SOLAR_GROUPS; i++)
+		solar_buf_printf(sb, "solar_group_last_read_seconds"
+				 "{group=\"%s\"} %ld\n", group_names[i],
+				 (long)group[i].last);
+}
+
+static void
+metrics_http(SOLAR_BUF *sb, const HTTP_STATS *h)
+{
+	int i;
+
+	solar_buf_printf(sb,
+	    "# TYPE solar_http_connections_total counter\n"
+	    "solar_http_connections_total %lu\n"
+	    "# TYPE solar_http_refused_total counter\n"
+	    "solar_http_refused_total %lu\n"
+	    "# TYPE solar_http_timeouts_total counter\n"
+	    "solar_http_timeouts_total %lu\n"
+	    "# TYPE solar_http_requests_total counter\n"
+	    "solar_http_requests_total %lu\n"
+	    "# TYPE solar_http_render_seconds_total counter\n"
+	    "solar_http_render_seconds_total %.6f\n"
+	    "# TYPE solar_http_render_max_seconds gauge\n"
+	    "solar_http_render_max_seconds %.6f\n"
+	    "# TYPE solar_http_sent_bytes_total counter\n"
+	    "solar_http_sent_bytes_total %lu\n"
+	    "# TYPE solar_http_streams gauge\n"
+	    "solar_http_streams %lu\n"
+	    "# TYPE solar_http_streams_dropped_total counter\n"
+	    "solar_http_streams_dropped_total %lu\n"
+	    "# TYPE solar_http_io_calls_total counter\n"
+	    "solar_http_io_calls_total %lu\n"
+	    "# TYPE solar_buf_grows_total counter\n"
+	    "solar_buf_grows_total %lu\n"
+	    "# TYPE solar_http_uring_workers gauge\n"
+	    "solar_http_uring_workers %lu\n"
+	    "# TYPE solar_http_responses_total counter\n",
+	    h->accepted, h->refused, h->timeouts, h->requests,
+	    h->render_sum, h->render_max, h->bytes_out, h->streams,
+	    h->dropped, h->io_calls, h->buf_grows, h->uring);
+	for (i = 1; i < 6; i++)
+		solar_buf_printf(sb, "solar_http_responses_total"
+				 "{code=\"%dxx\"} %lu\n", i, h->status[i]);
+}
+
+static void
+api_status(HTTP_RESPONSE *resp, WEB_CACHE *cache)
+{
+	SOLAR_JSON js;
+	SOLAR_INFO info;
+	time_t when;
+	int error;
+
+	if ((error = web_cache_info(cache, &info, &when)) != SOLAR_OK) {
+		api_error(resp, 503, solar_strerror(error));
+		return;
+	}
+	solar_json_init(&js, resp->body);
+	status_json(&js, &info, when, web_data_age(resp, when));
+	api_finish(resp, &js);
+}
+
+/* the /api/status object, also the data of each /stream event */
+static void
+status_json(SOLAR_JSON *js, const SOLAR_INFO *info, time_t when, long age)
+{
+	solar_json_object(js, NULL);
+	solar_json_int(js, "ts", (long)when);
+	solar_json_int(js, "age", age);
+	solar_json_float(js, "array_v", info->array_v, 1);
+	solar_json_float(js, "array_a", info->array_a, 2);
+	solar_json_int(js, "array_w", info->array_w);
+	solar_json_float(js, "bat_v", info->bat_v, 1);
+	solar_json_float(js, "bat_a", info->bat_a, 2);
+	solar_json_int(js, "soc", info->soc);
+	solar_json_int(js, "bat_temp", info->bat_temp);
+	solar_json_string(js, "charging_state", info->charging_state);
+	solar_json_float(js, "load_v", info->load_v, 1);
+	solar_json_float(js, "load_a", info->load_a, 2);
+	solar_json_int(js, "device_temp", info->device_temp);
+	solar_json_int(js, "power_gen_today", info->power_gen_today);
+	solar_json_int(js, "power_con_today", info->power_con_today);
+	solar_json_int(js, "fault_bits", info->fault_bits);
+	solar_json_end(js);
+}
+
+static void
+api_info(HTTP_RESPONSE *resp, WEB_CACHE *cache)
+{
+	SOLAR_JSON js;
+	SOLAR_INFO info;
+	time_t when;
+	int error;
+
+	if ((error = web_cache_info(cache, &info, &when)) != SOLAR_OK) {
+		api_error(resp, 503, solar_strerror(error));
+		return;
+	}
+	solar_json_init(&js, resp->body);
+	solar_json_object(&js, NULL);
+	solar_json_int(&js, "ts", (long)when);
+	solar_json_int(&js, "age", web_data_age(resp, when));
+	solar_json_info(&js, &info);
+	solar_json_end(&js);
+	api_finish(resp, &js);
+}
+
+/*
+ * api_history
+ * Days from .. to, 0 is today. While history is still being read
+ * "count" may be short of to - from + 1.
+ */
+static void
+api_history(HTTP_REQUEST *req, HTTP_RESPONSE *resp, WEB_CACHE *cache)
+{
+	SOLAR_HISTORY_COLUMNS h;
+	SOLAR_JSON js;
+	time_t when;
+	long from;
+	long to;
+	int error;
+
+	from = 0;
+	to = API_HISTORY_DAYS - 1;
+	if (http_query_int(req, "from", &from) < 0 ||
+	    http_query_int(req, "to", &to) < 0 ||
+	    from < 0 || to < from) {
+		api_error(resp, 400, "bad from or to");
+		return;
+	}
+	if (from >= MAX_DAYS_HISTORY) {
+		api_error(resp, 400, "from is past the oldest day kept");
+		return;
+	}
+	if (to >= MAX_DAYS_HISTORY)
+		to = MAX_DAYS_HISTORY - 1;
+	if ((error = web_cache_history(cache, from, to, &h, &when))
+	    != SOLAR_OK) {
+		api_error(resp, 503, solar_strerror(error));
+		return;
+	}
+	solar_json_init(&js, resp->body);
+	solar_json_object(&js, NULL);
+	solar_json_int(&js, "ts", (long)when);
+	solar_json_int(&js, "age", web_data_age(resp, when));
+	solar_json_int(&js, "from", h.first);
+	solar_json_int(&js, "count", h.count);
+	solar_json_floats(&js, "bat_min_v", h.bat_min_v, h.count, 1);
+	solar_json_floats(&js, "bat_max_v", h.bat_max_v, h.count, 1);
+	solar_json_floats(&js, "bat_max_charge_a", h.bat_max_charge_a,
+			  h.count, 2);
+	solar_json_floats(&js, "bat_max_discharge_a", h.bat_max_discharge_a,
+			  h.count, 2);
+	solar_json_floats(&js, "bat_max_charge_w", h.bat_max_charge_w,
+			  h.count, 1);
+	solar_json_floats(&js, "bat_max_discharge_w", h.bat_max_discharge_w,
+			  h.count, 1);
+	solar_json_floats(&js, "bat_charge_ah", h.bat_charge_ah, h.count, 0);
+	solar_json_floats(&js, "bat_discharge_ah", h.bat_discharge_ah,
+			  h.count, 0);
+	solar_json_floats(&js, "bat_charge_kwh", h.bat_charge_kwh,
+			  h.count, 3);
+	solar_json_floats(&js, "bat_discharge_kwh", h.bat_discharge_kwh,
+			  h.count, 3);
+	solar_json_end(&js);
+	api_finish(resp, &js);
+}
+
+/*
+ * api_series
+ * One snapshot field from the csv archive, from .. to in seconds
+ * since the epoch, downsampled to at most "points" samples. "rows"
+ * is how many samples there were.
+ */
+static void
+api_series(HTTP_REQUEST *req, HTTP_RESPONSE *resp)
+{
+	static SOLAR_POINT *out;
+	char name[32];
+	SOLAR_JSON js;
+	long from;
+	long to;
+	long points;
+	long rows;
+	int field;
+	int n;
+	int i;
+
+	if (archive == NULL) {
+		api_error(resp, 404, "no csvfilename configured");
+		return;
+	}
+	if (http_query(req, "field", name, sizeof(name)) != 1 ||
+	    (field = solar_snapshot_field(name)) < 0) {
+		api_error(resp, 400, "bad or missing field");
+		return;
+	}
+	to = time(NULL);
+	points = SERIES_POINTS;
+	if (http_query_int(req, "to", &to) < 0 ||
+	    http_query_int(req, "points", &points) < 0 ||
+	    points < 3 || points > SERIES_POINTS_MAX) {
+		api_error(resp, 400, "bad to or points");
+		return;
+	}
+	from = to - SERIES_SPAN;
+	if (http_query_int(req, "from", &from) < 0 || from > to) {
+		api_error(resp, 400, "bad from");
+		return;
+	}
+	if (out == NULL &&
+	    (out = malloc(SERIES_POINTS_MAX * sizeof(*out))) == NULL) {
+		api_error(resp, 503, "out of memory");
+		return;
+	}
+	n = solar_archive_series(archive, field, from, to, out, points,
+				 &rows);
+	if (n < 0) {
+		api_error(resp, 503, strerror(errno));
+		return;
+	}
+	solar_json_init(&js, resp->body);
+	solar_json_object(&js, NULL);
+	solar_json_string(&js, "field", name);
+	solar_json_int(&js, "from", from);
+	solar_json_int(&js, "to", to);
+	solar_json_int(&js, "rows", rows);
+	solar_json_int(&js, "count", n);
+	solar_json_array(&js, "t");
+	for (i = 0; i < n; i++)
+		solar_json_int(&js, NULL, (long)out[i].when);
+	solar_json_end(&js);
+	solar_json_array(&js, "v");
+	for (i = 0; i < n; i++)
+		solar_json_float(&js, NULL, out[i].value,
+				 solar_snapshot_decimals(field));
+	solar_json_end(&js);
+	solar_json_end(&js);
+	api_finish(resp, &js);
+}
+
+/* {"error":"..."} with the given status */
+static void
+api_error(HTTP_RESPONSE *resp, int status, const char *msg)
+{
+	SOLAR_JSON js;
+
+	resp->status = status;
+	if (status == 503)
+		http_add_header(resp, "Retry-After", "5");
+	solar_buf_reset(resp->body);
+	solar_json_init(&js, resp->body);
+	solar_json_object(&js, NULL);
+	solar_json_string(&js, "error", msg);
+	solar_json_end(&js);
+	(void)solar_json_finish(&js);
+}
+
+static void
+api_finish(HTTP_RESPONSE *resp, SOLAR_JSON *js)
+{
+	if (solar_json_finish(js) < 0)
+		api_error(resp, 500, "out of memory");
+}
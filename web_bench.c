@@ -0,0 +1,1014 @@
+/* Copyright (c) 2023 Diane Bruce db@db.net
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * web_bench
+ *
+ * Load test for web_status. A number of connections are kept busy,
+ * each sending its next request as soon as the last was answered,
+ * until -n requests have been made or -t seconds have gone by.
+ * The paths asked for are drawn at random, in proportion to their
+ * weights, from a mix given with -m path[:weight], once per path.
+ * Without -m a dashboard's mix of pages and API calls is used.
+ * With -k connections are kept alive between requests, without it
+ * each request has a connection of its own, as ab(1) does.
+ *
+ * Throughput, latency percentiles overall and per path, and from
+ * web_status /metrics before and after, whether it is on io_uring and
+ * the calls http_server.c counts itself are reported. Those are only
+ * its socket and poller calls and SOLAR_BUF growth, not what handlers,
+ * stdio or zlib do, so they are no per request total. For that run
+ * web_status under strace -c -f or truss -c for system calls, and
+ * with malloc_count.so preloaded and -a given for every allocation.
+ * Latency is from starting the request, its connect included without
+ * -k, until the last byte of the reply.
+ *
+ * With -x nothing is timed, instead requests the server must refuse,
+ * with a nul in them and so on, are sent one at a time and each must
+ * be answered with a 400 by a server that is still up afterwards.
+ *
+ * No hardware is needed, run web_status with modport given as
+ * solar_sim's terminal, and its csvfilename as any captured archive
+ * for solar_sim -r to replay.
+ *
+ * e.g. web_bench -h pi.local -c 16 -k -t 30
+ *	web_bench -c 4 -m / -m '/history?0,30:2' -m /api/status:10
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "config_parser.h"
+#include "malloc_count.h"
+#include "solar_config.h"
+
+extern char *optarg;
+extern int optind;
+
+#define MAXBUF		1024
+#define INBUF		16384	/* reply headers must fit */
+#define MIX_MAX		32
+#define CONNS_MAX	1024
+#define STATUS_MAX	600
+
+char *remotehost=NULL;
+
+PARSE_ITEMS parse_table = {{"remotehost", &remotehost},
+			    {NULL,NULL}};
+
+/* one path of the request mix */
+typedef struct {
+	char		*path;
+	int		weight;
+	long		count;
+} MIX;
+
+/* one answered request */
+typedef struct {
+	float		ms;
+	short		mix;
+} SAMPLE;
+
+/* how far a reply has been read */
+#define READ_HEADERS	0
+#define READ_LENGTH	1	/* Content-Length bytes */
+#define READ_CHUNK_SIZE	2
+#define READ_CHUNK	3	/* chunk and its CRLF */
+#define READ_TRAILER	4
+#define READ_CLOSE	5	/* until the server closes */
+#define READ_DONE	6
+
+typedef struct {
+	int		fd;
+	int		connecting;
+	int		mix;
+	char		out[MAXBUF];
+	int		outlen;
+	int		outoff;
+	char		in[INBUF];
+	int		inlen;
+	int		state;
+	int		status;
+	int		close;		/* server will close after this */
+	long long	left;
+	struct timespec	start;
+} CONN;
+
+/* counters scraped from /metrics */
+typedef struct {
+	double		requests;
+	double		io_calls;	/* by http_server.c only */
+	double		buf_grows;
+	double		connections;
+	double		uring;		/* workers on io_uring */
+} METRICS;
+
+static MIX mix[MIX_MAX];
+static int nmix;
+static int total_weight;
+
+static struct sockaddr_storage addr;
+static socklen_t addrlen;
+static char *hostname;
+static int keepalive;
+static int gzip_ok;
+static char *count_file;	/* -a, see malloc_count.c */
+
+static SAMPLE *samples;
+static long nsamples;
+static long maxsamples;
+static long status_count[STATUS_MAX];
+static long connect_errors;
+static long read_errors;
+static long timeouts;
+static long long bytes_read;
+static long started;
+
+static const char *default_mix[] = {
+	"/:4",
+	"/api/status:8",
+	"/history?0,6:1",
+	"/api/history?0,30:1",
+	"/api/series?field=bat_v:1",
+	"/style.css:2",
+	NULL
+};
+
+/* requests -x sends, each must be refused with a 400 */
+#define BAD(s)	{ s, sizeof(s) - 1 }
+static const struct {
+	const char	*req;
+	size_t		len;
+} bad_requests[] = {
+	BAD("GET / HTTP/1.1\r\nHost: x\r\nA: b\0c\r\n\r\n"),
+	BAD("\0GET / HTTP/1.1\r\nHost: x\r\n\r\n"),
+	BAD("GET /\0 HTTP/1.1\r\nHost: x\r\n\r\n"),
+	BAD("GET / HTTP/1.1\0\r\nHost: x\r\n\r\n"),
+	BAD("GET / HTTP/1.1\r\n\r\n"),
+	BAD("GET / HTTP/1.1\r\nHost: x\r\n Folded: y\r\n\r\n"),
+	{ NULL, 0 }
+};
+
+static void	usage(const char *progname);
+static void	add_mix(const char *spec);
+static void	resolve(const char *host);
+static int	pick(void);
+static int	conn_start(CONN *c);
+static int	conn_request(CONN *c);
+static int	conn_send(CONN *c);
+static int	conn_read(CONN *c);
+static int	parse_reply(CONN *c);
+static int	parse_headers(CONN *c);
+static void	conn_close(CONN *c);
+static double	elapsed(const struct timespec *since);
+static int	scrape(METRICS *m);
+static int	read_counts(MALLOC_COUNT *mc);
+static int	by_ms(const void *a, const void *b);
+static void	report(double seconds, int nconn, const METRICS *before,
+		       const METRICS *after, int scraped,
+		       const MALLOC_COUNT *mc_before,
+		       const MALLOC_COUNT *mc_after, int counted);
+static void	percentiles(const char *label, SAMPLE *s, long n);
+static int	refused(double timeout);
+static int	ask(const char *req, size_t len, double timeout);
+
+int
+main(int argc, char* argv[])
+{
+	static CONN conns[CONNS_MAX];
+	static struct pollfd pfd[CONNS_MAX];
+	struct timespec begin;
+	METRICS before;
+	METRICS after;
+	MALLOC_COUNT mc_before;
+	MALLOC_COUNT mc_after;
+	CONN *c;
+	long requests;
+	double seconds;
+	double timeout;
+	int scraped;
+	int counted;
+	int check;
+	int nconn;
+	int done;
+	int busy;
+	int ch;
+	int i;
+
+	(void)parse_config(SOLAR_GLOBAL_CONFIG, parse_table);
+	(void)parse_config(SOLAR_CONFIG, parse_table);
+
+	nconn = 1;
+	requests = 1000;
+	seconds = 0;
+	timeout = 10;
+	check = 0;
+	while ((ch = getopt(argc, argv, "a:c:h:km:n:t:T:xz?")) != -1) {
+		switch (ch) {
+		case 'a':
+			count_file = strdup(optarg);
+			break;
+		case 'c':
+			nconn = atoi(optarg);
+			break;
+		case 'h':
+			remotehost = strdup(optarg);
+			break;
+		case 'k':
+			keepalive = 1;
+			break;
+		case 'm':
+			add_mix(optarg);
+			break;
+		case 'n':
+			requests = atol(optarg);
+			break;
+		case 't':
+			seconds = atof(optarg);
+			break;
+		case 'T':
+			timeout = atof(optarg);
+			break;
+		case 'x':
+			check = 1;
+			break;
+		case 'z':
+			gzip_ok = 1;
+			break;
+		case '?':
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (nconn < 1 || nconn > CONNS_MAX || requests < 1 || seconds < 0 ||
+	    timeout <= 0)
+		usage(argv[0]);
+	if (nmix == 0)
+		for (i = 0; default_mix[i] != NULL; i++)
+			add_mix(default_mix[i]);
+	if (seconds > 0)
+		requests = LONG_MAX;
+	resolve(remotehost != NULL ? remotehost : "localhost");
+	if (check)
+		exit(refused(timeout) == 0 ? EX_OK : EX_UNAVAILABLE);
+
+	maxsamples = seconds > 0 ? 65536 : requests;
+	if ((samples = malloc(maxsamples * sizeof(*samples))) == NULL)
+		err(EX_OSERR, "malloc");
+	scraped = scrape(&before) == 0;
+	counted = read_counts(&mc_before) == 0;
+	srandom(1);		/* the same mix every run */
+
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	for (i = 0; i < nconn; i++) {
+		conns[i].fd = -1;
+		if (started < requests)
+			(void)conn_start(&conns[i]);
+	}
+	for (;;) {
+		busy = 0;
+		for (i = 0; i < nconn; i++) {
+			c = &conns[i];
+			pfd[i].fd = c->fd;
+			pfd[i].events = c->outoff < c->outlen ? POLLOUT : POLLIN;
+			pfd[i].revents = 0;
+			if (c->fd >= 0)
+				busy++;
+		}
+		if (busy == 0)
+			break;
+		if (poll(pfd, nconn, 100) < 0 && errno != EINTR)
+			err(EX_OSERR, "poll");
+		if (seconds > 0 && elapsed(&begin) >= seconds)
+			requests = started;	/* finish those under way */
+		for (i = 0; i < nconn; i++) {
+			c = &conns[i];
+			if (c->fd < 0)
+				continue;
+			done = 0;
+			if (pfd[i].revents & POLLOUT)
+				done = conn_send(c);
+			else if (pfd[i].revents & (POLLIN | POLLHUP | POLLERR))
+				done = conn_read(c);
+			else if (elapsed(&c->start) > timeout) {
+				timeouts++;
+				done = -1;
+			}
+			if (done == 0)
+				continue;
+			if (done < 0 || c->close || !keepalive ||
+			    started >= requests)
+				conn_close(c);
+			if (started >= requests)
+				continue;
+			if (c->fd >= 0)
+				(void)conn_request(c);
+			else
+				(void)conn_start(c);
+		}
+	}
+	seconds = elapsed(&begin);
+	counted = counted && read_counts(&mc_after) == 0;
+	if (scraped) {
+		/* workers publish their counters as they finish a poll */
+		usleep(200000);
+		scraped = scrape(&after) == 0;
+	}
+	report(seconds, nconn, &before, &after, scraped, &mc_before,
+	       &mc_after, counted);
+	exit(nsamples > 0 && connect_errors + read_errors + timeouts == 0 ?
+	     EX_OK : EX_UNAVAILABLE);
+}
+
+/*
+ * add_mix
+ *
+ * inputs	- path[:weight], weight 1 if not given
+ * output	- none
+ * side effects	- the path is added to the request mix
+ */
+static void
+add_mix(const char *spec)
+{
+	char *p;
+	char *colon;
+
+	if (nmix == MIX_MAX)
+		errx(EX_USAGE, "at most %d paths in the mix", MIX_MAX);
+	if (*spec != '/')
+		errx(EX_USAGE, "%s: paths start with /", spec);
+	p = strdup(spec);
+	mix[nmix].weight = 1;
+	if ((colon = strrchr(p, ':')) != NULL) {
+		*colon++ = '\0';
+		if ((mix[nmix].weight = atoi(colon)) < 1)
+			errx(EX_USAGE, "%s: weight must be 1 or more", spec);
+	}
+	if (strcmp(p, "/stream") == 0)
+		errx(EX_USAGE, "/stream never ends, it can't be timed");
+	mix[nmix].path = p;
+	total_weight += mix[nmix].weight;
+	nmix++;
+}
+
+/*
+ * resolve
+ *
+ * inputs	- "host" or "host:port", port 80 if not given
+ * output	- none
+ * side effects	- addr is set to the first address of host
+ */
+static void
+resolve(const char *host)
+{
+	struct addrinfo hints;
+	struct addrinfo *res;
+	char name[MAXBUF];
+	const char *port;
+	char *p;
+	int error;
+
+	strlcpy(name, host, sizeof(name));
+	port = "80";
+	if ((p = strchr(name, ':')) != NULL) {
+		*p++ = '\0';
+		port = p;
+	}
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if ((error = getaddrinfo(name, port, &hints, &res)) != 0)
+		errx(EX_NOHOST, "%s: %s", host, gai_strerror(error));
+	memcpy(&addr, res->ai_addr, res->ai_addrlen);
+	addrlen = res->ai_addrlen;
+	freeaddrinfo(res);
+	hostname = strdup(name);
+}
+
+/* a path from the mix, in proportion to its weight */
+static int
+pick(void)
+{
+	int w;
+	int i;
+
+	w = random() % total_weight;
+	for (i = 0; i < nmix - 1; i++)
+		if ((w -= mix[i].weight) < 0)
+			break;
+	return (i);
+}
+
+/*
+ * conn_start
+ *
+ * inputs	- CONN, closed
+ * output	- 0 or -1 if the connection failed at once
+ * side effects	- a connect is begun and the next request queued on it
+ */
+static int
+conn_start(CONN *c)
+{
+	int one;
+
+	if ((c->fd = socket(addr.ss_family, SOCK_STREAM, 0)) < 0)
+		err(EX_OSERR, "socket");
+	one = 1;
+	(void)setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK) < 0)
+		err(EX_OSERR, "fcntl");
+	if (conn_request(c) < 0)
+		return (-1);
+	if (connect(c->fd, (struct sockaddr *)&addr, addrlen) < 0 &&
+	    errno != EINPROGRESS) {
+		connect_errors++;
+		conn_close(c);
+		return (-1);
+	}
+	c->connecting = 1;
+	return (0);
+}
+
+/*
+ * conn_request
+ *
+ * inputs	- CONN, connected or connecting
+ * output	- 0
+ * side effects	- the next request of the mix is made ready to send
+ *		  and timing of it starts
+ */
+static int
+conn_request(CONN *c)
+{
+	c->mix = pick();
+	c->outlen = snprintf(c->out, sizeof(c->out), "GET %s HTTP/1.1\r\n"
+			     "Host: %s\r\n"
+			     "%s%s\r\n",
+			     mix[c->mix].path, hostname,
+			     gzip_ok ? "Accept-Encoding: gzip\r\n" : "",
+			     keepalive ? "" : "Connection: close\r\n");
+	if (c->outlen >= (int)sizeof(c->out))
+		errx(EX_USAGE, "%s: path too long", mix[c->mix].path);
+	c->outoff = 0;
+	c->inlen = 0;
+	c->state = READ_HEADERS;
+	c->status = 0;
+	c->close = 0;
+	started++;
+	clock_gettime(CLOCK_MONOTONIC, &c->start);
+	return (0);
+}
+
+/*
+ * conn_send
+ *
+ * inputs	- CONN, writable
+ * output	- 0 to carry on, -1 if the connection failed
+ * side effects	- as much of the request as fits is sent
+ */
+static int
+conn_send(CONN *c)
+{
+	socklen_t len;
+	ssize_t n;
+	int error;
+
+	if (c->connecting) {
+		len = sizeof(error);
+		if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0 ||
+		    error != 0) {
+			connect_errors++;
+			return (-1);
+		}
+		c->connecting = 0;
+	}
+	n = write(c->fd, c->out + c->outoff, c->outlen - c->outoff);
+	if (n < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return (0);
+		read_errors++;
+		return (-1);
+	}
+	c->outoff += n;
+	return (0);
+}
+
+/*
+ * conn_read
+ *
+ * inputs	- CONN, readable
+ * output	- 0 to carry on, 1 when the reply is complete, -1 on error
+ * side effects	- a complete reply is counted and its latency kept
+ */
+static int
+conn_read(CONN *c)
+{
+	ssize_t n;
+	int done;
+
+	if (c->connecting) {
+		connect_errors++;
+		return (-1);
+	}
+	n = read(c->fd, c->in + c->inlen, sizeof(c->in) - c->inlen);
+	if (n < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return (0);
+		read_errors++;
+		return (-1);
+	}
+	if (n == 0) {
+		if (c->state != READ_CLOSE) {
+			read_errors++;
+			return (-1);
+		}
+		c->state = READ_DONE;
+	}
+	bytes_read += n;
+	c->inlen += n;
+	if ((done = parse_reply(c)) <= 0)
+		return (done);
+
+	if (c->status > 0 && c->status < STATUS_MAX)
+		status_count[c->status]++;
+	mix[c->mix].count++;
+	if (nsamples == maxsamples) {
+		maxsamples *= 2;
+		if ((samples = realloc(samples, maxsamples *
+				       sizeof(*samples))) == NULL)
+			err(EX_OSERR, "realloc");
+	}
+	samples[nsamples].ms = elapsed(&c->start) * 1000.0;
+	samples[nsamples].mix = c->mix;
+	nsamples++;
+	return (1);
+}
+
+/*
+ * parse_reply
+ *
+ * inputs	- CONN with newly read bytes in c->in
+ * output	- 0 if more is to come, 1 when the reply is complete,
+ *		  -1 if it is not HTTP
+ * side effects	- body bytes are consumed, only headers are kept
+ */
+static int
+parse_reply(CONN *c)
+{
+	char *p;
+	char *end;
+	long long n;
+
+	for (;;) {
+		switch (c->state) {
+		case READ_HEADERS:
+			if ((n = parse_headers(c)) <= 0)
+				return (n);
+			break;
+		case READ_LENGTH:
+		case READ_CHUNK:
+			n = c->inlen < c->left ? c->inlen : c->left;
+			c->left -= n;
+			memmove(c->in, c->in + n, c->inlen - n);
+			c->inlen -= n;
+			if (c->left > 0)
+				return (0);
+			c->state = c->state == READ_LENGTH ? READ_DONE :
+				READ_CHUNK_SIZE;
+			break;
+		case READ_CHUNK_SIZE:
+		case READ_TRAILER:
+			if ((end = memmem(c->in, c->inlen, "\r\n", 2)) == NULL)
+				return (c->inlen == sizeof(c->in) ? -1 : 0);
+			if (c->state == READ_CHUNK_SIZE) {
+				n = strtoll(c->in, &p, 16);
+				if (p == c->in || n < 0) {
+					read_errors++;
+					return (-1);
+				}
+				c->left = n + 2;
+				c->state = n > 0 ? READ_CHUNK : READ_TRAILER;
+			} else if (end == c->in)
+				c->state = READ_DONE;
+			end += 2;
+			c->inlen -= end - c->in;
+			memmove(c->in, end, c->inlen);
+			break;
+		case READ_CLOSE:
+			c->inlen = 0;
+			return (0);
+		case READ_DONE:
+			return (1);
+		}
+	}
+}
+
+/*
+ * parse_headers
+ *
+ * inputs	- CONN reading headers
+ * output	- 0 if they are not all here yet, 1 if they are, -1 if
+ *		  the reply is not HTTP
+ * side effects	- status and how the body ends are noted, the headers
+ *		  are consumed
+ */
+static int
+parse_headers(CONN *c)
+{
+	char *end;
+	char *line;
+	char *next;
+	char *p;
+
+	if ((end = memmem(c->in, c->inlen, "\r\n\r\n", 4)) == NULL) {
+		if (c->inlen < (int)sizeof(c->in))
+			return (0);
+		read_errors++;
+		return (-1);
+	}
+	*end = '\0';
+	if (sscanf(c->in, "HTTP/1.%*d %d", &c->status) != 1) {
+		read_errors++;
+		return (-1);
+	}
+	c->state = READ_CLOSE;
+	if (c->status == 204 || c->status == 304)
+		c->state = READ_DONE;
+	for (line = c->in; line != NULL; line = next) {
+		if ((next = strstr(line, "\r\n")) != NULL) {
+			*next = '\0';
+			next += 2;
+		}
+		if ((p = strchr(line, ':')) == NULL)
+			continue;
+		*p++ = '\0';
+		while (*p == ' ')
+			p++;
+		if (strcasecmp(line, "Content-Length") == 0 &&
+		    c->state == READ_CLOSE) {
+			c->left = strtoll(p, NULL, 10);
+			c->state = c->left > 0 ? READ_LENGTH : READ_DONE;
+		} else if (strcasecmp(line, "Transfer-Encoding") == 0 &&
+			 strcasecmp(p, "chunked") == 0)
+			c->state = READ_CHUNK_SIZE;
+		else if (strcasecmp(line, "Connection") == 0 &&
+			 strcasecmp(p, "close") == 0)
+			c->close = 1;
+	}
+	if (c->state == READ_CLOSE)
+		c->close = 1;
+	end += 4;
+	c->inlen -= end - c->in;
+	memmove(c->in, end, c->inlen);
+	return (1);
+}
+
+static void
+conn_close(CONN *c)
+{
+	if (c->fd >= 0)
+		close(c->fd);
+	c->fd = -1;
+	c->connecting = 0;
+	c->outlen = c->outoff = 0;
+}
+
+/* seconds since */
+static double
+elapsed(const struct timespec *since)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - since->tv_sec +
+		(now.tv_nsec - since->tv_nsec) / 1e9);
+}
+
+/*
+ * scrape
+ *
+ * inputs	- METRICS to fill in
+ * output	- 0 or -1 if /metrics could not be had
+ * side effects	- one request is made, on a connection of its own
+ */
+static int
+scrape(METRICS *m)
+{
+	FILE *in;
+	char line[MAXBUF];
+	int fd;
+
+	memset(m, 0, sizeof(*m));
+	if ((fd = socket(addr.ss_family, SOCK_STREAM, 0)) < 0)
+		return (-1);
+	if (connect(fd, (struct sockaddr *)&addr, addrlen) < 0 ||
+	    dprintf(fd, "GET /metrics HTTP/1.1\r\nHost: %s\r\n"
+		    "Connection: close\r\n\r\n", hostname) < 0 ||
+	    (in = fdopen(fd, "r")) == NULL) {
+		close(fd);
+		return (-1);
+	}
+	if (fgets(line, sizeof(line), in) == NULL ||
+	    strncmp(line, "HTTP/1.1 200", 12) != 0) {
+		fclose(in);
+		return (-1);
+	}
+	while (fgets(line, sizeof(line), in) != NULL) {
+		(void)sscanf(line, "solar_http_requests_total %lf",
+			     &m->requests);
+		(void)sscanf(line, "solar_http_io_calls_total %lf",
+			     &m->io_calls);
+		(void)sscanf(line, "solar_buf_grows_total %lf",
+			     &m->buf_grows);
+		(void)sscanf(line, "solar_http_connections_total %lf",
+			     &m->connections);
+		(void)sscanf(line, "solar_http_uring_workers %lf",
+			     &m->uring);
+	}
+	fclose(in);
+	return (m->requests > 0 ? 0 : -1);
+}
+
+/*
+ * read_counts
+ *
+ * inputs	- MALLOC_COUNT to fill in
+ * output	- 0 or -1 if there is no -a file or it could not be read
+ */
+static int
+read_counts(MALLOC_COUNT *mc)
+{
+	int fd;
+	int n;
+
+	memset(mc, 0, sizeof(*mc));
+	if (count_file == NULL)
+		return (-1);
+	if ((fd = open(count_file, O_RDONLY)) < 0) {
+		warn("%s", count_file);
+		return (-1);
+	}
+	n = read(fd, mc, sizeof(*mc));
+	close(fd);
+	if (n != sizeof(*mc)) {
+		warnx("%s: not a malloc_count file", count_file);
+		return (-1);
+	}
+	return (0);
+}
+
+static int
+by_ms(const void *a, const void *b)
+{
+	const SAMPLE *sa = a;
+	const SAMPLE *sb = b;
+
+	return (sa->ms < sb->ms ? -1 : sa->ms > sb->ms);
+}
+
+/*
+ * report
+ *
+ * inputs	- seconds the run took and connections used
+ *		- /metrics from before and after and if they were had
+ *		- malloc_count from before and after and if they were had
+ * output	- none
+ * side effects	- the results are printed, samples are sorted
+ */
+static void
+report(double seconds, int nconn, const METRICS *before,
+       const METRICS *after, int scraped, const MALLOC_COUNT *mc_before,
+       const MALLOC_COUNT *mc_after, int counted)
+{
+	SAMPLE *s;
+	double served;
+	long n;
+	int i;
+	int j;
+
+	printf("%ld requests in %.2fs, %d connection%s, %s\n", nsamples,
+	       seconds, nconn, nconn == 1 ? "" : "s",
+	       keepalive ? "keep-alive" : "one request each");
+	printf("throughput  %.1f requests/s, %.2f MB/s\n",
+	       nsamples / seconds, bytes_read / seconds / 1e6);
+	printf("status     ");
+	for (i = 0; i < STATUS_MAX; i++)
+		if (status_count[i] > 0)
+			printf(" %d: %ld", i, status_count[i]);
+	printf("\n");
+	if (connect_errors + read_errors + timeouts > 0)
+		printf("errors      connect %ld, read %ld, timeout %ld\n",
+		       connect_errors, read_errors, timeouts);
+	if (nsamples == 0)
+		return;
+
+	qsort(samples, nsamples, sizeof(*samples), by_ms);
+	printf("%-28s %7s %8s %8s %8s %8s %8s\n", "latency ms", "count",
+	       "p50", "p95", "p99", "p99.9", "max");
+	percentiles("all", samples, nsamples);
+	if (nmix > 1) {
+		/* the sorted samples of each path stay sorted */
+		if ((s = malloc(nsamples * sizeof(*s))) == NULL)
+			err(EX_OSERR, "malloc");
+		for (i = 0; i < nmix; i++) {
+			for (n = 0, j = 0; n < nsamples; n++)
+				if (samples[n].mix == i)
+					s[j++] = samples[n];
+			percentiles(mix[i].path, s, j);
+		}
+		free(s);
+	}
+
+	if (counted)
+		printf("allocations %.2f/request, %.2f frees/request, all "
+		       "processes, from malloc_count\n",
+		       (double)(mc_after->allocs - mc_before->allocs) /
+		       nsamples,
+		       (double)(mc_after->frees - mc_before->frees) /
+		       nsamples);
+	if (!scraped)
+		return;
+	/* the second scrape counts itself */
+	served = after->requests - before->requests - 1;
+	if (served < 1)
+		return;
+	printf("server      %.0f requests, %.0f connections, %s\n",
+	       served, after->connections - before->connections - 1,
+	       after->uring > 0 ? "io_uring" : "epoll/kqueue");
+	printf("http_server %.2f socket and poller calls/request, "
+	       "%.3f buffer growths/request, handlers not included\n",
+	       (after->io_calls - before->io_calls) / served,
+	       (after->buf_grows - before->buf_grows) / served);
+}
+
+/* one line of latency percentiles, nearest rank, of sorted samples */
+static void
+percentiles(const char *label, SAMPLE *s, long n)
+{
+	static const double pct[] = { 50, 95, 99, 99.9, 100 };
+	long rank;
+	int i;
+
+	printf("%-28.28s %7ld", label, n);
+	for (i = 0; i < 5; i++) {
+		if (n == 0) {
+			printf(" %8s", "-");
+			continue;
+		}
+		rank = ceil(pct[i] / 100 * n);
+		if (rank < 1)
+			rank = 1;
+		printf(" %8.2f", s[rank - 1].ms);
+	}
+	printf("\n");
+}
+
+/*
+ * refused
+ *
+ * inputs	- seconds to wait for each reply
+ * output	- 0 or -1 if any was not refused, or the server went away
+ * side effects	- each of bad_requests is sent on a connection of its
+ *		  own and what came back is printed
+ */
+static int
+refused(double timeout)
+{
+	const char *p;
+	int failed;
+	int status;
+	int i;
+
+	failed = 0;
+	for (i = 0; bad_requests[i].req != NULL; i++) {
+		status = ask(bad_requests[i].req, bad_requests[i].len,
+			     timeout);
+		printf("%-4s ", status == 400 ? "ok" : "FAIL");
+		if (status < 0)
+			printf("no reply     ");
+		else
+			printf("status %-5d ", status);
+		for (p = bad_requests[i].req;
+		     p < bad_requests[i].req + bad_requests[i].len; p++)
+			if (*p == '\0')
+				printf("\\0");
+			else if (*p == '\r')
+				printf("\\r");
+			else if (*p == '\n')
+				printf("\\n");
+			else
+				putchar(*p);
+		printf("\n");
+		if (status != 400)
+			failed = 1;
+	}
+	p = "GET / HTTP/1.1\r\nHost: x\r\n\r\n";
+	status = ask(p, strlen(p), timeout);
+	printf("%-4s status %-5d still serving\n", status == 200 ? "ok" : "FAIL",
+	       status);
+	if (status != 200)
+		failed = 1;
+	return (failed ? -1 : 0);
+}
+
+/*
+ * ask
+ *
+ * inputs	- request, its length, nuls and all, seconds to wait
+ * output	- status of the reply or -1 if there was none
+ * side effects	- the request is made on a connection of its own
+ */
+static int
+ask(const char *req, size_t len, double timeout)
+{
+	struct timeval tv;
+	char line[MAXBUF];
+	ssize_t n;
+	size_t got;
+	int status;
+	int fd;
+
+	if ((fd = socket(addr.ss_family, SOCK_STREAM, 0)) < 0)
+		err(EX_OSERR, "socket");
+	tv.tv_sec = timeout;
+	tv.tv_usec = (timeout - tv.tv_sec) * 1e6;
+	(void)setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	if (connect(fd, (struct sockaddr *)&addr, addrlen) < 0 ||
+	    write(fd, req, len) != (ssize_t)len) {
+		close(fd);
+		return (-1);
+	}
+	got = 0;
+	while (got < sizeof(line) - 1 && memchr(line, '\n', got) == NULL) {
+		if ((n = read(fd, line + got, sizeof(line) - 1 - got)) <= 0)
+			break;
+		got += n;
+	}
+	close(fd);
+	line[got] = '\0';
+	if (sscanf(line, "HTTP/1.%*d %d", &status) != 1)
+		return (-1);
+	return (status);
+}
+
+/*
+ * usage
+ *
+ * inputs	- program name
+ * output	- none
+ * side effects	- how to run it is printed and it exits
+ */
+static void
+usage(const char *progname)
+{
+	fprintf(stderr, "%s: Defaults can be set in ~/%s\n", progname, SOLAR_CONFIG);
+	fprintf(stderr, "%s: Or in global %s\n", progname, SOLAR_GLOBAL_CONFIG);
+	fprintf(stderr, "%s: -h web_status host[:port] (remotehost), localhost if none\n", progname);
+	fprintf(stderr, "%s: -a file malloc_count.so counts into, see MALLOC_COUNT\n", progname);
+	fprintf(stderr, "%s: -c connections at once (1)\n", progname);
+	fprintf(stderr, "%s: -k keep connections alive\n", progname);
+	fprintf(stderr, "%s: -m path[:weight] to add to the mix, once per path\n", progname);
+	fprintf(stderr, "%s: -n requests to make (1000)\n", progname);
+	fprintf(stderr, "%s: -t seconds to run for instead\n", progname);
+	fprintf(stderr, "%s: -T seconds before a request is given up (10)\n", progname);
+	fprintf(stderr, "%s: -x check malformed requests are refused instead\n", progname);
+	fprintf(stderr, "%s: -z accept gzip, as browsers do\n", progname);
+	exit(EX_USAGE);
+}
@@ -0,0 +1,415 @@
+/* Copyright (c) 2023 Diane Bruce db@db.net
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Background refresher for web_status.
+ *
+ * One thread owns the SOLAR_CTX and runs the register group
+ * scheduler (solar_sched.c) as a bus loop. After every read it
+ * decodes what changed into a WEB_CACHE. Pages are rendered from a
+ * copy of the cache taken under its lock, so serving a page never
+ * waits on the serial port, and the bus load is the same however
+ * many browsers are watching. Each page says how old its data is.
+ *
+ * Every update also writes a byte to a pipe, so the HTTP side can
+ * wake from its poll and push new data to subscribers.
+ *
+ * The cache is in anonymous shared memory with a process shared
+ * lock, so any number of forked workers serve from the one refresher
+ * and bus load does not grow with them. Each worker has its own
+ * notify pipe, see web_cache_worker(). The lock is robust, a worker
+ * dying while holding it does not stop the others; nothing is ever
+ * written under it by a worker so the data stays consistent.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libsolar.h"
+#include "solar_sched.h"
+#include "web_cache.h"
+
+static void	*refresher(void *arg);
+static void	publish(WEB_CACHE *cache, SOLAR_SCHED *sched, int group,
+			int error, time_t now);
+static void	notify(WEB_CACHE *cache);
+static void	cache_lock(WEB_CACHE *cache);
+
+static SOLAR_SCHED *refresh_sched;
+static int	cache_worker;		/* this process's notify pipe */
+
+/*
+ * web_cache_new
+ *
+ * inputs	- number of worker processes that will serve from it
+ * output	- new WEB_CACHE or NULL with errno set
+ * side effects	- shared memory is mapped and notify pipes made
+ */
+WEB_CACHE *
+web_cache_new(int workers)
+{
+	pthread_mutexattr_t attr;
+	WEB_CACHE *cache;
+	int i;
+	int j;
+
+	if (workers < 1 || workers > WEB_WORKERS_MAX) {
+		errno = EINVAL;
+		return (NULL);
+	}
+	cache = mmap(NULL, sizeof(*cache), PROT_READ | PROT_WRITE,
+		     MAP_ANON | MAP_SHARED, -1, 0);
+	if (cache == MAP_FAILED)
+		return (NULL);
+	memset(cache, 0, sizeof(*cache));
+	if ((errno = pthread_mutexattr_init(&attr)) != 0 ||
+	    (errno = pthread_mutexattr_setpshared(&attr,
+				PTHREAD_PROCESS_SHARED)) != 0 ||
+	    (errno = pthread_mutexattr_setrobust(&attr,
+				PTHREAD_MUTEX_ROBUST)) != 0 ||
+	    (errno = pthread_mutex_init(&cache->lock, &attr)) != 0)
+		return (NULL);
+	pthread_mutexattr_destroy(&attr);
+	cache->workers = workers;
+	for (i = 0; i < workers; i++) {
+		if (pipe(cache->notify[i]) < 0)
+			return (NULL);
+		for (j = 0; j < 2; j++)
+			if (fcntl(cache->notify[i][j], F_SETFL,
+			    fcntl(cache->notify[i][j], F_GETFL) |
+			    O_NONBLOCK) < 0)
+				return (NULL);
+	}
+	return (cache);
+}
+
+/*
+ * web_cache_start
+ *
+ * inputs	- WEB_CACHE to keep up to date
+ *		- SOLAR_SCHED, from now on only used by the refresher
+ * output	- 0 or an errno
+ * side effects	- refresher thread is started
+ */
+int
+web_cache_start(WEB_CACHE *cache, SOLAR_SCHED *sched)
+{
+	pthread_t tid;
+	int error;
+
+	refresh_sched = sched;
+	error = pthread_create(&tid, NULL, refresher, cache);
+	if (error == 0)
+		pthread_detach(tid);
+	return (error);
+}
+
+/*
+ * web_cache_worker
+ *
+ * inputs	- WEB_CACHE
+ *		- which worker this process is, 0 .. workers-1
+ * output	- none
+ * side effects	- called in a forked worker, the pipes that are not
+ *		  its own are closed. The refresher's process and the
+ *		  one that forked it keep the write ends, should both
+ *		  exit the worker's pipe reads end of file, see
+ *		  web_cache_drain().
+ */
+void
+web_cache_worker(WEB_CACHE *cache, int worker)
+{
+	int i;
+
+	cache_worker = worker;
+	for (i = 0; i < cache->workers; i++) {
+		close(cache->notify[i][1]);
+		if (i != worker)
+			close(cache->notify[i][0]);
+	}
+}
+
+/*
+ * web_cache_info
+ *
+ * inputs	- WEB_CACHE
+ *		- SOLAR_INFO to copy into
+ *		- where to return when it was read
+ * output	- SOLAR_OK or the error keeping it from being read yet
+ */
+int
+web_cache_info(WEB_CACHE *cache, SOLAR_INFO *info, time_t *when)
+{
+	int error;
+
+	cache_lock(cache);
+	if (cache->have_info) {
+		*info = cache->info;
+		*when = cache->info_time;
+		error = SOLAR_OK;
+	} else
+		error = cache->error != SOLAR_OK ? cache->error : SOLAR_EIO;
+	pthread_mutex_unlock(&cache->lock);
+	return (error);
+}
+
+/*
+ * web_cache_history
+ *
+ * inputs	- WEB_CACHE
+ *		- first and last day wanted
+ *		- SOLAR_HISTORY_COLUMNS to copy into
+ *		- where to return when the oldest of them was read
+ * output	- SOLAR_OK, SOLAR_EINVAL or the error keeping the days
+ *		  from being read yet. Only the days read so far are
+ *		  copied, cols->count may be short.
+ */
+int
+web_cache_history(WEB_CACHE *cache, int first, int last,
+		  SOLAR_HISTORY_COLUMNS *cols, time_t *when)
+{
+	size_t len;
+	int error;
+
+	if (first < 0 || last >= MAX_DAYS_HISTORY || first > last)
+		return (SOLAR_EINVAL);
+
+	cache_lock(cache);
+	if (last >= cache->history_days)
+		last = cache->history_days - 1;
+	cols->first = first;
+	cols->count = 0;
+	if (first > last) {
+		error = cache->error != SOLAR_OK ? cache->error : SOLAR_EIO;
+		pthread_mutex_unlock(&cache->lock);
+		return (error);
+	}
+	cols->count = last - first + 1;
+	len = cols->count * sizeof(float);
+#define COPY_COLUMN(c)	memcpy(cols->c, cache->history.c + first, len)
+	COPY_COLUMN(bat_min_v);
+	COPY_COLUMN(bat_max_v);
+	COPY_COLUMN(bat_max_charge_a);
+	COPY_COLUMN(bat_max_discharge_a);
+	COPY_COLUMN(bat_max_charge_w);
+	COPY_COLUMN(bat_max_discharge_w);
+	COPY_COLUMN(bat_charge_ah);
+	COPY_COLUMN(bat_discharge_ah);
+	COPY_COLUMN(bat_charge_kwh);
+	COPY_COLUMN(bat_discharge_kwh);
+#undef COPY_COLUMN
+	*when = cache->history_time;
+	pthread_mutex_unlock(&cache->lock);
+	return (SOLAR_OK);
+}
+
+unsigned long
+web_cache_seq(WEB_CACHE *cache)
+{
+	unsigned long seq;
+
+	cache_lock(cache);
+	seq = cache->seq;
+	pthread_mutex_unlock(&cache->lock);
+	return (seq);
+}
+
+/*
+ * web_cache_notify_fd
+ * Readable after the cache has been updated, see web_cache_drain()
+ */
+int
+web_cache_notify_fd(WEB_CACHE *cache)
+{
+	return (cache->notify[cache_worker][0]);
+}
+
+/* -1 once the refresher's process has gone */
+int
+web_cache_drain(WEB_CACHE *cache)
+{
+	char buf[64];
+	ssize_t n;
+
+	while ((n = read(cache->notify[cache_worker][0], buf,
+			 sizeof(buf))) > 0)
+		;
+	return (n == 0 ? -1 : 0);
+}
+
+/* a full pipe already has a wakeup pending */
+static void
+notify(WEB_CACHE *cache)
+{
+	char c;
+	int i;
+
+	c = 0;
+	for (i = 0; i < cache->workers; i++)
+		(void)write(cache->notify[i][1], &c, 1);
+}
+
+/* take over the lock of a worker that died holding it */
+static void
+cache_lock(WEB_CACHE *cache)
+{
+	if (pthread_mutex_lock(&cache->lock) == EOWNERDEAD)
+		pthread_mutex_consistent(&cache->lock);
+}
+
+/*
+ * web_cache_bus
+ *
+ * inputs	- WEB_CACHE
+ *		- where to copy the modbus and register group statistics
+ * output	- none
+ */
+void
+web_cache_bus(WEB_CACHE *cache, MODBUS_STATS *modbus,
+	      SOLAR_GROUP group[SOLAR_GROUPS])
+{
+	cache_lock(cache);
+	*modbus = cache->modbus;
+	memcpy(group, cache->group, sizeof(cache->group));
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/*
+ * refresher
+ *
+ * The bus loop. Today's history record changes as fast as the
+ * live values so it is read along with them.
+ */
+static void *
+refresher(void *arg)
+{
+	WEB_CACHE *cache;
+	SOLAR_SCHED *sched;
+	time_t now;
+	int group;
+	int error;
+	int wait;
+
+	cache = arg;
+	sched = refresh_sched;
+	for (;;) {
+		now = time(NULL);
+		if ((wait = solar_sched_wait(sched, now)) > 0) {
+			sleep(wait);
+			continue;
+		}
+		error = solar_sched_run(sched, now, &group);
+		if (error == SOLAR_OK && group == SOLAR_GROUP_LIVE)
+			error = solar_sched_history(sched, now, 0, 0);
+		if (group >= 0)
+			publish(cache, sched, group, error, now);
+	}
+	return (NULL);
+}
+
+/*
+ * publish
+ *
+ * inputs	- WEB_CACHE
+ *		- SOLAR_SCHED that just read group
+ *		- result of the read and when
+ * output	- none
+ * side effects	- cache is updated from the SOLAR_CTX, seq is bumped
+ *		  only if the values or history differ from those
+ *		  cached, since every bump throws away the pre-rendered
+ *		  pages and their ETags
+ */
+static void
+publish(WEB_CACHE *cache, SOLAR_SCHED *sched, int group, int error,
+	time_t now)
+{
+	static SOLAR_HISTORY_COLUMNS cols;
+	SOLAR_INFO info;
+	MODBUS_STATS modbus;
+	time_t oldest;
+	int have_info;
+	int changed;
+	int days;
+
+	solar_modbus_stats(sched->ctx, &modbus);
+	if (error != SOLAR_OK) {
+		cache_lock(cache);
+		cache->error = error;
+		cache->error_time = now;
+		cache->modbus = modbus;
+		memcpy(cache->group, sched->group, sizeof(cache->group));
+		pthread_mutex_unlock(&cache->lock);
+		notify(cache);
+		return;
+	}
+
+	have_info = sched->group[SOLAR_GROUP_IDENT].last != 0 &&
+	    sched->group[SOLAR_GROUP_LIVE].last != 0 &&
+	    sched->group[SOLAR_GROUP_SETTINGS].last != 0;
+	if (have_info) {
+		/* strings are compared past their nul too */
+		memset(&info, 0, sizeof(info));
+		solar_cached_info(sched->ctx, &info);
+	}
+
+	/* today's record is read along with the live values */
+	oldest = now;
+	days = 0;
+	if (group == SOLAR_GROUP_HISTORY || group == SOLAR_GROUP_LIVE)
+		for (; days < MAX_DAYS_HISTORY &&
+		     sched->day_time[days] != 0; days++)
+			if (sched->day_time[days] < oldest)
+				oldest = sched->day_time[days];
+	if (days > 0)
+		solar_history_columns(sched->ctx, 0, days - 1, &cols);
+
+	cache_lock(cache);
+	changed = (have_info && (!cache->have_info ||
+	    memcmp(&cache->info, &info, sizeof(info)) != 0)) ||
+	    (days > 0 && (days != cache->history_days ||
+	    memcmp(&cache->history, &cols, sizeof(cols)) != 0));
+	if (have_info) {
+		cache->info = info;
+		cache->info_time = sched->group[SOLAR_GROUP_LIVE].last;
+		cache->have_info = 1;
+	}
+	if (days > 0) {
+		cache->history = cols;
+		cache->history_days = days;
+		cache->history_time = oldest;
+	}
+	cache->error = SOLAR_OK;
+	cache->modbus = modbus;
+	memcpy(cache->group, sched->group, sizeof(cache->group));
+	if (changed)
+		cache->seq++;
+	pthread_mutex_unlock(&cache->lock);
+	notify(cache);
+}
@@ -0,0 +1,69 @@
+/* Copyright (c) 2023 Diane Bruce db@db.net
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#ifndef __WEB_CACHE_H__
+#define __WEB_CACHE_H__
+
+#include <pthread.h>
+#include <time.h>
+#include "libsolar.h"
+#include "solar_sched.h"
+
+#define WEB_WORKERS_MAX	16
+
+/*
+ * What web_status serves from, filled in by the refresher thread.
+ * Plain data only, no pointers, it is in memory shared by all
+ * worker processes.
+ */
+typedef struct {
+	pthread_mutex_t	lock;
+	unsigned long	seq;		/* bumped when info or history change */
+	int		have_info;
+	SOLAR_INFO	info;
+	time_t		info_time;	/* when the live values were read */
+	int		history_days;	/* days 0 .. history_days-1 read */
+	SOLAR_HISTORY_COLUMNS history;	/* all days, first is 0 */
+	time_t		history_time;	/* oldest read of those days */
+	int		error;		/* last read error, SOLAR_OK if none */
+	time_t		error_time;
+	MODBUS_STATS	modbus;		/* bus statistics as of seq */
+	SOLAR_GROUP	group[SOLAR_GROUPS];
+	int		workers;
+	int		notify[WEB_WORKERS_MAX][2]; /* per worker pipe written
+					       on every update */
+} WEB_CACHE;
+
+WEB_CACHE *web_cache_new(int workers);
+int	web_cache_start(WEB_CACHE *cache, SOLAR_SCHED *sched);
+void	web_cache_worker(WEB_CACHE *cache, int worker);
+int	web_cache_info(WEB_CACHE *cache, SOLAR_INFO *info, time_t *when);
+int	web_cache_history(WEB_CACHE *cache, int first, int last,
+			  SOLAR_HISTORY_COLUMNS *cols, time_t *when);
+unsigned long web_cache_seq(WEB_CACHE *cache);
+int	web_cache_notify_fd(WEB_CACHE *cache);
+int	web_cache_drain(WEB_CACHE *cache);
+void	web_cache_bus(WEB_CACHE *cache, MODBUS_STATS *modbus,
+		      SOLAR_GROUP group[SOLAR_GROUPS]);
+
+#endif
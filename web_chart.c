@@ -0,0 +1,168 @@
+/* Copyright (c) 2023 Diane Bruce db@db.net
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Inline SVG charts for the web_status pages.
+ *
+ * Plain markup, no scripts, so they show on anything that can show
+ * the page. They are drawn from already downsampled data and become
+ * part of a pre-rendered page, so they cost nothing per request.
+ */
+
+#include <stdio.h>
+
+#include "libsolar.h"
+#include "solar_archive.h"
+#include "solar_format.h"
+#include "web_chart.h"
+
+#define SPARK_W		240
+#define SPARK_H		48
+#define HISTORY_W	720
+#define HISTORY_H	160
+#define PAD		2
+
+#define LINE_COLOUR	"#2196F3"
+#define LAST_COLOUR	"#9933cc"
+#define CHARGE_COLOUR	"#4caf50"
+#define DISCHARGE_COLOUR "#f44336"
+
+/*
+ * chart_sparkline
+ *
+ * inputs	- buffer the page is rendered into
+ *		- caption and unit of the values
+ *		- points, oldest first, and how many
+ *		- digits after the point of the values
+ * output	- none
+ * side effects	- a captioned line chart is appended, the latest
+ *		  point marked, nothing if there are no points
+ */
+void
+chart_sparkline(SOLAR_BUF *sb, const char *title, const char *unit,
+		const SOLAR_POINT *p, int n, int decimals)
+{
+	double t0, tspan;
+	double min, max;
+	double x, y;
+	int i;
+
+	if (n <= 0)
+		return;
+	min = max = p[0].value;
+	for (i = 1; i < n; i++) {
+		if (p[i].value < min)
+			min = p[i].value;
+		if (p[i].value > max)
+			max = p[i].value;
+	}
+	t0 = p[0].when;
+	tspan = p[n - 1].when - t0;
+
+	solar_buf_printf(sb, "<figure class=\"chart\"><figcaption>%s %.*f%s"
+			 " (%.*f to %.*f)</figcaption>\n"
+			 "<svg viewBox=\"0 0 %d %d\" width=\"%d\" "
+			 "height=\"%d\" role=\"img\" aria-label=\"%s\">\n"
+			 "<polyline fill=\"none\" stroke=\"" LINE_COLOUR "\" "
+			 "stroke-width=\"1.5\" points=\"",
+			 title, decimals, p[n - 1].value, unit,
+			 decimals, min, decimals, max,
+			 SPARK_W, SPARK_H, SPARK_W, SPARK_H, title);
+	x = y = 0;
+	for (i = 0; i < n; i++) {
+		x = PAD + (tspan > 0 ?
+		    (p[i].when - t0) / tspan * (SPARK_W - 2 * PAD) : 0);
+		y = max > min ? SPARK_H - PAD -
+		    (p[i].value - min) / (max - min) * (SPARK_H - 2 * PAD) :
+		    SPARK_H / 2;
+		solar_buf_printf(sb, "%s%.1f,%.1f", i > 0 ? " " : "", x, y);
+	}
+	solar_buf_printf(sb, "\"/>\n<circle cx=\"%.1f\" cy=\"%.1f\" r=\"2\" "
+			 "fill=\"" LAST_COLOUR "\"/>\n</svg></figure>\n", x, y);
+}
+
+/*
+ * chart_history
+ *
+ * inputs	- buffer the page is rendered into
+ *		- days of history, first is the newest
+ * output	- none
+ * side effects	- a bar chart of energy charged (up) and discharged
+ *		  (down) each day is appended, oldest day on the left
+ */
+void
+chart_history(SOLAR_BUF *sb, const SOLAR_HISTORY_COLUMNS *h)
+{
+	double max;
+	double bar;
+	double mid;
+	double x;
+	double c, d;
+	int i;
+
+	if (h->count <= 0)
+		return;
+	max = 0;
+	for (i = 0; i < h->count; i++) {
+		if (h->bat_charge_kwh[i] > max)
+			max = h->bat_charge_kwh[i];
+		if (h->bat_discharge_kwh[i] > max)
+			max = h->bat_discharge_kwh[i];
+	}
+	if (max <= 0)
+		max = 1;
+	bar = (double)(HISTORY_W - 2 * PAD) / h->count;
+	mid = HISTORY_H / 2.0;
+
+	solar_buf_printf(sb, "<figure class=\"chart\"><figcaption>Daily "
+			 "energy charged and discharged, days %d to %d, "
+			 "up to %.3fKWH</figcaption>\n"
+			 "<svg viewBox=\"0 0 %d %d\" width=\"%d\" "
+			 "height=\"%d\" role=\"img\" aria-label=\"Daily "
+			 "energy\">\n"
+			 "<line x1=\"0\" y1=\"%.1f\" x2=\"%d\" y2=\"%.1f\" "
+			 "stroke=\"#999999\"/>\n",
+			 h->first + h->count - 1, h->first, max,
+			 HISTORY_W, HISTORY_H, HISTORY_W, HISTORY_H,
+			 mid, HISTORY_W, mid);
+	solar_buf_printf(sb, "<g fill=\"" CHARGE_COLOUR "\">\n");
+	for (i = 0; i < h->count; i++) {
+		x = HISTORY_W - PAD - (i + 1) * bar;
+		c = h->bat_charge_kwh[i] / max * (mid - PAD);
+		if (c > 0)
+			solar_buf_printf(sb, "<rect x=\"%.1f\" y=\"%.1f\" "
+					 "width=\"%.1f\" height=\"%.1f\"/>\n",
+					 x, mid - c, bar * 0.8, c);
+	}
+	solar_buf_printf(sb, "</g>\n<g fill=\"" DISCHARGE_COLOUR "\">\n");
+	for (i = 0; i < h->count; i++) {
+		x = HISTORY_W - PAD - (i + 1) * bar;
+		d = h->bat_discharge_kwh[i] / max * (mid - PAD);
+		if (d > 0)
+			solar_buf_printf(sb, "<rect x=\"%.1f\" y=\"%.1f\" "
+					 "width=\"%.1f\" height=\"%.1f\"/>\n",
+					 x, mid, bar * 0.8, d);
+	}
+	solar_buf_printf(sb, "</g>\n</svg></figure>\n");
+}
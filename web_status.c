@@ -27,44 +27,185 @@
  *
  * program runs on remote data collection (Raspberry Pi in my case
  * as of September 19, 2022- db) and presents a highly simplified
- * web server. No checking of proper GET / from client is done a simple
- * check for a /history argument results in a history listing
- * otherwise a simple status of current state of charging system is done.
+ * web server. /history?day1,day2 results in a history listing,
+ * / a simple status of current state of charging system and
+ * /api/status, /api/info and /api/history the same as JSON.
+ * /metrics is for Prometheus and /stream pushes live values as
+ * Server-Sent Events. /api/series charts a field from the csv
+ * archive, if csvfilename is set, and the status page then has
+ * sparklines of the last day from it, see web_chart.c. The archive
+ * itself is /archive.csv, with Range so a host can fetch only what is
+ * new since it last did, see archive_sync.c
+ * Connections are handled by the non blocking server in http_server.c
+ *
+ * "workers" in the config file sets how many processes serve pages,
+ * default 1. Each has its own listening socket on port 80 with
+ * SO_REUSEPORT so the kernel spreads connections over them, and all
+ * serve from the one web cache in shared memory, see web_cache.c.
+ * The controller is read by a refresher thread in a process of its
+ * own. The first process only restarts it and workers that die, it
+ * never has a thread of its own so forking them again is safe.
+ *
+ * "io_uring = yes" has the workers serve on io_uring where the kernel
+ * has it (built with HAVE_IO_URING), with fewer system calls per
+ * request, see http_server.c. They quietly keep to epoll otherwise.
  */
 #include <ctype.h>
 #include <err.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <stddef.h>
 #include <string.h>
+#include <strings.h>
 #include <fcntl.h>
 #include <grp.h>
 #include <pwd.h>
 #include <unistd.h>
-#include <stdarg.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <sysexits.h>
+#include <time.h>
 #include "config_parser.h"
+#include "http_server.h"
 #include "libsolar.h"
+#include "solar_archive.h"
 #include "solar_config.h"
+#include "solar_sched.h"
+#include "web_api.h"
+#include "web_cache.h"
+#include "web_chart.h"
 
 char *modport;
+char *workers;
+char *csvfilename;
+char *iouring;
+SOLAR_CTX *solar_ctx;
+SOLAR_SCHED solar_sched;
+WEB_CACHE *web_cache;
+SOLAR_ARCHIVE archive;
+
+#define MAXLINE 100
+#define BACKLOG 64
 
 PARSE_ITEMS parse_table = {
 			   {"modport", &modport},
+			   {"workers", &workers},
+			   {"csvfilename", &csvfilename},
+			   {"io_uring", &iouring},
 			    {NULL,NULL}};
 
-static void do_http(FILE *fp);
-static void web_status(FILE *fp);
-static void web_history_status(FILE *fp, int day1, int day2);
-static void webprintf(FILE *fp, char *hdr, char *fmt, ...);
-static char *striptz(char *digits);
-static void page_header(FILE *fp);
+/*
+ * Days of a /history page the refresher has not read yet, e.g. just
+ * after starting, are sent as it reads them, see history_more().
+ */
+#define HISTORY_WAIT	120	/* longest to wait for them, seconds */
+
+typedef struct {
+	int		first;
+	int		next;		/* first day not sent yet */
+	int		last;
+	time_t		when;		/* oldest read of those sent */
+	time_t		deadline;
+} HISTORY_MORE;
+
+/*
+ * Sparklines of the last day from the csv archive. They are redrawn
+ * only when the archive has grown, not for every status page.
+ */
+#define SPARK_SPAN	86400
+
+static const char *spark_fields[] = {
+	"bat_v", "soc", "array_w", NULL
+};
+static const char *spark_titles[] = {
+	"Battery Voltage", "State of Charge", "Array Power", NULL
+};
+static const char *spark_units[] = {
+	"V", "%", "W", NULL
+};
+
+static int nworkers = 1;
+static int worker;			/* which one this process is */
+static pid_t worker_pid[WEB_WORKERS_MAX];
+static pid_t refresher_pid;
+static int worker_sock[WEB_WORKERS_MAX];
+static HTTP_STATS *worker_stats;	/* shared, one per worker */
+
+/*
+ * Pre-rendered pages. Each is rendered once per update of the web
+ * cache and then served as is, with an ETag made of the start time,
+ * the cache sequence number and how far the archive has been indexed,
+ * until either changes. A gzip variant is compressed at the same time
+ * for clients that take it.
+ */
+#define PAGE_SLOTS	8
+
+typedef time_t (*PAGE_RENDER)(HTTP_RESPONSE *resp, int day1, int day2);
+
+typedef struct {
+	char		key[MAXLINE];	/* path?query */
+	unsigned long	seq;		/* of the web cache rendered from */
+	off_t		indexed;	/* of the archive, for sparklines */
+	unsigned long	used;		/* for least recently used */
+	time_t		when;		/* when its data was read */
+	char		etag[64];
+	HTTP_BLOB	*blob;
+	HTTP_BLOB	*gzip;		/* NULL if not worth it */
+} WEB_PAGE;
+
+static WEB_PAGE pages[PAGE_SLOTS];
+static unsigned long page_tick;
+static time_t start_time;
+
+static SOLAR_BUF spark_svg;
+static off_t spark_indexed = -1;
+
+static HTTP_BLOB *style_blob;
+static HTTP_BLOB *style_gzip;
+static char style_etag[32];
+
+static int listen_socket(void);
+static void start_worker(int n);
+static void start_refresher(void);
+static void serve(void);
+static const HTTP_STATS *all_stats(HTTP_SERVER *server);
+static void cache_updated(HTTP_SERVER *server, void *arg);
+static void do_http(HTTP_REQUEST *req, HTTP_RESPONSE *resp, void *arg);
+static void serve_page(HTTP_REQUEST *req, HTTP_RESPONSE *resp,
+		       PAGE_RENDER render, int day1, int day2);
+static WEB_PAGE *find_page(const char *key);
+static void send_blob(HTTP_REQUEST *req, HTTP_RESPONSE *resp,
+		      HTTP_BLOB *blob, HTTP_BLOB *gzip, const char *etag);
+static void serve_style(HTTP_REQUEST *req, HTTP_RESPONSE *resp);
+static void serve_archive(HTTP_REQUEST *req, HTTP_RESPONSE *resp);
+static void make_style(void);
+static time_t web_status(HTTP_RESPONSE *resp, int day1, int day2);
+static time_t web_history_status(HTTP_RESPONSE *resp, int day1, int day2);
+static int history_more(SOLAR_BUF *sb, void *arg);
+static void history_rows(SOLAR_BUF *sb, SOLAR_HISTORY_COLUMNS *h);
+static void history_end(SOLAR_BUF *sb, int error, int count, int want,
+			time_t when);
+static void sparklines(SOLAR_BUF *sb);
+static off_t archive_indexed(void);
+static void data_read(SOLAR_BUF *sb, time_t when);
+static void page_product(SOLAR_BUF *sb, const SOLAR_INFO *info);
+static void web_open(SOLAR_BUF *sb, const char *tag, const char *label);
+static void web_close(SOLAR_BUF *sb, const char *tag, const char *unit);
+static void web_text(SOLAR_BUF *sb, const char *tag, const char *text);
+static void web_str(SOLAR_BUF *sb, const char *tag, const char *label,
+		    const char *s);
+static void web_int(SOLAR_BUF *sb, const char *tag, const char *label,
+		    long v, const char *unit);
+static void web_fixed(SOLAR_BUF *sb, const char *tag, const char *label,
+		      double v, int decimals, const char *unit);
+static void page_header(SOLAR_BUF *sb);
+static void page_error(HTTP_RESPONSE *resp, int error);
 
-#define MAXLINE 100
-#define BACKLOG 4
 
 /*
  * web_status produces a simple http response detailing the solar
@@ -74,38 +215,23 @@ static void page_header(FILE *fp);
 int
 main(int argc, char* argv[])
 {
-	int s;
-	int status;
-	struct sockaddr_in sa;
-	int connfd;
-	FILE *fp;
-	socklen_t b;
 	struct passwd *pw;
 	struct group *grp;
 	gid_t gidset[3];
-	int opt;
-	socklen_t optlen=sizeof(opt);
-	
+	pid_t pid;
+	int i;
+
 	if (parse_config(SOLAR_GLOBAL_CONFIG, parse_table) < 0)
 		err(EX_DATAERR, "Can't find config file");
+	if (workers != NULL)
+		nworkers = atoi(workers);
+	if (nworkers < 1 || nworkers > WEB_WORKERS_MAX)
+		errx(EX_DATAERR, "workers must be 1 to %d", WEB_WORKERS_MAX);
 
-	if ((s = socket(PF_INET, SOCK_STREAM, 0)) < 0)
-		err(EX_OSERR, "Socket error");
-	if ((setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) < 0)
-		err(EX_OSERR, "setsockopt error");
-	if ((setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)))< 0)
-		err(EX_OSERR, "setsockopt error");
-
-	bzero(&sa, sizeof(sa));
-
-	sa.sin_family = AF_INET;
-	sa.sin_addr.s_addr = 0;
-	sa.sin_port = htons(80);
-	sa.sin_addr.s_addr = htonl(INADDR_ANY);
+	/* port 80 needs root, so every worker's socket is made now */
+	for (i = 0; i < nworkers; i++)
+		worker_sock[i] = listen_socket();
 
-	if ((status = bind(s, (struct sockaddr *)&sa, sizeof(sa)) < 0))
-		err(EX_OSERR, "bind error");
-	
 	pw = getpwnam(SOLAR_USER);
 	if (pw == NULL)
 		err(EX_NOUSER, "%s does not exist", SOLAR_USER);
@@ -130,298 +256,993 @@ main(int argc, char* argv[])
 		err(EX_OSERR, "fork");
 		break;
 	default:
-		close (s);
 		return (0);
 		break;
 	case 0:
 		break;
 	}
 
-	listen(s, BACKLOG);
+	if ((solar_ctx = solar_ctx_new(modport)) == NULL)
+		err(EX_OSERR, "Can't allocate solar context");
+
+	/*
+	 * The controller is only ever read by the refresher thread,
+	 * pages are served from what it last read, see web_cache.c
+	 */
+	solar_sched_init(&solar_sched, solar_ctx);
+	if ((web_cache = web_cache_new(nworkers)) == NULL)
+		err(EX_OSERR, "Can't make web cache");
+	worker_stats = mmap(NULL, nworkers * sizeof(*worker_stats),
+			    PROT_READ | PROT_WRITE, MAP_ANON | MAP_SHARED,
+			    -1, 0);
+	if (worker_stats == MAP_FAILED)
+		err(EX_OSERR, "Can't map worker statistics");
+	start_time = time(NULL);
+	make_style();
+	if (csvfilename != NULL) {
+		solar_archive_init(&archive, csvfilename);
+		web_api_archive(&archive);
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	if (nworkers == 1) {
+		if (web_cache_start(web_cache, &solar_sched) != 0)
+			errx(EX_OSERR, "Can't start refresher thread");
+		serve();
+	}
 
-	for(;;){
-	        if ((connfd = accept(s, (struct sockaddr *)&sa, &b)) < 0)
+	/* only ever fork from a process without a second thread */
+	for (i = 0; i < nworkers; i++)
+		start_worker(i);
+	start_refresher();
+	for (;;) {
+		if ((pid = wait(NULL)) < 0) {
+			sleep(1);
 			continue;
+		}
+		if (pid == refresher_pid) {
+			sleep(1);
+			start_refresher();
+		}
+		for (i = 0; i < nworkers; i++)
+			if (worker_pid[i] == pid) {
+				sleep(1);	/* don't spin on a bad one */
+				start_worker(i);
+			}
+	}
+}
+
+/*
+ * listen_socket
+ *
+ * inputs	- none
+ * output	- socket listening on port 80
+ * side effects	- exits on error
+ */
+static int
+listen_socket(void)
+{
+	struct sockaddr_in sa;
+	int opt;
+	int s;
+
+	if ((s = socket(PF_INET, SOCK_STREAM, 0)) < 0)
+		err(EX_OSERR, "Socket error");
+	opt = 1;
+	if ((setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) < 0)
+		err(EX_OSERR, "setsockopt error");
+#ifdef SO_REUSEPORT_LB
+	/* FreeBSD only balances connections over a group with this */
+	if ((setsockopt(s, SOL_SOCKET, SO_REUSEPORT_LB, &opt, sizeof(opt)))< 0)
+		err(EX_OSERR, "setsockopt error");
+#else
+	if ((setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)))< 0)
+		err(EX_OSERR, "setsockopt error");
+#endif
+
+	bzero(&sa, sizeof(sa));
+
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(80);
+	sa.sin_addr.s_addr = htonl(INADDR_ANY);
+
+	if (bind(s, (struct sockaddr *)&sa, sizeof(sa)) < 0)
+		err(EX_OSERR, "bind error");
+	if (listen(s, BACKLOG) < 0)
+		err(EX_OSERR, "listen error");
+	return (s);
+}
+
+/*
+ * start_worker
+ *
+ * inputs	- worker number
+ * output	- none
+ * side effects	- a worker process is forked to serve on its socket
+ */
+static void
+start_worker(int n)
+{
+	pid_t pid;
+
+	memset(&worker_stats[n], 0, sizeof(worker_stats[n]));
+	while ((pid = fork()) < 0) {
+		warn("fork");
+		sleep(1);
+	}
+	switch (pid) {
+	case 0:
+		worker = n;
+		web_cache_worker(web_cache, n);
+		serve();
+		break;
+	default:
+		worker_pid[n] = pid;
+		break;
+	}
+}
+
+/*
+ * start_refresher
+ *
+ * inputs	- none
+ * output	- none
+ * side effects	- a process is forked to run the refresher thread.
+ *		  It goes when this one does, closing the last write
+ *		  ends of the notify pipes, so the workers go too.
+ */
+static void
+start_refresher(void)
+{
+	pid_t parent;
+	pid_t pid;
+	int i;
+
+	parent = getpid();
+	while ((pid = fork()) < 0) {
+		warn("fork");
+		sleep(1);
+	}
+	if (pid != 0) {
+		refresher_pid = pid;
+		return;
+	}
+	for (i = 0; i < nworkers; i++)
+		close(worker_sock[i]);
+	if (web_cache_start(web_cache, &solar_sched) != 0)
+		errx(EX_OSERR, "Can't start refresher thread");
+	while (getppid() == parent)
+		sleep(1);
+	exit(0);
+}
+
+/*
+ * serve
+ *
+ * inputs	- none
+ * output	- never returns
+ * side effects	- serves HTTP on this worker's socket
+ */
+static void
+serve(void)
+{
+	HTTP_SERVER server;
+	int flags;
+	int i;
+
+	for (i = 0; i < nworkers; i++)
+		if (i != worker)
+			close(worker_sock[i]);
+	flags = 0;
+	if (iouring != NULL && strcasecmp(iouring, "yes") == 0)
+		flags |= HTTP_URING;
+	if (http_server_init(&server, worker_sock[worker], flags, do_http,
+			     &server) < 0)
+		err(EX_OSERR, "Can't start http server");
+	if (http_server_watch(&server, web_cache_notify_fd(web_cache),
+			      cache_updated, web_cache) < 0)
+		err(EX_OSERR, "Can't watch for updates");
+
+	for (;;) {
+		http_server_poll(&server, 1000);
+		worker_stats[worker] = *http_server_stats(&server);
+	}
+}
+
+/*
+ * cache_updated
+ * The refresher has new data, for /stream and unfinished /history
+ */
+static void
+cache_updated(HTTP_SERVER *server, void *arg)
+{
+	web_stream_notify(server, arg);
+	http_server_more(server);
+}
+
+/*
+ * all_stats
+ *
+ * inputs	- this worker's HTTP_SERVER
+ * output	- HTTP statistics summed over all workers
+ */
+static const HTTP_STATS *
+all_stats(HTTP_SERVER *server)
+{
+	static HTTP_STATS sum;
+	const HTTP_STATS *h;
+	int i;
+	int j;
 
-		if ((fp = fdopen(connfd, "r+")) == NULL)
-			err(EX_OSERR, "fdopen");
-		setvbuf(fp, NULL, _IOLBF, 0);
-		fprintf(fp, "HTTP/1.1 200 OK\n\n");
-		do_http(fp);
-		fclose(fp);
-		close(connfd);
+	worker_stats[worker] = *http_server_stats(server);
+	memset(&sum, 0, sizeof(sum));
+	for (i = 0; i < nworkers; i++) {
+		h = &worker_stats[i];
+		sum.accepted += h->accepted;
+		sum.refused += h->refused;
+		sum.timeouts += h->timeouts;
+		sum.requests += h->requests;
+		for (j = 0; j < 6; j++)
+			sum.status[j] += h->status[j];
+		sum.render_sum += h->render_sum;
+		if (h->render_max > sum.render_max)
+			sum.render_max = h->render_max;
+		sum.bytes_out += h->bytes_out;
+		sum.streams += h->streams;
+		sum.dropped += h->dropped;
+		sum.io_calls += h->io_calls;
+		sum.buf_grows += h->buf_grows;
+		sum.uring += h->uring;
 	}
+	return (&sum);
 }
 
 /*
- * read one line from client. Don't bother checking for proper GETS etc.
- * simply invoke history or normal status depending on /history
- * found in the line. This will handle http://solar.local?history etc.
+ * do_http
+ *
+ * inputs	- parsed request
+ *		- response to fill in
+ * output	- none
+ * side effects	- the page is rendered into resp->body
+ *
+ * /history?day1,day2 gives the history of those days, / the status.
+ * /api/ requests get JSON and /metrics Prometheus text, see web_api.c
  */
 static void
-do_http(FILE *fp)
+do_http(HTTP_REQUEST *req, HTTP_RESPONSE *resp, void *arg)
 {
+	char query[MAXLINE];
 	char *p;
-	char *date_time;
-	char line[MAXLINE];
 	char **ap, *args[2];
 	int day1=0;
 	int day2=10;
 
-	fgets(line, sizeof(line), fp);
-	p = strchr(line, '/');
-	if (p != NULL) {
-		p++;
-		if (strncmp(p, "history",7) == 0) {
-			p += 7;
-			if (*p == '?') {
-				p++;
-
-				for (ap=args;(*ap = strsep(&p, " ,")) != NULL;)
-					if (**ap != '\0')
-						if (++ap >= &args[2])
-							break;
-				if (args[0] != NULL)
-					day1 = atoi(args[0]);
-				if (args[1] != NULL)
-					day2 = atoi(args[1]);
-				if (day2 < day1)
-					day2 = day1;
-				web_history_status(fp, day1, day2);
-			}
-		} else
-			web_status(fp);
-	} else
-		web_status(fp);
+	if (web_api(req, resp, web_cache))
+		return;
+	if (strcmp(req->path, "/stream") == 0) {
+		web_stream(resp, web_cache);
+		return;
+	}
+	if (strcmp(req->path, "/metrics") == 0) {
+		web_metrics(resp, web_cache, all_stats(arg));
+		return;
+	}
+	if (strcmp(req->path, "/history") == 0) {
+		strlcpy(query, req->query, sizeof(query));
+		p = query;
+		args[0] = args[1] = NULL;
+		for (ap=args;(*ap = strsep(&p, " ,")) != NULL;)
+			if (**ap != '\0')
+				if (++ap >= &args[2])
+					break;
+		if (args[0] != NULL)
+			day1 = atoi(args[0]);
+		if (args[1] != NULL)
+			day2 = atoi(args[1]);
+		if (day2 < day1)
+			day2 = day1;
+		serve_page(req, resp, web_history_status, day1, day2);
+	} else if (strcmp(req->path, "/") == 0 ||
+		   strcmp(req->path, "/index.html") == 0)
+		serve_page(req, resp, web_status, 0, 0);
+	else if (strcmp(req->path, "/style.css") == 0)
+		serve_style(req, resp);
+	else if (strcmp(req->path, "/archive.csv") == 0 && csvfilename != NULL)
+		serve_archive(req, resp);
+	else {
+		resp->status = 404;
+		page_header(resp->body);
+		web_text(resp->body, "h1", "Not found");
+		solar_buf_str(resp->body, "</body>\n</html>\n");
+	}
 }
 
 /*
- * web_status
+ * serve_page
  *
- * input	- fp File pointer to opened remote browser
+ * inputs	- request and response
+ *		- function rendering the page and its arguments
  * output	- none
- * side effects	- solar status for remote browser in html format
+ * side effects	- the page is rendered if the data changed since it
+ *		  last was, then sent or 304 if the client has it
  */
 static void
-web_status(FILE *fp)
+serve_page(HTTP_REQUEST *req, HTTP_RESPONSE *resp, PAGE_RENDER render,
+	   int day1, int day2)
 {
+	char key[MAXLINE];
+	WEB_PAGE *page;
+	HTTP_BLOB *blob;
+	SOLAR_BUF *body;
+	unsigned long seq;
+	off_t indexed;
+	time_t when;
+	int i;
+
+	snprintf(key, sizeof(key), "%s?%s", req->path, req->query);
+	seq = web_cache_seq(web_cache);
+	indexed = archive_indexed();
+	page = find_page(key);
+	if (page == NULL || page->seq != seq || page->indexed != indexed ||
+	    page->blob == NULL) {
+		if ((blob = http_blob_new()) == NULL) {
+			(void)render(resp, day1, day2);
+			return;
+		}
+		body = resp->body;
+		resp->body = &blob->buf;
+		when = render(resp, day1, day2);
+		resp->body = body;
+		if (resp->status != 200 || resp->more != NULL) {
+			resp->blob = blob;	/* this once only */
+			return;
+		}
+		if (page == NULL) {
+			page = &pages[0];
+			for (i = 1; i < PAGE_SLOTS; i++)
+				if (pages[i].used < page->used)
+					page = &pages[i];
+			strlcpy(page->key, key, sizeof(page->key));
+		}
+		if (page->blob != NULL)
+			http_blob_release(page->blob);
+		if (page->gzip != NULL)
+			http_blob_release(page->gzip);
+		page->blob = blob;
+		page->gzip = http_blob_gzip(blob);
+		page->seq = seq;
+		page->indexed = indexed;
+		page->when = when;
+		snprintf(page->etag, sizeof(page->etag), "\"%lx-%lx-%llx\"",
+			 (unsigned long)start_time, seq, (long long)indexed);
+	}
+	page->used = ++page_tick;
+	http_add_header(resp, "Cache-Control", "no-cache");
+	web_data_age(resp, page->when);
+	send_blob(req, resp, page->blob, page->gzip, page->etag);
+}
+
+/*
+ * send_blob
+ *
+ * inputs	- request and response
+ *		- identity and gzip (may be NULL) representations
+ *		- ETag of the identity one
+ * output	- none
+ * side effects	- the gzip variant is sent if the client accepts it,
+ *		  its ETag has -gz added, 304 if the client has it
+ */
+static void
+send_blob(HTTP_REQUEST *req, HTTP_RESPONSE *resp, HTTP_BLOB *blob,
+	  HTTP_BLOB *gzip, const char *etag)
+{
+	char gzetag[72];
+
+	http_add_header(resp, "Vary", "Accept-Encoding");
+	if (gzip != NULL && http_accepts(req, "gzip")) {
+		snprintf(gzetag, sizeof(gzetag), "%.*s-gz\"",
+			 (int)strlen(etag) - 1, etag);
+		http_add_header(resp, "Content-Encoding", "gzip");
+		etag = gzetag;
+		blob = gzip;
+	}
+	http_add_header(resp, "ETag", etag);
+	if (http_etag_match(req, etag))
+		resp->status = 304;
+	else
+		resp->blob = http_blob_hold(blob);
+}
+
+static WEB_PAGE *
+find_page(const char *key)
+{
+	int i;
+
+	for (i = 0; i < PAGE_SLOTS; i++)
+		if (pages[i].blob != NULL && strcmp(pages[i].key, key) == 0)
+			return (&pages[i]);
+	return (NULL);
+}
+
+/*
+ * The style sheet never changes, it is made and compressed once and
+ * may be kept by the browser for a day.
+ */
+static const char style_sheet[] =
+	".grid-container {\n"
+	"  display: grid;\n"
+	"  grid-template-columns: auto auto auto auto;\n"
+	"  grid-gap: 5px;\n"
+	"  padding: 5px;\n"
+	"  background-color: #2196F3;\n"
+	"  font-size: 20px;\n"
+	"}\n"
+	"html {\n"
+	"font-family: \"Lucida sans\", sans-serif;\n"
+	"}\n"
+	".header {\n"
+	"background-color: #9933cc;\n"
+	"color: #ffffff;\n"
+	"padding: 15px;\n"
+	"}\n"
+	"table, tr {\nborder: 1px solid black;\n}\n"
+	"tr {\ntext-align: center;\n}\n"
+	".chart {\n"
+	"display: inline-block;\n"
+	"margin: 5px;\n"
+	"}\n";
+
+static void
+make_style(void)
+{
+	const char *p;
+	unsigned long hash;
+
+	if ((style_blob = http_blob_new()) == NULL ||
+	    solar_buf_append(&style_blob->buf, style_sheet,
+			     sizeof(style_sheet) - 1) < 0)
+		err(EX_OSERR, "Can't allocate style sheet");
+	hash = 5381;
+	for (p = style_sheet; *p != '\0'; p++)
+		hash = hash * 33 + (unsigned char)*p;
+	snprintf(style_etag, sizeof(style_etag), "\"css-%lx\"", hash);
+	style_gzip = http_blob_gzip(style_blob);
+}
+
+static void
+serve_style(HTTP_REQUEST *req, HTTP_RESPONSE *resp)
+{
+	resp->content_type = "text/css";
+	http_add_header(resp, "Cache-Control", "max-age=86400");
+	send_blob(req, resp, style_blob, style_gzip, style_etag);
+}
+
+/*
+ * serve_archive
+ *
+ * inputs	- request and response
+ * output	- none
+ * side effects	- the csv archive, or the byte range asked for, is
+ *		  sent straight from the file with sendfile()
+ *
+ * The archive is only ever appended to, so a host that has the first
+ * N bytes asks for "Range: bytes=N-" and gets just the new lines, or
+ * 416 if there are none yet.
+ */
+static void
+serve_archive(HTTP_REQUEST *req, HTTP_RESPONSE *resp)
+{
+	struct stat st;
+	char modified[32];
+	char range[64];
+	off_t first;
+	off_t last;
+	int fd;
+
+	if ((fd = open(csvfilename, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+		if (fd >= 0)
+			close(fd);
+		resp->status = 503;
+		page_header(resp->body);
+		web_text(resp->body, "h1", "Archive unavailable");
+		solar_buf_str(resp->body, "</body>\n</html>\n");
+		return;
+	}
+	resp->content_type = "text/csv";
+	http_time(st.st_mtime, modified, sizeof(modified));
+	http_add_header(resp, "Last-Modified", modified);
+	http_add_header(resp, "Accept-Ranges", "bytes");
+	if (!http_modified_since(req, st.st_mtime)) {
+		resp->status = 304;
+		close(fd);
+		return;
+	}
+	switch (http_range(req, st.st_size, modified, &first, &last)) {
+	case -1:
+		resp->status = 416;
+		snprintf(range, sizeof(range), "bytes */%lld",
+			 (long long)st.st_size);
+		http_add_header(resp, "Content-Range", range);
+		close(fd);
+		return;
+	case 1:
+		resp->status = 206;
+		snprintf(range, sizeof(range), "bytes %lld-%lld/%lld",
+			 (long long)first, (long long)last,
+			 (long long)st.st_size);
+		http_add_header(resp, "Content-Range", range);
+		break;
+	}
+	resp->file = fd;
+	resp->file_off = first;
+	resp->file_len = last - first + 1;
+}
+
+/*
+ * web_status
+ *
+ * input	- resp the page is rendered into
+ *		- unused, see PAGE_RENDER
+ * output	- when the data shown was read, 0 on error
+ * side effects	- solar status for remote browser in html format
+ */
+/* ARGSUSED */
+static time_t
+web_status(HTTP_RESPONSE *resp, int day1, int day2)
+{
+	SOLAR_BUF *sb;
+	SOLAR_INFO info;
 	SOLAR_INFO *sol_info;
+	time_t when;
+	int error;
+
+	sb = resp->body;
+	sol_info = &info;
+	if ((error = web_cache_info(web_cache, sol_info, &when))
+	    != SOLAR_OK) {
+		page_error(resp, error);
+		return (0);
+	}
 
-	sol_info = get_solar_info(modport);
-
-	page_header(fp);
-	fprintf(fp, "<div class=\"header\">\n");
-	webprintf(fp, "h1","Solar Panel Status");
-	webprintf(fp, "h2","Product Model: %s<br>"
-		  "Hardware Version: %s<br>"
-		  "Software Version: %s<br>"
-		  "Serial number: %s</h2>",
-		  sol_info->model,
-		  sol_info->hardware_version,
-		  sol_info->software_version,
-		  sol_info->serial_number);
-	fprintf(fp, "</div>\n");
+	page_header(sb);
+	solar_buf_str(sb, "<div class=\"header\">\n");
+	web_text(sb, "h1", "Solar Panel Status");
+	page_product(sb, sol_info);
+	data_read(sb, when);
+	solar_buf_str(sb, "</div>\n");
+	sparklines(sb);
 	       
-	webprintf(fp, "h2","Array Information");
-	fprintf(fp, "<div class =\"grid-container\">\n");
-	webprintf(fp, "div","Array Voltage: %.3fV", sol_info->array_v);
-	webprintf(fp, "div","Array Current: %.3fA", sol_info->array_a);
-	webprintf(fp, "div","Array Power: %dW", sol_info->array_w);
-	webprintf(fp, "div","Array working state: %s",
-		  sol_info->array_working_state);
-	webprintf(fp, "div","Power Generated Today: %dW",
-		  sol_info->power_gen_today);
-	fprintf(fp, "</div>\n");
+	web_text(sb, "h2", "Array Information");
+	solar_buf_str(sb, "<div class =\"grid-container\">\n");
+	web_fixed(sb, "div", "Array Voltage: ", sol_info->array_v, 3, "V");
+	web_fixed(sb, "div", "Array Current: ", sol_info->array_a, 3, "A");
+	web_int(sb, "div", "Array Power: ", sol_info->array_w, "W");
+	web_str(sb, "div", "Array working state: ",
+		sol_info->array_working_state);
+	web_int(sb, "div", "Power Generated Today: ",
+		sol_info->power_gen_today, "W");
+	web_int(sb, "div", "Power Consumed Today: ",
+		sol_info->power_con_today, "W");
+	solar_buf_str(sb, "</div>\n");
 		  
-	webprintf(fp, "h2","Battery Information");
-	fprintf(fp, "<div class =\"grid-container\">\n");
-	webprintf(fp, "div","Battery Voltage: %.3fV", sol_info->bat_v);
-	webprintf(fp, "div","Battery charging amp: %.3fA", sol_info->bat_a);
-	webprintf(fp, "div","Charging state: %s", sol_info->charging_state);
-	fprintf(fp, "<div>State of Charge: %d%%</div>\n", sol_info->soc);
-	fprintf(fp, "</div>\n");
+	web_text(sb, "h2", "Battery Information");
+	solar_buf_str(sb, "<div class =\"grid-container\">\n");
+	web_fixed(sb, "div", "Battery Voltage: ", sol_info->bat_v, 3, "V");
+	web_fixed(sb, "div", "Battery charging amp: ", sol_info->bat_a, 3, "A");
+	web_str(sb, "div", "Charging state: ", sol_info->charging_state);
+	web_int(sb, "div", "State of Charge: ", sol_info->soc, "%");
+	solar_buf_str(sb, "</div>\n");
 	       
-	webprintf(fp, "h2","Load Information");
-	fprintf(fp, "<div class =\"grid-container\">\n");
-	webprintf(fp, "div","Load Voltage: %.3fV", sol_info->load_v);
-	webprintf(fp, "div","Load Current: %.3fA", sol_info->load_a);
-	fprintf(fp, "</div>\n");
+	web_text(sb, "h2", "Load Information");
+	solar_buf_str(sb, "<div class =\"grid-container\">\n");
+	web_fixed(sb, "div", "Load Voltage: ", sol_info->load_v, 3, "V");
+	web_fixed(sb, "div", "Load Current: ", sol_info->load_a, 3, "A");
+	solar_buf_str(sb, "</div>\n");
 	
-	webprintf(fp, "h2","Controller Information\n");
-	fprintf(fp, "<div class =\"grid-container\">\n");
-	webprintf(fp, "div","Device temperature: %dC", sol_info->device_temp);
-	webprintf(fp, "div","system voltage setting: %dV", sol_info->system_voltage_setting);
-
-	webprintf(fp, "div","system voltage recognized: %dV", sol_info->system_voltage_recognized);
-	webprintf(fp, "div","System Max Voltage supported: %dV", sol_info->max_v_system);
-	webprintf(fp, "div","System Rated Charge Current: %dA", sol_info->rated_charge_a);
-	fprintf(fp, "</div>\n");
+	web_text(sb, "h2", "Controller Information");
+	solar_buf_str(sb, "<div class =\"grid-container\">\n");
+	web_int(sb, "div", "Device temperature: ", sol_info->device_temp, "C");
+	web_int(sb, "div", "system voltage setting: ",
+		sol_info->system_voltage_setting, "V");
+
+	web_int(sb, "div", "system voltage recognized: ",
+		sol_info->system_voltage_recognized, "V");
+	web_int(sb, "div", "System Max Voltage supported: ",
+		sol_info->max_v_system, "V");
+	web_int(sb, "div", "System Rated Charge Current: ",
+		sol_info->rated_charge_a, "A");
+	solar_buf_str(sb, "</div>\n");
 		  
-	webprintf(fp, "h2","Battery History today");
-	fprintf(fp, "<div class =\"grid-container\">");
-	webprintf(fp, "div","Total battery charge: %dAH", sol_info->bat_charging_ah_today);
-	webprintf(fp, "div","Total battery discharge: %dAH", sol_info->bat_discharging_ah_today);
-	webprintf(fp, "div","Minimum battery voltage: %fV", sol_info->bat_min_volts_today);
-	webprintf(fp, "div","Maximum battery voltage: %fV", sol_info->bat_max_volts_today);
-	webprintf(fp, "div","Maximum battery<br>charging power: %fW", sol_info->bat_min_volts_today);
-	fprintf(fp, "</div>\n");
+	web_text(sb, "h2", "Battery History today");
+	solar_buf_str(sb, "<div class =\"grid-container\">");
+	web_int(sb, "div", "Total battery charge: ",
+		sol_info->bat_charging_ah_today, "AH");
+	web_int(sb, "div", "Total battery discharge: ",
+		sol_info->bat_discharging_ah_today, "AH");
+	web_fixed(sb, "div", "Minimum battery voltage: ",
+		  sol_info->bat_min_volts_today, 3, "V");
+	web_fixed(sb, "div", "Maximum battery voltage: ",
+		  sol_info->bat_max_volts_today, 3, "V");
+	web_fixed(sb, "div", "Maximum battery<br>charging power: ",
+		  sol_info->bat_min_volts_today, 3, "W");
+	solar_buf_str(sb, "</div>\n");
 		  
-	webprintf(fp, "h2","Historical data");
-	fprintf(fp, "<div class =\"grid-container\">");
-	webprintf(fp, "div","Total Operating Days: %d", sol_info->total_operating_days);
-	webprintf(fp, "div","Total times battery over discharged: %d",sol_info->bat_total_over_discharges);
-	webprintf(fp, "div","Total times battery fully charged: %d", sol_info->bat_total_full_charges);
-	fprintf(fp, "</div>\n");
-
-	fprintf(fp, "</body>\n</html>\n");
-	
-	free_solar_info(sol_info);
+	web_text(sb, "h2", "Historical data");
+	solar_buf_str(sb, "<div class =\"grid-container\">");
+	web_int(sb, "div", "Total Operating Days: ",
+		sol_info->total_operating_days, "");
+	web_int(sb, "div", "Total times battery over discharged: ",
+		sol_info->bat_total_over_discharges, "");
+	web_int(sb, "div", "Total times battery fully charged: ",
+		sol_info->bat_total_full_charges, "");
+	web_int(sb, "div", "Total energy generated: ", sol_info->gen_wh, "Wh");
+	web_int(sb, "div", "Total energy consumed: ", sol_info->con_wh, "Wh");
+	solar_buf_str(sb, "</div>\n");
+
+	solar_buf_str(sb, "</body>\n</html>\n");
+	return (when);
 }
 
-void
-web_history_status(FILE *fp, int day1, int day2)
+static time_t
+web_history_status(HTTP_RESPONSE *resp, int day1, int day2)
 {
-	int day;
+	SOLAR_BUF *sb;
+	int error;
+	SOLAR_INFO info;
 	SOLAR_INFO *sol_info;
-	SOLAR_HISTORY *sol_history;
+	SOLAR_HISTORY_COLUMNS history;
+	SOLAR_HISTORY_COLUMNS *h;
+	HISTORY_MORE *hm;
+	time_t when;
 	
-	sol_info = get_solar_info(modport);
+	sb = resp->body;
+	sol_info = &info;
+	if ((error = web_cache_info(web_cache, sol_info, &when))
+	    != SOLAR_OK) {
+		page_error(resp, error);
+		return (0);
+	}
 	
-	page_header(fp);
-	fprintf(fp, "<div class=\"header\">\n");
-	webprintf(fp, "h1","Solar History Status");
-	webprintf(fp, "h2","Product Model: %s<br>"
-		  "Hardware Version: %s<br>"
-		  "Software Version: %s<br>"
-		  "Serial number: %s</h2>",
-		  sol_info->model,
-		  sol_info->hardware_version,
-		  sol_info->software_version,
-		  sol_info->serial_number);
-	free_solar_info(sol_info);
+	page_header(sb);
+	solar_buf_str(sb, "<div class=\"header\">\n");
+	web_text(sb, "h1", "Solar History Status");
+	page_product(sb, sol_info);
 	
-	fprintf(fp, "</div>\n");
-	fprintf(fp, "<table>\n<tr>\n");
-	webprintf(fp, "th","Day");
-	webprintf(fp, "th","Min Battery Voltage(V)");
-	webprintf(fp, "th","Max Battery Voltage(V)");
-	webprintf(fp, "th","Max Charge Curr (A)");
-	webprintf(fp, "th","Max Discharge Curr (A)");
-	webprintf(fp, "th","Max Charge Power(W)");
-	webprintf(fp, "th","Max Discharge Power(W)");
-	webprintf(fp, "th","Charge(AH)");
-	webprintf(fp, "th","Discharge(AH)");
-	webprintf(fp, "th","Charge(KWH)");
-	webprintf(fp, "th","Discharge(KWH)");
+	solar_buf_str(sb, "</div>\n");
+
+	if (day1 >= MAX_DAYS_HISTORY)
+		day1 = MAX_DAYS_HISTORY - 1;
+	if (day2 >= MAX_DAYS_HISTORY)
+		day2 = MAX_DAYS_HISTORY - 1;
+	if (day1 < 0)
+		day1 = 0;
+	h = &history;
+	error = web_cache_history(web_cache, day1, day2, h, &when);
+	/* days still to come are sent as rows, too late for a chart */
+	if (h->count > 1 && h->count == day2 - day1 + 1)
+		chart_history(sb, h);
+
+	solar_buf_str(sb, "<table>\n<tr>\n");
+	web_text(sb, "th", "Day");
+	web_text(sb, "th", "Min Battery Voltage(V)");
+	web_text(sb, "th", "Max Battery Voltage(V)");
+	web_text(sb, "th", "Max Charge Curr (A)");
+	web_text(sb, "th", "Max Discharge Curr (A)");
+	web_text(sb, "th", "Max Charge Power(W)");
+	web_text(sb, "th", "Max Discharge Power(W)");
+	web_text(sb, "th", "Charge(AH)");
+	web_text(sb, "th", "Discharge(AH)");
+	web_text(sb, "th", "Charge(KWH)");
+	web_text(sb, "th", "Discharge(KWH)");
 	
-	fprintf(fp,"</tr>\n");
-
-	prime_solar_history(modport, day1, day2);
-	for (day = day1; day <= day2; day++) {
-		sol_history = get_solar_history(day);
-		fprintf(fp, "<tr>\n");
-		webprintf(fp, "td","%d", sol_history->day);
-		webprintf(fp, "td","%.3f", sol_history->bat_min_v);
-		webprintf(fp, "td","%.3f", sol_history->bat_max_v);
-		webprintf(fp, "td","%.3f", sol_history->bat_max_charge_a);
-		webprintf(fp, "td","%.3f", sol_history->bat_max_discharge_a);
-		webprintf(fp, "td","%.3f", sol_history->bat_max_charge_w);
-		webprintf(fp, "td","%.3f", sol_history->bat_max_discharge_w);
-		webprintf(fp, "td","%d", sol_history->bat_charge_ah);
-		webprintf(fp, "td","%d", sol_history->bat_discharge_ah);
-		webprintf(fp, "td","%.3f", sol_history->bat_charge_kwh);
-		webprintf(fp, "td","%.3f", sol_history->bat_discharge_kwh);
-		fprintf(fp,"</tr>\n");
-		free_solar_history(sol_history);
+	solar_buf_str(sb, "</tr>\n");
+
+	history_rows(sb, h);
+	if (h->count < day2 - day1 + 1 &&
+	    (hm = malloc(sizeof(*hm))) != NULL) {
+		hm->first = day1;
+		hm->next = day1 + h->count;
+		hm->last = day2;
+		hm->when = h->count > 0 ? when : 0;
+		hm->deadline = time(NULL) + HISTORY_WAIT;
+		resp->more = history_more;
+		resp->more_arg = hm;
+		return (when);
 	}
-	fprintf(fp, "</table>\n");
-	fprintf(fp, "</body>\n</html>\n");
+	history_end(sb, error, h->count, day2 - day1 + 1, when);
+	return (when);
+}
+
+/*
+ * history_more
+ *
+ * inputs	- buffer to append to, NULL if the client has gone
+ *		- HISTORY_MORE
+ * output	- 1 while days are still to come, else 0
+ * side effects	- rows for days read since last time are added, the
+ *		  page is finished once all are or HISTORY_WAIT is up
+ */
+static int
+history_more(SOLAR_BUF *sb, void *arg)
+{
+	static SOLAR_HISTORY_COLUMNS h;
+	HISTORY_MORE *hm;
+	time_t when;
+	int error;
+
+	hm = arg;
+	if (sb == NULL) {
+		free(hm);
+		return (0);
+	}
+	error = web_cache_history(web_cache, hm->next, hm->last, &h, &when);
+	if (h.count > 0) {
+		history_rows(sb, &h);
+		hm->next += h.count;
+		if (hm->when == 0 || when < hm->when)
+			hm->when = when;
+	}
+	if (hm->next <= hm->last && time(NULL) < hm->deadline)
+		return (1);
+	history_end(sb, hm->next > hm->last ? SOLAR_OK : error,
+		    hm->next - hm->first, hm->last - hm->first + 1, hm->when);
+	free(hm);
+	return (0);
+}
+
+static void
+history_rows(SOLAR_BUF *sb, SOLAR_HISTORY_COLUMNS *h)
+{
+	int day;
+	int i;
+
+	for (i = 0; i < h->count; i++) {
+		day = h->first + i;
+		solar_buf_str(sb, "<tr>\n");
+		web_int(sb, "td", "", day, "");
+		web_fixed(sb, "td", "", h->bat_min_v[i], 3, "");
+		web_fixed(sb, "td", "", h->bat_max_v[i], 3, "");
+		web_fixed(sb, "td", "", h->bat_max_charge_a[i], 3, "");
+		web_fixed(sb, "td", "", h->bat_max_discharge_a[i], 3, "");
+		web_fixed(sb, "td", "", h->bat_max_charge_w[i], 3, "");
+		web_fixed(sb, "td", "", h->bat_max_discharge_w[i], 3, "");
+		web_int(sb, "td", "", (int)h->bat_charge_ah[i], "");
+		web_int(sb, "td", "", (int)h->bat_discharge_ah[i], "");
+		web_fixed(sb, "td", "", h->bat_charge_kwh[i], 3, "");
+		web_fixed(sb, "td", "", h->bat_discharge_kwh[i], 3, "");
+		solar_buf_str(sb, "</tr>\n");
+	}
+}
+
+/*
+ * history_end
+ *
+ * inputs	- buffer the page is rendered into
+ *		- SOLAR_E error if the days could not all be read
+ *		- number of days shown and asked for
+ *		- oldest read of those shown
+ * output	- none
+ */
+static void
+history_end(SOLAR_BUF *sb, int error, int count, int want, time_t when)
+{
+	solar_buf_str(sb, "</table>\n");
+	if (error != SOLAR_OK)
+		web_str(sb, "p", "History unavailable: ",
+			solar_strerror(error));
+	else if (count < want) {
+		web_open(sb, "p", "Still reading history, ");
+		solar_buf_int(sb, count);
+		solar_buf_str(sb, " of ");
+		solar_buf_int(sb, want);
+		web_close(sb, "p", " days");
+	}
+	if (error == SOLAR_OK)
+		data_read(sb, when);
+	solar_buf_str(sb, "</body>\n</html>\n");
+}
+
+/*
+ * page_product
+ * The controller's identity, at the top of both pages.
+ */
+static void
+page_product(SOLAR_BUF *sb, const SOLAR_INFO *info)
+{
+	web_open(sb, "h2", "Product Model: ");
+	solar_buf_str(sb, info->model);
+	solar_buf_str(sb, "<br>Hardware Version: ");
+	solar_buf_str(sb, info->hardware_version);
+	solar_buf_str(sb, "<br>Software Version: ");
+	solar_buf_str(sb, info->software_version);
+	solar_buf_str(sb, "<br>Serial number: ");
+	solar_buf_str(sb, info->serial_number);
+	web_close(sb, "h2", "");
 }
 
 /*
  * page_header
  * helper function with same page header is used for both status and history
  *
- * inputs:		File pointer to remote browser
+ * inputs:		buffer the page is rendered into
  * output:		None
- * side effects:	prints HTML page header to remote browser
+ * side effects:	HTML page header is appended
  */
 static void
-page_header(FILE *fp)
+page_header(SOLAR_BUF *sb)
 {
-	fprintf(fp, "<html>\n<head>\n<style>\n"
-	".grid-container {\n"
-	"  display: grid;\n"
-	"  grid-template-columns: auto auto auto auto;\n"
-	"  grid-gap: 5px;\n"
-	"  padding: 5px;\n"
-	"  background-color: #2196F3;\n"
-	"  font-size: 20px;\n"
-	"}\n");
-	fprintf(fp, "html {\n"
-	       "font-family: \"Lucida sans\", sans-serif;\n"
-	       "}\n");
-
-	fprintf(fp, ".header {\n"
-	       "background-color: #9933cc;\n"
-	       "color: #ffffff;\n"
-	       "padding: 15px;\n"
-	       "}\n");
-
-	fprintf(fp, "table, tr {\nborder: 1px solid black;\n}\n");
-	fprintf(fp, "tr {\ntext-align: center;\n}\n");
-	fprintf(fp, "</style>\n"
+	solar_buf_str(sb, "<html>\n<head>\n"
+	       "<link rel=\"stylesheet\" href=\"/style.css\">\n"
 	       "</head>\n"
 	       "<body>\n");
 }
 
 /*
- * prints given hdr with a <> around eg. <hdr> then the fmt
- * is scanned and trailing zeroes are removed. Finally adds
- * a terminating </hdr>
+ * sparklines
+ *
+ * inputs	- buffer the status page is rendered into
+ * output	- none
+ * side effects	- the last day of battery voltage, SOC and array
+ *		  power from the csv archive is appended as SVG,
+ *		  redrawn only if the archive has grown since
  */
 static void
-webprintf(FILE *fp, char *hdr, char *fmt, ...)
+sparklines(SOLAR_BUF *sb)
 {
-	va_list ap;
-	char *ret;
-	char *extra;
-	
-	va_start(ap, fmt);
-	vasprintf(&ret, fmt, ap);
-	extra = striptz(ret);
-	if (extra != NULL)
-		fprintf(fp, "<%s>%s%s</%s>\n", hdr, ret, extra, hdr);
-	else
-		fprintf(fp, "<%s>%s</%s>\n", hdr, ret, hdr);
-	va_end(ap);
-	free(ret);
+	SOLAR_POINT points[CHART_SPARK_POINTS];
+	time_t now;
+	long rows;
+	int field;
+	int n;
+	int i;
+
+	if (csvfilename == NULL || archive_indexed() == 0)
+		return;
+	if (archive.indexed != spark_indexed) {
+		solar_buf_reset(&spark_svg);
+		now = time(NULL);
+		for (i = 0; spark_fields[i] != NULL; i++) {
+			field = solar_snapshot_field(spark_fields[i]);
+			n = solar_archive_series(&archive, field,
+						 now - SPARK_SPAN, now, points,
+						 CHART_SPARK_POINTS, &rows);
+			chart_sparkline(&spark_svg, spark_titles[i],
+					spark_units[i], points, n,
+					solar_snapshot_decimals(field));
+		}
+		spark_indexed = archive.indexed;
+	}
+	if (spark_svg.len > 0) {
+		solar_buf_str(sb, "<div>\n");
+		solar_buf_append(sb, spark_svg.buf, spark_svg.len);
+		solar_buf_str(sb, "</div>\n");
+	}
 }
 
 /*
- * Surprisingly printf doesn't allow one to output %f removing trailing zeros
- * So a little routine here to do that. This allowed me to match
- * output with python and actually easier to read as well.
+ * archive_indexed
+ * The archive is looked at no more often than once a second, as
+ * every page served asks.
  *
- * Since digits is modified in place, I can return a pointer to the
- * end of the string which could be a 'V' or 'A' etc.
+ * inputs:		None
+ * output:		how far the archive is indexed, 0 if there is none
  */
+static off_t
+archive_indexed(void)
+{
+	static time_t checked;
+	static off_t indexed;
+	time_t now;
+
+	if (csvfilename == NULL)
+		return (0);
+	if ((now = time(NULL)) != checked) {
+		checked = now;
+		indexed = solar_archive_update(&archive) < 0 ? 0 :
+		    archive.indexed;
+	}
+	return (indexed);
+}
 
-static char *
-striptz(char *digits)
+/*
+ * data_read
+ * Pages are kept until the data changes so they give the time it
+ * was read, values read again unchanged keep the page and the time
+ * they were first read. Its age in seconds is in the X-Data-Age header.
+ *
+ * inputs:		buffer the page is rendered into
+ *			when the data was read
+ * output:		None
+ */
+static void
+data_read(SOLAR_BUF *sb, time_t when)
 {
-	char *p;
-	char *q;
-	
-	if ((p = strchr(digits, '.')) == NULL)
-		return (NULL);
-	p++;
-	if ((q = strrchr(p, '0')) == NULL)
-		return (NULL);
-	p = q + 1;
-	while (*q == '0' && q[1] != '.')
-		*q-- = '\0';
-	if (*p == '\0')
-		p = NULL;
-	return (p);
+	char stamp[32];
+
+	*solar_fmt_time(stamp, when) = '\0';
+	web_str(sb, "p", "Data read at ", stamp);
+}
+
+/*
+ * page_error
+ * The controller could not be read, e.g. the serial port is busy.
+ * Say so and carry on serving, the next request will try again.
+ *
+ * inputs:		response the page is rendered into
+ *			SOLAR_E error code
+ * output:		None
+ * side effects:	HTML error page is appended
+ */
+static void
+page_error(HTTP_RESPONSE *resp, int error)
+{
+	SOLAR_BUF *sb;
+
+	sb = resp->body;
+	resp->status = 503;
+	http_add_header(resp, "Retry-After", "5");
+	page_header(sb);
+	web_text(sb, "h1", "Solar Panel Status");
+	web_str(sb, "p", "Controller unavailable: ", solar_strerror(error));
+	solar_buf_str(sb, "</body>\n</html>\n");
+}
+
+/*
+ * The page writer. Each element goes straight into the page buffer,
+ * numbers are converted by hand and there is nothing to allocate or
+ * free per element, see solar_buf_int() and solar_buf_fixed().
+ *
+ * inputs	- buffer the page is rendered into
+ *		- element e.g. "div", text before the value
+ *		- value, digits after the point, unit after it
+ */
+static void
+web_open(SOLAR_BUF *sb, const char *tag, const char *label)
+{
+	solar_buf_append(sb, "<", 1);
+	solar_buf_str(sb, tag);
+	solar_buf_append(sb, ">", 1);
+	solar_buf_str(sb, label);
+}
+
+static void
+web_close(SOLAR_BUF *sb, const char *tag, const char *unit)
+{
+	solar_buf_str(sb, unit);
+	solar_buf_append(sb, "</", 2);
+	solar_buf_str(sb, tag);
+	solar_buf_append(sb, ">\n", 2);
+}
+
+static void
+web_text(SOLAR_BUF *sb, const char *tag, const char *text)
+{
+	web_open(sb, tag, text);
+	web_close(sb, tag, "");
+}
+
+static void
+web_str(SOLAR_BUF *sb, const char *tag, const char *label, const char *s)
+{
+	web_open(sb, tag, label);
+	web_close(sb, tag, s);
+}
+
+static void
+web_int(SOLAR_BUF *sb, const char *tag, const char *label, long v,
+	const char *unit)
+{
+	web_open(sb, tag, label);
+	solar_buf_int(sb, v);
+	web_close(sb, tag, unit);
+}
+
+/* trailing zeros are dropped, 13.500 is shown as 13.5 */
+static void
+web_fixed(SOLAR_BUF *sb, const char *tag, const char *label, double v,
+	  int decimals, const char *unit)
+{
+	web_open(sb, tag, label);
+	solar_buf_fixed(sb, v, decimals);
+	web_close(sb, tag, unit);
 }